@@ -30,6 +30,8 @@
  * @param is_authenticated The client is authenticated.
  * @param auth_attempts The client authentication attempts.
  * @param can_register The client can register.
+ * @param presence_version The version of the roster of online users the client holds, 0 before the first snapshot.
+ * @param users_online The number of online users in the roster.
  */
 typedef struct client_state
 {
@@ -42,6 +44,8 @@ typedef struct client_state
     int is_authenticated;
     int auth_attempts;
     int can_register;
+    unsigned long long presence_version;
+    int users_online;
 } client_state;
 
 /**
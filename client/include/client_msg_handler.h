@@ -17,6 +17,17 @@
 #define MAX_INPUT_LENGTH 128
 #define MAX_MESSAGE_LENGTH 147
 
+/**
+ * Handle a presence message. This function is used to apply a roster snapshot or delta from the server to the client state.
+ * A delta that does not start at the version held by the client is dropped and the changes since that version are requested instead.
+ *
+ * @param msg The presence message, its payload is split in place.
+ * @param cl The client structure.
+ * @param cl_state The client state structure.
+ * @param log_filename The log filename.
+ */
+void handle_presence(message* msg, client* cl, client_state* cl_state, const char* log_filename);
+
 /**
  * Handle a message. This function is used to handle a message received from the server.
  *
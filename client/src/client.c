@@ -14,6 +14,7 @@
 #include <raylib.h>
 
 #include "protocol.h"
+#include "frame_decoder.h"
 #include "client_gui.h"
 #include "client_msg_handler.h"
 #include "client_openssl.h"
@@ -22,12 +23,16 @@
 volatile sig_atomic_t quit_flag = 0;
 volatile sig_atomic_t reconnect_flag = 0;
 static struct client cl = { -1, NULL, CLIENT_DEFAULT_NAME, NULL, NULL, "\0" };
-static struct client_state cl_state = { 1, 0, 0, 0, 0, 0, 0, -1, 0 };
+static struct client_state cl_state = { 1, 0, 0, 0, 0, 0, 0, -1, 0, 0, 0 };
 int server_answer = 0;
 char log_filename[256];
 
 void* receive_messages(void* arg)
 {
+    // the server coalesces messages into TLS records, a read may hold several messages or end inside one
+    frame_decoder decoder;
+    int decoder_ready = 0;
+    frame_decoder_init(&decoder, MESSAGE_PROTOCOL_TEXT);
     while (!quit_flag)
     {
         if (reconnect_flag)
@@ -53,9 +58,15 @@ void* receive_messages(void* arg)
             continue;
         }
 
+        // the wire format was negotiated during the handshake of the current connection
+        if (!decoder_ready)
+        {
+            frame_decoder_reset(&decoder, get_message_protocol(cl.ssl));
+            decoder_ready = 1;
+        }
+
         char buffer[BUFFER_SIZE];
         message msg;
-        memset(buffer, 0, sizeof(buffer));
         int nbytes = SSL_read(cl.ssl, buffer, sizeof(buffer));
 
         if (nbytes <= 0)
@@ -63,17 +74,48 @@ void* receive_messages(void* arg)
             int err = SSL_get_error(cl.ssl, nbytes);
             if (err == SSL_ERROR_ZERO_RETURN)
                 printf("Server disconnected.\n");
+            decoder_ready = 0;
             reconnect_flag = 1;
             continue;
         }
 
-        buffer[nbytes] = '\0';
-        msg.payload[0] = '\0';
-        msg.payload_length = 0;
-
-        parse_message(&msg, buffer);
-        handle_message(&msg, &cl, &cl_state, &reconnect_flag, &quit_flag, &server_answer, log_filename);
+        const char* frame;
+        size_t length;
+        int result;
+        frame_decoder_feed(&decoder, buffer, nbytes);
+        while ((result = frame_decoder_next(&decoder, &frame, &length)) == FRAME_DECODER_FRAME)
+        {
+            if (decoder.protocol == MESSAGE_PROTOCOL_BINARY)
+            {
+                // a frame that fails to parse would leave the previous message in msg, so it ends the connection like a malformed length
+                if (parse_binary_message(&msg, frame, length) != MESSAGE_PARSING_SUCCESS)
+                {
+                    result = FRAME_DECODER_INVALID;
+                    break;
+                }
+                // frames shared by many recipients leave the recipient out
+                if (!msg.recipient_uid[0])
+                    snprintf(msg.recipient_uid, HASH_HEX_OUTPUT_LENGTH, "%s", cl.uid);
+            }
+            else
+            {
+                char text[BUFFER_SIZE];
+                memcpy(text, frame, length);
+                text[length] = '\0';
+                msg.payload[0] = '\0';
+                msg.payload_length = 0;
+                parse_message(&msg, text);
+            }
+            handle_message(&msg, &cl, &cl_state, &reconnect_flag, &quit_flag, &server_answer, log_filename);
+        }
+        if (result != FRAME_DECODER_INCOMPLETE)
+        {
+            log_message(T_LOG_ERROR, log_filename, __FILE__, "Recv thread: Malformed message received, reconnecting");
+            decoder_ready = 0;
+            reconnect_flag = 1;
+        }
     }
+    frame_decoder_destroy(&decoder);
     if (arg) {}
     pthread_exit(NULL);
 }
@@ -284,6 +284,9 @@ void reset_state(client_state* cl_state)
     cl_state->is_authenticated = 0;
     cl_state->auth_attempts = 0;
     cl_state->can_register = 0;
+    // the roster of a new connection starts from its own snapshot
+    cl_state->presence_version = 0;
+    cl_state->users_online = 0;
 }
 
 void enable_cli_input()
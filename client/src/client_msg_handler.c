@@ -14,6 +14,66 @@
 #include "client_gui.h"
 #include "log.h"
 
+void handle_presence(message* msg, client* cl, client_state* cl_state, const char* log_filename)
+{
+    // every delta line moves the roster one version on, lines of versions already held are skipped
+    unsigned long long skip = 0;
+    int in_delta = 0;
+    char* next = NULL;
+    for (char* line = msg->payload; line && *line; line = next)
+    {
+        next = strchr(line, '\n');
+        if (next)
+            *next++ = '\0';
+        unsigned long long from, to;
+        int users;
+        if (line[0] == MESSAGE_PRESENCE_SNAPSHOT && sscanf(line + 1, "%llu %d", &to, &users) == 2)
+        {
+            // the users of the snapshot follow as join lines, they are counted as they arrive
+            cl_state->presence_version = to;
+            cl_state->users_online = 0;
+            in_delta = 0;
+            printf("(00000) Server: %d users online\n", users);
+        }
+        else if (line[0] == MESSAGE_PRESENCE_DELTA && sscanf(line + 1, "%llu %llu", &from, &to) == 2)
+        {
+            if (!cl_state->presence_version)
+                return; // the snapshot of the connection is on its way and covers the delta
+            if (to <= cl_state->presence_version)
+                return; // covered by a snapshot or a delta received earlier
+            if (from > cl_state->presence_version)
+            {
+                // a change was missed, the server is asked for everything since the version held
+                char version[TIMESTAMP_LENGTH + 1];
+                snprintf(version, sizeof(version), "%llu", cl_state->presence_version);
+                create_message(msg, MESSAGE_PRESENCE, cl->uid, "server", version);
+                if (send_message(cl->ssl, msg) != MESSAGE_SEND_SUCCESS)
+                    log_message(T_LOG_WARN, log_filename, __FILE__, "Failed to request presence since %s", version);
+                return;
+            }
+            skip = cl_state->presence_version - from;
+            cl_state->presence_version = to;
+            in_delta = 1;
+        }
+        else if (skip)
+            skip--;
+        else if (line[0] == MESSAGE_PRESENCE_JOIN)
+        {
+            cl_state->users_online++;
+            if (in_delta)
+                printf("(0%d) Server: %s%s\n", MESSAGE_CODE_USER_JOIN, line + 1, message_code_to_text(MESSAGE_CODE_USER_JOIN));
+            log_message(T_LOG_INFO, log_filename, __FILE__, "User %s is online", line + 1);
+        }
+        else if (line[0] == MESSAGE_PRESENCE_LEAVE)
+        {
+            cl_state->users_online--;
+            if (in_delta)
+                printf("(0%d) Server: %s%s\n", MESSAGE_CODE_USER_LEAVE, line + 1, message_code_to_text(MESSAGE_CODE_USER_LEAVE));
+            log_message(T_LOG_INFO, log_filename, __FILE__, "User %s is offline", line + 1);
+        }
+    }
+}
+
 void handle_message(message* msg, client* cl, client_state* cl_state, volatile sig_atomic_t* reconnect_flag, volatile sig_atomic_t* quit_flag, volatile sig_atomic_t* server_answer, const char* log_filename)
 {
     int msg_from_srv = !strcmp(msg->sender_uid, "server");
@@ -215,6 +275,10 @@ void handle_message(message* msg, client* cl, client_state* cl_state, volatile s
     {
         printf("(0%d) Server: %s%s\n", MESSAGE_CODE_USER_LEAVE, msg->payload, message_code_to_text(MESSAGE_CODE_USER_LEAVE));
     }
+    else if (msg->type == MESSAGE_PRESENCE && msg_from_srv)
+    {
+        handle_presence(msg, cl, cl_state, log_filename);
+    }
     else if (msg->type == MESSAGE_BROADCAST && msg_from_srv)
     {
         printf("(0%d) Server: %s\n", MESSAGE_CODE_BROADCAST, msg->payload);
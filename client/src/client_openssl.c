@@ -5,6 +5,7 @@
 #include <unistd.h>
 
 #include "log.h"
+#include "protocol.h"
 
 int init_ssl(struct client* cl)
 {
@@ -15,6 +16,12 @@ int init_ssl(struct client* cl)
     cl->ssl_ctx = SSL_CTX_new(TLS_client_method());
     if (!cl->ssl_ctx)
         return OPENSSL_SSL_CTX_CREATION_FAILURE;
+    // servers without the binary protocol ignore the offer and the connection keeps the text protocol
+    if (offer_binary_protocol(cl->ssl_ctx) != 0)
+    {
+        destroy_ssl(cl);
+        return OPENSSL_SSL_CTX_CREATION_FAILURE;
+    }
     cl->ssl = SSL_new(cl->ssl_ctx);
     if (!cl->ssl)
     {
@@ -0,0 +1,127 @@
+#define _GNU_SOURCE // clock_gettime
+
+#include "hash_map.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#define BENCH_MAX_ENTRIES 1000000
+#define BENCH_LOOKUPS 2000000
+#define BENCH_GROWN_SIZE 1000 // the size a map grown from is created with
+
+/**
+ * The benchmark key structure. This structure is used to hold a client connection with its UID and a UID that is not in the map.
+ *
+ * @param client The client connection.
+ * @param uid The UID of the client.
+ * @param missing A UID of no client.
+ */
+typedef struct bench_key
+{
+    client_connection client;
+    char uid[HASH_HEX_OUTPUT_LENGTH];
+    char missing[HASH_HEX_OUTPUT_LENGTH];
+} bench_key;
+
+static bench_key* bench_keys;
+static request bench_request;
+
+static double bench_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+// lookups follow a random order, so large maps miss the cache like a busy server would
+static size_t bench_next(uint64_t* seed, size_t entries)
+{
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 7;
+    *seed ^= *seed << 17;
+    return (size_t)(*seed % entries);
+}
+
+/**
+ * Measure a map. This function is used to time inserts, lookups that hit and miss by UID, lookups by username and erases of the given number of entries.
+ *
+ * @param entries The number of entries.
+ * @param hash_size The size the map is created with.
+ */
+static void bench_run(size_t entries, size_t hash_size)
+{
+    hash_map* map = hash_map_create(hash_size);
+    client_connection* found;
+    size_t hits = 0;
+    uint64_t seed = 88172645463325252ULL;
+
+    double start = bench_now();
+    for (size_t i = 0; i < entries; ++i)
+        hash_map_insert(map, &bench_keys[i].client);
+    double insert = (bench_now() - start) / (double)entries;
+
+    start = bench_now();
+    for (size_t i = 0; i < BENCH_LOOKUPS; ++i)
+        hits += hash_map_find(map, bench_keys[bench_next(&seed, entries)].uid, &found);
+    double hit = (bench_now() - start) / BENCH_LOOKUPS;
+
+    start = bench_now();
+    for (size_t i = 0; i < BENCH_LOOKUPS; ++i)
+        hits += hash_map_find(map, bench_keys[bench_next(&seed, entries)].missing, &found);
+    double miss = (bench_now() - start) / BENCH_LOOKUPS;
+
+    start = bench_now();
+    for (size_t i = 0; i < BENCH_LOOKUPS; ++i)
+        hits += hash_map_find_by_name(map, bench_keys[bench_next(&seed, entries)].client.username, &found);
+    double name = (bench_now() - start) / BENCH_LOOKUPS;
+
+    size_t histogram[4];
+    hash_map_histogram(map, histogram, 4);
+    size_t capacity = hash_map_capacity(map);
+
+    start = bench_now();
+    for (size_t i = 0; i < entries; ++i)
+        hash_map_erase(map, bench_keys[i].uid);
+    double erase = (bench_now() - start) / (double)entries;
+
+    if (hits != 2 * BENCH_LOOKUPS)
+        fprintf(stderr, "hash_map: %zu of %d lookups hit\n", hits, 2 * BENCH_LOOKUPS);
+    printf("hash_map: %7zu entries, created for %7zu: insert %4.0f ns, find hit %4.0f ns, find miss %4.0f ns, find by name %4.0f ns, erase %4.0f ns, load %.2f, %.1f%% in the home group\n",
+        entries, hash_size, insert, hit, miss, name, erase, (double)entries / (double)capacity, 100.0 * (double)histogram[0] / (double)entries);
+    ebr_collect();
+    hash_map_destroy(map);
+}
+
+int main()
+{
+    bench_keys = (bench_key*)calloc(BENCH_MAX_ENTRIES, sizeof(bench_key));
+    if (!bench_keys)
+    {
+        fprintf(stderr, "Key allocation failed\n");
+        return EXIT_FAILURE;
+    }
+    for (size_t i = 0; i < BENCH_MAX_ENTRIES; ++i)
+    {
+        bench_key* key = &bench_keys[i];
+        char name[MAX_USERNAME_LENGTH + 1];
+        snprintf(name, sizeof(name), "missing%zu", i);
+        get_hash((const unsigned char*)name, key->missing);
+        snprintf(key->client.username, sizeof(key->client.username), "user%zu", i);
+        get_hash((const unsigned char*)key->client.username, key->uid);
+        key->client.uid = key->uid;
+        key->client.req = &bench_request;
+    }
+
+    // every size is measured in a map created for it and in one that grows to it
+    size_t sizes[] = { 1000, 10000, 100000, 1000000 };
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+    {
+        bench_run(sizes[i], sizes[i]);
+        if (sizes[i] > BENCH_GROWN_SIZE)
+            bench_run(sizes[i], BENCH_GROWN_SIZE);
+    }
+    free(bench_keys);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,321 @@
+#define _GNU_SOURCE // clock_gettime, get_nprocs and pthread_barrier_t
+
+#include "protocol.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/sysinfo.h>
+
+#define BENCH_ITERATIONS 1000000
+#define BENCH_HASHED_ITERATIONS 200000 // the SHA-512 message UID path is slow enough that fewer calls give a stable figure
+#define BENCH_HASH_BATCH 64 // the inputs hashed by one get_hash_batch call
+#define BENCH_HASH_THREADS 4 // the fewest threads hashing at once, more on systems with more cores
+
+static volatile long bench_sink;
+
+static double bench_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static int bench_same(const message* a, const message* b)
+{
+    return a->type == b->type && a->payload_length == b->payload_length && !strcmp(a->message_uid, b->message_uid) && !strcmp(a->sender_uid, b->sender_uid)
+        && !strcmp(a->recipient_uid, b->recipient_uid) && !memcmp(a->payload, b->payload, a->payload_length);
+}
+
+/**
+ * Measure a message. This function is used to time both protocols encoding and decoding the message, after checking that every path gives the message back.
+ * Decoding is timed into a message structure, as the client does, and into a view, as the server does, and a binary frame is also timed translated to text for text connections.
+ *
+ * @param msg The message.
+ * @return 0 if every path gave the message back, -1 otherwise.
+ */
+static int bench_message(const message* msg)
+{
+    char text[BUFFER_SIZE];
+    char binary[BUFFER_SIZE];
+    char translated[BUFFER_SIZE];
+    message out;
+    message_view view;
+    int text_length = serialize_message(msg, text, sizeof(text));
+    int binary_length = serialize_binary_message(msg, binary, sizeof(binary));
+    if (text_length < 0 || binary_length < 0)
+    {
+        fprintf(stderr, "protocol: a %u byte payload did not fit into a message\n", msg->payload_length);
+        return -1;
+    }
+    text[text_length] = '\0';
+
+    memset(&out, 0, sizeof(out));
+    parse_message(&out, text);
+    int text_ok = bench_same(msg, &out);
+    int binary_ok = parse_binary_message(&out, binary, (size_t)binary_length) == MESSAGE_PARSING_SUCCESS && bench_same(msg, &out);
+    int view_ok = parse_message_view(&view, MESSAGE_PROTOCOL_TEXT, text, (size_t)text_length) == MESSAGE_PARSING_SUCCESS
+        && parse_message_view(&view, MESSAGE_PROTOCOL_BINARY, binary, (size_t)binary_length) == MESSAGE_PARSING_SUCCESS;
+    int translate_ok = translate_binary_message(binary, (size_t)binary_length, NULL, translated, sizeof(translated)) == text_length && !memcmp(translated, text, (size_t)text_length);
+    if (!text_ok || !binary_ok || !view_ok || !translate_ok)
+    {
+        fprintf(stderr, "protocol: a %u byte payload was not given back by the %s path\n", msg->payload_length,
+            !text_ok ? "text" : !binary_ok ? "binary" : !view_ok ? "view" : "translation");
+        return -1;
+    }
+
+    double start = bench_now();
+    for (int i = 0; i < BENCH_ITERATIONS; ++i)
+        bench_sink += serialize_message(msg, text, sizeof(text));
+    double text_encode = (bench_now() - start) / BENCH_ITERATIONS;
+
+    start = bench_now();
+    for (int i = 0; i < BENCH_ITERATIONS; ++i)
+    {
+        out.payload[0] = '\0';
+        parse_message(&out, text);
+        bench_sink += out.payload_length;
+    }
+    double text_decode = (bench_now() - start) / BENCH_ITERATIONS;
+
+    start = bench_now();
+    for (int i = 0; i < BENCH_ITERATIONS; ++i)
+        bench_sink += parse_message_view(&view, MESSAGE_PROTOCOL_TEXT, text, (size_t)text_length);
+    double text_view = (bench_now() - start) / BENCH_ITERATIONS;
+
+    start = bench_now();
+    for (int i = 0; i < BENCH_ITERATIONS; ++i)
+        bench_sink += serialize_binary_message(msg, binary, sizeof(binary));
+    double binary_encode = (bench_now() - start) / BENCH_ITERATIONS;
+
+    start = bench_now();
+    for (int i = 0; i < BENCH_ITERATIONS; ++i)
+        bench_sink += parse_binary_message(&out, binary, (size_t)binary_length);
+    double binary_decode = (bench_now() - start) / BENCH_ITERATIONS;
+
+    start = bench_now();
+    for (int i = 0; i < BENCH_ITERATIONS; ++i)
+        bench_sink += parse_message_view(&view, MESSAGE_PROTOCOL_BINARY, binary, (size_t)binary_length);
+    double binary_view = (bench_now() - start) / BENCH_ITERATIONS;
+
+    start = bench_now();
+    for (int i = 0; i < BENCH_ITERATIONS; ++i)
+        bench_sink += translate_binary_message(binary, (size_t)binary_length, NULL, translated, sizeof(translated));
+    double translate = (bench_now() - start) / BENCH_ITERATIONS;
+
+    start = bench_now();
+    for (int i = 0; i < BENCH_ITERATIONS; ++i)
+    {
+        message_buffer* buffer = message_buffer_create(msg);
+        bench_sink += buffer->length;
+        message_buffer_release(buffer);
+    }
+    double buffer_create = (bench_now() - start) / BENCH_ITERATIONS;
+
+    printf("protocol: %4u byte payload, text %4d B: encode %4.0f ns, decode %4.0f ns, view %4.0f ns | binary %4d B: encode %4.0f ns, decode %4.0f ns, view %4.0f ns, to text %4.0f ns, buffer %4.0f ns\n",
+        msg->payload_length, text_length, text_encode, text_decode, text_view, binary_length, binary_encode, binary_decode, binary_view, translate, buffer_create);
+    return 0;
+}
+
+// the message UID of create_message before time-ordered IDs, a SHA-512 of the timestamp and the payload
+static int bench_create_hashed_message(message* msg, message_type type, const char* sender_uid, const char* recipient_uid, const char* payload)
+{
+    char timestamp[TIMESTAMP_LENGTH];
+    get_timestamp(timestamp, TIMESTAMP_LENGTH);
+    char uid_before_hash[HASH_HEX_OUTPUT_LENGTH + MAX_PAYLOAD_SIZE];
+    snprintf(uid_before_hash, HASH_HEX_OUTPUT_LENGTH + MAX_PAYLOAD_SIZE, "%s%s", timestamp, payload);
+    char uid[HASH_HEX_OUTPUT_LENGTH];
+    if (get_hash((unsigned char*)uid_before_hash, uid) != 0)
+        return MESSAGE_CREATION_HASH_FAILURE;
+    snprintf(msg->message_uid, HASH_HEX_OUTPUT_LENGTH, "%s", uid);
+
+    msg->type = type;
+    snprintf(msg->sender_uid, HASH_HEX_OUTPUT_LENGTH, "%s", sender_uid);
+    snprintf(msg->recipient_uid, HASH_HEX_OUTPUT_LENGTH, "%s", recipient_uid);
+    msg->payload_length = strlen(payload);
+    snprintf(msg->payload, MAX_PAYLOAD_SIZE, "%s", payload);
+    return MESSAGE_CREATION_SUCCESS;
+}
+
+/**
+ * Measure message creation. This function is used to compare create_message with time-ordered IDs against the SHA-512 message UID it replaced.
+ *
+ * @param sender The sender's unique ID.
+ * @param recipient The recipient's unique ID.
+ * @param payload The payload.
+ */
+static void bench_create(const char* sender, const char* recipient, const char* payload)
+{
+    message msg;
+    double start = bench_now();
+    for (int i = 0; i < BENCH_ITERATIONS; ++i)
+        bench_sink += create_message(&msg, MESSAGE_TEXT, sender, recipient, payload);
+    double generated = BENCH_ITERATIONS / ((bench_now() - start) / 1e9);
+
+    start = bench_now();
+    for (int i = 0; i < BENCH_HASHED_ITERATIONS; ++i)
+        bench_sink += bench_create_hashed_message(&msg, MESSAGE_TEXT, sender, recipient, payload);
+    double hashed = BENCH_HASHED_ITERATIONS / ((bench_now() - start) / 1e9);
+
+    printf("protocol: %4zu byte payload, create_message: %6.2f M msg/s with generated IDs, %6.2f M msg/s with SHA-512 UIDs, %5.1fx\n",
+        strlen(payload), generated / 1e6, hashed / 1e6, generated / hashed);
+}
+
+static void bench_message_ids()
+{
+    message_id id;
+    char text[HASH_HEX_OUTPUT_LENGTH];
+    double start = bench_now();
+    for (int i = 0; i < BENCH_ITERATIONS; ++i)
+    {
+        generate_message_id(&id);
+        bench_sink += id.bytes[15];
+    }
+    double generated = BENCH_ITERATIONS / ((bench_now() - start) / 1e9);
+
+    start = bench_now();
+    for (int i = 0; i < BENCH_ITERATIONS; ++i)
+    {
+        generate_message_id(&id);
+        format_message_id(&id, text);
+        bench_sink += text[31];
+    }
+    double formatted = BENCH_ITERATIONS / ((bench_now() - start) / 1e9);
+    printf("protocol: generate_message_id %6.2f M ids/s, with hex formatting %6.2f M ids/s\n", generated / 1e6, formatted / 1e6);
+}
+
+/**
+ * The hashing thread structure. This structure is used to hand a hashing thread the call it measures.
+ *
+ * @param barrier The barrier all hashing threads start at.
+ * @param batched The batch status, the thread calls get_hash_batch instead of get_hash.
+ * @param failed The failure status, set if a hash could not be calculated.
+ */
+typedef struct bench_hasher
+{
+    pthread_barrier_t* barrier;
+    int batched;
+    int failed;
+} bench_hasher;
+
+static void* bench_hash(void* arg)
+{
+    bench_hasher* hasher = (bench_hasher*)arg;
+    char input_data[BENCH_HASH_BATCH][MAX_USERNAME_LENGTH + 1];
+    char output_data[BENCH_HASH_BATCH][HASH_HEX_OUTPUT_LENGTH];
+    const unsigned char* inputs[BENCH_HASH_BATCH];
+    char* outputs[BENCH_HASH_BATCH];
+    for (int i = 0; i < BENCH_HASH_BATCH; ++i)
+    {
+        snprintf(input_data[i], sizeof(input_data[i]), "user%d", i);
+        inputs[i] = (const unsigned char*)input_data[i];
+        outputs[i] = output_data[i];
+    }
+
+    pthread_barrier_wait(hasher->barrier);
+    for (int i = 0; i < BENCH_HASHED_ITERATIONS; i += BENCH_HASH_BATCH)
+    {
+        if (hasher->batched)
+            hasher->failed |= get_hash_batch(inputs, BENCH_HASH_BATCH, outputs);
+        else
+            for (int j = 0; j < BENCH_HASH_BATCH; ++j)
+                hasher->failed |= get_hash(inputs[j], outputs[j]);
+    }
+    return NULL;
+}
+
+/**
+ * Measure hashing. This function is used to time get_hash and get_hash_batch on username-sized inputs from the given number of threads at once.
+ *
+ * @param threads The number of hashing threads.
+ * @param batched The batch status, the threads call get_hash_batch instead of get_hash.
+ * @return The throughput in hashes per second, 0 if a hash could not be calculated.
+ */
+static double bench_hash_threads(int threads, int batched)
+{
+    pthread_t* ids = (pthread_t*)calloc((size_t)threads, sizeof(pthread_t));
+    bench_hasher* hashers = (bench_hasher*)calloc((size_t)threads, sizeof(bench_hasher));
+    if (!ids || !hashers)
+    {
+        free(ids);
+        free(hashers);
+        return 0;
+    }
+    pthread_barrier_t barrier;
+    pthread_barrier_init(&barrier, NULL, (unsigned)threads + 1);
+    for (int i = 0; i < threads; ++i)
+    {
+        hashers[i] = (bench_hasher){ &barrier, batched, 0 };
+        pthread_create(&ids[i], NULL, bench_hash, &hashers[i]);
+    }
+
+    pthread_barrier_wait(&barrier);
+    double start = bench_now();
+    int failed = 0;
+    for (int i = 0; i < threads; ++i)
+    {
+        pthread_join(ids[i], NULL);
+        failed |= hashers[i].failed;
+    }
+    double elapsed = (bench_now() - start) / 1e9;
+    pthread_barrier_destroy(&barrier);
+    free(hashers);
+    free(ids);
+    return failed ? 0 : (double)threads * BENCH_HASHED_ITERATIONS / elapsed;
+}
+
+static int bench_hashes()
+{
+    // every thread hashes with a digest context of its own, so the threads must not slow each other down
+    int counts[] = { 1, get_nprocs() > BENCH_HASH_THREADS ? get_nprocs() : BENCH_HASH_THREADS };
+    for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); ++i)
+    {
+        double single = bench_hash_threads(counts[i], 0);
+        double batched = bench_hash_threads(counts[i], 1);
+        if (single == 0 || batched == 0)
+        {
+            fprintf(stderr, "protocol: hashing failed with %d threads\n", counts[i]);
+            return -1;
+        }
+        printf("protocol: %2d threads, get_hash %6.2f M hashes/s, get_hash_batch of %d %6.2f M hashes/s\n", counts[i], single / 1e6, BENCH_HASH_BATCH, batched / 1e6);
+    }
+    return 0;
+}
+
+int main()
+{
+    char sender[HASH_HEX_OUTPUT_LENGTH];
+    char recipient[HASH_HEX_OUTPUT_LENGTH];
+    if (get_hash((const unsigned char*)"sender", sender) || get_hash((const unsigned char*)"recipient", recipient))
+    {
+        fprintf(stderr, "Hashing failed\n");
+        return EXIT_FAILURE;
+    }
+
+    // a chat line, a long paragraph and the longest payload
+    char payload[MAX_PAYLOAD_SIZE];
+    size_t lengths[] = { 32, 1024, MAX_PAYLOAD_SIZE - 1 };
+    printf("protocol: %d iterations of each path per message\n", BENCH_ITERATIONS);
+    for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); ++i)
+    {
+        for (size_t j = 0; j < lengths[i]; ++j)
+            payload[j] = (char)('a' + j % 26);
+        payload[lengths[i]] = '\0';
+        message msg;
+        if (create_message(&msg, MESSAGE_TEXT, sender, recipient, payload) != MESSAGE_CREATION_SUCCESS || bench_message(&msg))
+            return EXIT_FAILURE;
+    }
+    bench_message_ids();
+    for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); ++i)
+    {
+        for (size_t j = 0; j < lengths[i]; ++j)
+            payload[j] = (char)('a' + j % 26);
+        payload[lengths[i]] = '\0';
+        bench_create(sender, recipient, payload);
+    }
+    if (bench_hashes())
+        return EXIT_FAILURE;
+    return EXIT_SUCCESS;
+}
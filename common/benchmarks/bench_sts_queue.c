@@ -0,0 +1,131 @@
+#define _GNU_SOURCE // clock_gettime and pthread_barrier_t
+
+#include "sts_queue.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#define BENCH_MESSAGES (1 << 20)
+#define BENCH_MAX_PRODUCERS 64
+#define BENCH_BATCH 64 // the batch a connection writer pops
+#define BENCH_RUNS 3
+
+/**
+ * The producer structure. This structure is used to hand a producer its share of the message buffers.
+ *
+ * @param queue The queue the producer pushes to.
+ * @param barrier The barrier all producers and the consumer start at.
+ * @param buffers The message buffers of the producer.
+ * @param count The number of message buffers.
+ */
+typedef struct bench_producer
+{
+    sts_header* queue;
+    pthread_barrier_t* barrier;
+    message_buffer* buffers;
+    size_t count;
+} bench_producer;
+
+static double bench_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void* bench_produce(void* arg)
+{
+    bench_producer* producer = (bench_producer*)arg;
+    pthread_barrier_wait(producer->barrier);
+    for (size_t i = 0; i < producer->count; ++i)
+        sts_queue.push(producer->queue, &producer->buffers[i]);
+    return NULL;
+}
+
+/**
+ * Run a contention round. This function is used to push the messages from the given number of producers at once while a single consumer pops them in batches.
+ * Every producer's messages must arrive in the order it pushed them.
+ *
+ * @param buffers The message buffers, numbered by producer and sequence.
+ * @param producers The number of producers.
+ * @return The throughput in messages per second, 0 if the messages arrived out of order.
+ */
+static double bench_round(message_buffer* buffers, int producers)
+{
+    size_t count = BENCH_MESSAGES / (size_t)producers;
+    sts_header* queue = sts_queue.create();
+    pthread_barrier_t barrier;
+    pthread_barrier_init(&barrier, NULL, (unsigned)producers + 1);
+
+    pthread_t threads[BENCH_MAX_PRODUCERS];
+    bench_producer args[BENCH_MAX_PRODUCERS];
+    uint32_t expected[BENCH_MAX_PRODUCERS] = { 0 };
+    for (int i = 0; i < producers; ++i)
+    {
+        args[i] = (bench_producer){ queue, &barrier, buffers + (size_t)i * count, count };
+        for (size_t j = 0; j < count; ++j)
+        {
+            args[i].buffers[j].type = (message_type)i;
+            args[i].buffers[j].length = (uint32_t)j;
+        }
+        pthread_create(&threads[i], NULL, bench_produce, &args[i]);
+    }
+
+    pthread_barrier_wait(&barrier);
+    double start = bench_now();
+    size_t received = 0;
+    int ordered = 1;
+    message_buffer* batch[BENCH_BATCH];
+    while (received < count * (size_t)producers)
+    {
+        size_t popped = sts_queue.pop_batch(queue, batch, BENCH_BATCH, 100);
+        for (size_t i = 0; i < popped; ++i)
+        {
+            int producer = (int)batch[i]->type;
+            if (batch[i]->length != expected[producer]++)
+                ordered = 0;
+        }
+        received += popped;
+    }
+    double elapsed = bench_now() - start;
+
+    for (int i = 0; i < producers; ++i)
+        pthread_join(threads[i], NULL);
+    pthread_barrier_destroy(&barrier);
+    sts_queue.destroy(queue);
+    return ordered ? (double)received / elapsed : 0;
+}
+
+int main()
+{
+    message_buffer* buffers = (message_buffer*)calloc(BENCH_MESSAGES, sizeof(message_buffer));
+    if (!buffers)
+    {
+        fprintf(stderr, "Buffer allocation failed\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("sts_queue: %d messages, one consumer popping batches of %d, best of %d runs\n", BENCH_MESSAGES, BENCH_BATCH, BENCH_RUNS);
+    for (int producers = 1; producers <= BENCH_MAX_PRODUCERS; producers *= 2)
+    {
+        double best = 0;
+        for (int run = 0; run < BENCH_RUNS; ++run)
+        {
+            double throughput = bench_round(buffers, producers);
+            if (throughput == 0)
+            {
+                fprintf(stderr, "sts_queue: messages of a producer arrived out of order with %d producers\n", producers);
+                free(buffers);
+                return EXIT_FAILURE;
+            }
+            if (throughput > best)
+                best = throughput;
+        }
+        printf("sts_queue: %2d producers %8.2f Mmsg/s\n", producers, best / 1e6);
+    }
+    free(buffers);
+    return EXIT_SUCCESS;
+}
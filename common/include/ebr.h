@@ -0,0 +1,71 @@
+#ifndef __EBR_H
+#define __EBR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define EBR_GRACE_EPOCHS 2 // epochs the global epoch has to advance past the retirement of an object before it is reclaimed
+
+/**
+ * The retired object structure. This structure is embedded in objects that readers may still hold after they were unlinked, so they are reclaimed only once no reader can see them.
+ *
+ * @param next The next retired object.
+ * @param epoch The global epoch when the object was retired.
+ * @param reclaim The function freeing the object, it receives the embedded node.
+ */
+typedef struct ebr_node
+{
+    struct ebr_node* next;
+    uint64_t epoch;
+    void (*reclaim)(struct ebr_node*);
+} ebr_node;
+
+/**
+ * The reader record structure. This structure is used to announce the epoch a thread reads in, it is registered on the first read of a thread and reused by later threads once it exits.
+ *
+ * @param state The epoch the thread reads in shifted left by one with the lowest bit set, 0 while the thread does not read.
+ * @param in_use Whether the record belongs to a running thread.
+ * @param next The next registered record.
+ */
+typedef struct ebr_record
+{
+    atomic_uint_fast64_t state;
+    atomic_int in_use;
+    struct ebr_record* next;
+} ebr_record;
+
+/**
+ * Enter a read-side critical section. This function is used before reading shared objects that writers reclaim with ebr_retire, objects seen inside the section stay valid until ebr_exit.
+ * It never blocks, sections may be nested and are left with the outermost ebr_exit.
+ */
+void ebr_enter(void);
+
+/**
+ * Exit a read-side critical section. This function is used once the objects read since ebr_enter are no longer used.
+ */
+void ebr_exit(void);
+
+/**
+ * Retire an object. This function is used after an object is unlinked from every shared structure, it is reclaimed once every reader that might have seen it has left its section.
+ * It may be called from any thread and inside a read-side section.
+ *
+ * @param node The node embedded in the object.
+ * @param reclaim The function freeing the object.
+ */
+void ebr_retire(ebr_node* node, void (*reclaim)(ebr_node*));
+
+/**
+ * Collect retired objects. This function is used to advance the global epoch if every reader has caught up with it and to reclaim the objects whose grace period is over.
+ * It is cheap when nothing is retired, so event loops can call it on every iteration.
+ */
+void ebr_collect(void);
+
+/**
+ * Get the number of retired objects. This function is used to report how many objects wait for their grace period.
+ *
+ * @return The number of retired objects not reclaimed yet.
+ */
+size_t ebr_pending(void);
+
+#endif
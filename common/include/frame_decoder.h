@@ -0,0 +1,83 @@
+#ifndef __FRAME_DECODER_H
+#define __FRAME_DECODER_H
+
+#include <stddef.h>
+
+#include "protocol.h"
+
+#define FRAME_DECODER_CAPACITY BUFFER_SIZE // bytes a partial message may take, longer than any valid message of either protocol
+
+// The frame decoder result codes. These are used to determine the exit code of the frame_decoder_next function.
+#define FRAME_DECODER_FRAME 2400
+#define FRAME_DECODER_INCOMPLETE 2401
+#define FRAME_DECODER_INVALID 2402
+#define FRAME_DECODER_ALLOCATION_FAILURE 2403
+
+/**
+ * The frame decoder structure. This structure is used to cut a byte stream into messages regardless of how the reads split or merge them.
+ * Complete messages are returned straight from the fed bytes, only a message cut off by the end of a read is copied aside until the rest of it arrives.
+ * The buffer for those bytes is allocated the first time a message is cut off.
+ *
+ * @param protocol The message protocol of the stream.
+ * @param data The bytes of a message cut off by the end of a read.
+ * @param start The offset of the buffered bytes.
+ * @param length The number of buffered bytes.
+ * @param consumed The number of bytes of the last returned message, released by the next call.
+ * @param input The fed bytes not decoded yet.
+ * @param input_length The number of fed bytes not decoded yet.
+ */
+typedef struct frame_decoder
+{
+    message_protocol protocol;
+    char* data;
+    size_t start;
+    size_t length;
+    size_t consumed;
+    const char* input;
+    size_t input_length;
+} frame_decoder;
+
+/**
+ * Initialize a frame decoder. This function is used to prepare a decoder for a new stream.
+ *
+ * @param decoder The frame decoder.
+ * @param protocol The message protocol of the stream.
+ */
+void frame_decoder_init(frame_decoder* decoder, message_protocol protocol);
+
+/**
+ * Reset a frame decoder. This function is used to drop the buffered bytes, such as when the stream is replaced by a new connection.
+ *
+ * @param decoder The frame decoder.
+ * @param protocol The message protocol of the new stream.
+ */
+void frame_decoder_reset(frame_decoder* decoder, message_protocol protocol);
+
+/**
+ * Destroy a frame decoder. This function is used to free the buffer of the decoder.
+ *
+ * @param decoder The frame decoder.
+ */
+void frame_decoder_destroy(frame_decoder* decoder);
+
+/**
+ * Feed a frame decoder. This function is used to hand the bytes of a read to the decoder, they must stay valid until frame_decoder_next reports that it needs more.
+ *
+ * @param decoder The frame decoder.
+ * @param data The received bytes.
+ * @param length The number of received bytes.
+ */
+void frame_decoder_feed(frame_decoder* decoder, const char* data, size_t length);
+
+/**
+ * Get the next message. This function is used to take the next complete message from the stream, it is valid until the next call.
+ * Once the fed bytes are used up, the rest of a cut off message is kept and the function asks for more.
+ *
+ * @param decoder The frame decoder.
+ * @param frame The message, it is not null-terminated.
+ * @param length The length of the message.
+ * @return The frame decoder result code, FRAME_DECODER_FRAME if a message was returned.
+ */
+int frame_decoder_next(frame_decoder* decoder, const char** frame, size_t* length);
+
+#endif
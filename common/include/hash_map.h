@@ -5,53 +5,91 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdatomic.h>
 #include <string.h>
 #include <pthread.h>
 
 #include "protocol.h"
+#include "ebr.h"
+
+#define HASH_MAP_SHARDS 64 // independently locked tables, a key belongs to the shard selected by its hash
+#define HASH_MAP_GROUP_WIDTH 8 // slots whose control bytes are matched at once
+#define HASH_MAP_MIN_CAPACITY 16 // slots of the smallest shard table
+#define HASH_MAP_MIGRATE_STEP 16 // old slots copied per update while a shard grows, enough to finish before the new table fills
+
+#define HASH_MAP_KEY_UID 0 // shards indexing the client connections by UID
+#define HASH_MAP_KEY_USERNAME 1 // shards indexing the client connections by username
 
 /**
- * The hash node structure. This structure is used to define the hash node and its operations.
+ * The hash table structure. This structure is used to store the entries of a shard with open addressing, it is allocated together with its control words and slots.
+ * Every slot has a control byte that is either empty, deleted, or a 6-bit fingerprint of the key of the entry, so a probe compares keys only on a fingerprint match.
+ * Slots are probed a group of HASH_MAP_GROUP_WIDTH control bytes at a time, from the group selected by the key hash until a group with an empty slot.
+ * Readers load whole control words and slots atomically, writers change them under the shard mutex.
  *
- * @param cl The client connection structure.
- * @param next The next node in the linked list.
+ * @param capacity The number of slots, a power of two.
+ * @param used The number of slots that are not empty, deleted slots included.
+ * @param retire The node retiring the table once the shard has moved to a new one.
+ * @param ctrl The control words, one byte per slot.
+ * @param slots The client connections, one per slot.
  */
-typedef struct hash_node
+typedef struct hash_table
 {
-    client_connection* cl;  // Store client connection
-    struct hash_node* next;
-} hash_node;
+    size_t capacity;
+    size_t used;
+    ebr_node retire;
+    _Atomic uint64_t* ctrl;
+    _Atomic(client_connection*)* slots;
+} hash_table;
 
 /**
- * The hash bucket structure. This structure is used to define the hash bucket and its operations.
+ * The hash shard structure. This structure is used to lock and grow a part of the hash map on its own.
+ * A shard grows by copying its entries to a larger table a few at a time on every update, lookups check both tables until the copy is done.
+ * The old table keeps its entries until it is retired, so a reader walking it while entries are copied sees each of them once.
  *
- * @param head The head of the linked list.
- * @param mutex The mutex for synchronization.
+ * @param mutex The mutex serializing writers.
+ * @param table The table new entries are inserted into.
+ * @param old The table being copied into the new one, NULL when the shard is not growing.
+ * @param generation Odd while the tables are being swapped, so readers take a consistent pair.
+ * @param migrated The number of old slots copied so far.
+ * @param count The number of entries in the shard.
+ * @param key The key of the entries, HASH_MAP_KEY_UID or HASH_MAP_KEY_USERNAME.
  */
-typedef struct hash_bucket
+typedef struct hash_shard
 {
-    hash_node* head;
     pthread_mutex_t mutex;
-} hash_bucket;
+    _Atomic(hash_table*) table;
+    _Atomic(hash_table*) old;
+    atomic_uint generation;
+    size_t migrated;
+    size_t count;
+    int key;
+} hash_shard;
 
 /**
  * The hash map structure. This structure is used to define the hash map and its operations.
+ * Lookups and iterations are lock-free rather than wait-free, they take no lock and read inside an epoch section, where erased entries stay valid until every reader left it,
+ * but a reader retries taking the tables of a shard while a writer swaps them, so a reader may wait for a growing shard to move to its new table.
+ * A client connection erased from the map must therefore be freed through ebr_retire.
+ * Every entry is indexed by its UID and by its username, writers lock the UID shard before the username shard and update both indexes under the two locks.
+ * A reader may see an entry in one index shortly before or after it is in the other.
  *
- * @param hash_size The size of the hash map.
- * @param hash_table The hash table.
+ * @param hash_size The number of entries the hash map was sized for, it grows past it when needed.
+ * @param shards The hash shards indexing the entries by UID.
+ * @param name_shards The hash shards indexing the entries by username, allocated together with the UID shards.
  * @param current_elements The current number of elements in the hash map.
  */
 typedef struct hash_map
 {
     size_t hash_size;
-    hash_bucket* hash_table;
-    size_t current_elements;
+    hash_shard* shards;
+    hash_shard* name_shards;
+    atomic_size_t current_elements;
 } hash_map;
 
 /**
- * Function to create a hash map. This function will create a hash map with the specified hash size.
+ * Function to create a hash map. This function will create a hash map with room for the specified number of entries.
  *
- * @param hash_size The size of the hash map.
+ * @param hash_size The number of entries to make room for.
  * @return The hash map.
  */
 hash_map* hash_map_create(size_t hash_size);
@@ -64,7 +102,8 @@ hash_map* hash_map_create(size_t hash_size);
 void hash_map_destroy(hash_map* map);
 
 /**
- * Find an entry in the hash map. This function will find the entry in the hash map if it exists.
+ * Find an entry in the hash map. This function will find the entry in the hash map if it exists, lock-free.
+ * The client connection may be erased and reclaimed right after, so it may only be dereferenced by a caller inside ebr_enter and ebr_exit.
  *
  * @param map The hash map to search.
  * @param uid The uid to search for (already hashed).
@@ -73,17 +112,52 @@ void hash_map_destroy(hash_map* map);
  */
 bool hash_map_find(hash_map* map, const char* uid, client_connection** cl);
 
+/**
+ * Apply a function to an entry in the hash map. This function will call the specified callback function with a parameter for the entry if it exists, lock-free.
+ * The entry may be erased while the callback runs, but it is not reclaimed until the callback returns, so the client connection may be safely used inside it.
+ *
+ * @param map The hash map to search.
+ * @param uid The uid to search for (already hashed).
+ * @param callback The callback function to call for the entry.
+ * @param param The parameter to pass to the callback function.
+ * @return True if the entry was found, false otherwise.
+ */
+bool hash_map_apply(hash_map* map, const char* uid, void (*callback)(client_connection*, void*), void* param);
+
+/**
+ * Find an entry in the hash map by username. This function will find the entry with the specified username if it exists, lock-free and without a database query.
+ * The client connection may only be dereferenced by a caller inside ebr_enter and ebr_exit, like with hash_map_find.
+ *
+ * @param map The hash map to search.
+ * @param username The username to search for.
+ * @param cl The client connection pointer to store the result in.
+ * @return True if the entry was found, false otherwise.
+ */
+bool hash_map_find_by_name(hash_map* map, const char* username, client_connection** cl);
+
+/**
+ * Apply a function to an entry in the hash map by username. This function will call the specified callback function with a parameter for the entry with the specified username if it exists, like hash_map_apply.
+ *
+ * @param map The hash map to search.
+ * @param username The username to search for.
+ * @param callback The callback function to call for the entry.
+ * @param param The parameter to pass to the callback function.
+ * @return True if the entry was found, false otherwise.
+ */
+bool hash_map_apply_by_name(hash_map* map, const char* username, void (*callback)(client_connection*, void*), void* param);
+
 /**
  * Insert an entry into the hash map. This function will insert the entry into the hash map if it does not already exist.
+ * An entry with the same UID is replaced, but not one with the same username and another UID, as a username belongs to one client.
  *
  * @param map The hash map to insert into.
- * @param cl The client connection to insert (uses its `uid` as the key).
- * @return True if the entry was inserted, false otherwise.
+ * @param cl The client connection to insert (uses its `uid` and its `username` as the keys).
+ * @return 1 if the entry was inserted, 2 if it replaced the entry with the same UID, 0 if it was refused or the map could not grow.
  */
 int hash_map_insert(hash_map* map, client_connection* cl);
 
 /**
- * Erase an entry from the hash map. This function will remove the entry from the hash map if it exists.
+ * Erase an entry from the hash map. This function will remove the entry from both indexes of the hash map if it exists.
  *
  * @param map The hash map to erase from.
  * @param uid The uid to erase (already hashed).
@@ -91,14 +165,34 @@ int hash_map_insert(hash_map* map, client_connection* cl);
 void hash_map_erase(hash_map* map, const char* uid);
 
 /**
- * Clear the hash map. This function will remove all entries from the hash map.
+ * Clear the hash map. This function will remove all entries of the hash map and hand each of them to the release function once, it must not run concurrently with readers.
+ * The map does not own its entries, so the release function returns them to wherever they were allocated from, such as the connection pool of the server.
  *
  * @param map The hash map to clear.
+ * @param release The function releasing an entry.
+ */
+void hash_map_clear(hash_map* map, void (*release)(client_connection*));
+
+/**
+ * Get the probe lengths of the hash map. This function will count the entries found each number of groups away from the group their key hashes to, such as to check how evenly the keys are spread.
+ *
+ * @param map The hash map to inspect.
+ * @param histogram The histogram to fill, histogram[n] is the number of entries found n groups away.
+ * @param histogram_size The number of histogram slots, the last slot also counts all longer probes.
+ */
+void hash_map_histogram(hash_map* map, size_t* histogram, size_t histogram_size);
+
+/**
+ * Get the capacity of the hash map. This function will count the slots of all shard tables, including tables being moved.
+ *
+ * @param map The hash map to inspect.
+ * @return The number of slots.
  */
-void hash_map_clear(hash_map* map);
+size_t hash_map_capacity(hash_map* map);
 
 /**
- * Iterate over the hash map. This function will iterate over all entries in the hash map and call the specified callback function.
+ * Iterate over the hash map. This function will iterate over all entries in the hash map and call the specified callback function, lock-free.
+ * Every entry present for the whole iteration is visited once, entries inserted or erased meanwhile may or may not be visited.
  *
  * @param map The hash map to iterate over.
  * @param callback The callback function to call for each entry.
@@ -106,7 +200,7 @@ void hash_map_clear(hash_map* map);
 void hash_map_iterate(hash_map* map, void (*callback)(client_connection*));
 
 /**
- * Iterate over the hash map with a parameter. This function will iterate over all entries in the hash map and call the specified callback function with a parameter.
+ * Iterate over the hash map with a parameter. This function will iterate over all entries in the hash map and call the specified callback function with a parameter, like hash_map_iterate.
  *
  * @param map The hash map to iterate over.
  * @param callback The callback function to call for each entry.
@@ -3,6 +3,8 @@
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include <pthread.h>
 
 #define MAX_LOG_FILES 10
@@ -15,8 +17,13 @@
 #define LOG_SERVER_STARTED "Server started ----------------------------------------------------------------------------------------"
 #define LOG_CLIENT_STARTED "Client started ----------------------------------------------------------------------------------------"
 
-#define LOCKED_FILE_RETRY_TIME 1000 // in microseconds
-#define LOCKED_FILE_TIMEOUT 5000000 // in microseconds (5 seconds)
+#define LOG_MESSAGE_LENGTH 1024 // formatted message bytes kept, longer messages are truncated
+#define LOG_LINE_LENGTH (LOG_MESSAGE_LENGTH + 512) // the message with its timestamp, level and source file
+#define LOG_RING_SIZE 65536 // bytes of the ring buffer of every logging thread, a power of two
+#define LOG_MAX_ALIASES 64 // filename pointers remembered with the logger they resolved to
+#define LOG_BATCH_LINES 256 // lines written to a file with a single writev
+#define LOG_FLUSH_INTERVAL 10 // in milliseconds, how long the writer sleeps while the rings are idle
+#define LOG_BLOCK_RETRY_TIME 100 // in microseconds, how long a blocked thread waits for the writer to make room
 
 /**
  * The log level enumeration. This enumeration is used to define the level of logging that is being used. Regular log enums are used by Raylib.
@@ -36,34 +43,97 @@ typedef enum
     T_LOG_FATAL
 } log_level_t;
 
+/**
+ * The log overflow enumeration. This enumeration is used to define what a thread does with a message while its ring buffer is full.
+ *
+ * @param LOG_OVERFLOW_BLOCK The thread waits for the writer to make room, no message is lost
+ * @param LOG_OVERFLOW_DROP The message is dropped and counted, the thread never waits for the disk
+ */
+typedef enum
+{
+    LOG_OVERFLOW_BLOCK,
+    LOG_OVERFLOW_DROP
+} log_overflow_t;
+
 /**
  * The logger structure. This structure is used to store the logger for the logging system.
  *
- * @param filename The filename of the log file.
- * @param file The file pointer for the log file.
+ * @param filename The filename of the log file, as given to init_logging.
+ * @param fd The descriptor of the log file, opened for appending.
  */
 typedef struct logger_t
 {
     char* filename;
-    FILE* file;
+    int fd;
 } logger_t;
 
+/**
+ * The log alias structure. This structure is used to remember which logger a filename pointer resolved to, so later messages are matched by pointer.
+ *
+ * @param filename The filename pointer passed to log_message.
+ * @param logger The index of the logger.
+ */
+typedef struct log_alias_t
+{
+    const char* filename;
+    int logger;
+} log_alias_t;
+
+/**
+ * The log ring structure. This structure is used to store the formatted lines of a single thread until the writer writes them.
+ * The owning thread is the only producer and the writer the only consumer, so neither takes a lock. Every record is a header followed by the line padded to 8 bytes,
+ * a record that would wrap is preceded by a padding record, so every line is contiguous and written straight from the ring.
+ *
+ * @param buffer The ring memory of LOG_RING_SIZE bytes.
+ * @param head The number of bytes ever produced, advanced by the owning thread.
+ * @param tail The number of bytes ever consumed, advanced by the writer once the lines are written.
+ * @param drained The number of bytes the writer queued for writing, private to the writer.
+ * @param dropped The number of messages dropped while the ring was full.
+ * @param owned The ownership status, cleared when the thread exits so another thread can take the ring over.
+ * @param next The next ring of the ring list.
+ */
+typedef struct log_ring_t
+{
+    char* buffer;
+    atomic_uint_fast64_t head;
+    atomic_uint_fast64_t tail;
+    uint64_t drained;
+    atomic_ullong dropped;
+    atomic_int owned;
+    struct log_ring_t* next;
+} log_ring_t;
+
 /**
  * The loggers structure. This structure is used to store the loggers for the logging system.
  *
- * @param log_mutex The mutex for the loggers.
+ * @param log_mutex The mutex for the loggers, the aliases and the writer.
  * @param array The array of loggers.
- * @param is_initializing The flag to indicate if the loggers are initializing.
+ * @param aliases The filename pointers resolved so far.
+ * @param alias_count The number of aliases, published after the alias is stored.
+ * @param rings The ring list, rings are prepended and never removed.
+ * @param overflow The overflow policy of full rings.
+ * @param writer The writer thread.
+ * @param writer_running The writer thread status.
+ * @param stop The writer stop request.
+ * @param wake The condition the writer sleeps on between drains.
  */
 typedef struct loggers_t
 {
     pthread_mutex_t log_mutex;
     logger_t* array[MAX_LOG_FILES];
-    int is_initializing;
+    log_alias_t aliases[LOG_MAX_ALIASES];
+    atomic_int alias_count;
+    _Atomic(log_ring_t*) rings;
+    atomic_int overflow;
+    pthread_t writer;
+    int writer_running;
+    atomic_int stop;
+    pthread_cond_t wake;
 } loggers_t;
 
 /**
  * Initialize logging. This function is used to initialize the logging system, open and preserve the log file.
+ * The first call starts the writer thread, which writes the lines of all threads in batches.
  *
  * @param log_file The log file to write to.
  */
@@ -71,6 +141,8 @@ void init_logging(const char* filename);
 
 /**
  * Log a message. This function is used to log a message to the console or a file.
+ * The line is formatted into the ring buffer of the calling thread and written by the writer thread, the call takes no lock and makes no system call.
+ * The filename pointer is resolved to the logger once and matched by pointer afterwards, so it has to keep naming the same log file.
  *
  * @param level The log level.
  * @param log_file The file that the log message is destined for.
@@ -81,7 +153,21 @@ void init_logging(const char* filename);
 void log_message(log_level_t level, const char* filename, const char* source_file, const char* format, ...);
 
 /**
- * Finish logging. This function is used to finish logging and close the log file.
+ * Set log overflow policy. This function is used to choose whether threads wait for the writer or drop messages while their ring buffer is full.
+ *
+ * @param policy The overflow policy, LOG_OVERFLOW_BLOCK by default.
+ */
+void set_log_overflow(log_overflow_t policy);
+
+/**
+ * Get dropped log messages. This function is used to read the number of messages dropped because the ring buffer of their thread was full.
+ *
+ * @return The number of dropped messages.
+ */
+unsigned long long log_dropped_messages();
+
+/**
+ * Finish logging. This function is used to stop the writer thread once it wrote every queued line and close the log files.
  */
 void finish_logging();
 
@@ -0,0 +1,95 @@
+#ifndef __MEM_POOL_H
+#define __MEM_POOL_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#define MEM_POOL_ALIGNMENT 16
+#define MEM_POOL_SLAB_SIZE (64 * 1024) // bytes carved into objects whenever the pool runs dry
+#define MEM_POOL_CACHE_SIZE 64 // objects a thread keeps before returning a batch to the pool
+#define MEM_POOL_BATCH 32 // objects moved between a thread cache and the pool at once
+#define MEM_POOL_MAX_CACHES 8 // pools a thread can cache objects of, further pools are used without a cache
+
+#define MEM_POOL_OBJECT_SIZE(size) (((size) + MEM_POOL_ALIGNMENT - 1) & ~(size_t)(MEM_POOL_ALIGNMENT - 1))
+
+/**
+ * The memory pool initializer. This macro is used to statically initialize a pool of objects of the given size.
+ *
+ * @param size The object size.
+ */
+#define MEM_POOL_INITIALIZER(size) { MEM_POOL_OBJECT_SIZE((size) > sizeof(void*) ? (size) : sizeof(void*)), PTHREAD_MUTEX_INITIALIZER, NULL, 0, NULL, 0, 0, 0, 0, 0 }
+
+/**
+ * The memory pool structure. This structure is used to store fixed size objects carved from slabs, so allocating and freeing them does not reach malloc.
+ * Every thread keeps a cache of free objects and only locks the pool to exchange a batch of them, slabs are kept for the lifetime of the pool.
+ * The statistics are flushed from the thread caches every MEM_POOL_BATCH operations, so they lag behind by a few objects per thread.
+ *
+ * @param object_size The object size, rounded up to the alignment.
+ * @param mutex The mutex to lock the shared free list and the slabs.
+ * @param free_list The shared free objects, linked through their first bytes.
+ * @param free_count The number of shared free objects.
+ * @param slabs The slabs the objects are carved from.
+ * @param capacity The number of objects carved from the slabs.
+ * @param allocs The number of allocations.
+ * @param frees The number of frees.
+ * @param cache_hits The number of allocations served from the cache of the calling thread.
+ * @param misses The number of allocations that found the pool empty and allocated a slab.
+ */
+typedef struct mem_pool
+{
+    size_t object_size;
+    pthread_mutex_t mutex;
+    void* free_list;
+    size_t free_count;
+    void* slabs;
+    size_t capacity;
+    atomic_ullong allocs;
+    atomic_ullong frees;
+    atomic_ullong cache_hits;
+    atomic_ullong misses;
+} mem_pool;
+
+/**
+ * The memory pool statistics structure. This structure is used to report how a pool is used, so it can be sized.
+ *
+ * @param capacity The number of objects carved from the slabs.
+ * @param in_use The number of allocated objects.
+ * @param allocs The number of allocations.
+ * @param cache_hits The number of allocations served from a thread cache.
+ * @param misses The number of allocations that had to allocate a slab.
+ */
+typedef struct mem_pool_stats
+{
+    size_t capacity;
+    size_t in_use;
+    unsigned long long allocs;
+    unsigned long long cache_hits;
+    unsigned long long misses;
+} mem_pool_stats;
+
+/**
+ * Allocate from memory pool. This function is used to take an uninitialized object from the pool. It may be called from any thread.
+ *
+ * @param pool The memory pool.
+ * @return The object, NULL if a slab could not be allocated.
+ */
+void* mem_pool_alloc(mem_pool* pool);
+
+/**
+ * Free to memory pool. This function is used to return an object to the pool. It may be called from any thread, not only the one that allocated the object.
+ *
+ * @param pool The memory pool.
+ * @param ptr The object, NULL is ignored.
+ */
+void mem_pool_free(mem_pool* pool, void* ptr);
+
+/**
+ * Get memory pool statistics. This function is used to read the usage of the pool.
+ *
+ * @param pool The memory pool.
+ * @param stats The statistics to fill.
+ */
+void mem_pool_get_stats(mem_pool* pool, mem_pool_stats* stats);
+
+#endif
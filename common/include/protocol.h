@@ -3,9 +3,12 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdatomic.h>
 #include <arpa/inet.h>
 #include <openssl/ssl.h>
 
+#include "mem_pool.h"
+
 #define TIMESTAMP_LENGTH 20
 
 // The server port and message components size. These are used to define the port and buffer size for the server and client.
@@ -14,6 +17,8 @@
 #define HASH_LENGTH 64 // SHA-512 hash (64 bytes)
 #define HASH_HEX_OUTPUT_LENGTH (HASH_LENGTH * 2 + 1) // hex output length (2 chars per byte + \0) for SHA-512 it will be 129 (128 characters)
 #define HASH_MESSAGE_LENGTH (HASH_HEX_OUTPUT_LENGTH + MAX_USERNAME_LENGTH + 2) // hash message length (hash + separator + username + \0)
+#define MESSAGE_ID_LENGTH 16 // 128-bit message ID: timestamp (48 bits), node (16 bits), thread (24 bits), sequence (40 bits)
+#define MESSAGE_ID_HEX_LENGTH (MESSAGE_ID_LENGTH * 2 + 1) // hex output length (2 chars per byte + \0)
 #define MAX_PAYLOAD_SIZE 2048 // 2 KB
 #define MAX_USERNAME_LENGTH 16
 #define MAX_PASSWORD_LENGTH 16
@@ -22,6 +27,12 @@
 #define MESSAGE_DELIMITER "|"
 #define TIMESTAMP_LENGTH 20
 
+// The binary protocol. Clients offering it through ALPN at connect exchange length-prefixed frames, others keep the pipe-delimited text format.
+#define BINARY_PROTOCOL_NAME "secure-chat-bin/1"
+#define BINARY_PROTOCOL_VERSION 1
+#define BINARY_HEADER_LENGTH 16 // frame length (4), version (1), text ID flags (1), ID lengths (3), reserved (3), type (4)
+#define BINARY_MAX_MESSAGE_LENGTH (BINARY_HEADER_LENGTH + 3 * (HASH_HEX_OUTPUT_LENGTH - 1) + MAX_PAYLOAD_SIZE - 1)
+
 // The message creation result codes. These are used to determine the exit code of the create_message function.
 #define MESSAGE_CREATION_SUCCESS 2100
 #define MESSAGE_CREATION_FAILURE 2101
@@ -61,6 +72,12 @@
 #define MESSAGE_SIGNAL_QUIT "QUIT"
 #define MESSAGE_SIGNAL_EXIT "EXIT"
 
+// The presence payload. Every line starts with one of these markers, a snapshot resets the roster and a delta changes it from one version to another.
+#define MESSAGE_PRESENCE_SNAPSHOT '=' // "=<version> <users>", the roster at the version, its users follow as join lines in this and the next frames
+#define MESSAGE_PRESENCE_DELTA '@' // "@<from> <to>", the join and leave lines that follow turn the roster at the first version into the second
+#define MESSAGE_PRESENCE_JOIN '+' // "+<username>", the user is online
+#define MESSAGE_PRESENCE_LEAVE '-' // "-<username>", the user is offline
+
 #define CLIENT_DEFAULT_NAME "client"
 
 /**
@@ -82,6 +99,7 @@
  * @param MESSAGE_USER_JOIN User joined server
  * @param MESSAGE_USER_LEAVE User left server
  * @param MESSAGE_SYSTEM Server maintenance message
+ * @param MESSAGE_PRESENCE Roster of online users, a snapshot or a delta from the server, or the roster version held by a client asking for the changes since it
  * @return The message type enumeration.
  */
 typedef int32_t message_type;
@@ -104,6 +122,7 @@ enum
     MESSAGE_USER_JOIN,
     MESSAGE_USER_LEAVE,
     MESSAGE_SYSTEM,
+    MESSAGE_PRESENCE,
 };
 
 /**
@@ -164,6 +183,114 @@ enum
     MESSAGE_CODE_UID,
 };
 
+/**
+ * The message protocol enumeration. This enumeration is used to define the wire format of the messages exchanged over a connection.
+ *
+ * @param MESSAGE_PROTOCOL_TEXT Pipe-delimited text, the message UID, type, sender, recipient, payload length and payload
+ * @param MESSAGE_PROTOCOL_BINARY Length-prefixed frames with a fixed header, hex IDs are sent as raw bytes and an empty recipient addresses the receiving peer
+ */
+typedef enum
+{
+    MESSAGE_PROTOCOL_TEXT,
+    MESSAGE_PROTOCOL_BINARY
+} message_protocol;
+
+/**
+ * The message ID structure. This structure is used to identify a message without hashing it.
+ * The bytes are big-endian, so IDs compare like their millisecond timestamps, and the node, thread and sequence make them unique within a timestamp.
+ *
+ * @param bytes The ID bytes.
+ */
+typedef struct message_id
+{
+    unsigned char bytes[MESSAGE_ID_LENGTH];
+} message_id;
+
+/**
+ * The message link structure. This structure is used to chain messages in intrusive queues, so queueing a message does not allocate.
+ *
+ * @param next The link of the next message.
+ */
+typedef struct message_link
+{
+    _Atomic(struct message_link*) next;
+} message_link;
+
+/**
+ * The message buffer structure. This structure is used to pass a serialized message between threads and connections without copying it.
+ * The buffer is sized to the message, it is shared by reference counting and returns to its pool once the last reference is released.
+ * The message is held as a binary frame, connections speaking the text protocol translate it while copying it out.
+ * A long frame received whole is not copied at all, the buffer points into the receive buffer it was read into and keeps a reference to it.
+ * Shorter frames are copied, so a queued chat line holds a buffer of its own size rather than the whole receive buffer.
+ * The link is the first member, so a link taken from a queue can be cast back to the buffer.
+ *
+ * @param link The queue link, owned by the queue holding the buffer.
+ * @param refs The number of references.
+ * @param size_class The pool the buffer was taken from.
+ * @param type The type of the message.
+ * @param length The length of the binary frame, or the capacity of a receive buffer.
+ * @param text_length The length of the message in the text protocol, without the recipient's UID for fan-out messages.
+ * @param fanout The fan-out status, the frame names no recipient and every recipient is addressed by its own UID.
+ * @param recipient The recipient's unique ID, empty for fan-out messages.
+ * @param data The binary frame, held by this buffer or by the source buffer.
+ * @param source The receive buffer holding the frame, NULL if the buffer holds the frame itself.
+ * @param frame The binary frame followed by the recipient's unique ID, or just the recipient's unique ID if the frame is held by the source buffer.
+ */
+typedef struct message_buffer
+{
+    message_link link;
+    atomic_uint refs;
+    unsigned size_class;
+    message_type type;
+    uint32_t length;
+    uint32_t text_length;
+    int fanout;
+    const char* recipient;
+    const char* data;
+    struct message_buffer* source;
+    char frame[];
+} message_buffer;
+
+/**
+ * The message field structure. This structure is used to refer to a field of a received message without copying it.
+ *
+ * @param data The first byte of the field inside the received bytes.
+ * @param length The length of the field.
+ * @param raw The raw bytes status, the field is a binary ID whose text form is its lowercase hex encoding.
+ */
+typedef struct message_field
+{
+    const char* data;
+    uint32_t length;
+    int raw;
+} message_field;
+
+/**
+ * The message view structure. This structure is used to read a received message in place, its fields point into the received bytes and stay valid as long as they do.
+ *
+ * @param protocol The message protocol of the frame.
+ * @param frame The received frame.
+ * @param length The length of the frame.
+ * @param type The type of the message.
+ * @param message_uid The unique message ID.
+ * @param sender_uid The sender's unique ID.
+ * @param recipient_uid The recipient's unique ID.
+ * @param payload The message content or control data.
+ * @param source The receive buffer holding the frame, NULL if the frame is held elsewhere.
+ */
+typedef struct message_view
+{
+    message_protocol protocol;
+    const char* frame;
+    uint32_t length;
+    message_type type;
+    message_field message_uid;
+    message_field sender_uid;
+    message_field recipient_uid;
+    message_field payload;
+    message_buffer* source;
+} message_view;
+
 /**
  * The message structure. This structure is used to store message data.
  *
@@ -206,7 +333,7 @@ typedef struct
  * @param id The ID of the client.
  * @param uid The unique ID of the client.
  * @param username The username of the client.
- * @param is_ready The client readiness status.
+ * @param is_ready The client readiness status, set by the reactor of the client once it logged in and read by the threads delivering to it.
  * @param is_inserted The client hash map insertion status.
  * @param ping_sent The client ping status.
  */
@@ -216,7 +343,7 @@ typedef struct client_connection
     int id;
     char* uid;
     char username[MAX_USERNAME_LENGTH + 1];
-    int is_ready;
+    atomic_int is_ready;
     int is_inserted;
     int ping_sent;
 } client_connection;
@@ -232,6 +359,29 @@ typedef struct client_connection
  */
 int create_message(message* msg, message_type type, const char* sender_uid, const char* recipient_uid, const char* payload);
 
+/**
+ * Set the message ID node. This function is used to give the process a node ID of its own, so processes generating message IDs at once never collide.
+ * A process that does not set one picks a random node ID.
+ *
+ * @param node The node ID.
+ */
+void set_message_id_node(uint16_t node);
+
+/**
+ * Generate a message ID. This function is used to get a new time-ordered message ID, it takes a clock read and no locks.
+ *
+ * @param id The message ID.
+ */
+void generate_message_id(message_id* id);
+
+/**
+ * Format a message ID. This function is used to get the hex form of a message ID where a message needs it as text.
+ *
+ * @param id The message ID.
+ * @param buffer The buffer to store the hex string (must be at least MESSAGE_ID_HEX_LENGTH).
+ */
+void format_message_id(const message_id* id, char* buffer);
+
 /**
  * Parse a message. This function is used to parse a message structure and return the message content.
  *
@@ -242,7 +392,176 @@ int create_message(message* msg, message_type type, const char* sender_uid, cons
 void parse_message(message* msg, const char* buffer);
 
 /**
- * Send a message. This function is used to send a message using a secure SSL connection.
+ * Parse a message view. This function is used to read a complete frame of either protocol in place, nothing is copied.
+ *
+ * @param view The message view, its source is cleared.
+ * @param protocol The message protocol of the frame.
+ * @param frame The frame, such as returned by the frame decoder.
+ * @param length The length of the frame.
+ * @return The message parsing result code.
+ */
+int parse_message_view(message_view* view, message_protocol protocol, const char* frame, size_t length);
+
+/**
+ * Get the text of a message field. This function is used to copy a field out of a view when it has to be null-terminated, binary IDs are hex encoded.
+ *
+ * @param field The message field.
+ * @param buffer The buffer to store the text, HASH_HEX_OUTPUT_LENGTH bytes hold any ID.
+ * @param buffer_size The size of the buffer.
+ * @return The length of the text or -1 if it did not fit into the buffer.
+ */
+int message_field_to_text(const message_field* field, char* buffer, size_t buffer_size);
+
+/**
+ * Copy a message view. This function is used to fill a message structure from a view where every field has to be at hand, such as during authentication.
+ *
+ * @param view The message view.
+ * @param msg The message structure.
+ */
+void message_view_to_message(const message_view* view, message* msg);
+
+/**
+ * Serialize a message. This function is used to format a message into its wire representation.
+ *
+ * @param msg The message to serialize.
+ * @param buffer The buffer to store the serialized message.
+ * @param buffer_size The size of the buffer.
+ * @return The length of the serialized message or -1 if it did not fit into the buffer.
+ */
+int serialize_message(const message* msg, char* buffer, size_t buffer_size);
+
+/**
+ * Get serialized message length. This function is used to find where the first message ends in a stream of serialized messages, such as coalesced TLS records.
+ * The payload length field delimits the message, so messages may arrive split across reads or several in one read.
+ *
+ * @param buffer The received bytes.
+ * @param length The number of received bytes.
+ * @return The length of the first message, 0 if it is incomplete or -1 if the bytes are not a message.
+ */
+int get_message_length(const char* buffer, size_t length);
+
+/**
+ * Serialize a binary message. This function is used to format a message into a frame of the binary protocol.
+ *
+ * @param msg The message to serialize.
+ * @param buffer The buffer to store the frame.
+ * @param buffer_size The size of the buffer.
+ * @return The length of the frame or -1 if it did not fit into the buffer.
+ */
+int serialize_binary_message(const message* msg, char* buffer, size_t buffer_size);
+
+/**
+ * Parse a binary message. This function is used to parse a frame of the binary protocol into a message structure, hex IDs are restored to their text form.
+ *
+ * @param msg The message structure.
+ * @param buffer The frame.
+ * @param length The number of received bytes, at least the frame length.
+ * @return The message parsing result code.
+ */
+int parse_binary_message(message* msg, const char* buffer, size_t length);
+
+/**
+ * Get binary message length. This function is used to find where the first frame ends in a stream of binary frames.
+ *
+ * @param buffer The received bytes.
+ * @param length The number of received bytes.
+ * @return The length of the first frame, 0 if it is incomplete or -1 if the bytes are not a frame.
+ */
+int get_binary_message_length(const char* buffer, size_t length);
+
+/**
+ * Translate a binary message. This function is used to write a binary frame in the text protocol without parsing it into a message structure first.
+ *
+ * @param frame The binary frame.
+ * @param length The length of the frame.
+ * @param recipient The recipient's unique ID written instead of the one in the frame, NULL keeps the frame's recipient.
+ * @param buffer The buffer to store the text message, it is not null-terminated.
+ * @param buffer_size The size of the buffer.
+ * @return The length of the text message or -1 if the frame is malformed or the message did not fit into the buffer.
+ */
+int translate_binary_message(const char* frame, size_t length, const char* recipient, char* buffer, size_t buffer_size);
+
+/**
+ * Offer the binary protocol. This function is used by clients to offer the binary protocol through ALPN on every connection of the context.
+ *
+ * @param ctx The SSL context.
+ * @return 0 on success, -1 on failure.
+ */
+int offer_binary_protocol(SSL_CTX* ctx);
+
+/**
+ * Accept the binary protocol. This function is used by the server to select the binary protocol for every connection of the context whose client offers it.
+ *
+ * @param ctx The SSL context.
+ */
+void accept_binary_protocol(SSL_CTX* ctx);
+
+/**
+ * Get the message protocol. This function is used to get the wire format negotiated during the TLS handshake.
+ *
+ * @param ssl The SSL object of an established connection.
+ * @return The message protocol.
+ */
+message_protocol get_message_protocol(const SSL* ssl);
+
+/**
+ * Create a message buffer. This function is used to serialize a message into a buffer holding just the bytes it needs, with a single reference.
+ *
+ * @param msg The message to serialize.
+ * @return The message buffer, NULL on failure.
+ */
+message_buffer* message_buffer_create(const message* msg);
+
+/**
+ * Create a fan-out message buffer. This function is used to serialize a message once for many recipients, such as for a broadcast.
+ * The frame names no recipient, binary connections send it as it is and text connections insert the UID of their client.
+ *
+ * @param msg The message to serialize, its recipient UID is left out.
+ * @return The message buffer, NULL on failure.
+ */
+message_buffer* message_buffer_create_fanout(const message* msg);
+
+/**
+ * Create a message buffer from a view. This function is used to pass a received message on, a long binary frame held by a receive buffer is referenced rather than copied.
+ * A frame that fits one of the smaller buffer classes is copied, so only frames close to the longest message keep a receive buffer.
+ *
+ * @param view The message view.
+ * @return The message buffer, NULL on failure.
+ */
+message_buffer* message_buffer_create_view(const message_view* view);
+
+/**
+ * Create a receive buffer. This function is used to get a buffer to read bytes into, long messages received whole in it can be passed on by reference.
+ * The bytes are read into the frame of the buffer and its length is the capacity.
+ *
+ * @return The receive buffer, NULL on failure.
+ */
+message_buffer* message_buffer_create_receive(void);
+
+/**
+ * Retain a message buffer. This function is used to take another reference to the buffer, such as when it is queued on one more connection.
+ *
+ * @param buffer The message buffer.
+ * @return The message buffer.
+ */
+message_buffer* message_buffer_retain(message_buffer* buffer);
+
+/**
+ * Release a message buffer. This function is used to drop a reference to the buffer, the last one returns it to its pool.
+ *
+ * @param buffer The message buffer, NULL is ignored.
+ */
+void message_buffer_release(message_buffer* buffer);
+
+/**
+ * Get message buffer pool statistics. This function is used to read the usage of the message buffer pools, summed over all buffer sizes.
+ *
+ * @param stats The statistics to fill.
+ */
+void message_buffer_stats(mem_pool_stats* stats);
+
+/**
+ * Send a message. This function is used to send a message using a secure SSL connection, in the protocol negotiated for it.
  *
  * @param ssl The SSL object.
  * @param msg The message to send.
@@ -276,6 +595,7 @@ const char* message_code_to_string(message_code code);
 
 /**
  * Get the hash of an input. Calculates the SHA-512 hash of the input string and converts it to a hex string in a thread-safe manner.
+ * Every thread reuses a digest context of its own, so hashing does not allocate after the first call of a thread.
  *
  * @param input The input string for which the hash will be calculated.
  * @param output Buffer to store the resulting hex string (must be at least HASH_HEX_OUTPUT_LENGTH).
@@ -283,6 +603,36 @@ const char* message_code_to_string(message_code code);
  */
 int get_hash(const unsigned char* input, char* output);
 
+/**
+ * Get the hashes of several inputs. Calculates the SHA-512 hash of every input string like get_hash, looking up the digest context of the thread once for all of them.
+ *
+ * @param inputs The input strings for which the hashes will be calculated.
+ * @param count The number of inputs.
+ * @param outputs Buffers to store the resulting hex strings, one per input (each must be at least HASH_HEX_OUTPUT_LENGTH).
+ * @returns Exit code of the function, the outputs after a failed input are left unset.
+ */
+int get_hash_batch(const unsigned char* const* inputs, size_t count, char* const* outputs);
+
+/**
+ * Encode bytes as hex. This function is used to get the lowercase hex string of binary data such as hashes and IDs.
+ *
+ * @param src The bytes to encode.
+ * @param length The number of bytes.
+ * @param dest The buffer to store the hex string (must be at least 2 * length + 1).
+ * @return The length of the hex string.
+ */
+size_t hex_encode(const unsigned char* src, size_t length, char* dest);
+
+/**
+ * Decode hex as bytes. This function is used to get the binary data of a lowercase hex string, the inverse of hex_encode.
+ *
+ * @param src The hex string, it does not need to be null-terminated.
+ * @param length The length of the hex string.
+ * @param dest The buffer to store the bytes (must be at least length / 2).
+ * @return The number of decoded bytes, or -1 if the string is not lowercase hex of even length.
+ */
+long hex_decode(const char* src, size_t length, unsigned char* dest);
+
 /**
  * Get the timestamp. This function is used to get the timestamp in a YYYYMMDDHHMMSS format.
  *
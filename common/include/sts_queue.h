@@ -1,45 +1,59 @@
 #ifndef __STS_QUEUE_H
 #define __STS_QUEUE_H
 
+#include <stddef.h>
+#include <stdatomic.h>
 #include <pthread.h>
 
 #include "protocol.h"
 
-/**
- * The STS queue element structure. This structure is used to define the STS queue element.
- */
-typedef struct sts_element
-{
-    void* next;
-    message* value;
-} sts_element;
+#define STS_QUEUE_SPIN_COUNT 16 // yields of an empty queue consumer before it sleeps
 
 /**
  * The STS queue header structure. This structure is used to define the STS queue header.
+ * Producers only swap the tail, the consumer owns the head, so pushing takes no lock and the links embedded in the message buffers are the only nodes.
+ * The stub keeps the list non-empty, it is queued again whenever the consumer is about to take the last buffer.
+ *
+ * @param tail The link most recently pushed.
+ * @param head The link the consumer takes the next message from.
+ * @param stub The placeholder link.
+ * @param waiting The status of a consumer sleeping on the condition variable.
+ * @param wakeup The pending wakeup status, set by wake.
+ * @param mutex The mutex the consumer sleeps with.
+ * @param cond The condition variable the consumer sleeps on.
  */
 typedef struct sts_header
 {
-    sts_element* head;
-    sts_element* tail;
-    pthread_mutex_t* mutex;
+    _Atomic(message_link*) tail;
+    message_link* head;
+    message_link stub;
+    atomic_int waiting;
+    atomic_int wakeup;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
 } sts_header;
 
 /**
  * The STS queue structure. This structure is used to define the STS queue and its operations.
  *
- * This simple thread-safe queue is adopted from https://github.com/petercrona/StsQueue.
+ * This thread-safe queue keeps the interface of https://github.com/petercrona/StsQueue, it is a lock-free multi-producer single-consumer queue
+ * of intrusive message buffer links. The queue holds the reference of the pushed buffer and hands it to the consumer. Any thread may push, only one thread at a time may pop.
  *
  * @param create Create a new STS queue.
  * @param destroy Destroy the STS queue.
- * @param push Push a message to the STS queue.
- * @param pop Pop a message from the STS queue.
+ * @param push Push a message buffer to the STS queue.
+ * @param pop Pop a message buffer from the STS queue, NULL if it is empty.
+ * @param pop_batch Wait up to the timeout in milliseconds for message buffers and pop up to max of them at once, returning their number.
+ * @param wake Make a waiting pop_batch return, or the next one if none is waiting.
  */
 typedef struct
 {
     sts_header* (* const create)();
     void (* const destroy)(sts_header* handle);
-    void (* const push)(sts_header* handle, message* elem);
-    message* (* const pop)(sts_header* handle);
+    void (* const push)(sts_header* handle, message_buffer* elem);
+    message_buffer* (* const pop)(sts_header* handle);
+    size_t (* const pop_batch)(sts_header* handle, message_buffer** elems, size_t max, int timeout);
+    void (* const wake)(sts_header* handle);
 } _sts_queue;
 
 extern _sts_queue const sts_queue;
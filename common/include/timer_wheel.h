@@ -0,0 +1,109 @@
+#ifndef __TIMER_WHEEL_H
+#define __TIMER_WHEEL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_SLOT_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_SLOT_BITS)
+#define TIMER_WHEEL_SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_RANGE ((uint64_t)1 << (TIMER_WHEEL_SLOT_BITS * TIMER_WHEEL_LEVELS)) // ticks ahead a timer can be scheduled, later ones are clamped
+#define TIMER_WHEEL_NONE UINT64_MAX
+
+/**
+ * The timer structure. This structure is used to store a deadline embedded in the object it belongs to.
+ * Timers of a wheel are kept in circular lists, so scheduling and cancelling never allocate or search.
+ *
+ * @param expires The tick the timer fires at.
+ * @param callback The function called when the timer fires, it may schedule the timer again.
+ * @param arg The argument passed to the callback.
+ * @param prev The previous timer of the slot, NULL if the timer is not scheduled.
+ * @param next The next timer of the slot, NULL if the timer is not scheduled.
+ */
+typedef struct timer
+{
+    uint64_t expires;
+    void (*callback)(struct timer* t, void* arg);
+    void* arg;
+    struct timer* prev;
+    struct timer* next;
+} timer;
+
+/**
+ * The timer wheel structure. This structure is used to store timers in a hierarchy of wheels, each slot of a level spanning a whole revolution of the level below.
+ * Timers are moved down a level when their slot comes up, so every timer is touched at most once per level. The wheel is meant to be driven by a single thread.
+ *
+ * @param now The next tick to process.
+ * @param count The number of scheduled timers.
+ * @param slots The sentinel heads of the slot lists of every level.
+ */
+typedef struct timer_wheel
+{
+    uint64_t now;
+    size_t count;
+    timer slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+} timer_wheel;
+
+/**
+ * Initialize timer wheel. This function is used to create an empty wheel starting at the given tick.
+ *
+ * @param wheel The timer wheel.
+ * @param now The current tick.
+ */
+void timer_wheel_init(timer_wheel* wheel, uint64_t now);
+
+/**
+ * Initialize timer. This function is used to prepare an unscheduled timer.
+ *
+ * @param t The timer.
+ * @param callback The function called when the timer fires.
+ * @param arg The argument passed to the callback.
+ */
+void timer_init(timer* t, void (*callback)(timer* t, void* arg), void* arg);
+
+/**
+ * Schedule timer. This function is used to set the tick the timer fires at, replacing the previous one if it was scheduled.
+ * Ticks already processed fire on the next advance.
+ *
+ * @param wheel The timer wheel.
+ * @param t The timer.
+ * @param expires The tick the timer fires at.
+ */
+void timer_schedule(timer_wheel* wheel, timer* t, uint64_t expires);
+
+/**
+ * Cancel timer. This function is used to unschedule the timer. Cancelling an unscheduled timer has no effect.
+ *
+ * @param wheel The timer wheel.
+ * @param t The timer.
+ */
+void timer_cancel(timer_wheel* wheel, timer* t);
+
+/**
+ * Check timer. This function is used to check if the timer is scheduled.
+ *
+ * @param t The timer.
+ * @return 1 if the timer is scheduled, 0 otherwise.
+ */
+int timer_pending(const timer* t);
+
+/**
+ * Advance timer wheel. This function is used to process every tick up to and including the given one, firing the timers that are due.
+ *
+ * @param wheel The timer wheel.
+ * @param now The current tick.
+ * @return The number of fired timers.
+ */
+size_t timer_wheel_advance(timer_wheel* wheel, uint64_t now);
+
+/**
+ * Get next timer wheel event. This function is used to get how many ticks the owner may sleep before the wheel has to be advanced.
+ * The event is either a due timer or timers moving down a level, so it is never later than the earliest timer.
+ *
+ * @param wheel The timer wheel.
+ * @return The number of ticks from the next tick to process, TIMER_WHEEL_NONE if no timer is scheduled.
+ */
+uint64_t timer_wheel_next(const timer_wheel* wheel);
+
+#endif
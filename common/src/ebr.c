@@ -0,0 +1,151 @@
+#include "ebr.h"
+
+#include <stdlib.h>
+#include <pthread.h>
+
+static atomic_uint_fast64_t global_epoch = 1;
+static _Atomic(ebr_record*) records = NULL;
+
+static pthread_mutex_t retired_mutex = PTHREAD_MUTEX_INITIALIZER;
+static ebr_node* retired_head = NULL;
+static ebr_node* retired_tail = NULL;
+static atomic_size_t retired_count = 0;
+
+static _Thread_local ebr_record* thread_record = NULL;
+static _Thread_local unsigned thread_depth = 0;
+
+static pthread_once_t record_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t record_key;
+
+static void record_release(void* arg)
+{
+    // the record of an exiting thread is handed to the next thread that reads
+    ebr_record* record = (ebr_record*)arg;
+    atomic_store(&record->state, 0);
+    atomic_store(&record->in_use, 0);
+}
+
+static void record_key_create()
+{
+    pthread_key_create(&record_key, record_release);
+}
+
+static ebr_record* record_get()
+{
+    if (thread_record)
+        return thread_record;
+
+    for (ebr_record* record = atomic_load(&records); record; record = record->next)
+    {
+        int expected = 0;
+        if (!atomic_load_explicit(&record->in_use, memory_order_relaxed) && atomic_compare_exchange_strong(&record->in_use, &expected, 1))
+        {
+            thread_record = record;
+            break;
+        }
+    }
+    if (!thread_record)
+    {
+        // records are never freed, so the list can be walked without synchronization
+        ebr_record* record = (ebr_record*)malloc(sizeof(ebr_record));
+        if (!record)
+            abort();
+        atomic_init(&record->state, 0);
+        atomic_init(&record->in_use, 1);
+        record->next = atomic_load(&records);
+        while (!atomic_compare_exchange_weak(&records, &record->next, record));
+        thread_record = record;
+    }
+    pthread_once(&record_key_once, record_key_create);
+    pthread_setspecific(record_key, thread_record);
+    return thread_record;
+}
+
+void ebr_enter(void)
+{
+    if (thread_depth++)
+        return;
+    ebr_record* record = record_get();
+    atomic_store_explicit(&record->state, atomic_load(&global_epoch) << 1 | 1, memory_order_relaxed);
+    // the announcement is visible before any shared object is read
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+void ebr_exit(void)
+{
+    if (--thread_depth)
+        return;
+    atomic_store_explicit(&thread_record->state, 0, memory_order_release);
+}
+
+// the global epoch moves on once every reader announced it, returns the current epoch
+static uint_fast64_t epoch_try_advance()
+{
+    uint_fast64_t epoch = atomic_load(&global_epoch);
+    for (ebr_record* record = atomic_load(&records); record; record = record->next)
+    {
+        uint_fast64_t state = atomic_load(&record->state);
+        if ((state & 1) && state >> 1 != epoch)
+            return epoch;
+    }
+    if (atomic_compare_exchange_strong(&global_epoch, &epoch, epoch + 1))
+        return epoch + 1;
+    return epoch;
+}
+
+void ebr_retire(ebr_node* node, void (*reclaim)(ebr_node*))
+{
+    node->reclaim = reclaim;
+    node->next = NULL;
+    pthread_mutex_lock(&retired_mutex);
+    // stamped under the lock, so the list stays ordered by epoch
+    node->epoch = atomic_load(&global_epoch);
+    if (retired_tail)
+        retired_tail->next = node;
+    else
+        retired_head = node;
+    retired_tail = node;
+    atomic_fetch_add(&retired_count, 1);
+    pthread_mutex_unlock(&retired_mutex);
+    ebr_collect();
+}
+
+void ebr_collect(void)
+{
+    if (!atomic_load_explicit(&retired_count, memory_order_relaxed))
+        return;
+    uint_fast64_t epoch = epoch_try_advance();
+
+    pthread_mutex_lock(&retired_mutex);
+    ebr_node* head = NULL;
+    ebr_node* tail = NULL;
+    size_t count = 0;
+    for (ebr_node* node = retired_head; node && node->epoch + EBR_GRACE_EPOCHS <= epoch; node = node->next)
+    {
+        tail = node;
+        ++count;
+    }
+    if (tail)
+    {
+        head = retired_head;
+        retired_head = tail->next;
+        if (!retired_head)
+            retired_tail = NULL;
+        tail->next = NULL;
+        atomic_fetch_sub(&retired_count, count);
+    }
+    pthread_mutex_unlock(&retired_mutex);
+
+    // reclaimed outside the lock, a reclaim function may retire further objects
+    while (head)
+    {
+        ebr_node* next = head->next;
+        head->reclaim(head);
+        head = next;
+    }
+}
+
+size_t ebr_pending(void)
+{
+    return atomic_load(&retired_count);
+}
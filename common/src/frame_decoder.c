@@ -0,0 +1,132 @@
+#include "frame_decoder.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static int frame_length(message_protocol protocol, const char* data, size_t length)
+{
+    if (protocol == MESSAGE_PROTOCOL_BINARY)
+        return get_binary_message_length(data, length);
+    return get_message_length(data, length);
+}
+
+void frame_decoder_init(frame_decoder* decoder, message_protocol protocol)
+{
+    decoder->protocol = protocol;
+    decoder->data = NULL;
+    decoder->start = 0;
+    decoder->length = 0;
+    decoder->consumed = 0;
+    decoder->input = NULL;
+    decoder->input_length = 0;
+}
+
+void frame_decoder_reset(frame_decoder* decoder, message_protocol protocol)
+{
+    char* data = decoder->data;
+    frame_decoder_init(decoder, protocol);
+    decoder->data = data;
+}
+
+void frame_decoder_destroy(frame_decoder* decoder)
+{
+    if (decoder->data)
+        free(decoder->data);
+    frame_decoder_init(decoder, decoder->protocol);
+}
+
+void frame_decoder_feed(frame_decoder* decoder, const char* data, size_t length)
+{
+    decoder->input = data;
+    decoder->input_length = length;
+}
+
+int frame_decoder_next(frame_decoder* decoder, const char** frame, size_t* length)
+{
+    // the message returned last is released, it may have been buffered or still be in the input
+    if (decoder->consumed)
+    {
+        if (decoder->length)
+        {
+            decoder->start += decoder->consumed;
+            decoder->length -= decoder->consumed;
+        }
+        else
+        {
+            decoder->input += decoder->consumed;
+            decoder->input_length -= decoder->consumed;
+        }
+        decoder->consumed = 0;
+        if (!decoder->length)
+            decoder->start = 0;
+    }
+
+    // a cut off message is completed from the input before any message is taken from the input directly
+    size_t pulled = 0;
+    while (decoder->length)
+    {
+        int result = frame_length(decoder->protocol, decoder->data + decoder->start, decoder->length);
+        if (result < 0)
+            return FRAME_DECODER_INVALID;
+        if (result > 0)
+        {
+            // bytes pulled past the end of the message go back to the input, so the following messages are not copied
+            size_t excess = decoder->length - (size_t)result;
+            if (pulled && excess <= pulled)
+            {
+                decoder->length -= excess;
+                decoder->input -= excess;
+                decoder->input_length += excess;
+            }
+            *frame = decoder->data + decoder->start;
+            *length = (size_t)result;
+            decoder->consumed = (size_t)result;
+            return FRAME_DECODER_FRAME;
+        }
+        if (!decoder->input_length)
+            return FRAME_DECODER_INCOMPLETE;
+        if (decoder->start)
+        {
+            memmove(decoder->data, decoder->data + decoder->start, decoder->length);
+            decoder->start = 0;
+        }
+        if (decoder->length == FRAME_DECODER_CAPACITY)
+            return FRAME_DECODER_INVALID;
+        size_t count = FRAME_DECODER_CAPACITY - decoder->length;
+        if (count > decoder->input_length)
+            count = decoder->input_length;
+        memcpy(decoder->data + decoder->length, decoder->input, count);
+        decoder->length += count;
+        pulled += count;
+        decoder->input += count;
+        decoder->input_length -= count;
+    }
+
+    if (!decoder->input_length)
+        return FRAME_DECODER_INCOMPLETE;
+    int result = frame_length(decoder->protocol, decoder->input, decoder->input_length);
+    if (result < 0)
+        return FRAME_DECODER_INVALID;
+    if (result > 0)
+    {
+        *frame = decoder->input;
+        *length = (size_t)result;
+        decoder->consumed = (size_t)result;
+        return FRAME_DECODER_FRAME;
+    }
+
+    // the read ended inside a message, its bytes are kept until the rest arrives
+    if (decoder->input_length > FRAME_DECODER_CAPACITY)
+        return FRAME_DECODER_INVALID;
+    if (!decoder->data)
+    {
+        decoder->data = (char*)malloc(FRAME_DECODER_CAPACITY);
+        if (!decoder->data)
+            return FRAME_DECODER_ALLOCATION_FAILURE;
+    }
+    memcpy(decoder->data, decoder->input, decoder->input_length);
+    decoder->length = decoder->input_length;
+    decoder->input += decoder->input_length;
+    decoder->input_length = 0;
+    return FRAME_DECODER_INCOMPLETE;
+}
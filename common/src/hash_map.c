@@ -7,6 +7,269 @@
 #include "protocol.h"
 #include "log.h"
 
+// the finalizer spreads patterned keys over any table size
+static uint64_t hash_finalize(uint64_t hash)
+{
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+static uint64_t string_hash(const char* key)
+{
+    // FNV-1a over the whole string
+    uint64_t hash = 14695981039346656037ULL;
+    for (const unsigned char* c = (const unsigned char*)key; *c; ++c)
+        hash = (hash ^ *c) * 1099511628211ULL;
+    return hash;
+}
+
+// a UID is the SHA-512 of the username in hex, so its first 16 digits are 64 uniformly distributed bits
+static uint64_t uid_hash(const char* uid)
+{
+    uint64_t hash = 0;
+    int digits = 0;
+    for (; digits < 16; ++digits)
+    {
+        char c = uid[digits];
+        if (c >= '0' && c <= '9')
+            hash = hash << 4 | (uint64_t)(c - '0');
+        else if (c >= 'a' && c <= 'f')
+            hash = hash << 4 | (uint64_t)(c - 'a' + 10);
+        else
+            break;
+    }
+    if (digits < 16)
+        hash = string_hash(uid); // keys that are not hashes
+    return hash_finalize(hash);
+}
+
+static uint64_t key_hash(int key, const char* value)
+{
+    if (key == HASH_MAP_KEY_UID)
+        return uid_hash(value);
+    return hash_finalize(string_hash(value));
+}
+
+static const char* entry_key(const client_connection* cl, int key)
+{
+    if (key == HASH_MAP_KEY_UID)
+        return cl->uid;
+    return cl->username;
+}
+
+#define CTRL_EMPTY 0x80
+#define CTRL_DELETED 0xfe
+#define CTRL_MIGRATED 0x40 // set on entries copied from the old table, iterations visit them there instead
+#define GROUP_LSB 0x0101010101010101ULL
+#define GROUP_MSB 0x8080808080808080ULL
+
+// control bytes of a full slot hold the top 6 bits of the key hash, the shard and the group come from the other bits
+static uint8_t hash_fingerprint(uint64_t hash)
+{
+    return (uint8_t)(hash >> 58);
+}
+
+static hash_shard* hash_shard_get(hash_shard* shards, uint64_t hash)
+{
+    return &shards[(hash >> 48) % HASH_MAP_SHARDS];
+}
+
+static uint64_t group_load(const hash_table* table, size_t group_index)
+{
+    return atomic_load_explicit(&table->ctrl[group_index], memory_order_acquire);
+}
+
+// sets the high bit of every byte holding the fingerprint, whether the entry was copied or not
+static uint64_t group_match(uint64_t group, uint8_t fingerprint)
+{
+    uint64_t x = (group & ~(GROUP_LSB * CTRL_MIGRATED)) ^ (GROUP_LSB * fingerprint);
+    return ~(((x & ~GROUP_MSB) + ~GROUP_MSB) | x | ~GROUP_MSB);
+}
+
+// sets the high bit of every empty byte, deleted bytes also have bit 1 set
+static uint64_t group_match_empty(uint64_t group)
+{
+    return group & ~(group << 6) & GROUP_MSB;
+}
+
+static uint64_t group_match_free(uint64_t group)
+{
+    return group & GROUP_MSB;
+}
+
+static size_t group_first(uint64_t match)
+{
+    return (size_t)__builtin_ctzll(match) / 8;
+}
+
+static uint8_t ctrl_get(const hash_table* table, size_t index)
+{
+    return (uint8_t)(group_load(table, index / HASH_MAP_GROUP_WIDTH) >> (index % HASH_MAP_GROUP_WIDTH * 8));
+}
+
+// only called by writers, so the word is not changed by anyone else in between
+static void ctrl_set(hash_table* table, size_t index, uint8_t value)
+{
+    _Atomic uint64_t* word = &table->ctrl[index / HASH_MAP_GROUP_WIDTH];
+    unsigned shift = (unsigned)(index % HASH_MAP_GROUP_WIDTH * 8);
+    uint64_t group = atomic_load_explicit(word, memory_order_relaxed);
+    group = (group & ~((uint64_t)0xff << shift)) | (uint64_t)value << shift;
+    atomic_store_explicit(word, group, memory_order_release);
+}
+
+static hash_table* hash_table_create(size_t capacity)
+{
+    // the control words and the slots follow the table in one allocation
+    size_t groups = capacity / HASH_MAP_GROUP_WIDTH;
+    hash_table* table = (hash_table*)malloc(sizeof(hash_table) + groups * sizeof(uint64_t) + capacity * sizeof(client_connection*));
+    if (!table)
+        return NULL;
+    table->capacity = capacity;
+    table->used = 0;
+    table->ctrl = (_Atomic uint64_t*)(table + 1);
+    table->slots = (_Atomic(client_connection*)*)(table->ctrl + groups);
+    for (size_t i = 0; i < groups; ++i)
+        atomic_init(&table->ctrl[i], GROUP_LSB * CTRL_EMPTY);
+    for (size_t i = 0; i < capacity; ++i)
+        atomic_init(&table->slots[i], NULL);
+    return table;
+}
+
+static void hash_table_reclaim(ebr_node* node)
+{
+    free((char*)node - offsetof(hash_table, retire));
+}
+
+static long hash_table_find(const hash_table* table, int key, const char* value, uint64_t hash, client_connection** cl)
+{
+    size_t mask = table->capacity / HASH_MAP_GROUP_WIDTH - 1;
+    uint8_t fingerprint = hash_fingerprint(hash);
+    size_t group_index = (size_t)hash & mask;
+    for (size_t probe = 0; probe <= mask; ++probe)
+    {
+        uint64_t group = group_load(table, group_index);
+        for (uint64_t match = group_match(group, fingerprint); match; match &= match - 1)
+        {
+            size_t index = group_index * HASH_MAP_GROUP_WIDTH + group_first(match);
+            // a slot emptied after its control byte was loaded reads as NULL
+            client_connection* found = atomic_load_explicit(&table->slots[index], memory_order_acquire);
+            if (found && !strcmp(entry_key(found, key), value))
+            {
+                *cl = found;
+                return (long)index;
+            }
+        }
+        if (group_match_empty(group))
+            return -1;
+        group_index = (group_index + 1) & mask;
+    }
+    return -1;
+}
+
+// the table must have a free slot and must not hold the key yet
+static void hash_table_put(hash_table* table, client_connection* cl, uint64_t hash, uint8_t flags)
+{
+    size_t mask = table->capacity / HASH_MAP_GROUP_WIDTH - 1;
+    size_t group_index = (size_t)hash & mask;
+    uint64_t match;
+    while (!(match = group_match_free(group_load(table, group_index))))
+        group_index = (group_index + 1) & mask;
+    size_t index = group_index * HASH_MAP_GROUP_WIDTH + group_first(match);
+    if (ctrl_get(table, index) == CTRL_EMPTY)
+        table->used++;
+    // the slot is published by its control byte
+    atomic_store_explicit(&table->slots[index], cl, memory_order_release);
+    ctrl_set(table, index, hash_fingerprint(hash) | flags);
+}
+
+static void hash_table_remove(hash_table* table, size_t index)
+{
+    // probes stop at a group with an empty slot, so a slot in such a group can be emptied without cutting off any probe
+    if (group_match_empty(group_load(table, index / HASH_MAP_GROUP_WIDTH)))
+    {
+        ctrl_set(table, index, CTRL_EMPTY);
+        table->used--;
+    }
+    else
+        ctrl_set(table, index, CTRL_DELETED);
+    atomic_store_explicit(&table->slots[index], NULL, memory_order_release);
+}
+
+// readers take the tables of a shard as a pair that was current at the same time
+// a reader retries while a writer swaps the tables, which makes lookups lock-free but not wait-free
+static void hash_shard_tables(hash_shard* shard, hash_table** table, hash_table** old)
+{
+    unsigned generation;
+    do
+    {
+        generation = atomic_load_explicit(&shard->generation, memory_order_acquire);
+        *table = atomic_load_explicit(&shard->table, memory_order_acquire);
+        *old = atomic_load_explicit(&shard->old, memory_order_acquire);
+    } while ((generation & 1) || atomic_load_explicit(&shard->generation, memory_order_acquire) != generation);
+}
+
+static void hash_shard_swap(hash_shard* shard, hash_table* table, hash_table* old)
+{
+    atomic_fetch_add(&shard->generation, 1);
+    atomic_store_explicit(&shard->old, old, memory_order_release);
+    atomic_store_explicit(&shard->table, table, memory_order_release);
+    atomic_fetch_add(&shard->generation, 1);
+}
+
+// copies up to count entries of the old table into the new one, the old table is retired once it is copied
+static void hash_shard_migrate(hash_shard* shard, size_t count)
+{
+    hash_table* table = atomic_load_explicit(&shard->table, memory_order_relaxed);
+    hash_table* old = atomic_load_explicit(&shard->old, memory_order_relaxed);
+    while (old && count--)
+    {
+        size_t index = shard->migrated++;
+        if (!(ctrl_get(old, index) & CTRL_EMPTY))
+        {
+            client_connection* cl = atomic_load_explicit(&old->slots[index], memory_order_relaxed);
+            hash_table_put(table, cl, key_hash(shard->key, entry_key(cl, shard->key)), CTRL_MIGRATED);
+        }
+        if (shard->migrated == old->capacity)
+        {
+            hash_shard_swap(shard, table, NULL);
+            ebr_retire(&old->retire, hash_table_reclaim);
+            shard->migrated = 0;
+            old = NULL;
+        }
+    }
+}
+
+// makes room for one more entry, a full table is replaced and copied incrementally by the following updates
+static int hash_shard_reserve(hash_shard* shard)
+{
+    hash_table* table = atomic_load_explicit(&shard->table, memory_order_relaxed);
+    if ((table->used + 1) * 8 <= table->capacity * 7)
+        return 0;
+    hash_shard_migrate(shard, (size_t)-1);
+
+    // a table filled up by deleted slots is only rebuilt, it grows when more than half of it holds entries
+    size_t capacity = table->capacity;
+    if ((shard->count + 1) * 2 > capacity)
+        capacity *= 2;
+    hash_table* new_table = hash_table_create(capacity);
+    if (!new_table)
+        return -1;
+    shard->migrated = 0;
+    hash_shard_swap(shard, new_table, table);
+    return 0;
+}
+
+static size_t initial_capacity(size_t hash_size)
+{
+    size_t per_shard = hash_size / HASH_MAP_SHARDS + 1;
+    size_t capacity = HASH_MAP_MIN_CAPACITY;
+    while (capacity * 7 < per_shard * 8)
+        capacity *= 2;
+    return capacity;
+}
+
 hash_map* hash_map_create(size_t hash_size)
 {
     hash_map* map = (hash_map*)malloc(sizeof(hash_map));
@@ -14,37 +277,37 @@ hash_map* hash_map_create(size_t hash_size)
         return NULL;
 
     map->hash_size = hash_size;
-    map->hash_table = (hash_bucket*)calloc(hash_size, sizeof(hash_bucket));
-    if (!map->hash_table)
+    map->shards = (hash_shard*)calloc(2 * HASH_MAP_SHARDS, sizeof(hash_shard));
+    if (!map->shards)
     {
-        if (map)
-        {
-            free(map);
-            map = NULL;
-        }
+        free(map);
         return NULL;
     }
-    map->current_elements = 0;
+    map->name_shards = map->shards + HASH_MAP_SHARDS;
+    atomic_init(&map->current_elements, 0);
 
-    for (size_t i = 0; i < hash_size; ++i)
+    size_t capacity = initial_capacity(hash_size);
+    for (size_t i = 0; i < 2 * HASH_MAP_SHARDS; ++i)
     {
-        if (pthread_mutex_init(&map->hash_table[i].mutex, NULL) != 0)
+        hash_shard* shard = &map->shards[i];
+        hash_table* table = hash_table_create(capacity);
+        if (!table || pthread_mutex_init(&shard->mutex, NULL) != 0)
         {
+            if (table)
+                free(table);
             for (size_t j = 0; j < i; ++j)
-                pthread_mutex_destroy(&map->hash_table[j].mutex);
-            if (map->hash_table)
-            {
-                free(map->hash_table);
-                map->hash_table = NULL;
-            }
-            if (map)
             {
-                free(map);
-                map = NULL;
+                free(atomic_load(&map->shards[j].table));
+                pthread_mutex_destroy(&map->shards[j].mutex);
             }
+            free(map->shards);
+            free(map);
             return NULL;
         }
-        map->hash_table[i].head = NULL;
+        atomic_init(&shard->table, table);
+        atomic_init(&shard->old, NULL);
+        atomic_init(&shard->generation, 0);
+        shard->key = i < HASH_MAP_SHARDS ? HASH_MAP_KEY_UID : HASH_MAP_KEY_USERNAME;
     }
 
     return map;
@@ -54,66 +317,114 @@ void hash_map_destroy(hash_map* map)
 {
     if (!map) return;
 
-    for (size_t i = 0; i < map->hash_size; ++i)
+    for (size_t i = 0; i < 2 * HASH_MAP_SHARDS; ++i)
     {
-        hash_node* node = map->hash_table[i].head;
-        while (node)
-        {
-            hash_node* next = node->next;
-            if (node->cl)
-                node->cl = NULL;
-            if (node)
-            {
-                free(node);
-                node = NULL;
-            }
-            node = next;
-        }
-        pthread_mutex_destroy(&map->hash_table[i].mutex);
+        free(atomic_load(&map->shards[i].table));
+        if (atomic_load(&map->shards[i].old))
+            free(atomic_load(&map->shards[i].old));
+        pthread_mutex_destroy(&map->shards[i].mutex);
     }
 
-    if (map->hash_table)
+    if (map->shards)
     {
-        free(map->hash_table);
-        map->hash_table = NULL;
+        free(map->shards);
+        map->shards = NULL;
     }
-    if (map)
+    free(map);
+}
+
+// finds the entry in either table of the shard, readers and writers alike
+static client_connection* hash_shard_find(hash_shard* shard, const char* value, uint64_t hash)
+{
+    hash_table* table;
+    hash_table* old;
+    client_connection* cl = NULL;
+    hash_shard_tables(shard, &table, &old);
+    if (hash_table_find(table, shard->key, value, hash, &cl) < 0 && old)
+        hash_table_find(old, shard->key, value, hash, &cl);
+    return cl;
+}
+
+static bool hash_index_find(hash_shard* shards, int key, const char* value, client_connection** cl)
+{
+    uint64_t hash = key_hash(key, value);
+    ebr_enter();
+    client_connection* found = hash_shard_find(hash_shard_get(shards, hash), value, hash);
+    if (found && !found->req)
     {
-        free(map);
-        map = NULL;
+        log_message(T_LOG_ERROR, SERVER_LOG, __FILE__, "Found a client with NULL fields");
+        found = NULL;
     }
+    if (found)
+        *cl = found;
+    ebr_exit();
+    return found != NULL;
+}
+
+static bool hash_index_apply(hash_shard* shards, int key, const char* value, void (*callback)(client_connection*, void*), void* param)
+{
+    uint64_t hash = key_hash(key, value);
+    ebr_enter();
+    client_connection* found = hash_shard_find(hash_shard_get(shards, hash), value, hash);
+    if (found)
+        callback(found, param);  // Perform operation on the client connection, it is not reclaimed before the callback returns
+    ebr_exit();
+    return found != NULL;
 }
 
 bool hash_map_find(hash_map* map, const char* uid, client_connection** cl)
 {
-    // Directly use the uid to compute the index (uid is already hashed)
-    size_t hash_value = strtoul(uid, NULL, 16) % map->hash_size;
+    return hash_index_find(map->shards, HASH_MAP_KEY_UID, uid, cl);
+}
 
-    pthread_mutex_lock(&map->hash_table[hash_value].mutex);
-    hash_node* node = map->hash_table[hash_value].head;
+bool hash_map_apply(hash_map* map, const char* uid, void (*callback)(client_connection*, void*), void* param)
+{
+    return hash_index_apply(map->shards, HASH_MAP_KEY_UID, uid, callback, param);
+}
 
-    while (node)
-    {
-        if (node->cl && node->cl->uid && node->cl->req)
-        {
-            if (strcmp(node->cl->uid, uid) == 0)
-            {
-                *cl = node->cl;
-                pthread_mutex_unlock(&map->hash_table[hash_value].mutex);
-                return true;
-            }
-            node = node->next;
-        }
-        else
-        {
-            log_message(T_LOG_ERROR, SERVER_LOG, __FILE__, "Found a client with NULL fields");
-            pthread_mutex_unlock(&map->hash_table[hash_value].mutex);
-            return false;
-        }
-    }
+bool hash_map_find_by_name(hash_map* map, const char* username, client_connection** cl)
+{
+    return hash_index_find(map->name_shards, HASH_MAP_KEY_USERNAME, username, cl);
+}
 
-    pthread_mutex_unlock(&map->hash_table[hash_value].mutex);
-    return false;
+bool hash_map_apply_by_name(hash_map* map, const char* username, void (*callback)(client_connection*, void*), void* param)
+{
+    return hash_index_apply(map->name_shards, HASH_MAP_KEY_USERNAME, username, callback, param);
+}
+
+// finds the slots of the entry in both tables of a locked shard, an entry already copied is in both
+static client_connection* hash_shard_locate(hash_shard* shard, const char* value, uint64_t hash, long* index, long* old_index)
+{
+    hash_table* table = atomic_load_explicit(&shard->table, memory_order_relaxed);
+    hash_table* old = atomic_load_explicit(&shard->old, memory_order_relaxed);
+    client_connection* found = NULL;
+    *index = hash_table_find(table, shard->key, value, hash, &found);
+    *old_index = old ? hash_table_find(old, shard->key, value, hash, &found) : -1;
+    return found;
+}
+
+static void hash_shard_replace(hash_shard* shard, long index, long old_index, client_connection* cl)
+{
+    if (index >= 0)
+        atomic_store_explicit(&atomic_load_explicit(&shard->table, memory_order_relaxed)->slots[index], cl, memory_order_release);
+    if (old_index >= 0)
+        atomic_store_explicit(&atomic_load_explicit(&shard->old, memory_order_relaxed)->slots[old_index], cl, memory_order_release);
+}
+
+// the shard must have been reserved
+static void hash_shard_put(hash_shard* shard, client_connection* cl, uint64_t hash)
+{
+    hash_table_put(atomic_load_explicit(&shard->table, memory_order_relaxed), cl, hash, 0);
+    shard->count++;
+}
+
+static void hash_shard_remove(hash_shard* shard, long index, long old_index)
+{
+    if (index >= 0)
+        hash_table_remove(atomic_load_explicit(&shard->table, memory_order_relaxed), (size_t)index);
+    if (old_index >= 0)
+        hash_table_remove(atomic_load_explicit(&shard->old, memory_order_relaxed), (size_t)old_index);
+    shard->count--;
 }
 
 int hash_map_insert(hash_map* map, client_connection* cl)
@@ -121,133 +432,180 @@ int hash_map_insert(hash_map* map, client_connection* cl)
     int insert_success = 0;
     const char* uid = cl->uid;
 
-    // Directly use the uid to compute the index (uid is already hashed)
     if (!uid)
     {
         log_message(T_LOG_ERROR, SERVER_LOG, __FILE__, "Client UID is NULL");
         return insert_success;
     }
-    size_t hash_value = strtoul(uid, NULL, 16) % map->hash_size;
-
-    pthread_mutex_lock(&map->hash_table[hash_value].mutex);
-    hash_node* prev = NULL;
-    hash_node* node = map->hash_table[hash_value].head;
+    uint64_t hash = uid_hash(uid);
+    uint64_t name_hash = key_hash(HASH_MAP_KEY_USERNAME, cl->username);
+    hash_shard* shard = hash_shard_get(map->shards, hash);
+    hash_shard* name_shard = hash_shard_get(map->name_shards, name_hash);
+    long index, old_index, name_index, name_old_index;
 
-    while (node && node->cl && node->cl->uid && strcmp(node->cl->uid, uid) != 0)
-    {
-        prev = node;
-        node = node->next;
+    // the UID shard is always locked first, so writers locking both shards cannot deadlock
+    pthread_mutex_lock(&shard->mutex);
+    pthread_mutex_lock(&name_shard->mutex);
+    hash_shard_migrate(shard, HASH_MAP_MIGRATE_STEP);
+    hash_shard_migrate(name_shard, HASH_MAP_MIGRATE_STEP);
+    client_connection* found = hash_shard_locate(shard, uid, hash, &index, &old_index);
+    client_connection* name_found = hash_shard_locate(name_shard, cl->username, name_hash, &name_index, &name_old_index);
+    if (found != name_found)
+        log_message(T_LOG_ERROR, SERVER_LOG, __FILE__, "Username %s belongs to another client in the client map", cl->username);
+    else if (found)
+    { // Existing entry - overwriting existing client connection needs to be handled by the caller
+        hash_shard_replace(shard, index, old_index, cl);
+        hash_shard_replace(name_shard, name_index, name_old_index, cl);
+        insert_success = 2;
     }
-
-    if (!node)
-    {  // New entry
-        hash_node* new_node = (hash_node*)malloc(sizeof(hash_node));
-        new_node->cl = cl;  // Use client connection pointer directly
-        new_node->next = NULL;
-
-        if (!map->hash_table[hash_value].head)
-            map->hash_table[hash_value].head = new_node;
-        else
-            prev->next = new_node;
+    else if (hash_shard_reserve(shard) == 0 && hash_shard_reserve(name_shard) == 0)
+    {  // New entry, put into the indexes only once both have room for it
+        hash_shard_put(shard, cl, hash);
+        hash_shard_put(name_shard, cl, name_hash);
         map->current_elements++;
         insert_success = 1;
     }
     else
-    { // Existing entry - overwriting existing client connection needs to be handled by the caller
-        node->cl = cl;
-        insert_success = 2;
-    }
+        log_message(T_LOG_ERROR, SERVER_LOG, __FILE__, "Failed to grow the client map");
 
-    pthread_mutex_unlock(&map->hash_table[hash_value].mutex);
+    pthread_mutex_unlock(&name_shard->mutex);
+    pthread_mutex_unlock(&shard->mutex);
     return insert_success;
 }
 
 void hash_map_erase(hash_map* map, const char* uid)
 {
-    // Directly use the uid to compute the index (uid is already hashed)
-    size_t hash_value = strtoul(uid, NULL, 16) % map->hash_size;
+    uint64_t hash = uid_hash(uid);
+    hash_shard* shard = hash_shard_get(map->shards, hash);
+    long index, old_index;
 
-    pthread_mutex_lock(&map->hash_table[hash_value].mutex);
-    hash_node* prev = NULL;
-    hash_node* node = map->hash_table[hash_value].head;
-
-    while (node && strcmp(node->cl->uid, uid) != 0)
+    pthread_mutex_lock(&shard->mutex);
+    hash_shard_migrate(shard, HASH_MAP_MIGRATE_STEP);
+    client_connection* found = hash_shard_locate(shard, uid, hash, &index, &old_index);
+    if (found)
     {
-        prev = node;
-        node = node->next;
-    }
+        uint64_t name_hash = key_hash(HASH_MAP_KEY_USERNAME, found->username);
+        hash_shard* name_shard = hash_shard_get(map->name_shards, name_hash);
+        long name_index, name_old_index;
 
-    if (node)
-    {
-        if (!prev)
-            map->hash_table[hash_value].head = node->next;
-        else
-            prev->next = node->next;
+        pthread_mutex_lock(&name_shard->mutex);
+        hash_shard_migrate(name_shard, HASH_MAP_MIGRATE_STEP);
+        if (hash_shard_locate(name_shard, found->username, name_hash, &name_index, &name_old_index) == found)
+            hash_shard_remove(name_shard, name_index, name_old_index);
+        pthread_mutex_unlock(&name_shard->mutex);
 
+        hash_shard_remove(shard, index, old_index);
         map->current_elements--;
-        node->cl = NULL;
-        if (node)
+    }
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+// calls the callback for every full slot of the table, copied entries are skipped while the old table is visited too
+static void hash_table_visit(hash_table* table, uint8_t skip, void (*callback)(client_connection*, void*), void* param)
+{
+    for (size_t g = 0; g < table->capacity / HASH_MAP_GROUP_WIDTH; ++g)
+    {
+        uint64_t group = group_load(table, g);
+        for (uint64_t full = ~group & GROUP_MSB; full; full &= full - 1)
         {
-            free(node);
-            node = NULL;
+            size_t index = g * HASH_MAP_GROUP_WIDTH + group_first(full);
+            if ((uint8_t)(group >> (index % HASH_MAP_GROUP_WIDTH * 8)) & skip)
+                continue;
+            client_connection* cl = atomic_load_explicit(&table->slots[index], memory_order_acquire);
+            if (cl)
+                callback(cl, param);
         }
     }
+}
+
+static void hash_shard_visit(hash_shard* shard, void (*callback)(client_connection*, void*), void* param)
+{
+    hash_table* table;
+    hash_table* old;
+    ebr_enter();
+    hash_shard_tables(shard, &table, &old);
+    if (old)
+        hash_table_visit(old, 0, callback, param);
+    hash_table_visit(table, old ? CTRL_MIGRATED : 0, callback, param);
+    ebr_exit();
+}
 
-    pthread_mutex_unlock(&map->hash_table[hash_value].mutex);
+static void call_callback(client_connection* cl, void* callback)
+{
+    (*(void (**)(client_connection*))callback)(cl);
 }
 
-void hash_map_clear(hash_map* map)
+void hash_map_clear(hash_map* map, void (*release)(client_connection*))
 {
-    for (size_t i = 0; i < map->hash_size; ++i)
+    // the entries are released once, through the UID index
+    for (size_t i = 0; i < 2 * HASH_MAP_SHARDS; ++i)
     {
-        pthread_mutex_lock(&map->hash_table[i].mutex);
-        hash_node* node = map->hash_table[i].head;
-        while (node)
+        hash_shard* shard = &map->shards[i];
+        pthread_mutex_lock(&shard->mutex);
+        hash_shard_migrate(shard, (size_t)-1);
+        hash_table* table = atomic_load_explicit(&shard->table, memory_order_relaxed);
+        if (shard->key == HASH_MAP_KEY_UID)
         {
-            hash_node* next = node->next;
-            if (node->cl)
-            {
-                free(node->cl);
-                node->cl = NULL;
-            }
-            if (node)
-            {
-                free(node);
-                node = NULL;
-            }
-            node = next;
+            hash_table_visit(table, 0, call_callback, &release);
+            map->current_elements -= shard->count;
         }
-        map->hash_table[i].head = NULL;
-        pthread_mutex_unlock(&map->hash_table[i].mutex);
+        shard->count = 0;
+        for (size_t g = 0; g < table->capacity / HASH_MAP_GROUP_WIDTH; ++g)
+            atomic_store(&table->ctrl[g], GROUP_LSB * CTRL_EMPTY);
+        for (size_t j = 0; j < table->capacity; ++j)
+            atomic_store(&table->slots[j], NULL);
+        table->used = 0;
+        pthread_mutex_unlock(&shard->mutex);
     }
 }
 
 void hash_map_iterate(hash_map* map, void (*callback)(client_connection*))
 {
-    for (size_t i = 0; i < map->hash_size; ++i)
+    for (size_t i = 0; i < HASH_MAP_SHARDS; ++i)
+        hash_shard_visit(&map->shards[i], call_callback, &callback);
+}
+
+void hash_map_iterate2(hash_map* map, void (*callback)(client_connection*, void*), void* param)
+{
+    for (size_t i = 0; i < HASH_MAP_SHARDS; ++i)
+        hash_shard_visit(&map->shards[i], callback, param);  // Pass the client additional parameter
+}
+
+void hash_map_histogram(hash_map* map, size_t* histogram, size_t histogram_size)
+{
+    memset(histogram, 0, histogram_size * sizeof(size_t));
+    for (size_t i = 0; i < HASH_MAP_SHARDS; ++i)
     {
-        pthread_mutex_lock(&map->hash_table[i].mutex);  // Lock the bucket
-        hash_node* node = map->hash_table[i].head;
-        while (node)
+        hash_shard* shard = &map->shards[i];
+        pthread_mutex_lock(&shard->mutex);
+        hash_table* tables[] = { atomic_load(&shard->table), atomic_load(&shard->old) };
+        for (int t = 0; t < 2 && tables[t]; ++t)
         {
-            callback(node->cl);  // Perform operation on the client connection
-            node = node->next;
+            size_t mask = tables[t]->capacity / HASH_MAP_GROUP_WIDTH - 1;
+            for (size_t j = 0; j < tables[t]->capacity; ++j)
+            {
+                // copied entries are counted in the old table
+                uint8_t ctrl = ctrl_get(tables[t], j);
+                if ((ctrl & CTRL_EMPTY) || (t == 0 && tables[1] && (ctrl & CTRL_MIGRATED)))
+                    continue;
+                size_t home = (size_t)key_hash(shard->key, entry_key(atomic_load(&tables[t]->slots[j]), shard->key)) & mask;
+                size_t distance = (j / HASH_MAP_GROUP_WIDTH - home) & mask;
+                histogram[distance < histogram_size ? distance : histogram_size - 1]++;
+            }
         }
-        pthread_mutex_unlock(&map->hash_table[i].mutex);  // Unlock the bucket
+        pthread_mutex_unlock(&shard->mutex);
     }
 }
 
-void hash_map_iterate2(hash_map* map, void (*callback)(client_connection*, void*), void* param)
+size_t hash_map_capacity(hash_map* map)
 {
-    for (size_t i = 0; i < map->hash_size; ++i)
+    size_t capacity = 0;
+    for (size_t i = 0; i < HASH_MAP_SHARDS; ++i)
     {
-        pthread_mutex_lock(&map->hash_table[i].mutex);  // Lock the bucket
-        hash_node* node = map->hash_table[i].head;
-        while (node)
-        {
-            callback(node->cl, param);  // Pass the client additional parameter
-            node = node->next;
-        }
-        pthread_mutex_unlock(&map->hash_table[i].mutex);  // Unlock the bucket
+        pthread_mutex_lock(&map->shards[i].mutex);
+        hash_table* old = atomic_load(&map->shards[i].old);
+        capacity += atomic_load(&map->shards[i].table)->capacity + (old ? old->capacity : 0);
+        pthread_mutex_unlock(&map->shards[i].mutex);
     }
+    return capacity;
 }
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // O_CLOEXEC and usleep
 #include "log.h"
 
 #include <stdio.h>
@@ -6,20 +7,149 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <time.h>
 #include <pthread.h>
-#include <sys/file.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include "protocol.h"
 
-static struct loggers_t loggers = { PTHREAD_MUTEX_INITIALIZER, {NULL}, 0 };
-int fileno(FILE* __stream);
-void usleep(unsigned int usec);
+#define LOG_RING_MASK (LOG_RING_SIZE - 1)
+#define LOG_RECORD_PADDING UINT32_MAX // logger of a record skipping the end of the ring
+
+/**
+ * The log record structure. This structure is used to prefix every line in a ring with its length and logger.
+ *
+ * @param length The number of line bytes following the header.
+ * @param logger The index of the logger, LOG_RECORD_PADDING for the padding up to the end of the ring.
+ */
+typedef struct log_record
+{
+    uint32_t length;
+    uint32_t logger;
+} log_record;
+
+/**
+ * The log batch structure. This structure is used to collect the lines of a single log file for one writev.
+ *
+ * @param lines The lines, pointing into the rings.
+ * @param count The number of lines.
+ */
+typedef struct log_batch
+{
+    struct iovec lines[LOG_BATCH_LINES];
+    int count;
+} log_batch;
+
+static struct loggers_t loggers = { PTHREAD_MUTEX_INITIALIZER, {NULL}, {{NULL, 0}}, 0, NULL, LOG_OVERFLOW_BLOCK, 0, 0, 0, PTHREAD_COND_INITIALIZER };
+static log_batch batches[MAX_LOG_FILES]; // used by the writer only
+
+static _Thread_local log_ring_t* local_ring = NULL;
+static _Thread_local time_t timestamp_second = (time_t)-1;
+static _Thread_local char timestamp[TIMESTAMP_LENGTH];
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static size_t record_size(size_t length)
+{
+    return (sizeof(log_record) + length + 7) & ~(size_t)7;
+}
+
+static void log_flush(int logger)
+{
+    log_batch* batch = &batches[logger];
+    struct iovec* lines = batch->lines;
+    int count = batch->count;
+    while (count > 0)
+    {
+        ssize_t written = writev(loggers.array[logger]->fd, lines, count);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("Failed to write log file");
+            break;
+        }
+        // a short write resumes within the line it stopped in
+        while (count > 0 && (size_t)written >= lines->iov_len)
+        {
+            written -= lines->iov_len;
+            lines++;
+            count--;
+        }
+        if (count > 0)
+        {
+            lines->iov_base = (char*)lines->iov_base + written;
+            lines->iov_len -= written;
+        }
+    }
+    batch->count = 0;
+}
+
+// writes the lines queued in all rings, lines of every file are batched across threads and the rings are released only once written
+static size_t log_drain()
+{
+    size_t lines = 0;
+    log_ring_t* rings = atomic_load(&loggers.rings);
+    for (log_ring_t* ring = rings; ring; ring = ring->next)
+    {
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        ring->drained = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        while (ring->drained < head)
+        {
+            log_record* record = (log_record*)(ring->buffer + (ring->drained & LOG_RING_MASK));
+            if (record->logger != LOG_RECORD_PADDING)
+            {
+                log_batch* batch = &batches[record->logger];
+                if (batch->count == LOG_BATCH_LINES)
+                    log_flush((int)record->logger);
+                batch->lines[batch->count].iov_base = record + 1;
+                batch->lines[batch->count].iov_len = record->length;
+                batch->count++;
+                lines++;
+            }
+            ring->drained += record_size(record->length);
+        }
+    }
+    for (int i = 0; i < MAX_LOG_FILES; ++i)
+        if (batches[i].count)
+            log_flush(i);
+    for (log_ring_t* ring = rings; ring; ring = ring->next)
+        atomic_store_explicit(&ring->tail, ring->drained, memory_order_release);
+    return lines;
+}
+
+static void* log_writer(void* arg)
+{
+    if (arg) {}
+    for (;;)
+    {
+        // the stop request is read before draining, so every line queued before it is written
+        int stop = atomic_load(&loggers.stop);
+        if (log_drain())
+            continue;
+        if (stop)
+            break;
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += LOG_FLUSH_INTERVAL * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_mutex_lock(&loggers.log_mutex);
+        if (!atomic_load(&loggers.stop))
+            pthread_cond_timedwait(&loggers.wake, &loggers.log_mutex, &deadline);
+        pthread_mutex_unlock(&loggers.log_mutex);
+    }
+    pthread_exit(NULL);
+}
 
 void init_logging(const char* filename)
 {
-    loggers.is_initializing = 1;
     const char* log_dir = LOGS_DIR;
     struct stat st = { 0 };
 
@@ -28,12 +158,11 @@ void init_logging(const char* filename)
         if (mkdir(log_dir, 0700) != 0)
         {
             perror("Failed to create logs directory");
-            loggers.is_initializing = 0;
             return;
         }
     }
 
-    char full_path[256];
+    char full_path[MAX_FILENAME_LENGTH];
     snprintf(full_path, sizeof(full_path), "%s/%s", log_dir, filename);
 
     pthread_mutex_lock(&loggers.log_mutex);
@@ -41,76 +170,160 @@ void init_logging(const char* filename)
     {
         if (loggers.array[i] == NULL)
         {
-            loggers.array[i] = (struct logger_t*)malloc(sizeof(logger_t));
-            loggers.array[i]->filename = (char*)malloc(strlen(full_path) + 1);
-            if (loggers.array[i]->filename == NULL)
+            logger_t* logger = (logger_t*)malloc(sizeof(logger_t));
+            if (logger == NULL)
+            {
+                perror("Failed to allocate memory for logger");
+                break;
+            }
+            logger->filename = (char*)malloc(strlen(full_path) + 1);
+            if (logger->filename == NULL)
             {
                 perror("Failed to allocate memory for filename");
-                free(loggers.array[i]);
-                loggers.array[i] = NULL;
+                free(logger);
                 break;
             }
-            snprintf(loggers.array[i]->filename, strlen(full_path) + 1, "%s", full_path);
-            loggers.array[i]->file = fopen(full_path, "a");
-            if (loggers.array[i]->file == NULL)
+            snprintf(logger->filename, strlen(full_path) + 1, "%s", full_path);
+            logger->fd = open(full_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+            if (logger->fd < 0)
             {
                 perror("Failed to open log file");
-                free(loggers.array[i]->filename);
-                free(loggers.array[i]);
-                loggers.array[i] = NULL;
+                free(logger->filename);
+                free(logger);
+                break;
             }
+            loggers.array[i] = logger;
             break;
         }
     }
-    loggers.is_initializing = 0;
+
+    if (!loggers.writer_running)
+    {
+        static int exit_registered = 0;
+        atomic_store(&loggers.stop, 0);
+        if (pthread_create(&loggers.writer, NULL, log_writer, NULL) != 0)
+            perror("Failed to start log writer");
+        else
+            loggers.writer_running = 1;
+        // lines queued when the process exits without finishing logging are still written
+        if (!exit_registered && !atexit(finish_logging))
+            exit_registered = 1;
+    }
     pthread_mutex_unlock(&loggers.log_mutex);
 }
 
-void log_message(log_level_t level, const char* filename, const char* source_file, const char* format, ...)
+static void log_ring_release(void* ring)
 {
-    const char* log_dir = LOGS_DIR;
+    atomic_store(&((log_ring_t*)ring)->owned, 0);
+}
 
-    char full_path[256];
-    snprintf(full_path, sizeof(full_path), "%s/%s", log_dir, filename);
+static void log_ring_key_create()
+{
+    pthread_key_create(&ring_key, log_ring_release);
+}
 
-    pthread_mutex_lock(&loggers.log_mutex);
+// takes over the ring of an exited thread or adds a new one, the ring is given back when the thread exits
+static log_ring_t* log_ring_acquire()
+{
+    log_ring_t* ring = NULL;
+    for (log_ring_t* r = atomic_load(&loggers.rings); r && !ring; r = r->next)
+    {
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&r->owned, &expected, 1))
+            ring = r;
+    }
+    if (!ring)
+    {
+        ring = (log_ring_t*)calloc(1, sizeof(log_ring_t));
+        if (!ring)
+            return NULL;
+        ring->buffer = (char*)malloc(LOG_RING_SIZE);
+        if (!ring->buffer)
+        {
+            free(ring);
+            return NULL;
+        }
+        atomic_store(&ring->owned, 1);
+        ring->next = atomic_load(&loggers.rings);
+        while (!atomic_compare_exchange_weak(&loggers.rings, &ring->next, ring));
+    }
+    pthread_once(&ring_key_once, log_ring_key_create);
+    pthread_setspecific(ring_key, ring);
+    local_ring = ring;
+    return ring;
+}
 
-    FILE* log = NULL;
+static int log_resolve(const char* filename)
+{
+    int count = atomic_load_explicit(&loggers.alias_count, memory_order_acquire);
+    for (int i = 0; i < count; ++i)
+        if (loggers.aliases[i].filename == filename)
+            return loggers.aliases[i].logger;
+
+    char full_path[MAX_FILENAME_LENGTH];
+    snprintf(full_path, sizeof(full_path), "%s/%s", LOGS_DIR, filename);
+
+    pthread_mutex_lock(&loggers.log_mutex);
+    int logger = -1;
     for (int i = 0; i < MAX_LOG_FILES; i++)
     {
         if (loggers.array[i] != NULL && !strcmp(loggers.array[i]->filename, full_path))
         {
-            log = loggers.array[i]->file;
+            logger = i;
             break;
         }
     }
-
-    if (log == NULL)
+    count = atomic_load_explicit(&loggers.alias_count, memory_order_relaxed);
+    if (logger >= 0 && count < LOG_MAX_ALIASES)
     {
-        pthread_mutex_unlock(&loggers.log_mutex);
-        fprintf(stderr, "Log file not found: %s\n", full_path);
-        return;
+        loggers.aliases[count].filename = filename;
+        loggers.aliases[count].logger = logger;
+        atomic_store_explicit(&loggers.alias_count, count + 1, memory_order_release);
     }
+    pthread_mutex_unlock(&loggers.log_mutex);
+    return logger;
+}
 
-    int timeout = 0;
-    int error = 0;
-
-    error = flock(fileno(log), LOCK_EX | LOCK_NB);
-    while (error == -1 && (errno == EWOULDBLOCK || errno == EAGAIN))
+// makes room for a record, a record that would wrap is preceded by padding up to the end of the ring
+static log_record* log_reserve(log_ring_t* ring, size_t size, uint64_t* head)
+{
+    *head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t to_end = LOG_RING_SIZE - (size_t)(*head & LOG_RING_MASK);
+    size_t needed = size <= to_end ? size : to_end + size;
+    while (LOG_RING_SIZE - (size_t)(*head - atomic_load_explicit(&ring->tail, memory_order_acquire)) < needed)
     {
-        usleep(LOCKED_FILE_RETRY_TIME);
-        timeout += LOCKED_FILE_RETRY_TIME;
-
-        if (timeout > LOCKED_FILE_TIMEOUT)
+        if (atomic_load(&loggers.overflow) == LOG_OVERFLOW_DROP || atomic_load(&loggers.stop))
         {
-            fprintf(stderr, "Log file locking timed out: %s\n", full_path);
-            pthread_mutex_unlock(&loggers.log_mutex);
-            return;
+            atomic_fetch_add(&ring->dropped, 1);
+            return NULL;
         }
-        error = flock(fileno(log), LOCK_EX | LOCK_NB);
+        pthread_cond_signal(&loggers.wake);
+        usleep(LOG_BLOCK_RETRY_TIME);
     }
+    if (size > to_end)
+    {
+        log_record* padding = (log_record*)(ring->buffer + (*head & LOG_RING_MASK));
+        padding->length = (uint32_t)(to_end - sizeof(log_record));
+        padding->logger = LOG_RECORD_PADDING;
+        *head += to_end;
+    }
+    return (log_record*)(ring->buffer + (*head & LOG_RING_MASK));
+}
 
-    fseek(log, 0, SEEK_END);
+void log_message(log_level_t level, const char* filename, const char* source_file, const char* format, ...)
+{
+    int logger = log_resolve(filename);
+    if (logger < 0)
+    {
+        fprintf(stderr, "Log file not found: %s/%s\n", LOGS_DIR, filename);
+        return;
+    }
+    log_ring_t* ring = local_ring ? local_ring : log_ring_acquire();
+    if (!ring)
+    {
+        fprintf(stderr, "Failed to allocate log ring\n");
+        return;
+    }
 
     const char* level_str;
     switch (level)
@@ -123,36 +336,74 @@ void log_message(log_level_t level, const char* filename, const char* source_fil
     default: level_str = "UNKNOWN"; break;
     }
 
-    char timestamp[TIMESTAMP_LENGTH];
-    get_formatted_timestamp(timestamp, TIMESTAMP_LENGTH);
+    // the timestamp is formatted once per second and thread
+    time_t now = time(NULL);
+    if (now != timestamp_second)
+    {
+        get_formatted_timestamp(timestamp, TIMESTAMP_LENGTH);
+        timestamp_second = now;
+    }
+
+    char line[LOG_LINE_LENGTH];
+    int prefix = snprintf(line, sizeof(line) - LOG_MESSAGE_LENGTH - 1, "%s - %s - %s - ", timestamp, level_str, source_file);
+    size_t length = prefix < 0 ? 0 : (size_t)prefix;
+    if (length > sizeof(line) - LOG_MESSAGE_LENGTH - 2)
+        length = sizeof(line) - LOG_MESSAGE_LENGTH - 2;
 
-    char message[1024];
     va_list args;
     va_start(args, format);
-    vsnprintf(message, sizeof(message), format, args);
+    int message_length = vsnprintf(line + length, LOG_MESSAGE_LENGTH, format, args);
     va_end(args);
+    if (message_length > 0)
+        length += (size_t)message_length < LOG_MESSAGE_LENGTH ? (size_t)message_length : LOG_MESSAGE_LENGTH - 1;
+    line[length++] = '\n';
 
-    fprintf(log, "%s - %s - %s - %s\n", timestamp, level_str, source_file, message);
+    uint64_t head;
+    log_record* record = log_reserve(ring, record_size(length), &head);
+    if (!record)
+        return;
+    record->length = (uint32_t)length;
+    record->logger = (uint32_t)logger;
+    memcpy(record + 1, line, length);
+    head += record_size(length);
+    atomic_store_explicit(&ring->head, head, memory_order_release);
 
-    fflush(log);
+    // the writer polls idle rings, it is woken early only when this ring fills up
+    if (head - atomic_load_explicit(&ring->tail, memory_order_relaxed) > LOG_RING_SIZE / 2)
+        pthread_cond_signal(&loggers.wake);
+}
 
-    flock(fileno(log), LOCK_UN);
+void set_log_overflow(log_overflow_t policy)
+{
+    atomic_store(&loggers.overflow, policy);
+}
 
-    pthread_mutex_unlock(&loggers.log_mutex);
+unsigned long long log_dropped_messages()
+{
+    unsigned long long dropped = 0;
+    for (log_ring_t* ring = atomic_load(&loggers.rings); ring; ring = ring->next)
+        dropped += atomic_load(&ring->dropped);
+    return dropped;
 }
 
 void finish_logging()
 {
-    while (loggers.is_initializing)
-    {
-        usleep(10000); // 10 ms
-    }
     pthread_mutex_lock(&loggers.log_mutex);
+    int writer_running = loggers.writer_running;
+    loggers.writer_running = 0;
+    atomic_store(&loggers.stop, 1);
+    pthread_cond_signal(&loggers.wake);
+    pthread_mutex_unlock(&loggers.log_mutex);
+    if (writer_running)
+        pthread_join(loggers.writer, NULL);
+
+    pthread_mutex_lock(&loggers.log_mutex);
+    atomic_store(&loggers.alias_count, 0);
     for (int i = 0; i < MAX_LOG_FILES; i++)
     {
         if (loggers.array[i] != NULL)
         {
-            fclose(loggers.array[i]->file);
+            close(loggers.array[i]->fd);
             if (loggers.array[i]->filename != NULL)
                 free(loggers.array[i]->filename);
             free(loggers.array[i]);
@@ -0,0 +1,223 @@
+#include "mem_pool.h"
+
+#include <stdlib.h>
+#include <pthread.h>
+
+/**
+ * The thread cache structure. This structure is used to store the free objects and the unflushed statistics of one pool in one thread.
+ */
+typedef struct mem_pool_cache
+{
+    mem_pool* pool;
+    void* head;
+    size_t count;
+    unsigned ops;
+    unsigned long long allocs;
+    unsigned long long frees;
+    unsigned long long cache_hits;
+} mem_pool_cache;
+
+static _Thread_local mem_pool_cache caches[MEM_POOL_MAX_CACHES];
+
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cache_key;
+
+static inline void* object_next(void* obj)
+{
+    return *(void**)obj;
+}
+
+static inline void object_set_next(void* obj, void* next)
+{
+    *(void**)obj = next;
+}
+
+static void cache_flush_stats(mem_pool_cache* cache)
+{
+    mem_pool* pool = cache->pool;
+    atomic_fetch_add_explicit(&pool->allocs, cache->allocs, memory_order_relaxed);
+    atomic_fetch_add_explicit(&pool->frees, cache->frees, memory_order_relaxed);
+    atomic_fetch_add_explicit(&pool->cache_hits, cache->cache_hits, memory_order_relaxed);
+    cache->allocs = 0;
+    cache->frees = 0;
+    cache->cache_hits = 0;
+    cache->ops = 0;
+}
+
+// must be called with the pool mutex held
+static void pool_push_locked(mem_pool* pool, void* head, void* tail, size_t count)
+{
+    object_set_next(tail, pool->free_list);
+    pool->free_list = head;
+    pool->free_count += count;
+}
+
+// moves count objects from the cache to the shared free list
+static void cache_drain(mem_pool_cache* cache, size_t count)
+{
+    void* head = cache->head;
+    void* tail = head;
+    for (size_t i = 1; i < count; ++i)
+        tail = object_next(tail);
+    cache->head = object_next(tail);
+    cache->count -= count;
+
+    pthread_mutex_lock(&cache->pool->mutex);
+    pool_push_locked(cache->pool, head, tail, count);
+    pthread_mutex_unlock(&cache->pool->mutex);
+}
+
+static void cache_release(void* arg)
+{
+    // the objects cached by an exiting thread go back to the pool instead of being lost with the thread
+    mem_pool_cache* thread_caches = (mem_pool_cache*)arg;
+    for (int i = 0; i < MEM_POOL_MAX_CACHES; ++i)
+    {
+        if (!thread_caches[i].pool)
+            continue;
+        if (thread_caches[i].count)
+            cache_drain(&thread_caches[i], thread_caches[i].count);
+        cache_flush_stats(&thread_caches[i]);
+        thread_caches[i].pool = NULL;
+    }
+}
+
+static void cache_key_create()
+{
+    pthread_key_create(&cache_key, cache_release);
+}
+
+static mem_pool_cache* cache_get(mem_pool* pool)
+{
+    for (int i = 0; i < MEM_POOL_MAX_CACHES; ++i)
+    {
+        if (caches[i].pool == pool)
+            return &caches[i];
+    }
+    for (int i = 0; i < MEM_POOL_MAX_CACHES; ++i)
+    {
+        if (caches[i].pool)
+            continue;
+        pthread_once(&cache_key_once, cache_key_create);
+        pthread_setspecific(cache_key, caches);
+        caches[i].pool = pool;
+        return &caches[i];
+    }
+    return NULL;
+}
+
+// must be called with the pool mutex held, returns 0 if the slab was allocated
+static int pool_grow_locked(mem_pool* pool)
+{
+    size_t header = MEM_POOL_OBJECT_SIZE(sizeof(void*));
+    size_t count = (MEM_POOL_SLAB_SIZE - header) / pool->object_size;
+    if (count < MEM_POOL_BATCH)
+        count = MEM_POOL_BATCH;
+    char* slab = (char*)malloc(header + count * pool->object_size);
+    if (!slab)
+        return -1;
+    object_set_next(slab, pool->slabs);
+    pool->slabs = slab;
+
+    char* first = slab + header;
+    for (size_t i = 0; i + 1 < count; ++i)
+        object_set_next(first + i * pool->object_size, first + (i + 1) * pool->object_size);
+    pool_push_locked(pool, first, first + (count - 1) * pool->object_size, count);
+    pool->capacity += count;
+    atomic_fetch_add_explicit(&pool->misses, 1, memory_order_relaxed);
+    return 0;
+}
+
+// takes up to max objects from the shared free list, growing the pool if it is empty
+static void* pool_take(mem_pool* pool, size_t max, size_t* count)
+{
+    pthread_mutex_lock(&pool->mutex);
+    if (!pool->free_list && pool_grow_locked(pool) != 0)
+    {
+        pthread_mutex_unlock(&pool->mutex);
+        *count = 0;
+        return NULL;
+    }
+    void* head = pool->free_list;
+    void* tail = head;
+    size_t taken = 1;
+    while (taken < max && object_next(tail))
+    {
+        tail = object_next(tail);
+        taken++;
+    }
+    pool->free_list = object_next(tail);
+    pool->free_count -= taken;
+    pthread_mutex_unlock(&pool->mutex);
+
+    object_set_next(tail, NULL);
+    *count = taken;
+    return head;
+}
+
+void* mem_pool_alloc(mem_pool* pool)
+{
+    size_t count;
+    mem_pool_cache* cache = cache_get(pool);
+    if (!cache)
+    {
+        void* obj = pool_take(pool, 1, &count);
+        if (obj)
+            atomic_fetch_add_explicit(&pool->allocs, 1, memory_order_relaxed);
+        return obj;
+    }
+
+    if (cache->head)
+        cache->cache_hits++;
+    else
+    {
+        cache->head = pool_take(pool, MEM_POOL_BATCH, &count);
+        if (!cache->head)
+            return NULL;
+        cache->count = count;
+    }
+    void* obj = cache->head;
+    cache->head = object_next(obj);
+    cache->count--;
+    cache->allocs++;
+    if (++cache->ops >= MEM_POOL_BATCH)
+        cache_flush_stats(cache);
+    return obj;
+}
+
+void mem_pool_free(mem_pool* pool, void* ptr)
+{
+    if (!ptr)
+        return;
+    mem_pool_cache* cache = cache_get(pool);
+    if (!cache)
+    {
+        pthread_mutex_lock(&pool->mutex);
+        pool_push_locked(pool, ptr, ptr, 1);
+        pthread_mutex_unlock(&pool->mutex);
+        atomic_fetch_add_explicit(&pool->frees, 1, memory_order_relaxed);
+        return;
+    }
+
+    object_set_next(ptr, cache->head);
+    cache->head = ptr;
+    cache->count++;
+    cache->frees++;
+    // objects flowing from producer to consumer threads return to the pool in batches
+    if (cache->count > MEM_POOL_CACHE_SIZE)
+        cache_drain(cache, MEM_POOL_BATCH);
+    if (++cache->ops >= MEM_POOL_BATCH)
+        cache_flush_stats(cache);
+}
+
+void mem_pool_get_stats(mem_pool* pool, mem_pool_stats* stats)
+{
+    pthread_mutex_lock(&pool->mutex);
+    stats->capacity = pool->capacity;
+    pthread_mutex_unlock(&pool->mutex);
+    stats->allocs = atomic_load_explicit(&pool->allocs, memory_order_relaxed);
+    unsigned long long frees = atomic_load_explicit(&pool->frees, memory_order_relaxed);
+    stats->in_use = stats->allocs > frees ? (size_t)(stats->allocs - frees) : 0;
+    stats->cache_hits = atomic_load_explicit(&pool->cache_hits, memory_order_relaxed);
+    stats->misses = atomic_load_explicit(&pool->misses, memory_order_relaxed);
+}
@@ -1,80 +1,791 @@
+#define _GNU_SOURCE // clock_gettime
 #include "protocol.h"
 
 #include <stdio.h>
 #include <stddef.h>
 #include <string.h>
 #include <time.h>
+#include <pthread.h>
 #include <arpa/inet.h>
 #include <openssl/evp.h>
 #include <openssl/err.h>
+#include <openssl/rand.h>
 
 struct tm* localtime_r(const time_t* timer, struct tm* buf);
 
+// copies text truncated to the size of the destination, which is always terminated
+static size_t copy_text(char* dest, size_t dest_size, const char* src, size_t length)
+{
+    if (length >= dest_size)
+        length = dest_size - 1;
+    memcpy(dest, src, length);
+    dest[length] = '\0';
+    return length;
+}
+
 int create_message(message* msg, message_type type, const char* sender_uid, const char* recipient_uid, const char* payload)
 {
     if (payload == NULL)
         payload = "";
     if (msg == NULL || sender_uid == NULL || recipient_uid == NULL)
         return MESSAGE_CREATION_FAILURE;
-    else if (strlen(payload) > MAX_PAYLOAD_SIZE)
+    size_t payload_length = strlen(payload);
+    size_t sender_length = strlen(sender_uid);
+    size_t recipient_length = strlen(recipient_uid);
+    if (payload_length > MAX_PAYLOAD_SIZE)
         return MESSAGE_CREATION_PAYLOAD_SIZE_EXCEEDED;
-    else if (strlen(sender_uid) > HASH_HEX_OUTPUT_LENGTH || strlen(recipient_uid) > HASH_HEX_OUTPUT_LENGTH)
+    else if (sender_length > HASH_HEX_OUTPUT_LENGTH || recipient_length > HASH_HEX_OUTPUT_LENGTH)
         return MESSAGE_CREATION_USERNAME_SIZE_EXCEEDED;
-    else if (!strlen(payload) && (type != MESSAGE_PING || type != MESSAGE_ACK))
+    else if (!payload_length && (type != MESSAGE_PING || type != MESSAGE_ACK))
         return MESSAGE_CREATION_PAYLOAD_EMPTY;
 
-    // clear message structure
-    msg->message_uid[0] = '\0';
-    msg->sender_uid[0] = '\0';
-    msg->recipient_uid[0] = '\0';
-    msg->payload[0] = '\0';
-
-    // message uid is hash of the timestamp and payload
-    char timestamp[TIMESTAMP_LENGTH];
-    get_timestamp(timestamp, TIMESTAMP_LENGTH);
-    char uid_before_hash[HASH_HEX_OUTPUT_LENGTH + MAX_PAYLOAD_SIZE];
-    snprintf(uid_before_hash, HASH_HEX_OUTPUT_LENGTH + MAX_PAYLOAD_SIZE, "%s%s", timestamp, payload);
-    char uid[HASH_HEX_OUTPUT_LENGTH];
-    if (get_hash((unsigned char*)uid_before_hash, uid) != 0)
-        return MESSAGE_CREATION_HASH_FAILURE;
-    snprintf(msg->message_uid, HASH_HEX_OUTPUT_LENGTH, "%s", uid);
+    // the message uid is a time-ordered ID, unique without hashing the payload
+    message_id id;
+    generate_message_id(&id);
+    format_message_id(&id, msg->message_uid);
 
     msg->type = type;
-    snprintf(msg->sender_uid, HASH_HEX_OUTPUT_LENGTH, "%s", sender_uid);
-    snprintf(msg->recipient_uid, HASH_HEX_OUTPUT_LENGTH, "%s", recipient_uid);
-    msg->payload_length = strlen(payload);
-    snprintf(msg->payload, MAX_PAYLOAD_SIZE, "%s", payload);
-    msg->payload[msg->payload_length] = '\0';
+    copy_text(msg->sender_uid, HASH_HEX_OUTPUT_LENGTH, sender_uid, sender_length);
+    copy_text(msg->recipient_uid, HASH_HEX_OUTPUT_LENGTH, recipient_uid, recipient_length);
+    msg->payload_length = (uint32_t)copy_text(msg->payload, MAX_PAYLOAD_SIZE, payload, payload_length);
 
     return MESSAGE_CREATION_SUCCESS;
 }
 
+// -1 until the node ID is set or picked at random by the first ID generated
+static atomic_int message_id_node = -1;
+static atomic_uint message_id_threads = 0;
+static _Thread_local int message_id_thread = -1;
+static _Thread_local uint64_t message_id_sequence = 0;
+static _Thread_local uint64_t message_id_last_time = 0;
+
+void set_message_id_node(uint16_t node)
+{
+    atomic_store(&message_id_node, node);
+}
+
+void generate_message_id(message_id* id)
+{
+    int node = atomic_load_explicit(&message_id_node, memory_order_relaxed);
+    if (node < 0)
+    {
+        unsigned char random[2] = { 0, 0 };
+        RAND_bytes(random, sizeof(random));
+        int expected = -1;
+        atomic_compare_exchange_strong(&message_id_node, &expected, random[0] << 8 | random[1]);
+        node = atomic_load(&message_id_node);
+    }
+    if (message_id_thread < 0)
+        message_id_thread = (int)(atomic_fetch_add(&message_id_threads, 1) & 0xffffff);
+
+    // a clock stepping back must not reorder the IDs of a thread
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t time = (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+    if (time < message_id_last_time)
+        time = message_id_last_time;
+    message_id_last_time = time;
+    uint64_t sequence = message_id_sequence++ & 0xffffffffffULL;
+
+    uint64_t high = (time & 0xffffffffffffULL) << 16 | (uint64_t)node;
+    uint64_t low = (uint64_t)message_id_thread << 40 | sequence;
+    for (int i = 0; i < 8; ++i)
+    {
+        id->bytes[i] = (unsigned char)(high >> (56 - 8 * i));
+        id->bytes[8 + i] = (unsigned char)(low >> (56 - 8 * i));
+    }
+}
+
 void parse_message(message* msg, const char* buffer)
 {
-    char format_string[128];
-    snprintf(format_string, sizeof(format_string), "%%%d[^|]|%%d|%%%d[^|]|%%%d[^|]|%%u|%%%d[^\n]",
-        HASH_HEX_OUTPUT_LENGTH - 1, HASH_HEX_OUTPUT_LENGTH - 1, HASH_HEX_OUTPUT_LENGTH - 1, MAX_PAYLOAD_SIZE - 1);
-    sscanf(buffer, format_string,
-        msg->message_uid, (int*)&msg->type, msg->sender_uid, msg->recipient_uid, &msg->payload_length, msg->payload);
-    msg->payload[msg->payload_length] = '\0';
+    message_view view;
+    if (parse_message_view(&view, MESSAGE_PROTOCOL_TEXT, buffer, strlen(buffer)) == MESSAGE_PARSING_SUCCESS)
+        message_view_to_message(&view, msg);
+    else
+    {
+        msg->message_uid[0] = '\0';
+        msg->type = 0;
+        msg->sender_uid[0] = '\0';
+        msg->recipient_uid[0] = '\0';
+        msg->payload_length = 0;
+        msg->payload[0] = '\0';
+    }
 }
 
-int send_message(SSL* ssl, message* msg)
+int serialize_message(const message* msg, char* buffer, size_t buffer_size)
 {
-    if (msg == NULL)
-        return MESSAGE_SEND_FAILURE;
+    if (msg == NULL || buffer == NULL || !buffer_size)
+        return -1;
 
-    char buffer[BUFFER_SIZE];
-    memset(buffer, 0, sizeof(buffer));
-    snprintf(buffer, BUFFER_SIZE, "%s%s%d%s%s%s%s%s%u%s%s",
+    int length = snprintf(buffer, buffer_size, "%s%s%d%s%s%s%s%s%u%s%s",
         msg->message_uid, MESSAGE_DELIMITER,
         msg->type, MESSAGE_DELIMITER,
         msg->sender_uid, MESSAGE_DELIMITER,
         msg->recipient_uid, MESSAGE_DELIMITER,
         msg->payload_length, MESSAGE_DELIMITER,
         msg->payload);
+    if (length < 0 || (size_t)length >= buffer_size)
+        return -1;
+    return length;
+}
+
+int get_message_length(const char* buffer, size_t length)
+{
+    // message uid, type, sender uid and recipient uid precede the payload length
+    size_t pos = 0;
+    for (int field = 0; field < 4; ++field)
+    {
+        size_t start = pos;
+        while (pos < length && buffer[pos] != MESSAGE_DELIMITER[0])
+            pos++;
+        if (pos - start >= HASH_HEX_OUTPUT_LENGTH)
+            return -1;
+        if (pos == length)
+            return 0;
+        pos++;
+    }
+
+    unsigned payload_length = 0;
+    size_t start = pos;
+    while (pos < length && buffer[pos] >= '0' && buffer[pos] <= '9')
+    {
+        payload_length = payload_length * 10 + (unsigned)(buffer[pos] - '0');
+        if (payload_length >= MAX_PAYLOAD_SIZE)
+            return -1;
+        pos++;
+    }
+    if (pos == length)
+        return 0;
+    if (pos == start || buffer[pos] != MESSAGE_DELIMITER[0])
+        return -1;
+    pos++;
+
+    if (length - pos < payload_length)
+        return 0;
+    return (int)(pos + payload_length);
+}
+
+// binary frame header offsets, multi-byte fields are in network byte order
+#define BINARY_OFFSET_LENGTH 0
+#define BINARY_OFFSET_VERSION 4
+#define BINARY_OFFSET_FLAGS 5
+#define BINARY_OFFSET_ID_LENGTHS 6
+#define BINARY_OFFSET_TYPE 12
+#define BINARY_ID_COUNT 3
+
+#define HEX_ROW(high) high "0" high "1" high "2" high "3" high "4" high "5" high "6" high "7" high "8" high "9" high "a" high "b" high "c" high "d" high "e" high "f"
+
+// the two hex digits of every byte value, so a byte is encoded with a single lookup
+static const char hex_pairs[] =
+    HEX_ROW("0") HEX_ROW("1") HEX_ROW("2") HEX_ROW("3") HEX_ROW("4") HEX_ROW("5") HEX_ROW("6") HEX_ROW("7")
+    HEX_ROW("8") HEX_ROW("9") HEX_ROW("a") HEX_ROW("b") HEX_ROW("c") HEX_ROW("d") HEX_ROW("e") HEX_ROW("f");
+
+static void put_uint32(unsigned char* dest, uint32_t value)
+{
+    dest[0] = (unsigned char)(value >> 24);
+    dest[1] = (unsigned char)(value >> 16);
+    dest[2] = (unsigned char)(value >> 8);
+    dest[3] = (unsigned char)value;
+}
+
+static uint32_t get_uint32(const unsigned char* src)
+{
+    return (uint32_t)src[0] << 24 | (uint32_t)src[1] << 16 | (uint32_t)src[2] << 8 | (uint32_t)src[3];
+}
+
+// nibble values offset by one, 0 marks characters that are not lowercase hex
+static const unsigned char hex_values[256] =
+{
+    ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5, ['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+    ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16
+};
+
+// lowercase hex IDs of even length travel as raw bytes, anything else such as "server" as text
+static size_t binary_id_length(const message_field* id)
+{
+    if (id->raw)
+        return id->length;
+    size_t i = 0;
+    while (i + 1 < id->length && hex_values[(unsigned char)id->data[i]] && hex_values[(unsigned char)id->data[i + 1]])
+        i += 2;
+    return i && i == id->length ? i / 2 : id->length;
+}
+
+size_t hex_encode(const unsigned char* src, size_t length, char* dest)
+{
+    for (size_t i = 0; i < length; ++i)
+        memcpy(dest + 2 * i, hex_pairs + 2 * src[i], 2);
+    dest[2 * length] = '\0';
+    return length * 2;
+}
+
+long hex_decode(const char* src, size_t length, unsigned char* dest)
+{
+    if (length % 2)
+        return -1;
+    for (size_t i = 0; i < length; i += 2)
+    {
+        unsigned high = hex_values[(unsigned char)src[i]];
+        unsigned low = hex_values[(unsigned char)src[i + 1]];
+        if (!high || !low)
+            return -1;
+        dest[i / 2] = (unsigned char)((high - 1) << 4 | (low - 1));
+    }
+    return (long)(length / 2);
+}
+
+// IDs that do not decode as hex are copied as text, returns -1 if the ID does not fit
+static long encode_id(const message_field* id, unsigned char* dest, size_t dest_size, int* is_text)
+{
+    if (!id->raw && id->length && id->length / 2 <= dest_size)
+    {
+        long length = hex_decode(id->data, id->length, dest);
+        if (length >= 0)
+        {
+            *is_text = 0;
+            return length;
+        }
+    }
+    if (id->length > dest_size)
+        return -1;
+    memcpy(dest, id->data, id->length);
+    *is_text = !id->raw;
+    return (long)id->length;
+}
+
+static message_field text_field(const char* text)
+{
+    message_field field = { text, (uint32_t)strlen(text), 0 };
+    return field;
+}
+
+static size_t decode_id(const unsigned char* src, size_t length, int is_text, char* dest)
+{
+    if (is_text)
+    {
+        memcpy(dest, src, length);
+        return length;
+    }
+    return hex_encode(src, length, dest);
+}
+
+void format_message_id(const message_id* id, char* buffer)
+{
+    buffer[decode_id(id->bytes, MESSAGE_ID_LENGTH, 0, buffer)] = '\0';
+}
+
+static size_t format_decimal(char* dest, long long value)
+{
+    char digits[24];
+    size_t count = 0;
+    unsigned long long magnitude = value < 0 ? -(unsigned long long)value : (unsigned long long)value;
+    do
+    {
+        digits[count++] = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude);
+    size_t length = 0;
+    if (value < 0)
+        dest[length++] = '-';
+    while (count)
+        dest[length++] = digits[--count];
+    return length;
+}
+
+// the payload ends at its terminator like in the text protocol, so bytes past it never leave
+static message_field payload_field(const message* msg)
+{
+    size_t length = msg->payload_length < MAX_PAYLOAD_SIZE ? msg->payload_length : MAX_PAYLOAD_SIZE - 1;
+    const char* end = (const char*)memchr(msg->payload, '\0', length);
+    message_field field = { msg->payload, (uint32_t)(end ? (size_t)(end - msg->payload) : length), 0 };
+    return field;
+}
+
+// the exact frame length, so a buffer can be sized before serializing into it
+static size_t binary_fields_length(const message_field* ids, const message_field* payload)
+{
+    size_t length = BINARY_HEADER_LENGTH + payload->length;
+    for (int i = 0; i < BINARY_ID_COUNT; ++i)
+        length += binary_id_length(&ids[i]);
+    return length;
+}
+
+static int serialize_binary_fields(message_type type, const message_field* ids, const message_field* payload, char* buffer, size_t buffer_size)
+{
+    if (buffer_size < BINARY_HEADER_LENGTH || payload->length >= MAX_PAYLOAD_SIZE)
+        return -1;
+
+    unsigned char* frame = (unsigned char*)buffer;
+    unsigned char* dest = frame + BINARY_HEADER_LENGTH;
+    unsigned char* end = frame + buffer_size;
+    unsigned char flags = 0;
+    for (int i = 0; i < BINARY_ID_COUNT; ++i)
+    {
+        int is_text;
+        long id_length = encode_id(&ids[i], dest, (size_t)(end - dest), &is_text);
+        if (id_length < 0)
+            return -1;
+        frame[BINARY_OFFSET_ID_LENGTHS + i] = (unsigned char)id_length;
+        flags |= (unsigned char)(is_text << i);
+        dest += id_length;
+    }
+    if (payload->length > (size_t)(end - dest))
+        return -1;
+    memcpy(dest, payload->data, payload->length);
+    size_t length = (size_t)(dest + payload->length - frame);
+
+    put_uint32(frame + BINARY_OFFSET_LENGTH, (uint32_t)length);
+    frame[BINARY_OFFSET_VERSION] = BINARY_PROTOCOL_VERSION;
+    frame[BINARY_OFFSET_FLAGS] = flags;
+    memset(frame + BINARY_OFFSET_ID_LENGTHS + BINARY_ID_COUNT, 0, BINARY_OFFSET_TYPE - BINARY_OFFSET_ID_LENGTHS - BINARY_ID_COUNT);
+    put_uint32(frame + BINARY_OFFSET_TYPE, (uint32_t)type);
+    return (int)length;
+}
+
+int serialize_binary_message(const message* msg, char* buffer, size_t buffer_size)
+{
+    if (msg == NULL || buffer == NULL)
+        return -1;
+    message_field ids[BINARY_ID_COUNT] = { text_field(msg->message_uid), text_field(msg->sender_uid), text_field(msg->recipient_uid) };
+    message_field payload = payload_field(msg);
+    return serialize_binary_fields(msg->type, ids, &payload, buffer, buffer_size);
+}
+
+int get_binary_message_length(const char* buffer, size_t length)
+{
+    const unsigned char* frame = (const unsigned char*)buffer;
+    if (length < BINARY_HEADER_LENGTH)
+        return 0;
+    uint32_t frame_length = get_uint32(frame + BINARY_OFFSET_LENGTH);
+    if (frame[BINARY_OFFSET_VERSION] != BINARY_PROTOCOL_VERSION || frame_length > BINARY_MAX_MESSAGE_LENGTH)
+        return -1;
+
+    size_t ids_length = 0;
+    for (int i = 0; i < BINARY_ID_COUNT; ++i)
+    {
+        size_t id_length = frame[BINARY_OFFSET_ID_LENGTHS + i];
+        // a hex ID doubles in length once decoded, both forms must fit the text ID of a message
+        if ((frame[BINARY_OFFSET_FLAGS] >> i & 1 ? id_length : id_length * 2) >= HASH_HEX_OUTPUT_LENGTH)
+            return -1;
+        ids_length += id_length;
+    }
+    if (frame_length < BINARY_HEADER_LENGTH + ids_length || frame_length - BINARY_HEADER_LENGTH - ids_length >= MAX_PAYLOAD_SIZE)
+        return -1;
+    if (length < frame_length)
+        return 0;
+    return (int)frame_length;
+}
+
+int parse_binary_message(message* msg, const char* buffer, size_t length)
+{
+    if (msg == NULL || buffer == NULL)
+        return MESSAGE_PARSING_FAILURE;
+    message_view view;
+    int result = parse_message_view(&view, MESSAGE_PROTOCOL_BINARY, buffer, length);
+    if (result == MESSAGE_PARSING_SUCCESS)
+        message_view_to_message(&view, msg);
+    return result;
+}
+
+// reads a field terminated by the delimiter, returns 0 if there is no delimiter
+static int next_text_field(const char* frame, size_t length, size_t* pos, message_field* field)
+{
+    const char* end = (const char*)memchr(frame + *pos, MESSAGE_DELIMITER[0], length - *pos);
+    if (!end)
+        return 0;
+    field->data = frame + *pos;
+    field->length = (uint32_t)(end - field->data);
+    field->raw = 0;
+    *pos = (size_t)(end - frame) + 1;
+    return 1;
+}
+
+// parses a decimal number filling the whole field, returns 0 if it is not one
+static int parse_decimal(const message_field* field, long long min, long long max, long long* value)
+{
+    size_t i = 0;
+    int negative = field->length > 1 && field->data[0] == '-';
+    if (negative)
+        i++;
+    if (i == field->length || field->length - i > 10)
+        return 0;
+    long long result = 0;
+    for (; i < field->length; ++i)
+    {
+        if (field->data[i] < '0' || field->data[i] > '9')
+            return 0;
+        result = result * 10 + (field->data[i] - '0');
+    }
+    if (negative)
+        result = -result;
+    if (result < min || result > max)
+        return 0;
+    *value = result;
+    return 1;
+}
+
+static int parse_text_view(message_view* view, const char* frame, size_t length)
+{
+    size_t pos = 0;
+    message_field type;
+    message_field payload_length;
+    long long value;
+
+    if (!next_text_field(frame, length, &pos, &view->message_uid))
+        return MESSAGE_PARSING_INVALID_MESSAGE_UID;
+    if (view->message_uid.length >= HASH_HEX_OUTPUT_LENGTH)
+        return MESSAGE_PARSING_INVALID_MESSAGE_UID_LENGTH;
+    if (!next_text_field(frame, length, &pos, &type) || !parse_decimal(&type, INT32_MIN, INT32_MAX, &value))
+        return MESSAGE_PARSING_INVALID_MESSAGE_TYPE;
+    view->type = (message_type)value;
+    if (!next_text_field(frame, length, &pos, &view->sender_uid))
+        return MESSAGE_PARSING_INVALID_SENDER_UID;
+    if (view->sender_uid.length >= HASH_HEX_OUTPUT_LENGTH)
+        return MESSAGE_PARSING_INVALID_SENDER_UID_LENGTH;
+    if (!next_text_field(frame, length, &pos, &view->recipient_uid))
+        return MESSAGE_PARSING_INVALID_RECIPIENT_UID;
+    if (view->recipient_uid.length >= HASH_HEX_OUTPUT_LENGTH)
+        return MESSAGE_PARSING_INVALID_RECIPIENT_UID_LENGTH;
+    if (!next_text_field(frame, length, &pos, &payload_length) || !parse_decimal(&payload_length, 0, MAX_PAYLOAD_SIZE - 1, &value)
+        || length - pos < (size_t)value)
+        return MESSAGE_PARSING_INVALID_MESSAGE_LENGTH;
+    view->payload.data = frame + pos;
+    view->payload.length = (uint32_t)value;
+    view->payload.raw = 0;
+    view->length = (uint32_t)(pos + value);
+    return MESSAGE_PARSING_SUCCESS;
+}
+
+static int parse_binary_view(message_view* view, const char* frame, size_t length)
+{
+    int frame_length = get_binary_message_length(frame, length);
+    if (frame_length < 0)
+        return MESSAGE_PARSING_INVALID_MESSAGE;
+    else if (frame_length == 0)
+        return MESSAGE_PARSING_INVALID_MESSAGE_LENGTH;
+
+    const unsigned char* header = (const unsigned char*)frame;
+    const char* src = frame + BINARY_HEADER_LENGTH;
+    message_field* ids[BINARY_ID_COUNT] = { &view->message_uid, &view->sender_uid, &view->recipient_uid };
+    for (int i = 0; i < BINARY_ID_COUNT; ++i)
+    {
+        ids[i]->data = src;
+        ids[i]->length = header[BINARY_OFFSET_ID_LENGTHS + i];
+        ids[i]->raw = !(header[BINARY_OFFSET_FLAGS] >> i & 1);
+        src += ids[i]->length;
+    }
+    view->type = (message_type)get_uint32(header + BINARY_OFFSET_TYPE);
+    view->payload.data = src;
+    view->payload.length = (uint32_t)(frame + frame_length - src);
+    view->payload.raw = 0;
+    view->length = (uint32_t)frame_length;
+    return MESSAGE_PARSING_SUCCESS;
+}
+
+int parse_message_view(message_view* view, message_protocol protocol, const char* frame, size_t length)
+{
+    if (view == NULL || frame == NULL)
+        return MESSAGE_PARSING_FAILURE;
+    view->protocol = protocol;
+    view->frame = frame;
+    view->source = NULL;
+    if (protocol == MESSAGE_PROTOCOL_BINARY)
+        return parse_binary_view(view, frame, length);
+    return parse_text_view(view, frame, length);
+}
 
-    int bytes_sent = SSL_write(ssl, buffer, strlen(buffer));
+int message_field_to_text(const message_field* field, char* buffer, size_t buffer_size)
+{
+    size_t length = field->raw ? field->length * 2 : field->length;
+    if (length >= buffer_size)
+        return -1;
+    decode_id((const unsigned char*)field->data, field->length, !field->raw, buffer);
+    buffer[length] = '\0';
+    return (int)length;
+}
+
+void message_view_to_message(const message_view* view, message* msg)
+{
+    // the parsers bound every ID to the text ID of a message and the payload to its payload
+    message_field_to_text(&view->message_uid, msg->message_uid, HASH_HEX_OUTPUT_LENGTH);
+    msg->type = view->type;
+    message_field_to_text(&view->sender_uid, msg->sender_uid, HASH_HEX_OUTPUT_LENGTH);
+    message_field_to_text(&view->recipient_uid, msg->recipient_uid, HASH_HEX_OUTPUT_LENGTH);
+    msg->payload_length = view->payload.length;
+    memcpy(msg->payload, view->payload.data, view->payload.length);
+    msg->payload[view->payload.length] = '\0';
+}
+
+// the length of a valid frame in the text protocol, recipient_length replaces the frame's recipient unless it is -1
+static size_t binary_message_text_length(const unsigned char* frame, long recipient_length)
+{
+    size_t ids_length = 0;
+    size_t length = get_uint32(frame + BINARY_OFFSET_LENGTH) - BINARY_HEADER_LENGTH;
+    for (int i = 0; i < BINARY_ID_COUNT; ++i)
+    {
+        size_t id_length = frame[BINARY_OFFSET_ID_LENGTHS + i];
+        length -= id_length;
+        if (i == BINARY_ID_COUNT - 1 && recipient_length >= 0)
+            ids_length += (size_t)recipient_length;
+        else
+            ids_length += frame[BINARY_OFFSET_FLAGS] >> i & 1 ? id_length : id_length * 2;
+    }
+    char digits[24];
+    return ids_length + format_decimal(digits, (int32_t)get_uint32(frame + BINARY_OFFSET_TYPE)) + format_decimal(digits, (long long)length) + 5 + length;
+}
+
+int translate_binary_message(const char* frame, size_t length, const char* recipient, char* buffer, size_t buffer_size)
+{
+    int frame_length = get_binary_message_length(frame, length);
+    if (frame_length <= 0)
+        return -1;
+    const unsigned char* header = (const unsigned char*)frame;
+    size_t recipient_length = recipient ? strlen(recipient) : 0;
+    size_t text_length = binary_message_text_length(header, recipient ? (long)recipient_length : -1);
+    if (text_length > buffer_size)
+        return -1;
+
+    const unsigned char* src = header + BINARY_HEADER_LENGTH;
+    char* dest = buffer;
+    for (int i = 0; i < BINARY_ID_COUNT; ++i)
+    {
+        size_t id_length = header[BINARY_OFFSET_ID_LENGTHS + i];
+        if (i == BINARY_ID_COUNT - 1 && recipient)
+        {
+            memcpy(dest, recipient, recipient_length);
+            dest += recipient_length;
+        }
+        else
+            dest += decode_id(src, id_length, header[BINARY_OFFSET_FLAGS] >> i & 1, dest);
+        src += id_length;
+        *dest++ = MESSAGE_DELIMITER[0];
+        // the type follows the message UID
+        if (i == 0)
+        {
+            dest += format_decimal(dest, (int32_t)get_uint32(header + BINARY_OFFSET_TYPE));
+            *dest++ = MESSAGE_DELIMITER[0];
+        }
+    }
+    size_t payload_length = (size_t)((const unsigned char*)frame + frame_length - src);
+    dest += format_decimal(dest, (long long)payload_length);
+    *dest++ = MESSAGE_DELIMITER[0];
+    memcpy(dest, src, payload_length);
+    dest += payload_length;
+    return (int)(dest - buffer);
+}
+
+int offer_binary_protocol(SSL_CTX* ctx)
+{
+    // ALPN wire format, every protocol name is prefixed by its length
+    unsigned char protocols[sizeof(BINARY_PROTOCOL_NAME)];
+    protocols[0] = (unsigned char)(sizeof(BINARY_PROTOCOL_NAME) - 1);
+    memcpy(protocols + 1, BINARY_PROTOCOL_NAME, sizeof(BINARY_PROTOCOL_NAME) - 1);
+    // unlike most of OpenSSL, the ALPN setter returns 0 on success
+    return SSL_CTX_set_alpn_protos(ctx, protocols, sizeof(protocols)) ? -1 : 0;
+}
+
+static int select_binary_protocol(SSL* ssl, const unsigned char** out, unsigned char* outlen, const unsigned char* in, unsigned int inlen, void* arg)
+{
+    if (ssl || arg) {}
+    // the selection points into the client's list, OpenSSL copies it before the list is freed
+    for (unsigned int i = 0; i < inlen; i += in[i] + 1u)
+    {
+        if (in[i] == sizeof(BINARY_PROTOCOL_NAME) - 1 && i + 1 + in[i] <= inlen && !memcmp(in + i + 1, BINARY_PROTOCOL_NAME, in[i]))
+        {
+            *out = in + i + 1;
+            *outlen = in[i];
+            return SSL_TLSEXT_ERR_OK;
+        }
+    }
+    return SSL_TLSEXT_ERR_NOACK;
+}
+
+void accept_binary_protocol(SSL_CTX* ctx)
+{
+    // clients without ALPN or offering other protocols complete the handshake without a selection and speak text
+    SSL_CTX_set_alpn_select_cb(ctx, select_binary_protocol, NULL);
+}
+
+message_protocol get_message_protocol(const SSL* ssl)
+{
+    const unsigned char* selected;
+    unsigned int length;
+    SSL_get0_alpn_selected(ssl, &selected, &length);
+    if (length == sizeof(BINARY_PROTOCOL_NAME) - 1 && !memcmp(selected, BINARY_PROTOCOL_NAME, length))
+        return MESSAGE_PROTOCOL_BINARY;
+    return MESSAGE_PROTOCOL_TEXT;
+}
+
+// buffers are pooled by size, so a short message does not hold memory for the longest one, the last class holds receive buffers
+#define MESSAGE_BUFFER_CLASSES 5
+static mem_pool message_buffer_pools[MESSAGE_BUFFER_CLASSES] =
+{
+    MEM_POOL_INITIALIZER(256),
+    MEM_POOL_INITIALIZER(768),
+    MEM_POOL_INITIALIZER(1536),
+    MEM_POOL_INITIALIZER(sizeof(message_buffer) + BINARY_MAX_MESSAGE_LENGTH + HASH_HEX_OUTPUT_LENGTH),
+    MEM_POOL_INITIALIZER(sizeof(message_buffer) + BUFFER_SIZE + 1)
+};
+// received frames that would be copied into a smaller class are copied, a reference would keep a whole receive buffer for a short message
+#define MESSAGE_BUFFER_REFERENCE_CLASS 3
+
+static unsigned message_buffer_class(size_t frame_length, size_t recipient_length)
+{
+    size_t size = sizeof(message_buffer) + frame_length + recipient_length + 1;
+    unsigned size_class = 0;
+    while (size_class < MESSAGE_BUFFER_CLASSES && message_buffer_pools[size_class].object_size < size)
+        size_class++;
+    return size_class;
+}
+
+static message_buffer* message_buffer_alloc(size_t frame_length, const char* recipient, size_t recipient_length)
+{
+    unsigned size_class = message_buffer_class(frame_length, recipient_length);
+    if (size_class == MESSAGE_BUFFER_CLASSES)
+        return NULL;
+
+    message_buffer* buffer = (message_buffer*)mem_pool_alloc(&message_buffer_pools[size_class]);
+    if (!buffer)
+        return NULL;
+    atomic_init(&buffer->link.next, NULL);
+    atomic_init(&buffer->refs, 1);
+    buffer->size_class = size_class;
+    buffer->length = (uint32_t)frame_length;
+    buffer->fanout = 0;
+    char* recipient_copy = buffer->frame + frame_length;
+    memcpy(recipient_copy, recipient, recipient_length);
+    recipient_copy[recipient_length] = '\0';
+    buffer->recipient = recipient_copy;
+    buffer->data = buffer->frame;
+    buffer->source = NULL;
+    return buffer;
+}
+
+static message_buffer* message_buffer_serialize(message_type type, const message_field* ids, const message_field* payload, const char* recipient, size_t recipient_length)
+{
+    size_t length = binary_fields_length(ids, payload);
+    message_buffer* buffer = message_buffer_alloc(length, recipient, recipient_length);
+    if (!buffer)
+        return NULL;
+    if (serialize_binary_fields(type, ids, payload, buffer->frame, length) != (int)length)
+    {
+        message_buffer_release(buffer);
+        return NULL;
+    }
+    buffer->type = type;
+    buffer->text_length = (uint32_t)binary_message_text_length((const unsigned char*)buffer->data, -1);
+    return buffer;
+}
+
+message_buffer* message_buffer_create(const message* msg)
+{
+    if (msg == NULL)
+        return NULL;
+    message_field ids[BINARY_ID_COUNT] = { text_field(msg->message_uid), text_field(msg->sender_uid), text_field(msg->recipient_uid) };
+    message_field payload = payload_field(msg);
+    return message_buffer_serialize(msg->type, ids, &payload, ids[2].data, ids[2].length);
+}
+
+message_buffer* message_buffer_create_fanout(const message* msg)
+{
+    if (msg == NULL)
+        return NULL;
+    message_field ids[BINARY_ID_COUNT] = { text_field(msg->message_uid), text_field(msg->sender_uid), text_field("") };
+    message_field payload = payload_field(msg);
+    message_buffer* buffer = message_buffer_serialize(msg->type, ids, &payload, "", 0);
+    if (buffer)
+    {
+        buffer->fanout = 1;
+        buffer->text_length = (uint32_t)binary_message_text_length((const unsigned char*)buffer->data, 0);
+    }
+    return buffer;
+}
+
+message_buffer* message_buffer_create_view(const message_view* view)
+{
+    if (view == NULL)
+        return NULL;
+    char recipient[HASH_HEX_OUTPUT_LENGTH];
+    int recipient_length = message_field_to_text(&view->recipient_uid, recipient, sizeof(recipient));
+    if (recipient_length < 0)
+        return NULL;
+    if (view->protocol == MESSAGE_PROTOCOL_TEXT)
+    {
+        // text frames are transcoded once, straight from the received bytes
+        message_field ids[BINARY_ID_COUNT] = { view->message_uid, view->sender_uid, view->recipient_uid };
+        return message_buffer_serialize(view->type, ids, &view->payload, recipient, (size_t)recipient_length);
+    }
+
+    // binary frames are passed on unchanged, by reference only if they were received whole and are long enough to be worth the receive buffer they keep
+    int by_reference = view->source && message_buffer_class(view->length, (size_t)recipient_length) >= MESSAGE_BUFFER_REFERENCE_CLASS;
+    message_buffer* buffer = message_buffer_alloc(by_reference ? 0 : view->length, recipient, (size_t)recipient_length);
+    if (!buffer)
+        return NULL;
+    if (by_reference)
+    {
+        buffer->data = view->frame;
+        buffer->source = message_buffer_retain(view->source);
+    }
+    else
+        memcpy(buffer->frame, view->frame, view->length);
+    buffer->length = view->length;
+    buffer->type = view->type;
+    buffer->text_length = (uint32_t)binary_message_text_length((const unsigned char*)buffer->data, -1);
+    return buffer;
+}
+
+message_buffer* message_buffer_create_receive(void)
+{
+    return message_buffer_alloc(BUFFER_SIZE, "", 0);
+}
+
+message_buffer* message_buffer_retain(message_buffer* buffer)
+{
+    atomic_fetch_add_explicit(&buffer->refs, 1, memory_order_relaxed);
+    return buffer;
+}
+
+void message_buffer_release(message_buffer* buffer)
+{
+    if (buffer == NULL)
+        return;
+    // the last holder must see every write made through the other references before the buffer is reused
+    if (atomic_fetch_sub_explicit(&buffer->refs, 1, memory_order_acq_rel) == 1)
+    {
+        message_buffer* source = buffer->source;
+        mem_pool_free(&message_buffer_pools[buffer->size_class], buffer);
+        message_buffer_release(source);
+    }
+}
+
+void message_buffer_stats(mem_pool_stats* stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    for (int i = 0; i < MESSAGE_BUFFER_CLASSES; ++i)
+    {
+        mem_pool_stats class_stats;
+        mem_pool_get_stats(&message_buffer_pools[i], &class_stats);
+        stats->capacity += class_stats.capacity;
+        stats->in_use += class_stats.in_use;
+        stats->allocs += class_stats.allocs;
+        stats->cache_hits += class_stats.cache_hits;
+        stats->misses += class_stats.misses;
+    }
+}
+
+int send_message(SSL* ssl, message* msg)
+{
+    if (msg == NULL)
+        return MESSAGE_SEND_FAILURE;
+
+    char buffer[BUFFER_SIZE];
+    int length = get_message_protocol(ssl) == MESSAGE_PROTOCOL_BINARY
+        ? serialize_binary_message(msg, buffer, sizeof(buffer))
+        : serialize_message(msg, buffer, sizeof(buffer));
+    if (length < 0)
+        return MESSAGE_SEND_FAILURE;
+
+    int bytes_sent = SSL_write(ssl, buffer, length);
     if (bytes_sent <= 0)
     {
         int ssl_error = SSL_get_error(ssl, bytes_sent);
@@ -114,6 +825,7 @@ const char* message_type_to_text(message_type type)
     case MESSAGE_USER_JOIN: return "MESSAGE_USER_JOIN";
     case MESSAGE_USER_LEAVE: return "MESSAGE_USER_LEAVE";
     case MESSAGE_SYSTEM: return "MESSAGE_SYSTEM";
+    case MESSAGE_PRESENCE: return "MESSAGE_PRESENCE";
     default: return MESSAGE_TYPE_UNKNOWN;
     }
 }
@@ -157,48 +869,87 @@ const char* message_code_to_string(message_code code)
     return code_str;
 }
 
-int get_hash(const unsigned char* input, char* output)
+static pthread_once_t hash_once = PTHREAD_ONCE_INIT;
+static pthread_key_t hash_key;
+static const EVP_MD* hash_md = NULL;
+static _Thread_local EVP_MD_CTX* hash_ctx = NULL;
+
+static void hash_context_release(void* arg)
 {
-    EVP_MD_CTX* mdCtx = EVP_MD_CTX_new();
-    unsigned char hash[HASH_LENGTH];
-    unsigned int mdLen, i;
+    EVP_MD_CTX_free((EVP_MD_CTX*)arg);
+}
 
-    if (!mdCtx)
+static void hash_init()
+{
+    pthread_key_create(&hash_key, hash_context_release);
+    // an explicitly fetched digest spares every initialization the implicit lookup of EVP_sha512
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    hash_md = EVP_MD_fetch(NULL, "SHA512", NULL);
+#endif
+    if (!hash_md)
+        hash_md = EVP_sha512();
+}
+
+// the digest context of the calling thread, created on first use and freed when the thread exits
+static EVP_MD_CTX* hash_context_get()
+{
+    pthread_once(&hash_once, hash_init);
+    if (!hash_ctx)
     {
-        printf("Failed to create message digest context.\n");
-        return 1;
+        hash_ctx = EVP_MD_CTX_new();
+        if (!hash_ctx)
+            return NULL;
+        pthread_setspecific(hash_key, hash_ctx);
     }
+    return hash_ctx;
+}
+
+static int hash_compute(EVP_MD_CTX* ctx, const unsigned char* input, char* output)
+{
+    unsigned char hash[HASH_LENGTH];
+    unsigned int mdLen;
 
-    if (!EVP_DigestInit_ex(mdCtx, EVP_sha512(), NULL))
+    if (!EVP_DigestInit_ex(ctx, hash_md, NULL))
     {
         printf("Message digest initialization failed.\n");
-        EVP_MD_CTX_free(mdCtx);
         return 1;
     }
 
-    if (!EVP_DigestUpdate(mdCtx, input, strlen((const char*)input)))
+    if (!EVP_DigestUpdate(ctx, input, strlen((const char*)input)))
     {
         printf("Message digest update failed.\n");
-        EVP_MD_CTX_free(mdCtx);
         return 1;
     }
 
-    if (!EVP_DigestFinal_ex(mdCtx, hash, &mdLen))
+    if (!EVP_DigestFinal_ex(ctx, hash, &mdLen))
     {
         printf("Message digest finalization failed.\n");
-        EVP_MD_CTX_free(mdCtx);
         return 1;
     }
 
-    EVP_MD_CTX_free(mdCtx);
+    hex_encode(hash, mdLen, output);
+    return 0;
+}
+
+int get_hash(const unsigned char* input, char* output)
+{
+    return get_hash_batch(&input, 1, &output);
+}
 
-    for (i = 0; i < mdLen; i++)
+int get_hash_batch(const unsigned char* const* inputs, size_t count, char* const* outputs)
+{
+    EVP_MD_CTX* mdCtx = hash_context_get();
+    if (!mdCtx)
     {
-        sprintf(output + (i * 2), "%02x", hash[i]);
+        printf("Failed to create message digest context.\n");
+        return 1;
     }
 
-    output[mdLen * 2] = '\0';
-
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (hash_compute(mdCtx, inputs[i], outputs[i]))
+            return 1;
+    }
     return 0;
 }
 
@@ -1,80 +1,168 @@
+#define _GNU_SOURCE // clock_gettime and pthread_condattr_setclock
+
 #include "sts_queue.h"
 
 #include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
 #include <pthread.h>
 
 #include "protocol.h"
 
 static sts_header* create();
 static void destroy(sts_header* header);
-static void push(sts_header* header, message* elem);
-static message* pop(sts_header* header);
+static void push(sts_header* header, message_buffer* elem);
+static message_buffer* pop(sts_header* header);
+static size_t pop_batch(sts_header* header, message_buffer** elems, size_t max, int timeout);
+static void wake(sts_header* header);
 
 static sts_header* create()
 {
     sts_header* handle = malloc(sizeof(*handle));
-    handle->head = NULL;
-    handle->tail = NULL;
+    if (!handle)
+        return NULL;
+    atomic_init(&handle->stub.next, NULL);
+    atomic_init(&handle->tail, &handle->stub);
+    handle->head = &handle->stub;
+    atomic_init(&handle->waiting, 0);
+    atomic_init(&handle->wakeup, 0);
+    pthread_mutex_init(&handle->mutex, NULL);
 
-    pthread_mutex_t* mutex = malloc(sizeof(*mutex));
-    handle->mutex = mutex;
+    // waits are timed against the monotonic clock, so wall clock changes do not stall consumers
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&handle->cond, &attr);
+    pthread_condattr_destroy(&attr);
 
     return handle;
 }
 
 static void destroy(sts_header* header)
 {
-    free(header->mutex);
+    pthread_cond_destroy(&header->cond);
+    pthread_mutex_destroy(&header->mutex);
     free(header);
 }
 
-static void push(sts_header* header, message* elem)
+static void link_push(sts_header* header, message_link* link)
 {
-    // Create new element
-    sts_element* element = malloc(sizeof(*element));
-    element->value = elem;
-    element->next = NULL;
-
-    pthread_mutex_lock(header->mutex);
-    // Is list empty
-    if (header->head == NULL)
-    {
-        header->head = element;
-        header->tail = element;
-    }
-    else
+    atomic_store_explicit(&link->next, NULL, memory_order_relaxed);
+    // the swap orders producers, the previous tail is linked afterwards, so the consumer may briefly see it without a successor
+    message_link* prev = atomic_exchange(&header->tail, link);
+    atomic_store_explicit(&prev->next, link, memory_order_release);
+}
+
+static void signal_consumer(sts_header* header)
+{
+    // the lock makes sure a consumer that saw the queue empty is already waiting before it is signalled
+    pthread_mutex_lock(&header->mutex);
+    pthread_cond_signal(&header->cond);
+    pthread_mutex_unlock(&header->mutex);
+}
+
+static void push(sts_header* header, message_buffer* elem)
+{
+    link_push(header, &elem->link);
+    // pairs with the consumer announcing itself before checking for messages, so either it sees the message or the producer sees it waiting,
+    // only the producer clearing the flag signals, the others leave the waking consumer alone
+    if (atomic_load(&header->waiting) && atomic_exchange(&header->waiting, 0))
+        signal_consumer(header);
+}
+
+static int is_empty(sts_header* header)
+{
+    return header->head == &header->stub && atomic_load(&header->tail) == &header->stub;
+}
+
+static message_buffer* pop(sts_header* header)
+{
+    while (1)
     {
-        // Rewire
-        sts_element* oldTail = header->tail;
-        oldTail->next = element;
-        header->tail = element;
+        message_link* head = header->head;
+        message_link* next = atomic_load_explicit(&head->next, memory_order_acquire);
+        if (head == &header->stub)
+        {
+            if (!next)
+            {
+                if (atomic_load(&header->tail) == head)
+                    return NULL;
+                // a producer swapped the tail and has not linked it yet
+                sched_yield();
+                continue;
+            }
+            header->head = next;
+            head = next;
+            next = atomic_load_explicit(&head->next, memory_order_acquire);
+        }
+        if (next)
+        {
+            header->head = next;
+            return (message_buffer*)head;
+        }
+
+        // the head is the last message, the stub is queued behind it before it can be taken
+        if (atomic_load(&header->tail) == head)
+            link_push(header, &header->stub);
+        next = atomic_load_explicit(&head->next, memory_order_acquire);
+        if (next)
+        {
+            header->head = next;
+            return (message_buffer*)head;
+        }
+        sched_yield();
     }
-    pthread_mutex_unlock(header->mutex);
 }
 
-static message* pop(sts_header* header)
+static size_t pop_batch(sts_header* header, message_buffer** elems, size_t max, int timeout)
 {
-    pthread_mutex_lock(header->mutex);
-    sts_element* head = header->head;
+    size_t count = 0;
+    while (count < max && (elems[count] = pop(header)))
+        count++;
+    if (count || atomic_exchange(&header->wakeup, 0))
+        return count;
+
+    // giving producers a moment before sleeping lets a burst build up instead of waking the consumer for every message
+    for (int spin = 0; spin < STS_QUEUE_SPIN_COUNT && is_empty(header); ++spin)
+        sched_yield();
+    while (count < max && (elems[count] = pop(header)))
+        count++;
+    if (count)
+        return count;
 
-    // Is empty?
-    if (head == NULL)
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout / 1000;
+    deadline.tv_nsec += (long)(timeout % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000)
     {
-        pthread_mutex_unlock(header->mutex);
-        return NULL;
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
     }
-    else
+
+    pthread_mutex_lock(&header->mutex);
+    while (1)
     {
-        // Rewire
-        header->head = head->next;
+        atomic_store(&header->waiting, 1);
+        if (!is_empty(header) || atomic_load(&header->wakeup))
+            break;
+        if (pthread_cond_timedwait(&header->cond, &header->mutex, &deadline) == ETIMEDOUT)
+            break;
+    }
+    atomic_store(&header->waiting, 0);
+    pthread_mutex_unlock(&header->mutex);
+    atomic_store(&header->wakeup, 0);
 
-        // Get head and free element memory
-        message* value = head->value;
-        free(head);
+    while (count < max && (elems[count] = pop(header)))
+        count++;
+    return count;
+}
 
-        pthread_mutex_unlock(header->mutex);
-        return value;
-    }
+static void wake(sts_header* header)
+{
+    atomic_store(&header->wakeup, 1);
+    signal_consumer(header);
 }
 
 _sts_queue const sts_queue =
@@ -82,5 +170,7 @@ _sts_queue const sts_queue =
   create,
   destroy,
   push,
-  pop
+  pop,
+  pop_batch,
+  wake
 };
@@ -0,0 +1,170 @@
+#include "timer_wheel.h"
+
+#include <stdlib.h>
+
+static void timer_list_init(timer* head)
+{
+    head->prev = head;
+    head->next = head;
+}
+
+static void timer_list_append(timer* head, timer* t)
+{
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+static void timer_list_unlink(timer* t)
+{
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->prev = NULL;
+    t->next = NULL;
+}
+
+// moves every timer of the list to the end of the other list
+static void timer_list_splice(timer* from, timer* to)
+{
+    if (from->next == from)
+        return;
+    from->next->prev = to->prev;
+    to->prev->next = from->next;
+    from->prev->next = to;
+    to->prev = from->prev;
+    timer_list_init(from);
+}
+
+static void timer_wheel_add(timer_wheel* wheel, timer* t)
+{
+    if (t->expires < wheel->now)
+        t->expires = wheel->now;
+    uint64_t delta = t->expires - wheel->now;
+    if (delta >= TIMER_WHEEL_RANGE)
+    {
+        t->expires = wheel->now + TIMER_WHEEL_RANGE - 1;
+        delta = TIMER_WHEEL_RANGE - 1;
+    }
+
+    // the level is chosen by distance, the slot by the absolute tick, so a slot is only revisited once its timers are within reach of the level below
+    int level = 0;
+    while (delta >= ((uint64_t)1 << (TIMER_WHEEL_SLOT_BITS * (level + 1))))
+        level++;
+    size_t slot = (t->expires >> (TIMER_WHEEL_SLOT_BITS * level)) & TIMER_WHEEL_SLOT_MASK;
+    timer_list_append(&wheel->slots[level][slot], t);
+}
+
+void timer_wheel_init(timer_wheel* wheel, uint64_t now)
+{
+    wheel->now = now;
+    wheel->count = 0;
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; ++level)
+        for (int slot = 0; slot < TIMER_WHEEL_SLOTS; ++slot)
+            timer_list_init(&wheel->slots[level][slot]);
+}
+
+void timer_init(timer* t, void (*callback)(timer* t, void* arg), void* arg)
+{
+    t->expires = 0;
+    t->callback = callback;
+    t->arg = arg;
+    t->prev = NULL;
+    t->next = NULL;
+}
+
+void timer_schedule(timer_wheel* wheel, timer* t, uint64_t expires)
+{
+    timer_cancel(wheel, t);
+    t->expires = expires;
+    timer_wheel_add(wheel, t);
+    wheel->count++;
+}
+
+void timer_cancel(timer_wheel* wheel, timer* t)
+{
+    if (!t->next)
+        return;
+    timer_list_unlink(t);
+    wheel->count--;
+}
+
+int timer_pending(const timer* t)
+{
+    return t->next != NULL;
+}
+
+// re-adds the timers of a slot, which puts them on lower levels, returns the slot index
+static size_t timer_wheel_cascade(timer_wheel* wheel, int level)
+{
+    size_t slot = (wheel->now >> (TIMER_WHEEL_SLOT_BITS * level)) & TIMER_WHEEL_SLOT_MASK;
+    timer list;
+    timer_list_init(&list);
+    timer_list_splice(&wheel->slots[level][slot], &list);
+    while (list.next != &list)
+    {
+        timer* t = list.next;
+        timer_list_unlink(t);
+        timer_wheel_add(wheel, t);
+    }
+    return slot;
+}
+
+size_t timer_wheel_advance(timer_wheel* wheel, uint64_t now)
+{
+    size_t fired = 0;
+    while (wheel->now <= now)
+    {
+        // nothing can fire in between, so idle spans are skipped at once
+        if (!wheel->count)
+        {
+            wheel->now = now + 1;
+            break;
+        }
+
+        size_t slot = wheel->now & TIMER_WHEEL_SLOT_MASK;
+        for (int level = 1; !slot && level < TIMER_WHEEL_LEVELS; ++level)
+            slot = timer_wheel_cascade(wheel, level);
+
+        timer due;
+        timer_list_init(&due);
+        timer_list_splice(&wheel->slots[0][wheel->now & TIMER_WHEEL_SLOT_MASK], &due);
+        // callbacks rescheduling for the current tick land on the next one instead of a slot that was already taken
+        wheel->now++;
+        while (due.next != &due)
+        {
+            timer* t = due.next;
+            timer_list_unlink(t);
+            wheel->count--;
+            fired++;
+            t->callback(t, t->arg);
+        }
+    }
+    return fired;
+}
+
+uint64_t timer_wheel_next(const timer_wheel* wheel)
+{
+    if (!wheel->count)
+        return TIMER_WHEEL_NONE;
+
+    uint64_t next = TIMER_WHEEL_NONE;
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; ++level)
+    {
+        int shift = TIMER_WHEEL_SLOT_BITS * level;
+        uint64_t index = wheel->now >> shift;
+        // the slot of the next tick on level 0, or the slot that is cascaded next on the levels above
+        for (uint64_t i = level ? 1 : 0; i <= TIMER_WHEEL_SLOTS; ++i)
+        {
+            const timer* head = &wheel->slots[level][(index + i) & TIMER_WHEEL_SLOT_MASK];
+            if (head->next == head)
+                continue;
+            uint64_t at = level ? (index + i) << shift : index + i;
+            uint64_t delta = at > wheel->now ? at - wheel->now : 0;
+            if (delta < next)
+                next = delta;
+            break;
+        }
+    }
+    return next;
+}
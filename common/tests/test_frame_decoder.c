@@ -0,0 +1,257 @@
+#include "frame_decoder.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#define TEST_MESSAGES 5000
+#define TEST_ROUNDS 40
+#define TEST_STREAM_SIZE (TEST_MESSAGES * BINARY_MAX_MESSAGE_LENGTH)
+
+#define CHECK(condition, ...) \
+    do \
+    { \
+        if (!(condition)) \
+        { \
+            fprintf(stderr, "%s:%d: ", __FILE__, __LINE__); \
+            fprintf(stderr, __VA_ARGS__); \
+            fputc('\n', stderr); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while (0)
+
+/**
+ * The test stream structure. This structure is used to store serialized messages back to back, as a peer would write them.
+ *
+ * @param protocol The message protocol of the stream.
+ * @param data The serialized messages.
+ * @param length The number of bytes of the stream.
+ * @param offsets The offset of every message, followed by the stream length.
+ * @param count The number of messages.
+ */
+typedef struct test_stream
+{
+    message_protocol protocol;
+    char* data;
+    size_t length;
+    size_t offsets[TEST_MESSAGES + 1];
+    int count;
+} test_stream;
+
+static uint64_t test_seed = 88172645463325252ULL;
+
+static uint64_t test_random()
+{
+    test_seed ^= test_seed << 13;
+    test_seed ^= test_seed >> 7;
+    test_seed ^= test_seed << 17;
+    return test_seed;
+}
+
+static size_t test_random_range(size_t min, size_t max)
+{
+    return min + (size_t)(test_random() % (max - min + 1));
+}
+
+// mostly short messages with a long one now and then, so reads both merge many messages and end inside long ones
+static void test_stream_build(test_stream* stream, message_protocol protocol, int count)
+{
+    char uid[HASH_HEX_OUTPUT_LENGTH];
+    CHECK(get_hash((const unsigned char*)"frame decoder", uid) == 0, "hashing failed");
+
+    stream->protocol = protocol;
+    stream->data = (char*)malloc(TEST_STREAM_SIZE);
+    CHECK(stream->data, "stream allocation failed");
+    stream->length = 0;
+    stream->count = count;
+    for (int i = 0; i < count; ++i)
+    {
+        char payload[MAX_PAYLOAD_SIZE];
+        size_t payload_length = test_random_range(1, test_random() % 8 ? 64 : MAX_PAYLOAD_SIZE - 1);
+        for (size_t j = 0; j < payload_length; ++j)
+            payload[j] = protocol == MESSAGE_PROTOCOL_BINARY ? (char)test_random_range(1, 255) : (char)test_random_range('a', 'z');
+        payload[payload_length] = '\0';
+
+        message msg;
+        CHECK(create_message(&msg, MESSAGE_TEXT + (int)test_random_range(0, 9), test_random() % 2 ? uid : "server", test_random() % 3 ? uid : "client", payload) == MESSAGE_CREATION_SUCCESS,
+            "message %d creation failed", i);
+        char* out = stream->data + stream->length;
+        size_t out_size = TEST_STREAM_SIZE - stream->length;
+        int length = protocol == MESSAGE_PROTOCOL_BINARY ? serialize_binary_message(&msg, out, out_size) : serialize_message(&msg, out, out_size);
+        CHECK(length > 0, "message %d serialization failed", i);
+        stream->offsets[i] = stream->length;
+        stream->length += (size_t)length;
+    }
+    stream->offsets[count] = stream->length;
+}
+
+static void test_stream_destroy(test_stream* stream)
+{
+    free(stream->data);
+    stream->data = NULL;
+}
+
+/**
+ * Decode a stream in chunks. This function is used to feed the stream the way reads would deliver it and check every message against the written bytes.
+ * Every chunk is copied to its own allocation and poisoned and freed once the decoder asks for more, so a message returned from bytes of an earlier read fails.
+ *
+ * @param stream The stream.
+ * @param min_chunk The smallest chunk.
+ * @param max_chunk The largest chunk.
+ * @param reassembled The number of messages returned from the buffer of the decoder instead of the chunk.
+ */
+static void test_decode_chunks(const test_stream* stream, size_t min_chunk, size_t max_chunk, int* reassembled)
+{
+    frame_decoder decoder;
+    frame_decoder_init(&decoder, stream->protocol);
+    size_t position = 0;
+    int received = 0;
+    *reassembled = 0;
+    while (position < stream->length)
+    {
+        size_t chunk = test_random_range(min_chunk, max_chunk);
+        if (chunk > stream->length - position)
+            chunk = stream->length - position;
+        char* read = (char*)malloc(chunk);
+        CHECK(read, "chunk allocation failed");
+        memcpy(read, stream->data + position, chunk);
+        frame_decoder_feed(&decoder, read, chunk);
+
+        const char* frame;
+        size_t length;
+        int result;
+        while ((result = frame_decoder_next(&decoder, &frame, &length)) == FRAME_DECODER_FRAME)
+        {
+            CHECK(received < stream->count, "more messages than written");
+            size_t expected = stream->offsets[received + 1] - stream->offsets[received];
+            CHECK(length == expected, "message %d has length %zu instead of %zu", received, length, expected);
+            CHECK(!memcmp(frame, stream->data + stream->offsets[received], length), "message %d differs from the written bytes", received);
+            if (frame < read || frame >= read + chunk)
+                (*reassembled)++;
+            received++;
+        }
+        CHECK(result == FRAME_DECODER_INCOMPLETE, "decoder failed with %d after message %d", result, received);
+        memset(read, 0xAA, chunk);
+        free(read);
+        position += chunk;
+    }
+    CHECK(received == stream->count, "received %d of %d messages", received, stream->count);
+    CHECK(decoder.length == 0, "%zu bytes left in the decoder", decoder.length);
+    frame_decoder_destroy(&decoder);
+}
+
+static void test_random_fragmentation(message_protocol protocol)
+{
+    const char* name = protocol == MESSAGE_PROTOCOL_BINARY ? "binary" : "text";
+    test_stream stream;
+    test_stream_build(&stream, protocol, TEST_MESSAGES);
+
+    // single bytes and tiny reads first, then reads of up to a few messages and reads merging many
+    int reassembled;
+    for (int round = 0; round < TEST_ROUNDS; ++round)
+    {
+        size_t max_chunk = round < 4 ? (size_t)round + 1 : round % 2 ? test_random_range(2, BUFFER_SIZE) : test_random_range(BUFFER_SIZE, 8 * BUFFER_SIZE);
+        test_decode_chunks(&stream, 1, max_chunk, &reassembled);
+    }
+
+    // a whole stream in one read is returned straight from the read
+    test_decode_chunks(&stream, stream.length, stream.length, &reassembled);
+    CHECK(reassembled == 0, "%d messages of a single read were copied", reassembled);
+    test_stream_destroy(&stream);
+    printf("frame_decoder: %s random fragmentation ok\n", name);
+}
+
+// the rest of a cut off message arrives with whole messages behind it, only the cut off one may be copied
+static void test_excess_returned(message_protocol protocol)
+{
+    test_stream stream;
+    test_stream_build(&stream, protocol, 8);
+    size_t first = stream.offsets[1];
+
+    frame_decoder decoder;
+    frame_decoder_init(&decoder, protocol);
+    const char* frame;
+    size_t length;
+    frame_decoder_feed(&decoder, stream.data, first / 2);
+    CHECK(frame_decoder_next(&decoder, &frame, &length) == FRAME_DECODER_INCOMPLETE, "a cut off message was returned");
+
+    const char* rest = stream.data + first / 2;
+    size_t rest_length = stream.length - first / 2;
+    frame_decoder_feed(&decoder, rest, rest_length);
+    CHECK(frame_decoder_next(&decoder, &frame, &length) == FRAME_DECODER_FRAME, "the completed message was not returned");
+    CHECK(length == first && !memcmp(frame, stream.data, first), "the completed message differs");
+    for (int i = 1; i < stream.count; ++i)
+    {
+        CHECK(frame_decoder_next(&decoder, &frame, &length) == FRAME_DECODER_FRAME, "message %d was not returned", i);
+        CHECK(frame == stream.data + stream.offsets[i], "message %d was copied instead of returned from the read", i);
+    }
+    CHECK(frame_decoder_next(&decoder, &frame, &length) == FRAME_DECODER_INCOMPLETE, "the decoder kept bytes");
+    CHECK(decoder.length == 0, "%zu bytes left in the decoder", decoder.length);
+    frame_decoder_destroy(&decoder);
+    test_stream_destroy(&stream);
+    printf("frame_decoder: %s excess bytes returned to the read ok\n", protocol == MESSAGE_PROTOCOL_BINARY ? "binary" : "text");
+}
+
+static void test_reset()
+{
+    test_stream stream;
+    test_stream_build(&stream, MESSAGE_PROTOCOL_TEXT, 4);
+
+    frame_decoder decoder;
+    frame_decoder_init(&decoder, MESSAGE_PROTOCOL_TEXT);
+    const char* frame;
+    size_t length;
+    frame_decoder_feed(&decoder, stream.data, stream.offsets[1] - 1);
+    CHECK(frame_decoder_next(&decoder, &frame, &length) == FRAME_DECODER_INCOMPLETE, "a cut off message was returned");
+
+    // the bytes of the old connection are dropped, the new one starts at a message boundary
+    frame_decoder_reset(&decoder, MESSAGE_PROTOCOL_TEXT);
+    frame_decoder_feed(&decoder, stream.data, stream.length);
+    for (int i = 0; i < stream.count; ++i)
+    {
+        CHECK(frame_decoder_next(&decoder, &frame, &length) == FRAME_DECODER_FRAME, "message %d was not returned after the reset", i);
+        CHECK(frame == stream.data + stream.offsets[i], "message %d is not the one written after the reset", i);
+    }
+    CHECK(frame_decoder_next(&decoder, &frame, &length) == FRAME_DECODER_INCOMPLETE, "the decoder kept bytes");
+    frame_decoder_destroy(&decoder);
+    test_stream_destroy(&stream);
+    printf("frame_decoder: reset ok\n");
+}
+
+static void test_invalid()
+{
+    frame_decoder decoder;
+    const char* frame;
+    size_t length;
+    char junk[FRAME_DECODER_CAPACITY];
+
+    frame_decoder_init(&decoder, MESSAGE_PROTOCOL_BINARY);
+    memset(junk, 0xFF, 64);
+    frame_decoder_feed(&decoder, junk, 64);
+    CHECK(frame_decoder_next(&decoder, &frame, &length) == FRAME_DECODER_INVALID, "a binary header of the wrong version was accepted");
+
+    // a text message that never ends is given up once it would not fit any valid message
+    frame_decoder_reset(&decoder, MESSAGE_PROTOCOL_TEXT);
+    memset(junk, 'z', sizeof(junk));
+    int result = FRAME_DECODER_INCOMPLETE;
+    for (int i = 0; i < 4 && result == FRAME_DECODER_INCOMPLETE; ++i)
+    {
+        frame_decoder_feed(&decoder, junk, sizeof(junk) / 2);
+        result = frame_decoder_next(&decoder, &frame, &length);
+    }
+    CHECK(result == FRAME_DECODER_INVALID, "an endless text message was not rejected, got %d", result);
+    frame_decoder_destroy(&decoder);
+    printf("frame_decoder: invalid input rejected ok\n");
+}
+
+int main()
+{
+    test_random_fragmentation(MESSAGE_PROTOCOL_TEXT);
+    test_random_fragmentation(MESSAGE_PROTOCOL_BINARY);
+    test_excess_returned(MESSAGE_PROTOCOL_TEXT);
+    test_excess_returned(MESSAGE_PROTOCOL_BINARY);
+    test_reset();
+    test_invalid();
+    return EXIT_SUCCESS;
+}
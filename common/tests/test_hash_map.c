@@ -0,0 +1,413 @@
+#define _GNU_SOURCE // dup2 and fileno
+
+#include "hash_map.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#define TEST_KEYS 200000
+#define TEST_OPERATIONS 3000000
+#define TEST_CHECK_INTERVAL 50000
+#define TEST_THREADS 8
+#define TEST_THREAD_KEYS 5000
+#define TEST_THREAD_ROUNDS 20
+#define TEST_READERS 2
+#define TEST_CLEAR_KEYS 10000
+
+#define CHECK(condition, ...) \
+    do \
+    { \
+        if (!(condition)) \
+        { \
+            fprintf(stderr, "%s:%d: ", __FILE__, __LINE__); \
+            fprintf(stderr, __VA_ARGS__); \
+            fputc('\n', stderr); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while (0)
+
+/**
+ * The test key structure. This structure is used to hold the client connections that may be stored under one username.
+ * The copy has the UID and the username of the client and replaces it, the twin has another UID and the same username and is refused while the client is stored.
+ *
+ * @param client The client connection.
+ * @param copy Another client connection with the same UID and username.
+ * @param twin A client connection with another UID and the same username.
+ * @param uid The UID of the client and its copy.
+ * @param twin_uid The UID of the twin.
+ * @param stored The client connection the hash map should hold under the username, NULL if none.
+ */
+typedef struct test_key
+{
+    client_connection client;
+    client_connection copy;
+    client_connection twin;
+    char uid[HASH_HEX_OUTPUT_LENGTH];
+    char twin_uid[HASH_HEX_OUTPUT_LENGTH];
+    client_connection* stored;
+} test_key;
+
+static test_key* test_keys;
+static request test_request;
+static uint64_t test_seed = 88172645463325252ULL;
+
+static uint64_t test_random_next(uint64_t* seed)
+{
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 7;
+    *seed ^= *seed << 17;
+    return *seed;
+}
+
+static uint64_t test_random()
+{
+    return test_random_next(&test_seed);
+}
+
+static void test_connection_init(client_connection* cl, char* uid, const char* username)
+{
+    memset(cl, 0, sizeof(*cl));
+    cl->req = &test_request;
+    cl->uid = uid;
+    snprintf(cl->username, sizeof(cl->username), "%s", username);
+}
+
+// most UIDs are hashes like the server's, every tenth one is not, so both key hashes are probed
+static void test_keys_create(size_t count)
+{
+    test_keys = (test_key*)calloc(count, sizeof(test_key));
+    CHECK(test_keys, "key allocation failed");
+    for (size_t i = 0; i < count; ++i)
+    {
+        test_key* key = &test_keys[i];
+        char username[MAX_USERNAME_LENGTH + 1];
+        snprintf(username, sizeof(username), "user%zu", i);
+        if (i % 10)
+            CHECK(get_hash((const unsigned char*)username, key->uid) == 0, "hashing failed");
+        else
+            snprintf(key->uid, sizeof(key->uid), "uid-%zu", i);
+        snprintf(key->twin_uid, sizeof(key->twin_uid), "twin-%zu", i);
+        test_connection_init(&key->client, key->uid, username);
+        test_connection_init(&key->copy, key->uid, username);
+        test_connection_init(&key->twin, key->twin_uid, username);
+    }
+}
+
+static int test_is_client(const test_key* key, const client_connection* cl)
+{
+    return cl && (cl == &key->client || cl == &key->copy);
+}
+
+static void test_count(client_connection* cl, void* param)
+{
+    (*(size_t*)param)++;
+    if (cl) {}
+}
+
+// the map, its iteration and its probe histogram all agree with the reference
+static void test_check_totals(hash_map* map, size_t live)
+{
+    size_t visited = 0;
+    hash_map_iterate2(map, test_count, &visited);
+    CHECK(visited == live, "iteration visited %zu of %zu entries", visited, live);
+    CHECK(atomic_load(&map->current_elements) == live, "the map counts %zu of %zu entries", atomic_load(&map->current_elements), live);
+
+    size_t histogram[8] = { 0 };
+    size_t probed = 0;
+    hash_map_histogram(map, histogram, 8);
+    for (int i = 0; i < 8; ++i)
+        probed += histogram[i];
+    CHECK(probed == live, "the histogram holds %zu of %zu entries", probed, live);
+}
+
+static void test_check_key(hash_map* map, test_key* key)
+{
+    client_connection* found = NULL;
+    bool result = hash_map_find(map, key->uid, &found);
+    CHECK(result == test_is_client(key, key->stored) && (!result || found == key->stored), "%s found by UID does not match", key->client.username);
+    result = hash_map_find(map, key->twin_uid, &found);
+    CHECK(result == (key->stored == &key->twin) && (!result || found == &key->twin), "the twin of %s found by UID does not match", key->client.username);
+    result = hash_map_find_by_name(map, key->client.username, &found);
+    CHECK(result == (key->stored != NULL) && (!result || found == key->stored), "%s found by username does not match", key->client.username);
+}
+
+/**
+ * Run random operations against a reference. This function is used to insert, replace, erase and find random keys in a map that starts at the smallest size,
+ * so the shards grow and copy their tables many times while deleted slots pile up, and to compare every result with the reference.
+ */
+static void test_random_operations()
+{
+    hash_map* map = hash_map_create(1);
+    CHECK(map, "map creation failed");
+    size_t live = 0;
+    for (size_t operation = 0; operation < TEST_OPERATIONS; ++operation)
+    {
+        test_key* key = &test_keys[test_random() % TEST_KEYS];
+        uint64_t choice = test_random() % 8;
+        if (choice < 3)
+        {
+            // a client and its twin are never inserted over each other here, the refusal is checked on its own
+            client_connection* cl = key->stored == &key->twin ? &key->twin : test_random() % 2 ? &key->client : &key->copy;
+            int result = hash_map_insert(map, cl);
+            CHECK(result == (key->stored ? 2 : 1), "insert of %s returned %d", cl->uid, result);
+            live += key->stored == NULL;
+            key->stored = cl;
+        }
+        else if (choice == 3 && !key->stored)
+        {
+            CHECK(hash_map_insert(map, &key->twin) == 1, "insert of %s failed", key->twin_uid);
+            key->stored = &key->twin;
+            live++;
+        }
+        else if (choice < 6)
+        {
+            const char* uid = test_random() % 2 ? key->uid : key->twin_uid;
+            hash_map_erase(map, uid);
+            if (key->stored && !strcmp(key->stored->uid, uid))
+            {
+                key->stored = NULL;
+                live--;
+            }
+        }
+        test_check_key(map, key);
+
+        if (operation % TEST_CHECK_INTERVAL == 0)
+        {
+            test_check_totals(map, live);
+            ebr_collect();
+        }
+    }
+    test_check_totals(map, live);
+    for (size_t i = 0; i < TEST_KEYS; ++i)
+        test_check_key(map, &test_keys[i]);
+    size_t capacity = hash_map_capacity(map);
+
+    for (size_t i = 0; i < TEST_KEYS; ++i)
+    {
+        if (test_keys[i].stored)
+            hash_map_erase(map, test_keys[i].stored->uid);
+        test_keys[i].stored = NULL;
+        test_check_key(map, &test_keys[i]);
+    }
+    test_check_totals(map, 0);
+    ebr_collect();
+    hash_map_destroy(map);
+    printf("hash_map: %d random operations ok, %zu slots at the end\n", TEST_OPERATIONS, capacity);
+}
+
+// a username belongs to one client, another UID may not take it over
+static void test_username_taken()
+{
+    hash_map* map = hash_map_create(1);
+    CHECK(map, "map creation failed");
+    test_key* key = &test_keys[0];
+
+    // the refusals are logged, the test has no log to write them to
+    fflush(stderr);
+    int saved = dup(fileno(stderr));
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, fileno(stderr));
+    close(null);
+    int client_inserted = hash_map_insert(map, &key->client);
+    int twin_refused = hash_map_insert(map, &key->twin);
+    hash_map_erase(map, key->twin_uid);
+    key->stored = &key->client;
+    client_connection* found = NULL;
+    int client_kept = hash_map_find_by_name(map, key->client.username, &found) && found == &key->client;
+    hash_map_erase(map, key->uid);
+    int twin_inserted = hash_map_insert(map, &key->twin);
+    int copy_refused = hash_map_insert(map, &key->copy);
+    fflush(stderr);
+    dup2(saved, fileno(stderr));
+    close(saved);
+
+    CHECK(client_inserted == 1 && twin_inserted == 1, "a free username was refused");
+    CHECK(twin_refused == 0 && copy_refused == 0, "a taken username was given to another UID");
+    CHECK(client_kept, "erasing a refused UID erased the client holding the username");
+    key->stored = &key->twin;
+    test_check_key(map, key);
+    test_check_totals(map, 1);
+    hash_map_erase(map, key->twin_uid);
+    key->stored = NULL;
+    test_check_totals(map, 0);
+    hash_map_destroy(map);
+    printf("hash_map: taken username refused ok\n");
+}
+
+/**
+ * The churn structure. This structure is used to share the map between the writers and the readers of the churn test.
+ *
+ * @param map The hash map.
+ * @param writers The number of writers still running.
+ * @param failures The number of lookups that returned a wrong entry.
+ * @param lookups The number of lookups of the readers.
+ */
+typedef struct test_churn
+{
+    hash_map* map;
+    atomic_int writers;
+    atomic_int failures;
+    atomic_size_t lookups;
+} test_churn;
+
+typedef struct test_worker
+{
+    test_churn* churn;
+    size_t first;
+    uint64_t seed;
+} test_worker;
+
+static void test_worker_check(test_worker* worker, size_t i, client_connection* expected)
+{
+    test_key* key = &test_keys[i];
+    client_connection* found = NULL;
+    bool result = hash_map_find(worker->churn->map, key->uid, &found);
+    if (result != (expected != NULL) || (result && found != expected))
+        atomic_fetch_add(&worker->churn->failures, 1);
+    result = hash_map_find_by_name(worker->churn->map, key->client.username, &found);
+    if (result != (expected != NULL) || (result && found != expected))
+        atomic_fetch_add(&worker->churn->failures, 1);
+}
+
+// every writer owns its keys, inserts, replaces and erases them all on every round while the shards grow under the other writers and the readers
+static void* test_writer(void* arg)
+{
+    test_worker* worker = (test_worker*)arg;
+    hash_map* map = worker->churn->map;
+    for (int round = 0; round < TEST_THREAD_ROUNDS; ++round)
+    {
+        for (size_t i = worker->first; i < worker->first + TEST_THREAD_KEYS; ++i)
+            if (hash_map_insert(map, &test_keys[i].client) != 1)
+                atomic_fetch_add(&worker->churn->failures, 1);
+        for (size_t i = worker->first; i < worker->first + TEST_THREAD_KEYS; ++i)
+            test_worker_check(worker, i, &test_keys[i].client);
+        for (size_t i = worker->first; i < worker->first + TEST_THREAD_KEYS; ++i)
+            if (hash_map_insert(map, &test_keys[i].copy) != 2)
+                atomic_fetch_add(&worker->churn->failures, 1);
+        for (size_t i = worker->first; i < worker->first + TEST_THREAD_KEYS; ++i)
+        {
+            test_worker_check(worker, i, &test_keys[i].copy);
+            hash_map_erase(map, test_keys[i].uid);
+        }
+        for (size_t i = worker->first; i < worker->first + TEST_THREAD_KEYS; ++i)
+            test_worker_check(worker, i, NULL);
+        ebr_collect();
+    }
+    atomic_fetch_sub(&worker->churn->writers, 1);
+    return NULL;
+}
+
+typedef struct test_lookup
+{
+    const test_key* key;
+    test_churn* churn;
+} test_lookup;
+
+static void test_reader_match(client_connection* cl, void* param)
+{
+    test_lookup* lookup = (test_lookup*)param;
+    if (strcmp(cl->uid, lookup->key->uid) || strcmp(cl->username, lookup->key->client.username))
+        atomic_fetch_add(&lookup->churn->failures, 1);
+}
+
+// readers look up keys of every writer, a found entry must be the one stored under the key, and iterate over tables being copied and retired
+static void* test_reader(void* arg)
+{
+    test_worker* worker = (test_worker*)arg;
+    test_churn* churn = worker->churn;
+    size_t lookups = 0;
+    uint64_t seed = worker->seed;
+    while (atomic_load(&churn->writers))
+    {
+        for (int i = 0; i < 1000; ++i, ++lookups)
+        {
+            test_lookup lookup = { &test_keys[test_random_next(&seed) % (TEST_THREADS * TEST_THREAD_KEYS)], churn };
+            hash_map_apply(churn->map, lookup.key->uid, test_reader_match, &lookup);
+            hash_map_apply_by_name(churn->map, lookup.key->client.username, test_reader_match, &lookup);
+        }
+        size_t visited = 0;
+        hash_map_iterate2(churn->map, test_count, &visited);
+        if (visited > TEST_THREADS * TEST_THREAD_KEYS)
+            atomic_fetch_add(&churn->failures, 1);
+        ebr_collect();
+    }
+    atomic_fetch_add(&churn->lookups, lookups);
+    return NULL;
+}
+
+/**
+ * Churn the map from many threads. This function is used to run writers on disjoint keys and lock-free readers at once on a map that starts at the smallest size,
+ * so tables are copied and retired while readers probe and iterate them.
+ */
+static void test_churn_threads()
+{
+    test_churn churn;
+    churn.map = hash_map_create(1);
+    CHECK(churn.map, "map creation failed");
+    atomic_init(&churn.writers, TEST_THREADS);
+    atomic_init(&churn.failures, 0);
+    atomic_init(&churn.lookups, 0);
+
+    pthread_t threads[TEST_THREADS + TEST_READERS];
+    test_worker workers[TEST_THREADS + TEST_READERS];
+    for (int i = 0; i < TEST_THREADS + TEST_READERS; ++i)
+    {
+        workers[i] = (test_worker){ &churn, (size_t)i * TEST_THREAD_KEYS, 0x9E3779B97F4A7C15ULL * (uint64_t)(i + 1) };
+        CHECK(pthread_create(&threads[i], NULL, i < TEST_THREADS ? test_writer : test_reader, &workers[i]) == 0, "thread creation failed");
+    }
+    for (int i = 0; i < TEST_THREADS + TEST_READERS; ++i)
+        pthread_join(threads[i], NULL);
+
+    CHECK(atomic_load(&churn.failures) == 0, "%d lookups or inserts went wrong", atomic_load(&churn.failures));
+    test_check_totals(churn.map, 0);
+    size_t capacity = hash_map_capacity(churn.map);
+    ebr_collect();
+    hash_map_destroy(churn.map);
+    printf("hash_map: %d writers and %d readers churn ok, %zu reader lookups, %zu slots at the end\n", TEST_THREADS, TEST_READERS, atomic_load(&churn.lookups), capacity);
+}
+
+// the map does not own its entries, the test counts the releases in the IDs of the clients
+static void test_release(client_connection* cl)
+{
+    cl->id++;
+}
+
+// every entry is handed back once, including those still in the old table of a growing shard
+static void test_clear()
+{
+    hash_map* map = hash_map_create(1);
+    CHECK(map, "map creation failed");
+    for (size_t i = 0; i < TEST_CLEAR_KEYS; ++i)
+    {
+        test_keys[i].client.id = 0;
+        CHECK(hash_map_insert(map, &test_keys[i].client) == 1, "insert of %s failed", test_keys[i].uid);
+    }
+    hash_map_clear(map, test_release);
+    for (size_t i = 0; i < TEST_CLEAR_KEYS; ++i)
+    {
+        CHECK(test_keys[i].client.id == 1, "%s released %d times", test_keys[i].client.username, test_keys[i].client.id);
+        test_keys[i].stored = NULL;
+        test_check_key(map, &test_keys[i]);
+    }
+    test_check_totals(map, 0);
+    CHECK(hash_map_insert(map, &test_keys[0].client) == 1, "insert into a cleared map failed");
+    hash_map_erase(map, test_keys[0].uid);
+    hash_map_destroy(map);
+    printf("hash_map: %d entries cleared and released once ok\n", TEST_CLEAR_KEYS);
+}
+
+int main()
+{
+    test_keys_create(TEST_KEYS);
+    test_username_taken();
+    test_clear();
+    test_random_operations();
+    test_churn_threads();
+    free(test_keys);
+    return EXIT_SUCCESS;
+}
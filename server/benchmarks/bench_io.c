@@ -0,0 +1,444 @@
+#define _GNU_SOURCE // mkdtemp, nftw and pthread_barrier_t
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <ftw.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <openssl/ssl.h>
+
+#include "protocol.h"
+#include "frame_decoder.h"
+
+#define BENCH_CLIENTS 32
+#define BENCH_ROUNDS 100
+#define BENCH_WINDOW 32 // messages a client has in flight before it waits for them
+#define BENCH_PASSWORD "benchpassword"
+#define BENCH_START_TIMEOUT 60 // in seconds, the first start generates the server key
+#define BENCH_STOP_TIMEOUT 10 // in seconds
+#define BENCH_RECEIVE_TIMEOUT 10 // in seconds, a stalled server fails the benchmark instead of hanging it
+#define BENCH_SERVER_OUTPUT "server.out"
+
+/**
+ * The benchmark server structure. This structure is used to run a server process in a directory of its own, so every run starts with an empty database.
+ *
+ * @param pid The server process ID.
+ * @param input The write end of the server's standard input, CLI commands are written to it.
+ * @param directory The working directory of the server.
+ */
+typedef struct bench_server
+{
+    pid_t pid;
+    int input;
+    char directory[64];
+} bench_server;
+
+/**
+ * The benchmark client structure. This structure is used to hold a TLS connection to the server and the messages read from it.
+ *
+ * @param id The client ID, its username is derived from it.
+ * @param sock The socket.
+ * @param ssl The TLS connection.
+ * @param decoder The frame decoder cutting the reads into messages.
+ * @param uid The UID the server assigned the client.
+ * @param buffer The last read, the decoder may return messages from it until it asks for more.
+ * @param received The number of the client's own text messages received.
+ * @param failed The failure status.
+ */
+typedef struct bench_client
+{
+    int id;
+    int sock;
+    SSL* ssl;
+    frame_decoder decoder;
+    char uid[HASH_HEX_OUTPUT_LENGTH];
+    char buffer[BUFFER_SIZE];
+    long received;
+    int failed;
+} bench_client;
+
+static SSL_CTX* bench_ctx;
+static pthread_barrier_t bench_barrier;
+
+static double bench_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static int bench_connect()
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(PORT);
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0)
+        return -1;
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+    {
+        close(sock);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    struct timeval timeout = { BENCH_RECEIVE_TIMEOUT, 0 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    return sock;
+}
+
+static void bench_server_stop(bench_server* server, int* fallback, int failed);
+
+static int bench_remove_entry(const char* path, const struct stat* st, int flag, struct FTW* ftw)
+{
+    if (st || flag || ftw) {}
+    return remove(path);
+}
+
+/**
+ * Start a server. This function is used to run the server binary with the given I/O backend in a new temporary directory and wait until it accepts connections.
+ *
+ * @param server The benchmark server.
+ * @param binary The server binary.
+ * @param io The I/O backend option value.
+ * @return 0 once the server accepts connections, -1 otherwise.
+ */
+static int bench_server_start(bench_server* server, const char* binary, const char* io)
+{
+    // a server left running would be measured instead
+    int sock = bench_connect();
+    if (sock >= 0)
+    {
+        close(sock);
+        fprintf(stderr, "io: port %d is already in use\n", PORT);
+        return -1;
+    }
+    snprintf(server->directory, sizeof(server->directory), "/tmp/bench_io_XXXXXX");
+    if (!mkdtemp(server->directory))
+        return -1;
+    int input[2];
+    if (pipe(input) < 0)
+        return -1;
+
+    char option[32];
+    snprintf(option, sizeof(option), "--io=%s", io);
+    server->pid = fork();
+    if (server->pid < 0)
+        return -1;
+    if (!server->pid)
+    {
+        // the CLI reads the pipe, the output is kept aside to explain a failed start
+        // the server opens its database in the database directory but does not create it
+        if (chdir(server->directory) != 0 || mkdir("database", 0700) != 0)
+            _exit(EXIT_FAILURE);
+        int output = open(BENCH_SERVER_OUTPUT, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        dup2(input[0], STDIN_FILENO);
+        dup2(output, STDOUT_FILENO);
+        dup2(output, STDERR_FILENO);
+        close(input[0]);
+        close(input[1]);
+        close(output);
+        execl(binary, binary, option, (char*)NULL);
+        _exit(EXIT_FAILURE);
+    }
+    close(input[0]);
+    server->input = input[1];
+
+    for (double deadline = bench_now() + BENCH_START_TIMEOUT; bench_now() < deadline; usleep(100000))
+    {
+        sock = bench_connect();
+        if (sock >= 0)
+        {
+            close(sock);
+            return 0;
+        }
+        if (waitpid(server->pid, NULL, WNOHANG) == server->pid)
+        {
+            server->pid = -1;
+            break;
+        }
+    }
+    bench_server_stop(server, NULL, 1);
+    return -1;
+}
+
+/**
+ * Stop a server. This function is used to stop the server through its CLI, kill it if it does not exit in time and remove its directory.
+ *
+ * @param server The benchmark server.
+ * @param fallback Set if the server logged that io_uring fell back to epoll, may be NULL.
+ * @param failed The failed start status, the output of the server is printed.
+ */
+static void bench_server_stop(bench_server* server, int* fallback, int failed)
+{
+    if (write(server->input, "!exit\n", 6) < 0) {}
+    close(server->input);
+    int exited = server->pid < 0;
+    for (double deadline = bench_now() + BENCH_STOP_TIMEOUT; !exited && bench_now() < deadline; usleep(100000))
+        exited = waitpid(server->pid, NULL, WNOHANG) == server->pid;
+    if (!exited)
+    {
+        kill(server->pid, SIGKILL);
+        waitpid(server->pid, NULL, 0);
+    }
+
+    char path[128];
+    char line[1024];
+    if (failed)
+    {
+        snprintf(path, sizeof(path), "%s/%s", server->directory, BENCH_SERVER_OUTPUT);
+        FILE* output = fopen(path, "r");
+        while (output && fgets(line, sizeof(line), output))
+            fprintf(stderr, "io: server: %s", line);
+        if (output)
+            fclose(output);
+    }
+
+    if (fallback)
+    {
+        snprintf(path, sizeof(path), "%s/logs/server.log", server->directory);
+        FILE* log = fopen(path, "r");
+        *fallback = 0;
+        while (log && fgets(line, sizeof(line), log))
+            if (strstr(line, "falling back to epoll"))
+                *fallback = 1;
+        if (log)
+            fclose(log);
+    }
+    nftw(server->directory, bench_remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+// the next message of the connection, reading as needed
+static int bench_receive(bench_client* client, message* msg)
+{
+    const char* frame;
+    size_t length;
+    int result;
+    while ((result = frame_decoder_next(&client->decoder, &frame, &length)) == FRAME_DECODER_INCOMPLETE)
+    {
+        int bytes = SSL_read(client->ssl, client->buffer, sizeof(client->buffer));
+        if (bytes <= 0)
+            return -1;
+        frame_decoder_feed(&client->decoder, client->buffer, (size_t)bytes);
+    }
+    if (result != FRAME_DECODER_FRAME)
+        return -1;
+    char text[BUFFER_SIZE];
+    memcpy(text, frame, length);
+    text[length] = '\0';
+    msg->payload[0] = '\0';
+    msg->payload_length = 0;
+    parse_message(msg, text);
+    return 0;
+}
+
+// skips messages until one of the type, and with the code as payload unless the code is 0
+static int bench_expect(bench_client* client, message_type type, message_code code, message* msg)
+{
+    char expected[16];
+    snprintf(expected, sizeof(expected), "%d", code);
+    while (bench_receive(client, msg) == 0)
+        if (msg->type == type && (!code || !strcmp(msg->payload, expected)))
+            return 0;
+    return -1;
+}
+
+static int bench_send(bench_client* client, message_type type, const char* sender, const char* recipient, const char* payload)
+{
+    message msg;
+    if (create_message(&msg, type, sender, recipient, payload) != MESSAGE_CREATION_SUCCESS)
+        return -1;
+    return send_message(client->ssl, &msg) == MESSAGE_SEND_SUCCESS ? 0 : -1;
+}
+
+/**
+ * Register a client. This function is used to connect a client and go through the registration of a new user, as the client application does.
+ *
+ * @param client The benchmark client.
+ * @return 0 once the client holds its UID, -1 otherwise.
+ */
+static int bench_register(bench_client* client)
+{
+    message msg;
+    char username[MAX_USERNAME_LENGTH + 1];
+    snprintf(username, sizeof(username), "bench%d", client->id);
+    client->sock = bench_connect();
+    if (client->sock < 0)
+        return -1;
+    client->ssl = SSL_new(bench_ctx);
+    SSL_set_fd(client->ssl, client->sock);
+    frame_decoder_init(&client->decoder, MESSAGE_PROTOCOL_TEXT);
+    if (SSL_connect(client->ssl) <= 0
+        || bench_expect(client, MESSAGE_AUTH, MESSAGE_CODE_ENTER_USERNAME, &msg)
+        || bench_send(client, MESSAGE_AUTH, CLIENT_DEFAULT_NAME, "server", username)
+        || bench_expect(client, MESSAGE_CHOICE, MESSAGE_CODE_USER_REGISTER_CHOICE, &msg)
+        || bench_send(client, MESSAGE_CHOICE, CLIENT_DEFAULT_NAME, "server", "y")
+        || bench_expect(client, MESSAGE_AUTH, MESSAGE_CODE_ENTER_PASSWORD, &msg)
+        || bench_send(client, MESSAGE_AUTH, CLIENT_DEFAULT_NAME, "server", BENCH_PASSWORD)
+        || bench_expect(client, MESSAGE_AUTH, MESSAGE_CODE_ENTER_PASSWORD_CONFIRMATION, &msg)
+        || bench_send(client, MESSAGE_AUTH, CLIENT_DEFAULT_NAME, "server", BENCH_PASSWORD)
+        || bench_expect(client, MESSAGE_UID, 0, &msg))
+        return -1;
+
+    // the payload is the username and the UID
+    const char* uid = strstr(msg.payload, MESSAGE_DELIMITER);
+    if (!uid)
+        return -1;
+    snprintf(client->uid, sizeof(client->uid), "%s", uid + 1);
+    return 0;
+}
+
+// every client sends a window of messages to itself and waits for all of them, so the server reads, routes and writes for every client at once
+static void* bench_client_run(void* arg)
+{
+    bench_client* client = (bench_client*)arg;
+    pthread_barrier_wait(&bench_barrier);
+    char payload[64];
+    message msg;
+    for (int round = 0; round < BENCH_ROUNDS && !client->failed; ++round)
+    {
+        for (int i = 0; i < BENCH_WINDOW && !client->failed; ++i)
+        {
+            snprintf(payload, sizeof(payload), "bench message %d of client %d", round * BENCH_WINDOW + i, client->id);
+            client->failed = bench_send(client, MESSAGE_TEXT, client->uid, client->uid, payload);
+        }
+        for (int i = 0; i < BENCH_WINDOW && !client->failed; ++i)
+        {
+            client->failed = bench_expect(client, MESSAGE_TEXT, 0, &msg);
+            client->received += !client->failed;
+        }
+    }
+    pthread_barrier_wait(&bench_barrier);
+    return NULL;
+}
+
+static void bench_client_close(bench_client* client)
+{
+    if (client->ssl)
+    {
+        SSL_shutdown(client->ssl);
+        SSL_free(client->ssl);
+    }
+    if (client->sock >= 0)
+        close(client->sock);
+    frame_decoder_destroy(&client->decoder);
+}
+
+/**
+ * Run the load against a backend. This function is used to start the server with the backend, register the clients, time their message exchange and stop the server.
+ *
+ * @param binary The server binary.
+ * @param io The I/O backend option value.
+ * @param throughput The delivered messages per second.
+ * @return 0 if every message was delivered, -1 otherwise.
+ */
+static int bench_run(const char* binary, const char* io, double* throughput)
+{
+    bench_server server;
+    if (bench_server_start(&server, binary, io))
+    {
+        fprintf(stderr, "io: the server did not start with --io=%s\n", io);
+        return -1;
+    }
+
+    static bench_client clients[BENCH_CLIENTS];
+    pthread_t threads[BENCH_CLIENTS];
+    int result = 0;
+    memset(clients, 0, sizeof(clients));
+    for (int i = 0; i < BENCH_CLIENTS; ++i)
+    {
+        clients[i].id = i;
+        clients[i].sock = -1;
+        if (bench_register(&clients[i]))
+        {
+            fprintf(stderr, "io: client %d failed to register with --io=%s\n", i, io);
+            result = -1;
+            break;
+        }
+    }
+
+    long received = 0;
+    if (!result)
+    {
+        pthread_barrier_init(&bench_barrier, NULL, BENCH_CLIENTS + 1);
+        for (int i = 0; i < BENCH_CLIENTS; ++i)
+            pthread_create(&threads[i], NULL, bench_client_run, &clients[i]);
+        pthread_barrier_wait(&bench_barrier);
+        double start = bench_now();
+        pthread_barrier_wait(&bench_barrier);
+        double elapsed = bench_now() - start;
+        for (int i = 0; i < BENCH_CLIENTS; ++i)
+        {
+            pthread_join(threads[i], NULL);
+            received += clients[i].received;
+            result |= clients[i].failed ? -1 : 0;
+        }
+        pthread_barrier_destroy(&bench_barrier);
+        *throughput = (double)received / elapsed;
+        if (result)
+            fprintf(stderr, "io: %ld of %d messages delivered with --io=%s\n", received, BENCH_CLIENTS * BENCH_ROUNDS * BENCH_WINDOW, io);
+    }
+
+    for (int i = 0; i < BENCH_CLIENTS; ++i)
+        bench_client_close(&clients[i]);
+    int fallback = 0;
+    bench_server_stop(&server, &fallback, 0);
+    if (fallback)
+        printf("io: the kernel refused io_uring, --io=%s ran on epoll\n", io);
+    return result;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc != 2)
+    {
+        fprintf(stderr, "Usage: %s <server binary>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    // the server runs in a directory of its own
+    char* binary = realpath(argv[1], NULL);
+    if (!binary)
+    {
+        fprintf(stderr, "io: server binary %s not found\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    setbuf(stdout, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    bench_ctx = SSL_CTX_new(TLS_client_method());
+    if (!bench_ctx)
+    {
+        free(binary);
+        return EXIT_FAILURE;
+    }
+    SSL_CTX_set_verify(bench_ctx, SSL_VERIFY_NONE, NULL);
+
+    // the same load against both backends of the same server binary
+    const char* backends[] = { "epoll", "uring" };
+    double throughput[2] = { 0, 0 };
+    printf("io: %d clients, each sending %d rounds of %d messages to itself over TLS\n", BENCH_CLIENTS, BENCH_ROUNDS, BENCH_WINDOW);
+    for (int i = 0; i < 2; ++i)
+    {
+        if (bench_run(binary, backends[i], &throughput[i]))
+        {
+            SSL_CTX_free(bench_ctx);
+            free(binary);
+            return EXIT_FAILURE;
+        }
+        printf("io: --io=%-5s %8.0f msg/s\n", backends[i], throughput[i]);
+    }
+    printf("io: io_uring delivers %.2fx the messages of epoll\n", throughput[1] / throughput[0]);
+    SSL_CTX_free(bench_ctx);
+    free(binary);
+    return EXIT_SUCCESS;
+}
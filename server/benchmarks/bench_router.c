@@ -0,0 +1,168 @@
+#define _GNU_SOURCE // clock_gettime, mkdtemp and sched_yield
+
+#include "server_router.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+
+#define BENCH_MESSAGES 65536
+#define BENCH_RECIPIENTS 256 // enough recipients to spread the messages over every shard
+#define BENCH_PAYLOAD "a chat line of about thirty two"
+
+static uint64_t* bench_submitted;
+static uint64_t* bench_latencies;
+static atomic_size_t bench_delivered;
+static atomic_int bench_failed;
+
+static uint64_t bench_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// the delivery reads the message in place as the server does, its sequence number leads the payload
+static void bench_route(message_buffer* msg)
+{
+    uint64_t now = bench_now();
+    message_view view;
+    if (parse_message_view(&view, MESSAGE_PROTOCOL_BINARY, msg->data, msg->length) != MESSAGE_PARSING_SUCCESS)
+    {
+        atomic_store(&bench_failed, 1);
+        atomic_fetch_add_explicit(&bench_delivered, 1, memory_order_release);
+        return;
+    }
+    size_t seq = 0;
+    for (uint32_t i = 0; i < view.payload.length && view.payload.data[i] >= '0' && view.payload.data[i] <= '9'; ++i)
+        seq = seq * 10 + (size_t)(view.payload.data[i] - '0');
+    if (seq < BENCH_MESSAGES)
+        bench_latencies[seq] = now - bench_submitted[seq];
+    else
+        atomic_store(&bench_failed, 1);
+    atomic_fetch_add_explicit(&bench_delivered, 1, memory_order_release);
+}
+
+static int bench_compare(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Run a latency round. This function is used to submit the messages while keeping the given number of them in flight, and to time each one from its enqueue to its delivery.
+ * A single message in flight gives the latency of an idle router, larger windows add the time a message waits behind the ones before it.
+ *
+ * @param pool The router pool.
+ * @param msgs The messages, their payloads numbered by sequence.
+ * @param window The number of messages in flight.
+ * @return 0 if every message was delivered, -1 otherwise.
+ */
+static int bench_round(router_pool* pool, message* msgs, size_t window)
+{
+    atomic_store(&bench_delivered, 0);
+    uint64_t start = bench_now();
+    for (size_t i = 0; i < BENCH_MESSAGES; ++i)
+    {
+        while (i - atomic_load_explicit(&bench_delivered, memory_order_acquire) >= window)
+            sched_yield();
+        message_buffer* buffer = message_buffer_create(&msgs[i]);
+        if (!buffer)
+        {
+            fprintf(stderr, "router: message buffer allocation failed\n");
+            return -1;
+        }
+        bench_submitted[i] = bench_now();
+        router_submit(pool, buffer);
+    }
+    while (atomic_load_explicit(&bench_delivered, memory_order_acquire) < BENCH_MESSAGES)
+        sched_yield();
+    double elapsed = (double)(bench_now() - start) / 1e9;
+    if (atomic_load(&bench_failed))
+    {
+        fprintf(stderr, "router: a message was delivered without its sequence number\n");
+        return -1;
+    }
+
+    qsort(bench_latencies, BENCH_MESSAGES, sizeof(uint64_t), bench_compare);
+    printf("router: %3zu in flight %8.0f msg/s, enqueue to delivery p50 %7.1f us, p99 %7.1f us\n", window, BENCH_MESSAGES / elapsed,
+        (double)bench_latencies[BENCH_MESSAGES / 2] / 1e3, (double)bench_latencies[BENCH_MESSAGES * 99 / 100] / 1e3);
+    return 0;
+}
+
+int main()
+{
+    bench_submitted = (uint64_t*)calloc(BENCH_MESSAGES, sizeof(uint64_t));
+    bench_latencies = (uint64_t*)calloc(BENCH_MESSAGES, sizeof(uint64_t));
+    message* msgs = (message*)calloc(BENCH_MESSAGES, sizeof(message));
+    if (!bench_submitted || !bench_latencies || !msgs)
+    {
+        fprintf(stderr, "Message allocation failed\n");
+        return EXIT_FAILURE;
+    }
+
+    char sender[HASH_HEX_OUTPUT_LENGTH];
+    char recipients[BENCH_RECIPIENTS][HASH_HEX_OUTPUT_LENGTH];
+    get_hash((const unsigned char*)"sender", sender);
+    for (int i = 0; i < BENCH_RECIPIENTS; ++i)
+    {
+        char name[MAX_USERNAME_LENGTH + 1];
+        snprintf(name, sizeof(name), "recipient%d", i);
+        get_hash((const unsigned char*)name, recipients[i]);
+    }
+    for (size_t i = 0; i < BENCH_MESSAGES; ++i)
+    {
+        char payload[MAX_PAYLOAD_SIZE];
+        snprintf(payload, sizeof(payload), "%08zu %s", i, BENCH_PAYLOAD);
+        if (create_message(&msgs[i], MESSAGE_TEXT, sender, recipients[i % BENCH_RECIPIENTS], payload) != MESSAGE_CREATION_SUCCESS)
+        {
+            fprintf(stderr, "Message creation failed\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    // the routers log, so they run in a directory of their own
+    char directory[] = "/tmp/bench_router.XXXXXX";
+    if (!mkdtemp(directory) || chdir(directory))
+    {
+        perror("Benchmark directory creation failed");
+        return EXIT_FAILURE;
+    }
+    init_logging(SERVER_LOG);
+
+    router_pool pool;
+    int result = EXIT_SUCCESS;
+    if (router_pool_start(&pool, ROUTER_COUNT, bench_route) != ROUTER_SUCCESS)
+    {
+        fprintf(stderr, "Router pool start failed\n");
+        result = EXIT_FAILURE;
+    }
+    else
+    {
+        printf("router: %d messages through %d routers to %d recipients\n", BENCH_MESSAGES, ROUTER_COUNT, BENCH_RECIPIENTS);
+        size_t windows[] = { 1, 16, 256 };
+        for (size_t i = 0; i < sizeof(windows) / sizeof(windows[0]) && result == EXIT_SUCCESS; ++i)
+            if (bench_round(&pool, msgs, windows[i]))
+                result = EXIT_FAILURE;
+        router_pool_stop(&pool);
+    }
+
+    finish_logging();
+    char path[sizeof(directory) + sizeof(LOGS_DIR) + sizeof(SERVER_LOG) + 2];
+    snprintf(path, sizeof(path), "%s/%s/%s", directory, LOGS_DIR, SERVER_LOG);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/%s", directory, LOGS_DIR);
+    rmdir(path);
+    rmdir(directory);
+    free(msgs);
+    free(bench_latencies);
+    free(bench_submitted);
+    return result;
+}
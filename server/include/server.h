@@ -10,9 +10,14 @@
 #include "protocol.h"
 #include "sts_queue.h"
 #include "hash_map.h"
+#include "server_config.h"
+#include "server_handshake.h"
+#include "server_router.h"
+#include "server_presence.h"
+#include "server_auth.h"
 
-#define MAX_CLIENTS 100
-#define MAX_THREADS 100 // overrides max clients
+#define MAX_CLIENTS 10000
+#define MAX_THREADS 100 // service threads, clients are served by reactors
 
 #define DB_NAME "sqlite.db"
 #define DB_PATH_LENGTH 256
@@ -21,6 +26,12 @@
 
 #define PORT_BIND_INTERVAL 1
 #define PORT_BIND_ATTEMPTS 120
+#define LISTEN_BACKLOG 1024 // pending connections per listening socket, capped by net.core.somaxconn
+
+#define CLIENT_AUTH_TIMEOUT 60000 // in milliseconds, time a client has to log in or register
+#define CLIENT_PING_INTERVAL 15000 // in milliseconds, time between an ACK and the next PING
+#define CLIENT_ACK_TIMEOUT 15000 // in milliseconds, time a client has to answer a PING
+#define CLIENT_KICK_DELAY 5000 // in milliseconds, time an unresponsive client is given to leave after the quit signal
 
 #define DATABASE_CONNECTION_INTERVAL 5 
 #define DATABASE_CONNECTION_ATTEMPTS 10 
@@ -59,10 +70,14 @@
 #define USER_AUTHENTICATION_USER_AUTHENTICATION_FAILURE 1417
 #define USER_AUTHENTICATION_MEMORY_ALLOCATION_FAILURE 1418
 #define USER_AUTHENTICATION_LAST_LOGIN_UPDATE_FAILURE 1419
+#define USER_AUTHENTICATION_IN_PROGRESS 1420
 
 // Other
 # define SINGLE_CORE_SYSTEM 1500
 
+struct connection;
+struct reactor;
+
 /**
  * The server structure. This structure is used to store information about the server.
  *
@@ -70,14 +85,20 @@
  * @param addr The server address.
  * @param requests_handled The number of requests handled.
  * @param client_logins_handled The number of client logins handled.
- * @param thread_count The number of all allocated threads.
+ * @param thread_count The number of allocated service threads.
  * @param thread_count_mutex The mutex to lock the thread count.
- * @param threads The array of threads.
- * @param message_queue The message queue.
+ * @param threads The array of service threads.
  * @param client_map The client hash map.
  * @param ssl_ctx The SSL context.
  * @param ssl The SSL object.
  * @param start_time The server start time.
+ * @param reactors The array of reactors serving client connections.
+ * @param reactor_count The number of reactors.
+ * @param config The server configuration.
+ * @param handshakes The handshake pool performing TLS handshakes of accepted connections.
+ * @param routers The router shards delivering queued messages.
+ * @param presence The roster of online users sent to clients.
+ * @param auths The auth pool running the database stages of authentication.
  */
 struct server
 {
@@ -87,28 +108,56 @@ struct server
     int client_logins_handled;
     int thread_count;
     pthread_mutex_t thread_count_mutex;
-    pthread_t threads[MAX_CLIENTS];
-    sts_header* message_queue;
+    pthread_t threads[MAX_THREADS];
     hash_map* client_map;
     SSL_CTX* ssl_ctx;
     SSL* ssl;
     time_t start_time;
+    struct reactor* reactors;
+    int reactor_count;
+    server_config config;
+    handshake_pool handshakes;
+    router_pool routers;
+    presence presence;
+    auth_pool auths;
 };
 
 /**
- * Print client. This function is used to print a client connection.
+ * The client timer enumeration. This enumeration is used to define which liveness deadline the timer of a connection was scheduled for.
  *
- * @param cl The client connection pointer.
+ * @param CLIENT_TIMER_AUTH The client has to complete authentication
+ * @param CLIENT_TIMER_PING The client is sent a PING
+ * @param CLIENT_TIMER_ACK The client has to answer the PING with an ACK
+ * @param CLIENT_TIMER_KICK The client was signalled to quit and is disconnected
  */
-void print_client(client_connection* cl);
+typedef enum
+{
+    CLIENT_TIMER_AUTH,
+    CLIENT_TIMER_PING,
+    CLIENT_TIMER_ACK,
+    CLIENT_TIMER_KICK
+} client_timer;
 
 /**
- * Send ping message. This function is used to send a ping message to a client.
- * The function is meant to be used with the hash map.
+ * The fan-out structure. This structure is used to store a server message serialized once and queued on many client connections, such as a broadcast.
+ *
+ * @param buffer The message buffer serialized without a recipient UID, every client queues a reference to it.
+ * @param exclude The client connection left out, NULL to reach every ready client.
+ * @param count The number of clients the message was queued on.
+ */
+typedef struct fanout
+{
+    message_buffer* buffer;
+    client_connection* exclude;
+    int count;
+} fanout;
+
+/**
+ * Print client. This function is used to print a client connection.
  *
  * @param cl The client connection pointer.
  */
-void send_ping(client_connection* cl);
+void print_client(client_connection* cl);
 
 /**
  * Send quit signal. This function is used to send a quit signal to a client.
@@ -119,30 +168,75 @@ void send_ping(client_connection* cl);
 void send_quit_signal(client_connection* cl);
 
 /**
- * Send broadcast message. This function is used to send a broadcast message to a client.
- * The function is meant to be used with the hash map.
+ * Prepare fan-out. This function is used to create and serialize a server message once for all of its recipients.
+ * The fan-out holds a reference to the message buffer until it is finished.
+ *
+ * @param fan The fan-out to fill.
+ * @param type The message type.
+ * @param payload The message payload.
+ * @param exclude The client connection left out, NULL to reach every ready client.
+ * @return 0 on success, -1 on failure.
+ */
+int prepare_fanout(fanout* fan, message_type type, const char* payload, client_connection* exclude);
+
+/**
+ * Finish fan-out. This function is used to drop the reference of the fan-out to its message buffer once it was sent to all recipients.
+ *
+ * @param fan The fan-out.
+ */
+void finish_fanout(fanout* fan);
+
+/**
+ * Send broadcast message. This function is used to queue a prepared fan-out message on a ready client, unless it is the excluded one.
+ * The function is meant to be used with the hash map, broadcasts and join messages share the serialized message across all clients.
  *
  * @param cl The client connection pointer.
- * @param arg The message to send.
+ * @param arg The fan-out pointer.
  */
 void send_broadcast(client_connection* cl, void* arg);
 
 /**
- * Send join message. This function is used to send a join message to a client, as long as it is not the new client.
- * The function is meant to be used with the hash map.
+ * Client open handler. This function is used to start the authentication of a connection registered with a reactor.
  *
- * @param cl The client connection pointer.
- * @param arg The new client connection pointer.
+ * @param conn The connection.
  */
-void send_join_message(client_connection* cl, void* arg);
+void handle_client_open(struct connection* conn);
 
 /**
- * Client handler. This function is used to handle a request, create and connect user to the server.
- * The function is meant to be run in a separate thread.
+ * Client handler. This function is used to handle a message received from a connection, authenticate and connect user to the server.
+ * The function is meant to be called by the reactor owning the connection, the view is only valid during the call.
+ *
+ * @param conn The connection.
+ * @param view The received message.
+ * @return 0 if the connection should stay open, -1 otherwise.
+ */
+int handle_client(struct connection* conn, const message_view* view);
+
+/**
+ * Client auth completion handler. This function is used to answer a connection once an auth worker finished the database stage of its authentication.
+ * The function is meant to be called by the reactor owning the connection.
+ *
+ * @param conn The connection.
+ * @return 0 if the connection should stay open, -1 otherwise.
+ */
+int handle_client_auth_done(struct connection* conn);
+
+/**
+ * Client timer handler. This function is used to act on a liveness deadline of a connection: it sends a PING when one is due,
+ * signals a client that did not answer to quit and closes connections that failed to authenticate or to leave in time.
+ * The function is meant to be called by the reactor owning the connection when its timer fires.
+ *
+ * @param conn The connection.
+ * @return 0 if the connection should stay open, -1 otherwise.
+ */
+int handle_client_timer(struct connection* conn);
+
+/**
+ * Client close handler. This function is used to disconnect user from the server before its connection is released.
  *
- * @param arg The request structure.
+ * @param conn The connection.
  */
-void* handle_client(void* arg);
+void handle_client_close(struct connection* conn);
 
 /**
  * Command line interface handler. This function is used to handle the server command line interface.
@@ -153,12 +247,12 @@ void* handle_client(void* arg);
 void* handle_cli(void* arg);
 
 /**
- * Message queue handler. This function is used to handle the message queue.
+ * Presence update handler. This function is used to broadcast the roster changes collected during every presence tick.
  * The function is meant to be run in a separate thread.
  *
  * @param arg Not used.
  */
-void* handle_msg_queue(void* arg);
+void* handle_presence_update(void* arg);
 
 /**
  * Information update handler. This function is used to update the server information and log it.
@@ -169,7 +263,7 @@ void* handle_msg_queue(void* arg);
 void* handle_info_update(void* arg);
 
 /**
- * Add client connection. This function is accepting new client connections and handle them in separate threads.
+ * Add client connection. This function is accepting new client connections and hands them off to the reactors.
  * The function is meant to be run in a separate thread.
  *
  * @param arg Not used.
@@ -179,8 +273,9 @@ void* handle_connection_add(void* arg);
 /**
  * Runs the server. This function is meant to be called by the main function of the server program.
  *
+ * @param config The server configuration.
  * @return The exit code of the server.
  */
-int run_server();
+int run_server(const server_config* config);
 
 #endif
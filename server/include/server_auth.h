@@ -1,16 +1,170 @@
 #ifndef __SERVER_AUTH_H
 #define __SERVER_AUTH_H
 
-#include "server.h"
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sqlite3.h>
+
+#include "protocol.h"
 #include "hash_map.h"
 
+#define AUTH_WORKER_COUNT 2
+#define AUTH_BUSY_TIMEOUT 5000 // in milliseconds, how long a query waits for a database locked by another worker
+
+// The auth pool result codes.
+#define AUTH_POOL_SUCCESS 5500
+#define AUTH_POOL_THREAD_FAILURE 5501
+#define AUTH_POOL_STOPPED 5502
+
+struct connection;
+struct reactor;
+
+/**
+ * The authentication stage enumeration. This enumeration is used to define which reply the server awaits from an unauthenticated client.
+ *
+ * @param AUTH_STAGE_USERNAME Awaiting username
+ * @param AUTH_STAGE_REGISTER_CHOICE Awaiting registration choice (y/n)
+ * @param AUTH_STAGE_REGISTER_PASSWORD Awaiting password of the user being registered
+ * @param AUTH_STAGE_REGISTER_PASSWORD_CONFIRMATION Awaiting password confirmation of the user being registered
+ * @param AUTH_STAGE_LOGIN_PASSWORD Awaiting password of the existing user
+ */
+typedef enum
+{
+    AUTH_STAGE_USERNAME,
+    AUTH_STAGE_REGISTER_CHOICE,
+    AUTH_STAGE_REGISTER_PASSWORD,
+    AUTH_STAGE_REGISTER_PASSWORD_CONFIRMATION,
+    AUTH_STAGE_LOGIN_PASSWORD
+} auth_stage;
+
+/**
+ * The authentication job structure. This structure is used to pass a database stage of the authentication to an auth worker and its outcome back to the reactor.
+ *
+ * @param conn The connection being authenticated.
+ * @param target The reactor the outcome is handed back to.
+ * @param stage The stage run by the worker, the username lookup, registration or login.
+ * @param username The username to look up, register or log in.
+ * @param password The password to register or check, cleared by the worker.
+ * @param uid The UID of the registered or logged in user.
+ * @param result The user authentication result code of the stage.
+ * @param next The next job of the pool queue or the reactor completion list.
+ */
+typedef struct auth_job
+{
+    struct connection* conn;
+    struct reactor* target;
+    auth_stage stage;
+    char username[MAX_USERNAME_LENGTH + 1];
+    char password[MAX_PASSWORD_LENGTH];
+    char uid[HASH_HEX_OUTPUT_LENGTH];
+    int result;
+    struct auth_job* next;
+} auth_job;
+
+/**
+ * The authentication state structure. This structure is used to store the progress of a request authentication between received messages.
+ *
+ * @param stage The current authentication stage.
+ * @param attempts The number of used authentication attempts.
+ * @param username The username given by the client.
+ * @param password The password given by the client during registration.
+ * @param busy The job status, set while an auth worker runs the job of the connection.
+ * @param job The job of the connection, a connection waits for one database stage at a time.
+ */
+typedef struct auth_state
+{
+    auth_stage stage;
+    int attempts;
+    char username[MAX_USERNAME_LENGTH + 1];
+    char password[MAX_PASSWORD_LENGTH];
+    int busy;
+    auth_job job;
+} auth_state;
+
+struct auth_pool;
+
+/**
+ * The auth worker structure. This structure is used to store a thread running authentication jobs on its own database connection.
+ *
+ * @param id The worker ID.
+ * @param thread The worker thread.
+ * @param db The database connection of the worker, opened once and reused by every job.
+ * @param pool The pool the worker belongs to.
+ */
+typedef struct auth_worker
+{
+    int id;
+    pthread_t thread;
+    sqlite3* db;
+    struct auth_pool* pool;
+} auth_worker;
+
 /**
- * Authenticates a request. This function is used to authenticate a user request. Returns the authentication result code.
+ * The auth pool structure. This structure is used to store the workers running the database queries and password hashing of authentication off the reactor threads.
  *
- * @param req The request to authenticate.
- * @param uid The obtained unique ID of the client.
+ * @param workers The array of workers.
+ * @param worker_count The number of workers.
+ * @param mutex The mutex to lock the job queue.
+ * @param cond The condition the workers wait on for jobs.
+ * @param head The oldest queued job.
+ * @param tail The newest queued job.
+ * @param stop The pool stop request.
+ * @param completed The number of completed jobs.
+ */
+typedef struct auth_pool
+{
+    auth_worker* workers;
+    int worker_count;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    auth_job* head;
+    auth_job* tail;
+    int stop;
+    atomic_ullong completed;
+} auth_pool;
+
+/**
+ * Start auth pool. This function is used to create the workers of the pool, every worker opens its own database connection.
+ *
+ * @param pool The auth pool.
+ * @param worker_count The number of workers.
+ * @return The auth pool result code.
+ */
+int auth_pool_start(auth_pool* pool, int worker_count);
+
+/**
+ * Stop auth pool. This function is used to stop the workers once they finished their jobs, jobs still queued are handed back to their reactors as failed.
+ *
+ * @param pool The auth pool.
+ */
+void auth_pool_stop(auth_pool* pool);
+
+/**
+ * Begins request authentication. This function is used to reset the authentication state and send the welcome and username prompts to the client.
+ *
+ * @param conn The connection to authenticate.
+ */
+void user_auth_begin(struct connection* conn);
+
+/**
+ * Authenticates a request. This function is used to advance the authentication of a user request with the received message. Returns the authentication result code.
+ * USER_AUTHENTICATION_IN_PROGRESS is returned while the server awaits another reply from the client or while an auth worker runs the database stage,
+ * whose outcome the reactor passes to user_auth_complete.
+ *
+ * @param conn The connection to authenticate, its client connection obtains username and UID on success.
+ * @param msg The message received from the client.
  * @param user_map The user hash map.
+ * @param pool The auth pool running the database stages.
+ */
+int user_auth(struct connection* conn, message* msg, hash_map* user_map, auth_pool* pool);
+
+/**
+ * Completes an authentication stage. This function is used on the reactor thread to answer the client once an auth worker finished the job of the connection.
+ * Returns the authentication result code like user_auth.
+ *
+ * @param conn The connection whose job finished, its client connection obtains username and UID on success.
+ * @return The authentication result code.
  */
-int user_auth(request* req, client_connection* cl, hash_map* user_map);
+int user_auth_complete(struct connection* conn);
 
 #endif
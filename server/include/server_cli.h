@@ -9,6 +9,7 @@
 #define SRV_BUFSIZE 64
 #define SRV_DELIM " "
 #define MAX_LINE_LENGTH 256
+#define BUCKET_HISTOGRAM_SIZE 8 // probe lengths printed by !buckets, the last line counts all longer probes
 
 #define SRV_COMMANDS_NUM (int) (sizeof(srv_commands) / sizeof(server_command))
 
@@ -58,6 +59,14 @@ int srv_clear(char** args);
  */
 extern int srv_list(char** args);
 
+/**
+ * Print probe lengths. This function is used to print how many users of the client map are found after probing each number of slot groups.
+ *
+ * @param args The arguments passed to the function should be empty.
+ * @return The exit code.
+ */
+extern int srv_buckets(char** args);
+
 /**
  * Ban user. This function is used to ban a specified user.
  *
@@ -0,0 +1,92 @@
+#ifndef __SERVER_CONFIG_H
+#define __SERVER_CONFIG_H
+
+#include "log.h"
+
+// The server configuration result codes.
+#define SERVER_CONFIG_SUCCESS 1600
+#define SERVER_CONFIG_INVALID_OPTION 1601
+#define SERVER_CONFIG_INVALID_VALUE 1602
+#define SERVER_CONFIG_HELP 1603
+
+#define SERVER_CONFIG_MAX_REACTORS 256
+#define SERVER_CONFIG_MAX_HANDSHAKE_WORKERS 64
+#define SERVER_CONFIG_MAX_HANDSHAKE_TIMEOUT 60000 // in milliseconds
+#define SERVER_CONFIG_MAX_BACKLOG 65535
+#define SERVER_CONFIG_MAX_ROUTERS 64
+#define SERVER_CONFIG_MAX_NODE_ID 65535
+#define SERVER_CONFIG_MAX_PRESENCE_TICK 1000 // in milliseconds
+#define SERVER_CONFIG_MAX_AUTH_WORKERS 64
+
+/**
+ * The server mode enumeration. This enumeration is used to define how client connections are accepted.
+ *
+ * @param SERVER_MODE_ACCEPT_THREAD Single listening socket, a dedicated thread accepts and hands connections off to the reactors
+ * @param SERVER_MODE_MULTI_REACTOR Every reactor owns a SO_REUSEPORT listening socket, accepts on its own and is pinned to a core
+ */
+typedef enum
+{
+    SERVER_MODE_ACCEPT_THREAD,
+    SERVER_MODE_MULTI_REACTOR
+} server_mode;
+
+/**
+ * The server I/O backend enumeration. This enumeration is used to define how reactors wait for socket events and move bytes.
+ *
+ * @param SERVER_IO_EPOLL Readiness events with epoll, TLS reads and writes directly on non-blocking sockets
+ * @param SERVER_IO_URING Completions with io_uring using multishot accept and receive, provided buffers and TLS through memory BIOs
+ */
+typedef enum
+{
+    SERVER_IO_EPOLL,
+    SERVER_IO_URING
+} server_io;
+
+/**
+ * The server configuration structure. This structure is used to store the server start arguments.
+ *
+ * @param mode The server mode.
+ * @param reactor_count The number of reactors, 0 selects the default of the mode.
+ * @param handshake_workers The number of TLS handshake workers.
+ * @param handshake_timeout The TLS handshake timeout in milliseconds.
+ * @param backlog The listen backlog of every listening socket.
+ * @param io The I/O backend of the reactors.
+ * @param router_count The number of router shards.
+ * @param node_id The node ID put in the message IDs, -1 picks a random one.
+ * @param presence_tick The interval of presence broadcasts in milliseconds.
+ * @param log_overflow What logging threads do while their log ring buffer is full.
+ * @param auth_workers The number of auth workers running the database stages of authentication.
+ */
+typedef struct server_config
+{
+    server_mode mode;
+    int reactor_count;
+    int handshake_workers;
+    int handshake_timeout;
+    int backlog;
+    server_io io;
+    int router_count;
+    int node_id;
+    int presence_tick;
+    log_overflow_t log_overflow;
+    int auth_workers;
+} server_config;
+
+/**
+ * Parse server configuration. This function is used to fill the server configuration with defaults and the given start arguments.
+ *
+ * @param config The server configuration.
+ * @param argc The number of arguments.
+ * @param argv The arguments.
+ * @return The server configuration result code.
+ */
+int parse_server_config(server_config* config, int argc, char** argv);
+
+/**
+ * Print server usage. This function is used to print the available start arguments.
+ *
+ * @param program The program name.
+ */
+void print_server_usage(const char* program);
+
+#endif
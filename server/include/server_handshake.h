@@ -0,0 +1,171 @@
+#ifndef __SERVER_HANDSHAKE_H
+#define __SERVER_HANDSHAKE_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <openssl/ssl.h>
+
+#define HANDSHAKE_WORKER_COUNT 2
+#define HANDSHAKE_MAX_IN_FLIGHT 1024 // handshakes accepted by the pool before new connections are rejected
+#define HANDSHAKE_TIMEOUT 5000 // in milliseconds
+#define HANDSHAKE_MAX_EVENTS 64
+#define HANDSHAKE_SWEEP_INTERVAL 100 // in milliseconds
+
+// The handshake result codes.
+#define HANDSHAKE_SUCCESS 5100
+#define HANDSHAKE_EPOLL_FAILURE 5101
+#define HANDSHAKE_EVENTFD_FAILURE 5102
+#define HANDSHAKE_THREAD_FAILURE 5103
+#define HANDSHAKE_POOL_FULL 5104
+#define HANDSHAKE_SSL_FAILURE 5105
+#define HANDSHAKE_TIMED_OUT 5106
+
+struct reactor;
+
+/**
+ * The handshake structure. This structure is used to store a TLS handshake in progress.
+ *
+ * @param sock The client socket.
+ * @param ssl The SSL object.
+ * @param addr The client address.
+ * @param target The reactor the connection is handed off to once the handshake completes.
+ * @param start The handshake start time in microseconds.
+ * @param prev The previous handshake of the worker, in start time order.
+ * @param next The next handshake of the worker, in start time order.
+ */
+typedef struct handshake
+{
+    int sock;
+    SSL* ssl;
+    struct sockaddr_in addr;
+    struct reactor* target;
+    uint64_t start;
+    struct handshake* prev;
+    struct handshake* next;
+} handshake;
+
+struct handshake_pool;
+
+/**
+ * The handshake worker structure. This structure is used to store a thread driving non-blocking handshakes of many connections with epoll.
+ *
+ * @param id The worker ID.
+ * @param thread The worker thread.
+ * @param epoll_fd The epoll instance.
+ * @param event_fd The eventfd used to wake the worker.
+ * @param pool The pool the worker belongs to.
+ * @param pending_mutex The mutex to lock the pending handshakes.
+ * @param pending The handshakes submitted to the worker and not yet registered.
+ * @param oldest The oldest handshake driven by the worker.
+ * @param newest The newest handshake driven by the worker.
+ */
+typedef struct handshake_worker
+{
+    int id;
+    pthread_t thread;
+    int epoll_fd;
+    int event_fd;
+    struct handshake_pool* pool;
+    pthread_mutex_t pending_mutex;
+    handshake* pending;
+    handshake* oldest;
+    handshake* newest;
+} handshake_worker;
+
+/**
+ * The handshake pool structure. This structure is used to store the bounded worker pool performing TLS handshakes before connections reach the reactors.
+ *
+ * @param ssl_ctx The SSL context of accepted connections.
+ * @param workers The array of workers.
+ * @param worker_count The number of workers.
+ * @param timeout The handshake timeout in milliseconds.
+ * @param stop The pool stop request.
+ * @param next_worker The worker receiving the next handshake.
+ * @param in_flight The number of handshakes in progress.
+ * @param completed The number of completed handshakes.
+ * @param failed The number of failed handshakes.
+ * @param timed_out The number of timed out handshakes.
+ * @param rejected The number of connections rejected because the pool was full.
+ * @param latency_total The total latency of completed handshakes in microseconds.
+ * @param latency_max The maximum latency of a completed handshake in microseconds.
+ */
+typedef struct handshake_pool
+{
+    SSL_CTX* ssl_ctx;
+    handshake_worker* workers;
+    int worker_count;
+    int timeout;
+    atomic_int stop;
+    atomic_uint next_worker;
+    atomic_int in_flight;
+    atomic_ullong completed;
+    atomic_ullong failed;
+    atomic_ullong timed_out;
+    atomic_ullong rejected;
+    atomic_ullong latency_total;
+    atomic_ullong latency_max;
+} handshake_pool;
+
+/**
+ * The handshake statistics structure. This structure is used to store a snapshot of the handshake pool metrics.
+ *
+ * @param in_flight The number of handshakes in progress.
+ * @param completed The number of completed handshakes.
+ * @param failed The number of failed handshakes, including timed out ones.
+ * @param timed_out The number of timed out handshakes.
+ * @param rejected The number of connections rejected because the pool was full.
+ * @param latency_avg The average latency of completed handshakes in milliseconds.
+ * @param latency_max The maximum latency of a completed handshake in milliseconds.
+ */
+typedef struct handshake_stats
+{
+    int in_flight;
+    unsigned long long completed;
+    unsigned long long failed;
+    unsigned long long timed_out;
+    unsigned long long rejected;
+    double latency_avg;
+    double latency_max;
+} handshake_stats;
+
+/**
+ * Start handshake pool. This function is used to create the workers of the pool.
+ *
+ * @param pool The handshake pool.
+ * @param ssl_ctx The SSL context of accepted connections.
+ * @param worker_count The number of workers.
+ * @param timeout The handshake timeout in milliseconds.
+ * @return The handshake result code.
+ */
+int handshake_pool_start(handshake_pool* pool, SSL_CTX* ssl_ctx, int worker_count, int timeout);
+
+/**
+ * Stop handshake pool. This function is used to stop the workers and close the connections still in the handshake.
+ *
+ * @param pool The handshake pool.
+ */
+void handshake_pool_stop(handshake_pool* pool);
+
+/**
+ * Submit handshake. This function is used to pass an accepted socket to the pool. It may be called from any thread and never blocks on the client.
+ * The socket is owned by the pool afterwards, it is closed if the handshake fails, times out or the pool is full.
+ *
+ * @param pool The handshake pool.
+ * @param sock The accepted non-blocking client socket.
+ * @param addr The client address.
+ * @param target The reactor the connection is handed off to once the handshake completes.
+ * @return The handshake result code.
+ */
+int handshake_submit(handshake_pool* pool, int sock, const struct sockaddr_in* addr, struct reactor* target);
+
+/**
+ * Get handshake statistics. This function is used to take a snapshot of the handshake pool metrics.
+ *
+ * @param pool The handshake pool.
+ * @param stats The statistics to fill.
+ */
+void handshake_pool_stats(handshake_pool* pool, handshake_stats* stats);
+
+#endif
@@ -0,0 +1,139 @@
+#ifndef __SERVER_PRESENCE_H
+#define __SERVER_PRESENCE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "protocol.h"
+#include "hash_map.h"
+
+#define PRESENCE_PAGE_USERS 100 // users per snapshot frame, their join lines and the snapshot line fit one payload
+#define PRESENCE_HISTORY 4096 // roster changes kept for deltas, clients holding an older version get a snapshot
+#define PRESENCE_INITIAL_CAPACITY 1024 // roster slots allocated up front
+#define PRESENCE_TICK 100 // in milliseconds, how long roster changes are collected before they are broadcast
+
+// The presence result codes.
+#define PRESENCE_SUCCESS 5400
+#define PRESENCE_ALLOCATION_FAILURE 5401
+#define PRESENCE_MESSAGE_FAILURE 5402
+
+struct connection;
+
+/**
+ * The presence change structure. This structure is used to remember a roster change, so clients holding an earlier version can be sent only what changed since.
+ *
+ * @param marker The presence line marker, MESSAGE_PRESENCE_JOIN or MESSAGE_PRESENCE_LEAVE.
+ * @param username The username of the user that joined or left.
+ */
+typedef struct presence_change
+{
+    char marker;
+    char username[MAX_USERNAME_LENGTH + 1];
+} presence_change;
+
+/**
+ * The presence structure. This structure is used to store the roster of online users with a version that grows by one on every join and leave.
+ * The roster is split into pages of PRESENCE_PAGE_USERS users, each page is serialized once into a fan-out frame and reused until one of its users changes.
+ * The first page is sent in the frame carrying the snapshot line, so a roster of up to PRESENCE_PAGE_USERS users is served in a single frame.
+ *
+ * @param version The version of the roster, it starts at the start time of the server in microseconds, so versions of an earlier run are never mistaken for current ones.
+ * @param mutex The mutex serializing roster access.
+ * @param users The connections of the online users, a leaving user's slot is taken by the last user.
+ * @param count The number of online users.
+ * @param capacity The number of roster slots.
+ * @param pages The serialized frames of the pages after the first, indexed by page, NULL when the page has to be serialized again.
+ * @param head The serialized frame of the snapshot line and the first page, NULL when it has to be serialized again.
+ * @param head_version The version the head frame was serialized for.
+ * @param history The latest roster changes, the change to version v is at v % PRESENCE_HISTORY.
+ * @param history_count The number of changes kept.
+ * @param broadcast_version The version the roster was last broadcast at, later changes wait for the next tick.
+ * @param broadcasts The number of ticks that broadcast roster changes.
+ * @param broadcast_changes The number of roster changes broadcast.
+ * @param broadcast_frames The number of frames queued on client connections by the broadcasts.
+ * @param messages_saved The number of messages the broadcasts saved compared to a message per change and client.
+ */
+typedef struct presence
+{
+    uint64_t version;
+    pthread_mutex_t mutex;
+    struct connection** users;
+    size_t count;
+    size_t capacity;
+    message_buffer** pages;
+    message_buffer* head;
+    uint64_t head_version;
+    presence_change history[PRESENCE_HISTORY];
+    size_t history_count;
+    uint64_t broadcast_version;
+    atomic_ullong broadcasts;
+    atomic_ullong broadcast_changes;
+    atomic_ullong broadcast_frames;
+    atomic_ullong messages_saved;
+} presence;
+
+/**
+ * Initialize presence. This function is used to create an empty roster.
+ *
+ * @param p The presence.
+ * @return The presence result code.
+ */
+int presence_init(presence* p);
+
+/**
+ * Destroy presence. This function is used to free the roster and release its serialized frames.
+ *
+ * @param p The presence.
+ */
+void presence_destroy(presence* p);
+
+/**
+ * Join presence. This function is used to list an authenticated client in the roster.
+ *
+ * @param p The presence.
+ * @param conn The connection of the client, its username is listed.
+ * @return The presence result code.
+ */
+int presence_join(presence* p, struct connection* conn);
+
+/**
+ * Leave presence. This function is used to remove a client from the roster, it does nothing if the client is not listed.
+ *
+ * @param p The presence.
+ * @param conn The connection of the client.
+ */
+void presence_leave(presence* p, struct connection* conn);
+
+/**
+ * Send presence. This function is used to queue the changes to the roster since the version a client holds on its connection.
+ * A client holding no version, a version older than the kept changes or a version of another run is sent a snapshot instead.
+ *
+ * @param p The presence.
+ * @param conn The connection of the client.
+ * @param since The roster version held by the client, 0 for none.
+ * @return The presence result code.
+ */
+int presence_send(presence* p, struct connection* conn, uint64_t since);
+
+/**
+ * Broadcast presence. This function is used to queue the roster changes since the previous broadcast on every ready client, it is called once per tick.
+ * The changes of a tick are serialized once into delta frames of up to PRESENCE_PAGE_USERS changes and every client queues references to the same frames,
+ * so a burst of joins and leaves costs a client one frame instead of a message per change. If more changes piled up than are kept, a snapshot is broadcast instead.
+ *
+ * @param p The presence.
+ * @param map The client hash map.
+ * @return The presence result code.
+ */
+int presence_broadcast(presence* p, hash_map* map);
+
+/**
+ * Get the roster version. This function is used to report the current version of the roster.
+ *
+ * @param p The presence.
+ * @param count The number of online users to store, may be NULL.
+ * @return The roster version.
+ */
+uint64_t presence_version(presence* p, size_t* count);
+
+#endif
@@ -0,0 +1,338 @@
+#ifndef __SERVER_REACTOR_H
+#define __SERVER_REACTOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <openssl/ssl.h>
+
+#include "protocol.h"
+#include "frame_decoder.h"
+#include "server_auth.h"
+#include "server_config.h"
+#include "server_uring.h"
+#include "timer_wheel.h"
+#include "mem_pool.h"
+#include "ebr.h"
+
+#define REACTOR_COUNT 4
+#define REACTOR_MAX_EVENTS 256
+#define REACTOR_READ_BUDGET 16 // TLS records read from one connection per wakeup
+#define REACTOR_WAIT_TIMEOUT 1000 // in milliseconds
+
+#define CONNECTION_OUTPUT_LIMIT (1024 * 1024) // pending outbound bytes before a client is considered stalled
+#define CONNECTION_COALESCE_SIZE 16384 // pending outbound bytes flushed without waiting, one full TLS record
+#define CONNECTION_FLUSH_DELAY 1 // in milliseconds, how long messages from other threads wait to be coalesced
+#define CONNECTION_RESERVED_FDS 256 // descriptors kept for listeners, reactors, handshake workers, databases and logs
+#define CONNECTION_REF_CAPACITY 16 // queued message buffer references a connection makes room for at first
+
+// The reactor result codes.
+#define REACTOR_SUCCESS 5000
+#define REACTOR_EPOLL_FAILURE 5001
+#define REACTOR_EVENTFD_FAILURE 5002
+#define REACTOR_THREAD_FAILURE 5003
+#define REACTOR_CONNECTION_FAILURE 5004
+#define REACTOR_LISTENER_FAILURE 5005
+
+struct reactor;
+struct handshake_pool;
+
+/**
+ * The listener structure. This structure is used to store a non-blocking listening socket watched by an epoll instance.
+ * Accepting is paused by dropping the epoll interest while the server is full and resumed once a connection is released.
+ *
+ * @param fd The listening socket, -1 if not used.
+ * @param epoll_fd The epoll instance watching the socket, -1 if the socket is accepted through io_uring.
+ * @param wake_fd The eventfd of the reactor accepting through io_uring, woken to resume the listener.
+ * @param paused The admission control status.
+ * @param next_paused The next paused listener.
+ */
+typedef struct listener
+{
+    int fd;
+    int epoll_fd;
+    int wake_fd;
+    atomic_int paused;
+    struct listener* next_paused;
+} listener;
+
+/**
+ * The server connection structure. This structure is used to store the state of a single non-blocking client connection owned by a reactor.
+ * The client connection is the first member, so the pointer stored in the client hash map can be cast back to the connection.
+ *
+ * @param cl The client connection.
+ * @param req The client request.
+ * @param owner The reactor owning the connection.
+ * @param protocol The message protocol negotiated during the TLS handshake.
+ * @param decoder The decoder cutting the received bytes into messages.
+ * @param auth The authentication state.
+ * @param presence_slot The slot of the client in the presence roster, -1 while it is not listed.
+ * @param ssl_mutex The mutex serializing SSL object and output buffer access.
+ * @param out_buf The pending outbound bytes.
+ * @param out_start The offset of the first unsent byte.
+ * @param out_len The number of unsent bytes.
+ * @param out_cap The output buffer capacity.
+ * @param out_refs The message buffers queued behind the pending outbound bytes, copied into the output buffer when the connection is flushed.
+ * @param out_ref_count The number of queued message buffers.
+ * @param out_ref_cap The queued message buffers capacity.
+ * @param out_ref_bytes The number of bytes the queued message buffers take on the wire.
+ * @param out_armed The EPOLLOUT interest status.
+ * @param tx_buf The TLS records taken from the memory BIO and sent through io_uring.
+ * @param tx_start The offset of the first unsent record byte.
+ * @param tx_len The number of unsent record bytes.
+ * @param tx_cap The record buffer capacity.
+ * @param recv_armed The multishot receive status.
+ * @param send_inflight The io_uring send status.
+ * @param closing The release status, set while io_uring requests of a released connection are still in flight.
+ * @param released The release status, set under the SSL mutex once the reactor let go of the connection, so senders that found it in the client map stop queueing.
+ * @param retire The node reclaiming the connection once no client map reader can hold it anymore.
+ * @param flush_queued The flush list membership status.
+ * @param flush_next The next connection of the reactor flush list.
+ * @param timer The liveness timer, scheduled on the wheel of the owning reactor.
+ * @param timer_state The client state the timer was scheduled for, interpreted by the client timer handler.
+ * @param prev The previous connection of the reactor.
+ * @param next The next connection of the reactor.
+ */
+typedef struct connection
+{
+    client_connection cl;
+    request req;
+    struct reactor* owner;
+    message_protocol protocol;
+    frame_decoder decoder;
+    auth_state auth;
+    int presence_slot;
+    pthread_mutex_t ssl_mutex;
+    char* out_buf;
+    size_t out_start;
+    size_t out_len;
+    size_t out_cap;
+    message_buffer** out_refs;
+    size_t out_ref_count;
+    size_t out_ref_cap;
+    size_t out_ref_bytes;
+    int out_armed;
+    char* tx_buf;
+    size_t tx_start;
+    size_t tx_len;
+    size_t tx_cap;
+    int recv_armed;
+    int send_inflight;
+    int closing;
+    int released;
+    ebr_node retire;
+    atomic_int flush_queued;
+    struct connection* flush_next;
+    timer timer;
+    int timer_state;
+    struct connection* prev;
+    struct connection* next;
+} connection;
+
+/**
+ * The reactor structure. This structure is used to store an epoll event loop serving a set of connections from a single thread.
+ *
+ * @param id The reactor ID.
+ * @param thread The reactor thread.
+ * @param io The I/O backend.
+ * @param epoll_fd The epoll instance, -1 with io_uring.
+ * @param ring The io_uring instance.
+ * @param wake_value The eventfd counter read through io_uring.
+ * @param accept_armed The multishot accept status.
+ * @param event_fd The eventfd used to wake the reactor.
+ * @param listener The SO_REUSEPORT listener accepted by the reactor, its socket is -1 if connections are handed off.
+ * @param cpu The core the reactor thread is pinned to, -1 if not pinned.
+ * @param handshakes The handshake pool performing TLS handshakes of connections accepted by the reactor.
+ * @param stop The reactor stop request.
+ * @param pending_mutex The mutex to lock the pending connections.
+ * @param pending The connections handed off to the reactor and not yet registered.
+ * @param auth_done The authentication jobs finished by the auth workers and not yet answered.
+ * @param connections The connections registered with the reactor.
+ * @param closing The released connections waiting for their io_uring requests or authentication jobs to complete.
+ * @param flush_mutex The mutex to lock the flush list and its deadline.
+ * @param flush_list The connections with queued messages waiting to be written.
+ * @param flush_deadline The monotonic time in milliseconds the flush list is due at.
+ * @param timers The timer wheel of the connection timers, ticking in monotonic milliseconds.
+ * @param connection_count The number of connections owned by the reactor.
+ * @param sent_messages The number of messages queued on the connections of the reactor.
+ * @param sent_flushes The number of writes of coalesced messages.
+ */
+typedef struct reactor
+{
+    int id;
+    pthread_t thread;
+    server_io io;
+    int epoll_fd;
+    uring ring;
+    uint64_t wake_value;
+    int accept_armed;
+    int event_fd;
+    listener listener;
+    int cpu;
+    struct handshake_pool* handshakes;
+    atomic_int stop;
+    pthread_mutex_t pending_mutex;
+    connection* pending;
+    auth_job* auth_done;
+    connection* connections;
+    connection* closing;
+    pthread_mutex_t flush_mutex;
+    connection* flush_list;
+    uint64_t flush_deadline;
+    timer_wheel timers;
+    atomic_size_t connection_count;
+    atomic_ullong sent_messages;
+    atomic_ullong sent_flushes;
+} reactor;
+
+/**
+ * Start reactor. This function is used to create the event loop and run the reactor in a separate thread.
+ * If io_uring is requested but cannot be set up, the reactor falls back to epoll.
+ *
+ * @param r The reactor.
+ * @param io The I/O backend.
+ * @param id The reactor ID.
+ * @param handshakes The handshake pool performing TLS handshakes of connections accepted by the reactor.
+ * @param listen_fd The listening socket to accept on, -1 if the reactor only serves handed off connections.
+ * @param cpu The core to pin the reactor thread to, -1 to leave scheduling to the kernel.
+ * @return The reactor result code.
+ */
+int reactor_start(reactor* r, server_io io, int id, struct handshake_pool* handshakes, int listen_fd, int cpu);
+
+/**
+ * Stop reactor. This function is used to stop the reactor thread and close all of its connections.
+ *
+ * @param r The reactor.
+ */
+void reactor_stop(reactor* r);
+
+/**
+ * Add connection. This function is used to hand off an accepted TLS connection to the reactor. It may be called from any thread.
+ *
+ * @param r The reactor.
+ * @param sock The client socket.
+ * @param ssl The SSL object with a completed handshake.
+ * The connection keeps the admission slot taken when it was accepted.
+ * @param addr The client address.
+ * @return The reactor result code.
+ */
+int reactor_add_connection(reactor* r, int sock, SSL* ssl, const struct sockaddr_in* addr);
+
+/**
+ * Complete auth job. This function is used to hand a finished authentication job back to the reactor owning its connection. It may be called from any thread.
+ * The reactor answers the client from its own thread, a connection released while its job was running is freed once the job is back.
+ *
+ * @param r The reactor.
+ * @param job The finished job.
+ */
+void reactor_complete_auth(reactor* r, auth_job* job);
+
+/**
+ * Get connection total. This function is used to get the number of admitted connections, including those still in the TLS handshake.
+ *
+ * @return The number of connections.
+ */
+size_t reactor_connection_total();
+
+/**
+ * Get connection pool statistics. This function is used to read the usage of the pool the connection records are allocated from.
+ *
+ * @param stats The statistics to fill.
+ */
+void reactor_connection_stats(mem_pool_stats* stats);
+
+/**
+ * Limit connections. This function is used to fit the admission limit into the descriptor limit of the process, raising the soft limit as far as the hard limit allows.
+ * Every connection takes a descriptor and CONNECTION_RESERVED_FDS are kept for the rest of the server, so listeners pause at the limit instead of failing with EMFILE.
+ *
+ * @param max_connections The number of connections wanted.
+ * @return The admission limit.
+ */
+size_t reactor_limit_connections(size_t max_connections);
+
+/**
+ * Release connection. This function is used to return the admission slot of an accepted connection, resuming paused listeners if the server was full.
+ * Reactors release the slots of their connections, it is called directly only for connections that never reached a reactor.
+ */
+void reactor_connection_release();
+
+/**
+ * Register listener. This function is used to make the listening socket non-blocking and watch it with the epoll instance.
+ * The listener itself is the epoll event data, so the caller recognizes its events by comparing the pointer.
+ *
+ * @param l The listener.
+ * @param fd The listening socket.
+ * @param epoll_fd The epoll instance.
+ * @return The reactor result code.
+ */
+int listener_register(listener* l, int fd, int epoll_fd);
+
+/**
+ * Accept from listener. This function is used to accept a single connection as a non-blocking, close-on-exec socket.
+ * Callers drain the listener by accepting until it fails with EAGAIN. If the server is full, the listener is paused and the call fails with EAGAIN.
+ * If the process runs out of descriptors, the listener is paused until a connection is released and the call fails with EMFILE or ENFILE.
+ *
+ * @param l The listener.
+ * @param addr The client address.
+ * @return The client socket, -1 on failure with errno set.
+ */
+int listener_accept(listener* l, struct sockaddr_in* addr);
+
+/**
+ * Enable port reuse. This function is used to let every reactor bind its own listening socket to the server port.
+ *
+ * @param sock The socket, before it is bound.
+ * @return 0 on success, -1 on failure.
+ */
+int reactor_enable_reuseport(int sock);
+
+/**
+ * Send a message over connection. This function is used to queue a message on the connection for the owning reactor to write.
+ * Messages queued within CONNECTION_FLUSH_DELAY are coalesced into as few TLS records as possible, the queue is flushed early once it holds CONNECTION_COALESCE_SIZE bytes
+ * and right away when called from the reactor thread. It may be called from any thread holding a reference to the connection.
+ *
+ * @param conn The connection.
+ * @param msg The message to send.
+ * @return The message send result code.
+ */
+int connection_send(connection* conn, message* msg);
+
+/**
+ * Send a message buffer over connection. This function is used to queue a reference to a serialized message, so queueing it on many connections copies no bytes.
+ * The bytes are copied once the reactor flushes the connection, the UID of the connection is inserted as the recipient of fan-out messages.
+ * It may be called from any thread holding a reference to the connection, the caller keeps its own reference to the buffer.
+ *
+ * @param conn The connection.
+ * @param buffer The message buffer.
+ * @return The message send result code.
+ */
+int connection_send_buffer(connection* conn, message_buffer* buffer);
+
+/**
+ * Set connection timer. This function is used to schedule the liveness timer of the connection, replacing the one scheduled before.
+ * Once the delay passes the reactor calls the client timer handler with the state, and releases the connection if the handler asks to.
+ * It must be called from the thread of the owning reactor, such as from the client handlers.
+ *
+ * @param conn The connection.
+ * @param state The client state the timer is scheduled for.
+ * @param delay The delay in milliseconds.
+ */
+void connection_set_timer(connection* conn, int state, int delay);
+
+/**
+ * Cancel connection timer. This function is used to unschedule the liveness timer of the connection. It must be called from the thread of the owning reactor.
+ *
+ * @param conn The connection.
+ */
+void connection_cancel_timer(connection* conn);
+
+/**
+ * Close connection. This function is used to request the owning reactor to close the connection. It may be called from any thread holding a reference to the connection.
+ *
+ * @param conn The connection.
+ */
+void connection_close(connection* conn);
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef __SERVER_ROUTER_H
+#define __SERVER_ROUTER_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "protocol.h"
+#include "sts_queue.h"
+
+#define ROUTER_COUNT 2
+#define ROUTER_BATCH_SIZE 64 // messages taken from a shard queue per lock
+#define ROUTER_WAIT_TIMEOUT 100 // in milliseconds, bounds the shutdown delay of the routers
+
+// The router result codes.
+#define ROUTER_SUCCESS 5300
+#define ROUTER_QUEUE_FAILURE 5301
+#define ROUTER_THREAD_FAILURE 5302
+
+struct router_pool;
+
+/**
+ * The router structure. This structure is used to store a router shard delivering the messages of the recipients hashed to it.
+ *
+ * @param id The router ID.
+ * @param thread The router thread.
+ * @param queue The message queue of the shard.
+ * @param depth The number of messages waiting in the queue.
+ * @param routed The number of routed messages.
+ * @param pool The pool the router belongs to.
+ */
+typedef struct router
+{
+    int id;
+    pthread_t thread;
+    sts_header* queue;
+    atomic_size_t depth;
+    atomic_ullong routed;
+    struct router_pool* pool;
+} router;
+
+/**
+ * The router pool structure. This structure is used to store the router shards. Messages of one recipient always reach the same shard, so they are delivered in order.
+ *
+ * @param routers The array of routers.
+ * @param router_count The number of routers.
+ * @param route The function delivering a message, the router releases its reference once it returns.
+ * @param stop The pool stop request.
+ */
+typedef struct router_pool
+{
+    router* routers;
+    int router_count;
+    void (*route)(message_buffer* msg);
+    atomic_int stop;
+} router_pool;
+
+/**
+ * Start router pool. This function is used to create the router shards and their threads.
+ *
+ * @param pool The router pool.
+ * @param router_count The number of routers.
+ * @param route The function delivering a message, the router releases its reference once it returns.
+ * @return The router result code.
+ */
+int router_pool_start(router_pool* pool, int router_count, void (*route)(message_buffer* msg));
+
+/**
+ * Stop router pool. This function is used to stop the router threads and release the messages that were not routed.
+ *
+ * @param pool The router pool.
+ */
+void router_pool_stop(router_pool* pool);
+
+/**
+ * Submit message. This function is used to enqueue a message on the shard of its recipient. It may be called from any thread.
+ * The reference of the caller to the message is owned by the pool afterwards.
+ *
+ * @param pool The router pool.
+ * @param msg The message buffer.
+ */
+void router_submit(router_pool* pool, message_buffer* msg);
+
+#endif
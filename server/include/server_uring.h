@@ -0,0 +1,124 @@
+#ifndef __SERVER_URING_H
+#define __SERVER_URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES 1024 // submission queue entries, the completion queue is twice as large
+#define URING_BUFFER_COUNT 256 // provided receive buffers, must be a power of two
+#define URING_BUFFER_SIZE 4096
+#define URING_BUFFER_GROUP 0
+
+// The io_uring result codes.
+#define URING_SUCCESS 5200
+#define URING_SETUP_FAILURE 5201
+#define URING_MMAP_FAILURE 5202
+#define URING_BUFFER_FAILURE 5203
+
+/**
+ * The io_uring structure. This structure is used to store a ring set up with raw system calls and its provided buffer ring.
+ * The ring is meant to be driven by a single thread.
+ *
+ * @param fd The ring file descriptor.
+ * @param sq_head The kernel submission queue head.
+ * @param sq_tail The submission queue tail shared with the kernel.
+ * @param sq_mask The submission queue index mask.
+ * @param sq_entries The number of submission queue entries.
+ * @param sqes The submission queue entries.
+ * @param sq_pending The number of entries prepared and not yet submitted.
+ * @param cq_head The completion queue head shared with the kernel.
+ * @param cq_tail The kernel completion queue tail.
+ * @param cq_mask The completion queue index mask.
+ * @param cqes The completion queue entries.
+ * @param ring_ptr The mapping of the submission and completion rings.
+ * @param ring_size The size of the ring mapping.
+ * @param sqes_size The size of the submission queue entries mapping.
+ * @param buf_ring The provided buffer ring.
+ * @param bufs The memory of the provided buffers.
+ */
+typedef struct uring
+{
+    int fd;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    struct io_uring_sqe* sqes;
+    unsigned sq_pending;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+    void* ring_ptr;
+    size_t ring_size;
+    size_t sqes_size;
+    struct io_uring_buf_ring* buf_ring;
+    char* bufs;
+} uring;
+
+/**
+ * Initialize io_uring. This function is used to create the ring, map its queues and register the provided receive buffers.
+ *
+ * @param ring The ring.
+ * @return The io_uring result code.
+ */
+int uring_init(uring* ring);
+
+/**
+ * Destroy io_uring. This function is used to unmap the ring and close it, cancelling all requests in flight.
+ *
+ * @param ring The ring.
+ */
+void uring_destroy(uring* ring);
+
+/**
+ * Get submission queue entry. This function is used to get a cleared entry to prepare, submitting the queue first if it is full.
+ *
+ * @param ring The ring.
+ * @return The submission queue entry, NULL if the queue could not be submitted.
+ */
+struct io_uring_sqe* uring_get_sqe(uring* ring);
+
+/**
+ * Submit and wait. This function is used to submit the prepared entries and wait for at least one completion with a single system call.
+ *
+ * @param ring The ring.
+ * @param timeout The wait timeout in milliseconds.
+ * @return The number of submitted entries, -1 on failure with errno set.
+ */
+int uring_submit_and_wait(uring* ring, int timeout);
+
+/**
+ * Peek completion. This function is used to get the oldest unconsumed completion.
+ *
+ * @param ring The ring.
+ * @return The completion queue entry, NULL if there is none.
+ */
+struct io_uring_cqe* uring_peek_cqe(uring* ring);
+
+/**
+ * Consume completion. This function is used to release the completion returned by uring_peek_cqe to the kernel.
+ *
+ * @param ring The ring.
+ */
+void uring_cqe_seen(uring* ring);
+
+/**
+ * Get provided buffer. This function is used to get the memory of the provided buffer selected by the kernel for a receive.
+ *
+ * @param ring The ring.
+ * @param bid The buffer ID from the completion flags.
+ * @return The buffer.
+ */
+char* uring_buffer(uring* ring, unsigned bid);
+
+/**
+ * Recycle provided buffer. This function is used to give a consumed receive buffer back to the kernel.
+ *
+ * @param ring The ring.
+ * @param bid The buffer ID.
+ */
+void uring_buffer_recycle(uring* ring, unsigned bid);
+
+#endif
@@ -1,13 +1,22 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "server.h"
+#include "server_config.h"
 #include "protocol.h"
 
-int main()
+int main(int argc, char** argv)
 {
     setbuf(stdout, NULL);
 
-    int result = run_server();
+    server_config config;
+    int config_result = parse_server_config(&config, argc, argv);
+    if (config_result != SERVER_CONFIG_SUCCESS)
+    {
+        print_server_usage(argv[0]);
+        return config_result == SERVER_CONFIG_HELP ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    int result = run_server(&config);
     if (result != 0)
     {
         fprintf(stderr, "Server failed to run with error code: %d\n", result);
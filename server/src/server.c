@@ -10,6 +10,7 @@
 #include <errno.h>
 #include <ctype.h>
 #include <sys/sysinfo.h>
+#include <sys/epoll.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 #include <readline/readline.h>
@@ -20,16 +21,13 @@
 #include "server_db.h"
 #include "server_auth.h"
 #include "server_openssl.h"
+#include "server_reactor.h"
 #include "log.h"
-#include "sts_queue.h"
 
 volatile sig_atomic_t quit_flag = 0;
-extern _sts_queue const sts_queue;
-extern sts_header* create();
-static struct server srv = { 0, {0}, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER, {0}, NULL, NULL, NULL, NULL, 0 };
+static struct server srv = { 0, {0}, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER, {0}, NULL, NULL, NULL, 0, NULL, 0, {SERVER_MODE_ACCEPT_THREAD, 0, 0, 0, 0, SERVER_IO_EPOLL, 0, -1, PRESENCE_TICK, LOG_OVERFLOW_BLOCK, 0}, {0}, {0}, {0}, {0} };
 
 void usleep(unsigned int usec);
-char* strdup(const char* str1);
 
 int srv_exit(char** args)
 {
@@ -54,6 +52,18 @@ int srv_list(char** args)
     return 1;
 }
 
+int srv_buckets(char** args)
+{
+    if (args[0] != NULL)
+        log_message(T_LOG_WARN, SERVER_LOG, __FILE__, "Arguments provided for buckets command ignored");
+    size_t histogram[BUCKET_HISTOGRAM_SIZE];
+    hash_map_histogram(srv.client_map, histogram, BUCKET_HISTOGRAM_SIZE);
+    printf("Users online: %zu, slots: %zu\n", (size_t)srv.client_map->current_elements, hash_map_capacity(srv.client_map));
+    for (int i = 0; i < BUCKET_HISTOGRAM_SIZE; ++i)
+        printf("%2d%s groups probed: %zu users\n", i + 1, i == BUCKET_HISTOGRAM_SIZE - 1 ? "+" : " ", histogram[i]);
+    return 1;
+}
+
 int srv_ban(char** args)
 {
     if (args[0] == NULL)
@@ -69,6 +79,12 @@ int srv_ban(char** args)
     return 1;
 }
 
+static void kick_client(client_connection* cl, void* arg)
+{
+    send_quit_signal(cl);
+    if (arg) {}
+}
+
 int srv_kick(char** args)
 {
     if (args[0] == NULL)
@@ -80,16 +96,8 @@ int srv_kick(char** args)
     {
         log_message(T_LOG_WARN, SERVER_LOG, __FILE__, "Multiple arguments provided for kick command. Only first argument will be used");
     }
-    client_connection* cl = (client_connection*)malloc(sizeof(client_connection));
-    if (!cl)
-    {
-        log_message(T_LOG_ERROR, SERVER_LOG, __FILE__, "Srv kick: client memory allocation failed");
-        return -1;
-    }
-    int recipient_found = hash_map_find(srv.client_map, args[0], &cl);
-    if (recipient_found)
-        send_quit_signal(cl);
-    else
+    int recipient_found = hash_map_apply_by_name(srv.client_map, args[0], kick_client, NULL) || hash_map_apply(srv.client_map, args[0], kick_client, NULL);
+    if (!recipient_found)
         log_message(T_LOG_WARN, SERVER_LOG, __FILE__, "Recipient not found in client map");
     return 1;
 }
@@ -143,7 +151,16 @@ int srv_broadcast(char** args)
             strcat(concatenated_args, " ");
     }
 
-    hash_map_iterate2(srv.client_map, send_broadcast, concatenated_args);
+    fanout fan;
+    if (prepare_fanout(&fan, MESSAGE_TEXT, concatenated_args, NULL) != 0)
+    {
+        log_message(T_LOG_ERROR, SERVER_LOG, __FILE__, "Srv broadcast: message creation failed");
+        free(concatenated_args);
+        return -1;
+    }
+    hash_map_iterate2(srv.client_map, send_broadcast, &fan);
+    finish_fanout(&fan);
+    log_message(T_LOG_INFO, CLIENTS_LOG, __FILE__, "Broadcast message to %d clients: %s", fan.count, concatenated_args);
 
     free(concatenated_args);
     return 1;
@@ -154,176 +171,211 @@ void print_client(client_connection* cl)
     printf("ID: %d, Username: %s, Address: %s:%d, UID: %s\n", cl->id, cl->username, inet_ntoa(cl->req->addr.sin_addr), ntohs(cl->req->addr.sin_port), cl->uid);
 }
 
-void send_ping(client_connection* cl)
+void send_quit_signal(client_connection* cl)
 {
-    if (cl->is_ready)
+    if (atomic_load_explicit(&cl->is_ready, memory_order_acquire))
     {
-        log_message(T_LOG_INFO, CLIENTS_LOG, __FILE__, "Sending PING to client %d", cl->id);
-        message* msg = (message*)malloc(sizeof(message));
-        if (!msg)
+        log_message(T_LOG_INFO, CLIENTS_LOG, __FILE__, "Sending quit signal to client %d", cl->id);
+        message msg;
+        message_buffer* buffer = NULL;
+        if (create_message(&msg, MESSAGE_SIGNAL, "server", cl->uid, MESSAGE_SIGNAL_QUIT) == MESSAGE_CREATION_SUCCESS)
+            buffer = message_buffer_create(&msg);
+        if (!buffer)
         {
-            log_message(T_LOG_ERROR, SERVER_LOG, __FILE__, "Send ping: message memory allocation failed");
+            log_message(T_LOG_ERROR, SERVER_LOG, __FILE__, "Send quit signal: message creation failed");
             return;
         }
-        create_message(msg, MESSAGE_PING, "server", cl->uid, "PING");
-        sts_queue.push(srv.message_queue, msg);
+        router_submit(&srv.routers, buffer);
     }
 }
 
-void kick_unresponsive(client_connection* cl)
+int prepare_fanout(fanout* fan, message_type type, const char* payload, client_connection* exclude)
 {
-    if (cl->is_ready && cl->ping_sent)
-    {
-        log_message(T_LOG_INFO, CLIENTS_LOG, __FILE__, "Kicking unresponsive client %d", cl->id);
-        send_quit_signal(cl);
-        sleep(5);
-        hash_map_erase(srv.client_map, cl->uid);
-    }
+    // one message ID is generated and the frame serialized once per fan-out, only text connections insert their client's UID as the recipient
+    message msg;
+    if (create_message(&msg, type, "server", "", payload) != MESSAGE_CREATION_SUCCESS)
+        return -1;
+    fan->buffer = message_buffer_create_fanout(&msg);
+    if (!fan->buffer)
+        return -1;
+    fan->exclude = exclude;
+    fan->count = 0;
+    return 0;
 }
 
-void send_quit_signal(client_connection* cl)
+void finish_fanout(fanout* fan)
 {
-    if (cl->is_ready)
-    {
-        log_message(T_LOG_INFO, CLIENTS_LOG, __FILE__, "Sending quit signal to client %d", cl->id);
-        message* msg = (message*)malloc(sizeof(message));
-        if (!msg)
-        {
-            log_message(T_LOG_ERROR, SERVER_LOG, __FILE__, "Send quit signal: message memory allocation failed");
-            return;
-        }
-        create_message(msg, MESSAGE_SIGNAL, "server", cl->uid, MESSAGE_SIGNAL_QUIT);
-        sts_queue.push(srv.message_queue, msg);
-    }
+    message_buffer_release(fan->buffer);
+    fan->buffer = NULL;
 }
 
 void send_broadcast(client_connection* cl, void* arg)
 {
-    char* msg_payload = (char*)arg;
-    if (cl->is_ready)
+    fanout* fan = (fanout*)arg;
+    if (atomic_load_explicit(&cl->is_ready, memory_order_acquire) && cl != fan->exclude)
     {
-        log_message(T_LOG_INFO, CLIENTS_LOG, __FILE__, "Broadcasting message to client %d: %s", cl->id, msg_payload);
-        message* msg = (message*)malloc(sizeof(message));
-        if (!msg)
-        {
-            log_message(T_LOG_ERROR, SERVER_LOG, __FILE__, "Send broadcast: message memory allocation failed");
-            return;
-        }
-        create_message(msg, MESSAGE_TEXT, "server", cl->uid, msg_payload);
-        sts_queue.push(srv.message_queue, msg);
+        // every client queues a reference to the same buffer, the bytes are copied when its connection is flushed
+        if (connection_send_buffer((connection*)cl, fan->buffer) == MESSAGE_SEND_SUCCESS)
+            fan->count++;
     }
 }
 
-void send_join_message(client_connection* cl, void* arg)
+void handle_client_open(connection* conn)
 {
-    client_connection* new_cl = (client_connection*)arg;
-    if (cl->is_ready && cl != new_cl)
-    {
-        log_message(T_LOG_INFO, CLIENTS_LOG, __FILE__, "Sending join message to client %d", cl->id);
-        message* msg = (message*)malloc(sizeof(message));
-        if (!msg)
-        {
-            log_message(T_LOG_ERROR, SERVER_LOG, __FILE__, "Send join message: message memory allocation failed");
-            return;
-        }
-        create_message(msg, MESSAGE_USER_JOIN, "server", cl->uid, new_cl->username);
-        sts_queue.push(srv.message_queue, msg);
-    }
+    // before authentication log to requests.log
+    srv.requests_handled++;
+    atomic_store_explicit(&conn->cl.is_ready, 0, memory_order_release);
+    conn->cl.is_inserted = 0;
+    log_message(T_LOG_INFO, REQUESTS_LOG, __FILE__, "Handing request %s:%d (%s protocol)", inet_ntoa(conn->req.addr.sin_addr), ntohs(conn->req.addr.sin_port),
+        conn->protocol == MESSAGE_PROTOCOL_BINARY ? "binary" : "text");
+    connection_set_timer(conn, CLIENT_TIMER_AUTH, CLIENT_AUTH_TIMEOUT);
+    user_auth_begin(conn);
 }
 
-void* handle_client(void* arg)
+// admits the client once the authentication result is a success, returns 0 if the connection stays open
+static int handle_client_auth_result(connection* conn, int auth_result)
 {
-    // before authentication log to requests.log
-    char buffer[BUFFER_SIZE];
-    int nbytes;
-    request* req = (request*)arg;
-    message msg;
-    client_connection cl;
-    srv.requests_handled++;
-    cl.is_ready = 0;
-    cl.is_inserted = 0;
-    log_message(T_LOG_INFO, REQUESTS_LOG, __FILE__, "Handing request %s:%d", inet_ntoa(req->addr.sin_addr), ntohs(req->addr.sin_port));
+    client_connection* cl = &conn->cl;
+    request* req = &conn->req;
 
-    if (user_auth(req, &cl, srv.client_map) != USER_AUTHENTICATION_SUCCESS)
-    {
-        close(req->sock);
-        pthread_exit(NULL);
-    }
+    if (auth_result == USER_AUTHENTICATION_IN_PROGRESS)
+        return 0;
+    else if (auth_result != USER_AUTHENTICATION_SUCCESS)
+        return -1;
 
-    if (!hash_map_insert(srv.client_map, &cl))
+    if (!hash_map_insert(srv.client_map, cl))
     {
         log_message(T_LOG_ERROR, CLIENTS_LOG, __FILE__, "Failed to insert client into client map");
-        close(req->sock);
-        pthread_exit(NULL);
+        return -1;
     }
-    cl.is_inserted = 1;
-    cl.id = srv.client_map->current_elements - 1;
-    log_message(T_LOG_INFO, CLIENTS_LOG, __FILE__, "%s added to client array", cl.username);
+    cl->is_inserted = 1;
+    cl->id = srv.client_map->current_elements - 1;
+    presence_join(&srv.presence, conn);
+    log_message(T_LOG_INFO, CLIENTS_LOG, __FILE__, "%s added to client array", cl->username);
 
     // from this point log to client_connections.log
     srv.client_logins_handled++;
-    log_message(T_LOG_INFO, CLIENTS_LOG, __FILE__, "Successful auth of client - id: %d - username: %s - address: %s:%d - uid: %s", cl.id, cl.username, inet_ntoa(req->addr.sin_addr), ntohs(req->addr.sin_port), cl.uid);
+    log_message(T_LOG_INFO, CLIENTS_LOG, __FILE__, "Successful auth of client - id: %d - username: %s - address: %s:%d - uid: %s", cl->id, cl->username, inet_ntoa(req->addr.sin_addr), ntohs(req->addr.sin_port), cl->uid);
+
+    // the client learns who is online from one snapshot, the others learn about the join from the next presence broadcast.
+    // the snapshot is queued before the client is ready, so no broadcast delta reaches it ahead of the version it builds on
+    presence_send(&srv.presence, conn, 0);
+    // the release publishes the admitted client to the broadcast and presence threads, which deliver only after their acquire sees it ready
+    atomic_store_explicit(&cl->is_ready, 1, memory_order_release);
+    connection_set_timer(conn, CLIENT_TIMER_PING, CLIENT_PING_INTERVAL);
+    return 0;
+}
 
-    // send join message to all clients except the new one
-    hash_map_iterate2(srv.client_map, send_join_message, &cl);
+static int handle_client_auth(connection* conn, message* msg)
+{
+    return handle_client_auth_result(conn, user_auth(conn, msg, srv.client_map, &srv.auths));
+}
 
-    cl.is_ready = 1;
-    while ((nbytes = SSL_read(cl.req->ssl, buffer, sizeof(buffer))) > 0)
+int handle_client_auth_done(connection* conn)
+{
+    if (quit_flag)
+        return -1;
+    return handle_client_auth_result(conn, user_auth_complete(conn));
+}
+
+int handle_client(connection* conn, const message_view* view)
+{
+    client_connection* cl = &conn->cl;
+    if (quit_flag)
+        return -1;
+    if (!atomic_load_explicit(&cl->is_ready, memory_order_acquire))
     {
-        if (quit_flag)
-            break;
+        // authentication needs every field at hand, it happens once per connection
+        message msg;
+        message_view_to_message(view, &msg);
+        return handle_client_auth(conn, &msg);
+    }
 
-        if (nbytes > 0)
-        {
-            parse_message(&msg, buffer);
-            char log_buf[BUFFER_SIZE];
-            sprintf(log_buf, "Received message from client %d, %s: %s", cl.id, msg.sender_uid, msg.payload);
-            log_message(T_LOG_INFO, CLIENTS_LOG, __FILE__, log_buf);
+    char sender[HASH_HEX_OUTPUT_LENGTH];
+    message_field_to_text(&view->sender_uid, sender, sizeof(sender));
+    log_message(T_LOG_INFO, CLIENTS_LOG, __FILE__, "Received message from client %d, %s: %.*s", cl->id, sender, (int)view->payload.length, view->payload.data);
 
-            if (msg.type == MESSAGE_PING)
-            {
-                create_message(&msg, MESSAGE_ACK, "server", msg.sender_uid, "ACK");
-                send_message(cl.req->ssl, &msg);
-            }
-            else if (msg.type == MESSAGE_ACK)
-            {
-                log_message(T_LOG_INFO, CLIENTS_LOG, __FILE__, "Received ACK from client %d", cl.id);
-                cl.ping_sent = 0;
-            }
-            else
-            {
-                message* new_msg = (message*)malloc(sizeof(message));
-                if (!new_msg)
-                {
-                    log_message(T_LOG_ERROR, SERVER_LOG, __FILE__, "Failed to allocate memory for message that should be enqueued for handling");
-                    continue;
-                }
-                memcpy(new_msg, &msg, sizeof(message));
-                sts_queue.push(srv.message_queue, new_msg);
-            }
+    if (view->type == MESSAGE_PING)
+    {
+        message msg;
+        create_message(&msg, MESSAGE_ACK, "server", sender, "ACK");
+        connection_send(conn, &msg);
+    }
+    else if (view->type == MESSAGE_ACK)
+    {
+        log_message(T_LOG_INFO, CLIENTS_LOG, __FILE__, "Received ACK from client %d", cl->id);
+        if (cl->ping_sent)
+        {
+            cl->ping_sent = 0;
+            connection_set_timer(conn, CLIENT_TIMER_PING, CLIENT_PING_INTERVAL);
         }
-        else
-            log_message(T_LOG_INFO, CLIENTS_LOG, __FILE__, "Received malformed message from client %d", cl.id);
     }
-    // client disconnected
-    log_message(T_LOG_INFO, CLIENTS_LOG, __FILE__, "Client %d disconnected", cl.id);
-    if (cl.is_inserted)
-        hash_map_erase(srv.client_map, cl.uid);
-    close(cl.req->sock);
-    free(req);
-    pthread_exit(NULL);
+    else if (view->type == MESSAGE_PRESENCE)
+    {
+        // the payload is the roster version the client holds, it is sent what changed since
+        char version[TIMESTAMP_LENGTH + 1];
+        if (message_field_to_text(&view->payload, version, sizeof(version)) < 0)
+            version[0] = '\0';
+        presence_send(&srv.presence, conn, strtoull(version, NULL, 10));
+    }
+    else
+    {
+        // binary frames received whole are referenced where they were read, others are serialized into a buffer sized to them
+        message_buffer* buffer = message_buffer_create_view(view);
+        if (!buffer)
+        {
+            log_message(T_LOG_ERROR, SERVER_LOG, __FILE__, "Failed to allocate memory for message that should be enqueued for handling");
+            return 0;
+        }
+        router_submit(&srv.routers, buffer);
+    }
+    return 0;
 }
 
-void* handle_client_ping(void* arg)
+int handle_client_timer(connection* conn)
 {
-    while (!quit_flag)
+    client_connection* cl = &conn->cl;
+    message msg;
+    switch ((client_timer)conn->timer_state)
+    {
+    case CLIENT_TIMER_AUTH:
+        log_message(T_LOG_INFO, REQUESTS_LOG, __FILE__, "Request %s:%d timed out during authentication", inet_ntoa(conn->req.addr.sin_addr), ntohs(conn->req.addr.sin_port));
+        return -1;
+    case CLIENT_TIMER_PING:
+        log_message(T_LOG_INFO, CLIENTS_LOG, __FILE__, "Sending PING to client %d", cl->id);
+        create_message(&msg, MESSAGE_PING, "server", cl->uid, "PING");
+        connection_send(conn, &msg);
+        cl->ping_sent = 1;
+        connection_set_timer(conn, CLIENT_TIMER_ACK, CLIENT_ACK_TIMEOUT);
+        return 0;
+    case CLIENT_TIMER_ACK:
+        // the client is asked to leave on its own first and disconnected if it does not
+        log_message(T_LOG_INFO, CLIENTS_LOG, __FILE__, "Kicking unresponsive client %d", cl->id);
+        create_message(&msg, MESSAGE_SIGNAL, "server", cl->uid, MESSAGE_SIGNAL_QUIT);
+        connection_send(conn, &msg);
+        connection_set_timer(conn, CLIENT_TIMER_KICK, CLIENT_KICK_DELAY);
+        return 0;
+    case CLIENT_TIMER_KICK:
+        log_message(T_LOG_INFO, CLIENTS_LOG, __FILE__, "Closing connection of unresponsive client %d", cl->id);
+        return -1;
+    }
+    return 0;
+}
+
+void handle_client_close(connection* conn)
+{
+    // client disconnected
+    client_connection* cl = &conn->cl;
+    if (cl->is_inserted)
     {
-        hash_map_iterate(srv.client_map, send_ping);
-        sleep(15);
-        hash_map_iterate(srv.client_map, kick_unresponsive);
+        log_message(T_LOG_INFO, CLIENTS_LOG, __FILE__, "Client %d disconnected", cl->id);
+        hash_map_erase(srv.client_map, cl->uid);
+        presence_leave(&srv.presence, conn);
+        cl->is_inserted = 0;
     }
-    if (arg) {}
-    pthread_exit(NULL);
+    else
+        log_message(T_LOG_INFO, REQUESTS_LOG, __FILE__, "Request %s:%d closed", inet_ntoa(conn->req.addr.sin_addr), ntohs(conn->req.addr.sin_port));
+    atomic_store_explicit(&cl->is_ready, 0, memory_order_release);
 }
 
 void* handle_cli(void* arg)
@@ -350,51 +402,30 @@ void* handle_cli(void* arg)
     pthread_exit(NULL);
 }
 
-void* handle_msg_queue(void* arg)
+static void deliver_message(client_connection* cl, void* arg)
+{
+    connection_send_buffer((connection*)cl, (message_buffer*)arg);
+}
+
+// NOTE: use only for authenticated users with UID. routers will not handle messages with "client" sender or recipient
+static void route_message(message_buffer* msg)
 {
-    // approach: pop one message at the time and sleep briefly
-    // NOTE: use only for authenticated users with UID. router will not handle messages with "client" sender or recipient
+    // the recipient queues a reference to the buffer and the router releases its own afterwards, so nothing is allocated or copied per message
+    log_message(T_LOG_INFO, SERVER_LOG, __FILE__, "Message of type %d to %s: %u bytes", msg->type, msg->recipient, msg->length);
+    int recipient_found = hash_map_apply(srv.client_map, msg->recipient, deliver_message, msg);
+    if (!recipient_found)
+        log_message(T_LOG_WARN, SERVER_LOG, __FILE__, "Recipient not found in the client map: %s (msg type: %d)", msg->recipient, msg->type);
+}
+
+void* handle_presence_update(void* arg)
+{
+    if (arg) {}
+    // joins and leaves of a tick reach every client together, a reconnect storm costs a client a frame per tick instead of a message per login
     while (!quit_flag)
     {
-        message* msg = sts_queue.pop(srv.message_queue);
-        if (msg)
-        {
-            const char* payload_copy = strdup(msg->payload);
-            if (!payload_copy)
-            {
-                log_message(T_LOG_ERROR, SERVER_LOG, __FILE__, "Failed to copy message payload");
-                free(msg);
-                continue;
-            }
-            log_message(T_LOG_INFO, SERVER_LOG, __FILE__, "Message from %s to %s: %s", msg->sender_uid, msg->recipient_uid, (char*)payload_copy);
-            client_connection* cl = (client_connection*)malloc(sizeof(client_connection));
-            if (!cl)
-            {
-                log_message(T_LOG_ERROR, SERVER_LOG, __FILE__, "Msg queue: client memory allocation failed");
-                free(msg);
-                free((void*)payload_copy);
-                continue;
-            }
-            int recipient_found = hash_map_find(srv.client_map, msg->recipient_uid, &cl);
-            if (recipient_found)
-            {
-                send_message(cl->req->ssl, msg);
-                if (msg->type == MESSAGE_PING && !strcmp(msg->sender_uid, "server"))
-                {
-                    log_message(T_LOG_INFO, CLIENTS_LOG, __FILE__, "Sent PING to client %d", cl->id);
-                    cl->ping_sent = 1;
-                }
-            }
-            else
-                log_message(T_LOG_WARN, SERVER_LOG, __FILE__, "Recipient not found in the client map: %s (msg type: %d; msg payload: %s)", msg->recipient_uid, msg->type, msg->payload);
-            free(cl);
-            free(msg);
-            free((void*)payload_copy);
-        }
-        usleep(50000); // 50 ms
+        usleep(srv.config.presence_tick * 1000);
+        presence_broadcast(&srv.presence, srv.client_map);
     }
-    if (arg) {}
-    log_message(T_LOG_INFO, SERVER_LOG, __FILE__, "Exiting msg queue thread");
     pthread_exit(NULL);
 }
 
@@ -403,17 +434,52 @@ void* handle_info_update(void* arg)
     struct sysinfo sys_info;
     char formatted_srv_uptime[9];
     char formatted_sys_uptime[9];
+    char reactor_counts[512];
+    char router_depths[512];
+    handshake_stats hs_stats;
+    mem_pool_stats msg_pool;
+    mem_pool_stats conn_pool;
     while (!quit_flag)
     {
         int user_count = srv.client_map->current_elements;
 
+        // per reactor connection counts show how evenly the kernel spreads SO_REUSEPORT accepts
+        size_t offset = 0;
+        unsigned long long sent_messages = 0;
+        unsigned long long sent_flushes = 0;
+        reactor_counts[0] = '\0';
+        for (int i = 0; i < srv.reactor_count; ++i)
+        {
+            sent_messages += atomic_load(&srv.reactors[i].sent_messages);
+            sent_flushes += atomic_load(&srv.reactors[i].sent_flushes);
+            if (offset < sizeof(reactor_counts))
+                offset += snprintf(reactor_counts + offset, sizeof(reactor_counts) - offset, "%s%zu",
+                    i ? "/" : "", atomic_load(&srv.reactors[i].connection_count));
+        }
+
+        // per shard queue depth shows recipients falling behind and uneven recipient hashing
+        unsigned long long routed = 0;
+        offset = 0;
+        router_depths[0] = '\0';
+        for (int i = 0; i < srv.routers.router_count; ++i)
+        {
+            routed += atomic_load(&srv.routers.routers[i].routed);
+            if (offset < sizeof(router_depths))
+                offset += snprintf(router_depths + offset, sizeof(router_depths) - offset, "%s%zu",
+                    i ? "/" : "", atomic_load(&srv.routers.routers[i].depth));
+        }
+
+        handshake_pool_stats(&srv.handshakes, &hs_stats);
+        message_buffer_stats(&msg_pool);
+        reactor_connection_stats(&conn_pool);
+
         if (!sysinfo(&sys_info))
         {
             time_t current_time = time(NULL);
             long uptime_seconds = (long)difftime(current_time, srv.start_time);
             format_uptime(uptime_seconds, formatted_srv_uptime, sizeof(formatted_srv_uptime));
             format_uptime(sys_info.uptime, formatted_sys_uptime, sizeof(formatted_sys_uptime));
-            log_message(T_LOG_INFO, SYSTEM_LOG, __FILE__, "Online: %d, Req: %d, Auths: %d, Uptime: %s, Sys-uptime: %s, Load avg: %.2f, RAM: %lu/%lu MB",
+            log_message(T_LOG_INFO, SYSTEM_LOG, __FILE__, "Online: %d, Req: %d, Auths: %d, Uptime: %s, Sys-uptime: %s, Load avg: %.2f, RAM: %lu/%lu MB, Reactors: %s, Router depth: %s, Routed: %llu, Sent: %llu in %llu writes, Handshakes: %llu ok/%llu failed/%llu timed out/%llu rejected/%d in flight, avg %.2f ms, max %.2f ms, Pools: messages %zu/%zu in use, %.1f%% cached, %llu grows, connections %zu/%zu in use, %.1f%% cached, %llu grows, Presence: %llu changes in %llu ticks, %llu frames, %llu messages saved, Log drops: %llu",
                 user_count,
                 srv.requests_handled,
                 srv.client_logins_handled,
@@ -421,7 +487,32 @@ void* handle_info_update(void* arg)
                 formatted_sys_uptime,
                 sys_info.loads[0] / 65536.0,
                 (sys_info.totalram - sys_info.freeram) / 1024 / 1024,
-                sys_info.totalram / 1024 / 1024);
+                sys_info.totalram / 1024 / 1024,
+                reactor_counts,
+                router_depths,
+                routed,
+                sent_messages,
+                sent_flushes,
+                hs_stats.completed,
+                hs_stats.failed,
+                hs_stats.timed_out,
+                hs_stats.rejected,
+                hs_stats.in_flight,
+                hs_stats.latency_avg,
+                hs_stats.latency_max,
+                msg_pool.in_use,
+                msg_pool.capacity,
+                msg_pool.allocs ? 100.0 * msg_pool.cache_hits / msg_pool.allocs : 0.0,
+                msg_pool.misses,
+                conn_pool.in_use,
+                conn_pool.capacity,
+                conn_pool.allocs ? 100.0 * conn_pool.cache_hits / conn_pool.allocs : 0.0,
+                conn_pool.misses,
+                atomic_load(&srv.presence.broadcast_changes),
+                atomic_load(&srv.presence.broadcasts),
+                atomic_load(&srv.presence.broadcast_frames),
+                atomic_load(&srv.presence.messages_saved),
+                log_dropped_messages());
         }
         else
             log_message(T_LOG_ERROR, SYSTEM_LOG, __FILE__, "Failed to get system info");
@@ -436,87 +527,65 @@ void* handle_connection_add(void* arg)
 {
     int cl_sock;
     struct sockaddr_in cl_addr;
-    socklen_t cl_len = sizeof(cl_addr);
+    int next_reactor = 0;
+    listener l;
+    struct epoll_event event;
 
-    while (!quit_flag)
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0 || listener_register(&l, srv.sock, epoll_fd) != REACTOR_SUCCESS)
     {
-        if (srv.thread_count >= MAX_CLIENTS || srv.thread_count >= MAX_THREADS)
-        {
-            usleep(200000); // 200 ms
-            continue;
-        }
-
-        cl_sock = accept(srv.sock, (struct sockaddr*)&cl_addr, &cl_len);
-        if (cl_sock < 0)
-        {
-            if (quit_flag)
-            {
-                close(srv.sock);
-                log_message(T_LOG_INFO, SERVER_LOG, __FILE__, "Server shutting down");
-                finish_logging();
-                exit(EXIT_SUCCESS);
-            }
-            if (errno == EINTR)
-                continue;
-            perror("Accept failed");
-            continue;
-        }
+        log_message(T_LOG_ERROR, SERVER_LOG, __FILE__, "Listener registration failed: %s", strerror(errno));
+        pthread_exit(NULL);
+    }
 
-        SSL* client_ssl = SSL_new(srv.ssl_ctx);
-        if (!client_ssl)
-        {
-            log_message(T_LOG_ERROR, SERVER_LOG, __FILE__, "Failed to create SSL object for client");
-            close(cl_sock);
-            continue;
-        }
-        SSL_set_fd(client_ssl, cl_sock);
-        if (SSL_accept(client_ssl) <= 0)
-        {
-            log_message(T_LOG_ERROR, SERVER_LOG, __FILE__, "SSL handshake failed");
-            SSL_free(client_ssl);
-            close(cl_sock);
-            continue;
-        }
-        request* req = (request*)malloc(sizeof(request));
-        if (!req)
-        {
-            log_message(T_LOG_ERROR, SERVER_LOG, __FILE__, "Request memory allocation failed");
-            SSL_free(client_ssl);
-            close(cl_sock);
+    while (!quit_flag)
+    {
+        // blocks while the listener is paused by admission control, the timeout only lets the loop observe quit_flag
+        if (epoll_wait(epoll_fd, &event, 1, 1000) <= 0)
             continue;
-        }
-        req->sock = cl_sock;
-        req->addr = cl_addr;
-        req->ssl = client_ssl;
 
-        pthread_t tid;
-        if (pthread_create(&tid, NULL, handle_client, (void*)req) != 0)
+        while ((cl_sock = listener_accept(&l, &cl_addr)) >= 0)
         {
-            char error_msg[128];
-            snprintf(error_msg, sizeof(error_msg), "Thread creation failed: %s", strerror(errno));
-            log_message(T_LOG_WARN, SERVER_LOG, __FILE__, "Thread creation failed for client %s: %s", inet_ntoa(cl_addr.sin_addr), error_msg);
-            SSL_free(client_ssl);
-            close(cl_sock);
-            free(req);
-            continue;
-        }
-        pthread_mutex_lock(&srv.thread_count_mutex);
-        if (srv.thread_count < MAX_CLIENTS)
-        {
-            srv.threads[srv.thread_count] = tid;
-            srv.thread_count++;
+            // the handshake runs on the pool, so a slow client cannot stall later connects,
+            // connections are spread over reactors in round-robin order
+            reactor* r = &srv.reactors[next_reactor];
+            next_reactor = (next_reactor + 1) % srv.reactor_count;
+            handshake_submit(&srv.handshakes, cl_sock, &cl_addr, r);
         }
-        pthread_mutex_unlock(&srv.thread_count_mutex);
-
-        usleep(100000); // 100 ms
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            log_message(T_LOG_WARN, SERVER_LOG, __FILE__, "Accept failed: %s", strerror(errno));
     }
+    close(epoll_fd);
     if (arg) {}
     log_message(T_LOG_INFO, SERVER_LOG, __FILE__, "Exiting connection add thread");
     pthread_exit(NULL);
 }
 
-int run_server()
+static int open_reuseport_listener()
+{
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0)
+        return -1;
+    if (reactor_enable_reuseport(sock) < 0 ||
+        bind(sock, (struct sockaddr*)&srv.addr, sizeof(srv.addr)) < 0 ||
+        listen(sock, srv.config.backlog) < 0)
+    {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+int run_server(const server_config* config)
 {
+    srv.config = *config;
+    if (srv.config.node_id >= 0)
+        set_message_id_node((uint16_t)srv.config.node_id);
+    int multi_reactor = srv.config.mode == SERVER_MODE_MULTI_REACTOR;
+    int reactor_count = srv.config.reactor_count;
+    if (!reactor_count)
+        reactor_count = multi_reactor ? get_nprocs() : REACTOR_COUNT;
+
     if (get_nprocs() == 2)
     {
         log_message(T_LOG_WARN, SERVER_LOG, __FILE__, "Server running on a dual core system");
@@ -527,9 +596,13 @@ int run_server()
         return SINGLE_CORE_SYSTEM;
     }
 
+    set_log_overflow(srv.config.log_overflow);
     init_logging(SERVER_LOG);
     log_message(T_LOG_INFO, SERVER_LOG, __FILE__, LOG_SERVER_STARTED);
 
+    // writes to disconnected clients must fail with EPIPE instead of terminating the server
+    signal(SIGPIPE, SIG_IGN);
+
     sqlite3* db;
     if (setup_db(&db, DB_NAME) != DATABASE_CREATE_SUCCESS)
     {
@@ -546,6 +619,21 @@ int run_server()
         finish_logging();
         exit(EXIT_FAILURE);
     }
+    // connections the server closed linger in TIME-WAIT on the port, so a restarted server could not bind without it
+    int reuse = 1;
+    setsockopt(srv.sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (multi_reactor)
+    {
+        // every reactor binds its own listener to the same port and the kernel balances incoming connections between them
+        if (reactor_enable_reuseport(srv.sock) < 0)
+        {
+            perror("SO_REUSEPORT failed");
+            close(srv.sock);
+            log_message(T_LOG_ERROR, SERVER_LOG, __FILE__, "Setting SO_REUSEPORT failed. Server shutting down");
+            finish_logging();
+            exit(EXIT_FAILURE);
+        }
+    }
     srv.addr.sin_family = AF_INET;
     srv.addr.sin_addr.s_addr = INADDR_ANY;
     srv.addr.sin_port = htons(PORT);
@@ -555,9 +643,17 @@ int run_server()
         finish_logging();
         exit(EXIT_FAILURE);
     }
-    srv.message_queue = sts_queue.create();
     srv.client_map = hash_map_create(MAX_CLIENTS);
     srv.start_time = time(NULL);
+    size_t connection_limit = reactor_limit_connections(MAX_CLIENTS);
+    if (connection_limit < MAX_CLIENTS)
+        log_message(T_LOG_WARN, SERVER_LOG, __FILE__, "Descriptor limit allows %zu connections out of %d", connection_limit, MAX_CLIENTS);
+    if (presence_init(&srv.presence) != PRESENCE_SUCCESS)
+    {
+        log_message(T_LOG_ERROR, SERVER_LOG, __FILE__, "Presence roster allocation failed. Server shutting down");
+        finish_logging();
+        exit(EXIT_FAILURE);
+    }
 
     if (srv.addr.sin_family == AF_INET)
         log_message(T_LOG_INFO, SERVER_LOG, __FILE__, "IPv4 socket created with address %s and port %d", inet_ntoa(srv.addr.sin_addr), PORT);
@@ -610,7 +706,7 @@ int run_server()
         exit(EXIT_FAILURE);
     }
 
-    if (listen(srv.sock, 10) < 0)
+    if (listen(srv.sock, srv.config.backlog) < 0)
     {
         perror("Listen failed");
         close(srv.sock);
@@ -618,7 +714,7 @@ int run_server()
         finish_logging();
         exit(EXIT_FAILURE);
     }
-    log_message(T_LOG_INFO, SERVER_LOG, __FILE__, "Server listening on port %d", PORT);
+    log_message(T_LOG_INFO, SERVER_LOG, __FILE__, "Server listening on port %d with backlog %d", PORT, srv.config.backlog);
 
     pthread_t cli_thread;
     if (pthread_create(&cli_thread, NULL, handle_cli, (void*)NULL) != 0)
@@ -636,36 +732,96 @@ int run_server()
     srv.threads[srv.thread_count] = info_update_thread;
     srv.thread_count++;
 
-    pthread_t msg_queue_thread;
-    if (pthread_create(&msg_queue_thread, NULL, handle_msg_queue, (void*)NULL) != 0)
-        log_message(T_LOG_WARN, SERVER_LOG, __FILE__, "Message queue handler thread creation failed: %s", strerror(errno));
-    log_message(T_LOG_INFO, SERVER_LOG, __FILE__, "Message queue handler thread started");
-    srv.threads[srv.thread_count] = msg_queue_thread;
+    // not cancelled on exit, so it never stops holding frames or the roster lock, it notices the quit flag within a tick
+    pthread_t presence_update_thread;
+    if (pthread_create(&presence_update_thread, NULL, handle_presence_update, (void*)NULL) != 0)
+        log_message(T_LOG_WARN, SERVER_LOG, __FILE__, "Presence update thread creation failed: %s", strerror(errno));
+    log_message(T_LOG_INFO, SERVER_LOG, __FILE__, "Presence update thread started with a %d ms tick", srv.config.presence_tick);
+    srv.threads[srv.thread_count] = presence_update_thread;
     srv.thread_count++;
 
-    pthread_t client_ping_thread;
-    if (pthread_create(&client_ping_thread, NULL, handle_client_ping, (void*)NULL) != 0)
-        log_message(T_LOG_WARN, SERVER_LOG, __FILE__, "Client ping thread creation failed: %s", strerror(errno));
-    log_message(T_LOG_INFO, SERVER_LOG, __FILE__, "Client ping thread started");
-    srv.threads[srv.thread_count] = client_ping_thread;
-    srv.thread_count++;
+    if (router_pool_start(&srv.routers, srv.config.router_count, route_message) != ROUTER_SUCCESS)
+    {
+        log_message(T_LOG_ERROR, SERVER_LOG, __FILE__, "Router start failed. Server shutting down");
+        close(srv.sock);
+        finish_logging();
+        exit(EXIT_FAILURE);
+    }
+    log_message(T_LOG_INFO, SERVER_LOG, __FILE__, "%d routers started", srv.routers.router_count);
 
     init_logging(REQUESTS_LOG);
     init_logging(CLIENTS_LOG);
     log_message(T_LOG_INFO, REQUESTS_LOG, __FILE__, LOG_SERVER_STARTED);
     log_message(T_LOG_INFO, CLIENTS_LOG, __FILE__, LOG_SERVER_STARTED);
 
-    pthread_t connection_add_thread;
-    if (pthread_create(&connection_add_thread, NULL, handle_connection_add, (void*)NULL) != 0)
+    srv.reactors = (reactor*)calloc(reactor_count, sizeof(reactor));
+    if (!srv.reactors)
     {
-        log_message(T_LOG_WARN, SERVER_LOG, __FILE__, "Connection add thread creation failed: %s", strerror(errno));
+        log_message(T_LOG_ERROR, SERVER_LOG, __FILE__, "Reactor memory allocation failed. Server shutting down");
         close(srv.sock);
         finish_logging();
         exit(EXIT_FAILURE);
     }
-    log_message(T_LOG_INFO, SERVER_LOG, __FILE__, "Connection add thread started");
-    srv.threads[srv.thread_count] = connection_add_thread;
-    srv.thread_count++;
+    if (handshake_pool_start(&srv.handshakes, srv.ssl_ctx, srv.config.handshake_workers, srv.config.handshake_timeout) != HANDSHAKE_SUCCESS)
+    {
+        log_message(T_LOG_ERROR, SERVER_LOG, __FILE__, "Handshake pool start failed. Server shutting down");
+        close(srv.sock);
+        finish_logging();
+        exit(EXIT_FAILURE);
+    }
+    log_message(T_LOG_INFO, SERVER_LOG, __FILE__, "%d handshake workers started with %d ms timeout", srv.handshakes.worker_count, srv.handshakes.timeout);
+    if (auth_pool_start(&srv.auths, srv.config.auth_workers) != AUTH_POOL_SUCCESS)
+    {
+        log_message(T_LOG_ERROR, SERVER_LOG, __FILE__, "Auth pool start failed. Server shutting down");
+        close(srv.sock);
+        finish_logging();
+        exit(EXIT_FAILURE);
+    }
+    log_message(T_LOG_INFO, SERVER_LOG, __FILE__, "%d auth workers started", srv.auths.worker_count);
+
+    int nprocs = get_nprocs();
+    for (int i = 0; i < reactor_count; ++i)
+    {
+        int listen_fd = -1;
+        int cpu = -1;
+        if (multi_reactor)
+        {
+            // the bound server socket becomes the listener of the first reactor
+            listen_fd = i ? open_reuseport_listener() : srv.sock;
+            cpu = i % nprocs;
+            if (listen_fd < 0)
+            {
+                log_message(T_LOG_ERROR, SERVER_LOG, __FILE__, "Reactor %d listener creation failed: %s. Server shutting down", i, strerror(errno));
+                close(srv.sock);
+                finish_logging();
+                exit(EXIT_FAILURE);
+            }
+        }
+        if (reactor_start(&srv.reactors[i], srv.config.io, i, &srv.handshakes, listen_fd, cpu) != REACTOR_SUCCESS)
+        {
+            log_message(T_LOG_ERROR, SERVER_LOG, __FILE__, "Reactor %d start failed. Server shutting down", i);
+            close(srv.sock);
+            finish_logging();
+            exit(EXIT_FAILURE);
+        }
+        srv.reactor_count++;
+    }
+    log_message(T_LOG_INFO, SERVER_LOG, __FILE__, "%d reactors started in %s mode", srv.reactor_count, multi_reactor ? "multi reactor" : "accept thread");
+
+    pthread_t connection_add_thread;
+    if (!multi_reactor)
+    {
+        if (pthread_create(&connection_add_thread, NULL, handle_connection_add, (void*)NULL) != 0)
+        {
+            log_message(T_LOG_WARN, SERVER_LOG, __FILE__, "Connection add thread creation failed: %s", strerror(errno));
+            close(srv.sock);
+            finish_logging();
+            exit(EXIT_FAILURE);
+        }
+        log_message(T_LOG_INFO, SERVER_LOG, __FILE__, "Connection add thread started");
+        srv.threads[srv.thread_count] = connection_add_thread;
+        srv.thread_count++;
+    }
 
     while (!quit_flag)
         usleep(100000); // 100 ms
@@ -673,17 +829,27 @@ int run_server()
     // exit
     pthread_cancel(cli_thread);
     pthread_cancel(info_update_thread);
-    pthread_cancel(msg_queue_thread);
-    pthread_cancel(client_ping_thread);
-    pthread_cancel(connection_add_thread);
+    if (!multi_reactor)
+        pthread_cancel(connection_add_thread);
 
     for (int i = 0; i < srv.thread_count; ++i)
         pthread_join(srv.threads[i], NULL);
+    // routers deliver to reactor connections, handshakes and auth jobs complete into the reactors, so all of them are stopped first
+    router_pool_stop(&srv.routers);
+    handshake_pool_stop(&srv.handshakes);
+    auth_pool_stop(&srv.auths);
+    for (int i = 0; i < srv.reactor_count; ++i)
+        reactor_stop(&srv.reactors[i]);
+    free(srv.reactors);
+    // no thread reads the client map anymore, so the retired connections are reclaimed within the grace epochs
+    for (int i = 0; i <= EBR_GRACE_EPOCHS && ebr_pending(); ++i)
+        ebr_collect();
 
-    sts_queue.destroy(srv.message_queue);
     hash_map_destroy(srv.client_map);
+    presence_destroy(&srv.presence);
     destroy_ssl(&srv);
-    close(srv.sock);
+    if (!multi_reactor) // otherwise closed by the first reactor
+        close(srv.sock);
 
     log_message(T_LOG_INFO, SERVER_LOG, __FILE__, "Server shutting down");
     finish_logging();
@@ -4,433 +4,589 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
 #include <arpa/inet.h>
 
+#include "server.h"
 #include "server_db.h"
+#include "server_reactor.h"
 #include "log.h"
 #include "hash_map.h"
 
-int user_auth(request* req, client_connection* cl, hash_map* user_map)
+static void auth_send(connection* conn, message_type type, int code)
 {
     message msg;
-    char buffer[BUFFER_SIZE];
-    int nbytes;
+    char send_msg[MAX_PAYLOAD_SIZE];
+    sprintf(send_msg, "%d", code);
+    create_message(&msg, type, "server", CLIENT_DEFAULT_NAME, send_msg);
+    connection_send(conn, &msg);
+}
 
-    sqlite3* db;
-    sqlite3_stmt* stmt = NULL;
-    int db_result = connect_db(&db, DB_NAME);
-    if (db_result != DATABASE_CONNECTION_SUCCESS)
+static void auth_send_uid(connection* conn)
+{
+    message msg;
+    client_connection* cl = &conn->cl;
+
+    // send username + separator + uid
+    char send_data[HASH_MESSAGE_LENGTH + strlen(cl->username) + strlen(MESSAGE_DELIMITER) + 1]; // Buffer to hold username + separator + uid
+    snprintf(send_data, sizeof(send_data), "%s%s%s", cl->username, MESSAGE_DELIMITER, cl->uid); // Concatenate username, separator, and uid
+    create_message(&msg, MESSAGE_UID, "server", CLIENT_DEFAULT_NAME, send_data); // Pass the new buffer to create_message
+    connection_send(conn, &msg);
+}
+
+static void auth_prompt_username(connection* conn)
+{
+    auth_state* auth = &conn->auth;
+    if (!auth->attempts)
+    {
+        auth_send(conn, MESSAGE_TOAST, MESSAGE_CODE_WELCOME);
+        auth_send(conn, MESSAGE_AUTH_ATTEMPS, USER_LOGIN_ATTEMPTS - auth->attempts);
+        auth_send(conn, MESSAGE_AUTH, MESSAGE_CODE_USER_REGISTER_INFO);
+    }
+    else
+        auth_send(conn, MESSAGE_AUTH_ATTEMPS, USER_LOGIN_ATTEMPTS - auth->attempts);
+    auth_send(conn, MESSAGE_AUTH, MESSAGE_CODE_ENTER_USERNAME);
+    auth->stage = AUTH_STAGE_USERNAME;
+}
+
+// returns USER_AUTHENTICATION_IN_PROGRESS while attempts are left, otherwise USER_AUTHENTICATION_FAILURE
+static int auth_next_attempt(connection* conn)
+{
+    if (conn->auth.attempts >= USER_LOGIN_ATTEMPTS)
+        return USER_AUTHENTICATION_FAILURE;
+    auth_prompt_username(conn);
+    return USER_AUTHENTICATION_IN_PROGRESS;
+}
+
+void user_auth_begin(connection* conn)
+{
+    memset(&conn->auth, 0, sizeof(conn->auth));
+    auth_prompt_username(conn);
+}
+
+// hands the database stage of the connection to a worker, the reactor answers the client once the job comes back
+static int auth_submit(connection* conn, auth_pool* pool, auth_stage stage, const char* password)
+{
+    auth_state* auth = &conn->auth;
+    auth_job* job = &auth->job;
+    job->conn = conn;
+    job->target = conn->owner;
+    job->stage = stage;
+    memcpy(job->username, auth->username, sizeof(job->username));
+    snprintf(job->password, sizeof(job->password), "%s", password);
+    job->uid[0] = '\0';
+    job->result = USER_AUTHENTICATION_IN_PROGRESS;
+    job->next = NULL;
+
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->stop)
     {
-        close(req->sock);
+        pthread_mutex_unlock(&pool->mutex);
+        memset(job->password, 0, sizeof(job->password));
         return USER_AUTHENTICATION_DATABASE_CONNECTION_FAILURE;
     }
+    auth->busy = 1;
+    if (pool->tail)
+        pool->tail->next = job;
+    else
+        pool->head = job;
+    pool->tail = job;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+    return USER_AUTHENTICATION_IN_PROGRESS;
+}
+
+static int auth_username(connection* conn, message* msg, hash_map* user_map, auth_pool* pool)
+{
+    auth_state* auth = &conn->auth;
+    request* req = &conn->req;
+
+    snprintf(auth->username, MAX_USERNAME_LENGTH, "%.*s", MAX_USERNAME_LENGTH - 1, msg->payload);
+    auth->username[MAX_USERNAME_LENGTH] = '\0';
+
+    log_message(T_LOG_INFO, REQUESTS_LOG, __FILE__, "Request from %s:%d for username %s", inet_ntoa(req->addr.sin_addr), ntohs(req->addr.sin_port), auth->username);
+
+    // a user that is online exists, so the database is not asked
+    client_connection* online_cl = NULL;
+    if (hash_map_find_by_name(user_map, auth->username, &online_cl))
+    {
+        log_message(T_LOG_INFO, REQUESTS_LOG, __FILE__, "Request from %s:%d failed authentication - user already online", inet_ntoa(req->addr.sin_addr), ntohs(req->addr.sin_port));
+        auth_send(conn, MESSAGE_AUTH, MESSAGE_CODE_USER_ALREADY_ONLINE);
+        auth->attempts++;
+        return auth_next_attempt(conn);
+    }
+    return auth_submit(conn, pool, AUTH_STAGE_USERNAME, "");
+}
 
-    int attempts = 0;
-    while (attempts < USER_LOGIN_ATTEMPTS)
+static int auth_username_done(connection* conn, int result)
+{
+    auth_state* auth = &conn->auth;
+    request* req = &conn->req;
+
+    if (result == USER_AUTHENTICATION_USERNAME_DOES_NOT_EXIST)
     {
-        char send_msg[MAX_PAYLOAD_SIZE];
-        send_msg[0] = '\0';
-        if (!attempts)
-        {
-            sprintf(send_msg, "%d", MESSAGE_CODE_WELCOME);
-            create_message(&msg, MESSAGE_TOAST, "server", CLIENT_DEFAULT_NAME, send_msg);
-            send_message(req->ssl, &msg);
-            send_msg[0] = '\0';
-            sprintf(send_msg, "%d", USER_LOGIN_ATTEMPTS - attempts);
-            create_message(&msg, MESSAGE_AUTH_ATTEMPS, "server", CLIENT_DEFAULT_NAME, send_msg);
-            send_message(req->ssl, &msg);
-            send_msg[0] = '\0';
-            sprintf(send_msg, "%d", MESSAGE_CODE_USER_REGISTER_INFO);
-            create_message(&msg, MESSAGE_AUTH, "server", CLIENT_DEFAULT_NAME, send_msg);
-            send_message(req->ssl, &msg);
-        }
-        else
+        if (!auth->attempts)
         {
-            sprintf(send_msg, "%d", USER_LOGIN_ATTEMPTS - attempts);
-            create_message(&msg, MESSAGE_AUTH_ATTEMPS, "server", CLIENT_DEFAULT_NAME, send_msg);
-            send_message(req->ssl, &msg);
+            // register
+            auth_send(conn, MESSAGE_AUTH, MESSAGE_CODE_USER_DOES_NOT_EXIST);
+            auth_send(conn, MESSAGE_CHOICE, MESSAGE_CODE_USER_REGISTER_CHOICE);
+            auth->stage = AUTH_STAGE_REGISTER_CHOICE;
+            return USER_AUTHENTICATION_IN_PROGRESS;
         }
-        send_msg[0] = '\0';
-        sprintf(send_msg, "%d", MESSAGE_CODE_ENTER_USERNAME);
-        create_message(&msg, MESSAGE_AUTH, "server", CLIENT_DEFAULT_NAME, send_msg);
-        send_message(req->ssl, &msg);
 
-        nbytes = SSL_read(req->ssl, buffer, sizeof(buffer));
-        if (nbytes <= 0)
+        auth->attempts++;
+        if (auth->attempts == USER_LOGIN_ATTEMPTS)
         {
-            close(req->sock);
-            return USER_AUTHENTICATION_USERNAME_RECEIVE_FAILURE;
+            auth_send(conn, MESSAGE_AUTH, MESSAGE_CODE_USER_DOES_NOT_EXIST);
+            auth_send(conn, MESSAGE_ERROR, MESSAGE_CODE_USER_AUTHENTICATION_ATTEMPTS_EXCEEDED);
+            log_message(T_LOG_INFO, REQUESTS_LOG, __FILE__, "Request from %s:%d failed authentication - out of login attempts", inet_ntoa(req->addr.sin_addr), ntohs(req->addr.sin_port));
+            return USER_AUTHENTICATION_ATTEMPTS_EXCEEDED;
         }
+        auth_send(conn, MESSAGE_AUTH, MESSAGE_CODE_USER_DOES_NOT_EXIST);
+        auth_send(conn, MESSAGE_AUTH, MESSAGE_CODE_TRY_AGAIN);
+        return auth_next_attempt(conn);
+    }
+    else if (result != USER_AUTHENTICATION_SUCCESS)
+        return result;
 
-        parse_message(&msg, buffer);
+    // username exists, authenticate credentials
+    auth_send(conn, MESSAGE_AUTH, MESSAGE_CODE_ENTER_PASSWORD);
+    auth->stage = AUTH_STAGE_LOGIN_PASSWORD;
+    return USER_AUTHENTICATION_IN_PROGRESS;
+}
 
-        char username[MAX_USERNAME_LENGTH + 1];
-        snprintf(username, MAX_USERNAME_LENGTH, "%.*s", MAX_USERNAME_LENGTH - 1, msg.payload);
-        username[MAX_USERNAME_LENGTH] = '\0';
+static int auth_register_choice(connection* conn, message* msg)
+{
+    auth_state* auth = &conn->auth;
+    request* req = &conn->req;
 
-        log_message(T_LOG_INFO, REQUESTS_LOG, __FILE__, "Request from %s:%d for username %s", inet_ntoa(req->addr.sin_addr), ntohs(req->addr.sin_port), username);
+    if (!strcmp(msg->payload, "y") || !strcmp(msg->payload, "Y"))
+    {
+        auth_send(conn, MESSAGE_AUTH, MESSAGE_CODE_ENTER_PASSWORD);
+        auth->stage = AUTH_STAGE_REGISTER_PASSWORD;
+        return USER_AUTHENTICATION_IN_PROGRESS;
+    }
+    else if (!strcmp(msg->payload, "n") || !strcmp(msg->payload, "N"))
+    {
+        auth->attempts++;
+        return auth_next_attempt(conn);
+    }
+
+    char choice_truncated[4];
+    snprintf(choice_truncated, 4, "%.*s", 3, msg->payload);
+    log_message(T_LOG_INFO, REQUESTS_LOG, __FILE__, "Request from %s:%d failed authentication - invalid choice: %s", inet_ntoa(req->addr.sin_addr), ntohs(req->addr.sin_port), choice_truncated);
+    return USER_AUTHENTICATION_INVALID_CHOICE;
+}
+
+static int auth_register(connection* conn, message* msg, auth_pool* pool)
+{
+    auth_state* auth = &conn->auth;
 
-        char* sql = "SELECT uid FROM users WHERE username = ?;";
+    char password_confirmation[MAX_PASSWORD_LENGTH];
+    snprintf(password_confirmation, MAX_PASSWORD_LENGTH, "%.*s", MAX_PASSWORD_LENGTH - 1, msg->payload);
 
-        if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) != SQLITE_OK)
+    if (strcmp(auth->password, password_confirmation))
+    {
+        auth_send(conn, MESSAGE_AUTH, MESSAGE_CODE_PASSWORDS_DO_NOT_MATCH);
+        auth_send(conn, MESSAGE_AUTH, MESSAGE_CODE_TRY_AGAIN);
+        auth->attempts++;
+        return auth_next_attempt(conn);
+    }
+    return auth_submit(conn, pool, AUTH_STAGE_REGISTER_PASSWORD_CONFIRMATION, auth->password);
+}
+
+// takes the username and UID of the authenticated user, returns USER_AUTHENTICATION_SUCCESS on success
+static int auth_set_user(connection* conn)
+{
+    auth_state* auth = &conn->auth;
+    client_connection* cl = &conn->cl;
+    request* req = &conn->req;
+
+    snprintf(cl->username, MAX_USERNAME_LENGTH + 1, "%s", auth->username);
+    cl->uid = (char*)malloc(strlen(auth->job.uid) + 1);
+    if (!cl->uid)
+    {
+        fprintf(stderr, "Failed to allocate memory for UID\n");
+        log_message(T_LOG_WARN, REQUESTS_LOG, __FILE__, "Failed to allocate memory for UID - request from %s:%d", inet_ntoa(req->addr.sin_addr), ntohs(req->addr.sin_port));
+        log_message(T_LOG_WARN, SERVER_LOG, __FILE__, "Failed to allocate memory for UID - request from %s:%d", inet_ntoa(req->addr.sin_addr), ntohs(req->addr.sin_port));
+        return USER_AUTHENTICATION_MEMORY_ALLOCATION_FAILURE;
+    }
+    strcpy(cl->uid, auth->job.uid);
+    return USER_AUTHENTICATION_SUCCESS;
+}
+
+static int auth_register_done(connection* conn, int result)
+{
+    auth_state* auth = &conn->auth;
+    client_connection* cl = &conn->cl;
+
+    if (result != USER_AUTHENTICATION_SUCCESS || (result = auth_set_user(conn)) != USER_AUTHENTICATION_SUCCESS)
+        return result;
+
+    log_message(T_LOG_INFO, REQUESTS_LOG, __FILE__, "Registered user %s with UID %s", auth->username, cl->uid);
+
+    // send auth success message without UID specified as recipient parameter. user should be reading UID from next message now on
+    auth_send(conn, MESSAGE_AUTH, MESSAGE_CODE_USER_CREATED);
+    auth_send_uid(conn);
+    return USER_AUTHENTICATION_SUCCESS;
+}
+
+static int auth_login(connection* conn, message* msg, auth_pool* pool)
+{
+    char password[MAX_PASSWORD_LENGTH];
+    snprintf(password, MAX_PASSWORD_LENGTH, "%.*s", MAX_PASSWORD_LENGTH - 1, msg->payload);
+    int result = auth_submit(conn, pool, AUTH_STAGE_LOGIN_PASSWORD, password);
+    memset(password, 0, sizeof(password));
+    return result;
+}
+
+static int auth_login_done(connection* conn, int result)
+{
+    auth_state* auth = &conn->auth;
+    client_connection* cl = &conn->cl;
+    request* req = &conn->req;
+
+    if (result == USER_AUTHENTICATION_USER_AUTHENTICATION_FAILURE)
+    {
+        log_message(T_LOG_INFO, REQUESTS_LOG, __FILE__, "Request from %s:%d failed authentication - invalid password", inet_ntoa(req->addr.sin_addr), ntohs(req->addr.sin_port));
+        auth->attempts++;
+        if (auth->attempts == USER_LOGIN_ATTEMPTS)
         {
-            fprintf(stderr, "Can't prepare username query: %s\n", sqlite3_errmsg(db));
-            goto cleanup;
+            auth_send(conn, MESSAGE_AUTH, MESSAGE_CODE_INVALID_PASSWORD);
+            auth_send(conn, MESSAGE_ERROR, MESSAGE_CODE_USER_AUTHENTICATION_ATTEMPTS_EXCEEDED);
         }
-
-        if (sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC) != SQLITE_OK)
+        else
         {
-            fprintf(stderr, "Can't bind username parameter: %s\n", sqlite3_errmsg(db));
-            goto cleanup;
+            auth_send(conn, MESSAGE_AUTH, MESSAGE_CODE_ENTER_PASSWORD);
+            auth_send(conn, MESSAGE_AUTH, MESSAGE_CODE_TRY_AGAIN);
         }
 
-        if (sqlite3_step(stmt) != SQLITE_ROW)
+        if (auth->attempts >= USER_LOGIN_ATTEMPTS)
         {
-            if (!attempts)
-            {
-                // register
-                send_msg[0] = '\0';
-                sprintf(send_msg, "%d", MESSAGE_CODE_USER_DOES_NOT_EXIST);
-                create_message(&msg, MESSAGE_AUTH, "server", CLIENT_DEFAULT_NAME, send_msg);
-                send_message(req->ssl, &msg);
-                send_msg[0] = '\0';
-                sprintf(send_msg, "%d", MESSAGE_CODE_USER_REGISTER_CHOICE);
-                create_message(&msg, MESSAGE_CHOICE, "server", CLIENT_DEFAULT_NAME, send_msg);
-                send_message(req->ssl, &msg);
-
-                nbytes = SSL_read(req->ssl, buffer, sizeof(buffer));
-                if (nbytes <= 0)
-                {
-                    goto cleanup;
-                }
-
-                parse_message(&msg, buffer);
-
-                if (!strcmp(msg.payload, "y") || !strcmp(msg.payload, "Y"))
-                {
-                    send_msg[0] = '\0';
-                    sprintf(send_msg, "%d", MESSAGE_CODE_ENTER_PASSWORD);
-                    create_message(&msg, MESSAGE_AUTH, "server", CLIENT_DEFAULT_NAME, send_msg);
-                    send_message(req->ssl, &msg);
-
-                    nbytes = SSL_read(req->ssl, buffer, sizeof(buffer));
-                    if (nbytes <= 0)
-                    {
-                        goto cleanup;
-                    }
-
-                    parse_message(&msg, buffer);
-
-                    char password[MAX_PASSWORD_LENGTH];
-                    snprintf(password, MAX_PASSWORD_LENGTH, "%.*s", MAX_PASSWORD_LENGTH - 1, msg.payload);
-
-                    send_msg[0] = '\0';
-                    sprintf(send_msg, "%d", MESSAGE_CODE_ENTER_PASSWORD_CONFIRMATION);
-                    create_message(&msg, MESSAGE_AUTH, "server", CLIENT_DEFAULT_NAME, send_msg);
-                    send_message(req->ssl, &msg);
-
-                    nbytes = SSL_read(req->ssl, buffer, sizeof(buffer));
-                    if (nbytes <= 0)
-                    {
-                        goto cleanup;
-                    }
-
-                    parse_message(&msg, buffer);
-
-                    char password_confirmation[MAX_PASSWORD_LENGTH];
-                    snprintf(password_confirmation, MAX_PASSWORD_LENGTH, "%.*s", MAX_PASSWORD_LENGTH - 1, msg.payload);
-
-                    if (!strcmp(password, password_confirmation))
-                    {
-                        // save username and password to database
-                        snprintf(cl->username, MAX_USERNAME_LENGTH + 1, "%s", username);
-
-                        cl->uid = (char*)malloc(HASH_HEX_OUTPUT_LENGTH);
-                        if (!cl->uid)
-                        {
-                            fprintf(stderr, "Failed to allocate memory for UID\n");
-                            log_message(T_LOG_WARN, REQUESTS_LOG, __FILE__, "Failed to allocate memory for UID - register request from %s:%d", inet_ntoa(req->addr.sin_addr), ntohs(req->addr.sin_port));
-                            log_message(T_LOG_WARN, SERVER_LOG, __FILE__, "Failed to allocate memory for UID - register request from %s:%d", inet_ntoa(req->addr.sin_addr), ntohs(req->addr.sin_port));
-                            goto cleanup;
-                        }
-                        if (get_hash((unsigned char*)username, cl->uid) != 0)
-                        {
-                            fprintf(stderr, "Failed to hash username\n");
-                            log_message(T_LOG_WARN, REQUESTS_LOG, __FILE__, "Failed to hash username - register request from %s:%d", inet_ntoa(req->addr.sin_addr), ntohs(req->addr.sin_port));
-                            log_message(T_LOG_WARN, SERVER_LOG, __FILE__, "Failed to hash username - register request from %s:%d", inet_ntoa(req->addr.sin_addr), ntohs(req->addr.sin_port));
-                            goto cleanup;
-                        }
-
-                        char password_hash[HASH_HEX_OUTPUT_LENGTH];
-                        if (get_hash((unsigned char*)password, password_hash) != 0)
-                        {
-                            fprintf(stderr, "Failed to hash password\n");
-                            log_message(T_LOG_WARN, REQUESTS_LOG, __FILE__, "Failed to hash password - register request from %s:%d", inet_ntoa(req->addr.sin_addr), ntohs(req->addr.sin_port));
-                            log_message(T_LOG_WARN, SERVER_LOG, __FILE__, "Failed to hash password - register request from %s:%d", inet_ntoa(req->addr.sin_addr), ntohs(req->addr.sin_port));
-                            goto cleanup;
-                        }
-
-                        sql = "INSERT INTO users (username, uid, password_hash, last_login) VALUES (?, ?, ?, CURRENT_TIMESTAMP);";
-
-                        if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) != SQLITE_OK)
-                        {
-                            fprintf(stderr, "Can't prepare user creation query: %s\n", sqlite3_errmsg(db));
-                            goto cleanup;
-                        }
-
-                        if (sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC) != SQLITE_OK ||
-                            sqlite3_bind_text(stmt, 2, cl->uid, -1, SQLITE_STATIC) != SQLITE_OK ||
-                            sqlite3_bind_text(stmt, 3, (char*)password_hash, HASH_HEX_OUTPUT_LENGTH, SQLITE_STATIC) != SQLITE_OK)
-                        {
-                            fprintf(stderr, "Can't bind query parameters: %s\n", sqlite3_errmsg(db));
-                            goto cleanup;
-                        }
-
-                        if (sqlite3_step(stmt) != SQLITE_DONE)
-                        {
-                            fprintf(stderr, "Can't create user: %s\n", sqlite3_errmsg(db));
-                            goto cleanup;
-                        }
-
-                        sqlite3_finalize(stmt);
-                        stmt = NULL;
-                        sqlite3_close(db);
-                        cl->req = req;
-
-                        log_message(T_LOG_INFO, REQUESTS_LOG, __FILE__, "Registered user %s with UID %s", username, cl->uid);
-
-                        // send auth success message without UID specified as recipient parameter. user should be reading UID from next message now on
-                        send_msg[0] = '\0';
-                        sprintf(send_msg, "%d", MESSAGE_CODE_USER_CREATED);
-                        create_message(&msg, MESSAGE_AUTH, "server", CLIENT_DEFAULT_NAME, send_msg);
-                        send_message(req->ssl, &msg);
-
-                        // send username + separator + uid
-                        char send_data[HASH_MESSAGE_LENGTH + strlen(cl->username) + strlen(MESSAGE_DELIMITER) + 1]; // Buffer to hold username + separator + uid
-                        snprintf(send_data, sizeof(send_data), "%s%s%s", cl->username, MESSAGE_DELIMITER, cl->uid); // Concatenate username, separator, and uid
-                        create_message(&msg, MESSAGE_UID, "server", CLIENT_DEFAULT_NAME, send_data); // Pass the new buffer to create_message
-                        send_message(req->ssl, &msg);
-
-                        return USER_AUTHENTICATION_SUCCESS;
-                    }
-                    else
-                    {
-                        send_msg[0] = '\0';
-                        sprintf(send_msg, "%d", MESSAGE_CODE_PASSWORDS_DO_NOT_MATCH);
-                        create_message(&msg, MESSAGE_AUTH, "server", CLIENT_DEFAULT_NAME, send_msg);
-                        send_message(req->ssl, &msg);
-                        send_msg[0] = '\0';
-                        sprintf(send_msg, "%d", MESSAGE_CODE_TRY_AGAIN);
-                        create_message(&msg, MESSAGE_AUTH, "server", CLIENT_DEFAULT_NAME, send_msg);
-                        send_message(req->ssl, &msg);
-                        attempts++;
-                    }
-                }
-                else if (!strcmp(msg.payload, "n") || !strcmp(msg.payload, "N"))
-                {
-                    attempts++;
-                }
-                else
-                {
-                    char choice_truncated[4];
-                    snprintf(choice_truncated, 4, "%.*s", 3, msg.payload);
-                    log_message(T_LOG_INFO, REQUESTS_LOG, __FILE__, "Request from %s:%d failed authentication - invalid choice: %s", inet_ntoa(req->addr.sin_addr), ntohs(req->addr.sin_port), choice_truncated);
-                    goto cleanup;
-                }
-            }
-            else
-            {
-                attempts++;
-                if (attempts == USER_LOGIN_ATTEMPTS)
-                {
-                    send_msg[0] = '\0';
-                    sprintf(send_msg, "%d", MESSAGE_CODE_USER_DOES_NOT_EXIST);
-                    create_message(&msg, MESSAGE_AUTH, "server", CLIENT_DEFAULT_NAME, send_msg);
-                    send_message(req->ssl, &msg);
-                    send_msg[0] = '\0';
-                    sprintf(send_msg, "%d", MESSAGE_CODE_USER_AUTHENTICATION_ATTEMPTS_EXCEEDED);
-                    create_message(&msg, MESSAGE_ERROR, "server", CLIENT_DEFAULT_NAME, send_msg);
-                    send_message(req->ssl, &msg);
-
-                    log_message(T_LOG_INFO, REQUESTS_LOG, __FILE__, "Request from %s:%d failed authentication - out of login attempts", inet_ntoa(req->addr.sin_addr), ntohs(req->addr.sin_port));
-                    goto cleanup;
-                }
-                else
-                {
-                    send_msg[0] = '\0';
-                    sprintf(send_msg, "%d", MESSAGE_CODE_USER_DOES_NOT_EXIST);
-                    create_message(&msg, MESSAGE_AUTH, "server", CLIENT_DEFAULT_NAME, send_msg);
-                    send_message(req->ssl, &msg);
-                    send_msg[0] = '\0';
-                    sprintf(send_msg, "%d", MESSAGE_CODE_TRY_AGAIN);
-                    create_message(&msg, MESSAGE_AUTH, "server", CLIENT_DEFAULT_NAME, send_msg);
-                    send_message(req->ssl, &msg);
-                }
-            }
+            log_message(T_LOG_INFO, REQUESTS_LOG, __FILE__, "Request from %s:%d failed authentication - out of login attempts", inet_ntoa(req->addr.sin_addr), ntohs(req->addr.sin_port));
+            return USER_AUTHENTICATION_ATTEMPTS_EXCEEDED;
         }
-        else
-        {
-            // username exists, check if online
-            const char* uid = (const char*)sqlite3_column_text(stmt, 0); // this becomes inaccessible after first sqlite3_finalize
-
-            if (hash_map_find(user_map, uid, &cl))
-            {
-                log_message(T_LOG_INFO, REQUESTS_LOG, __FILE__, "Request from %s:%d failed authentication - user already online", inet_ntoa(req->addr.sin_addr), ntohs(req->addr.sin_port));
-                send_msg[0] = '\0';
-                sprintf(send_msg, "%d", MESSAGE_CODE_USER_ALREADY_ONLINE);
-                create_message(&msg, MESSAGE_AUTH, "server", CLIENT_DEFAULT_NAME, send_msg);
-                send_message(req->ssl, &msg);
-                sqlite3_finalize(stmt);
-                stmt = NULL;
-                attempts++;
-                continue;
-            }
-
-            // authenticate credentials
-            send_msg[0] = '\0';
-            sprintf(send_msg, "%d", MESSAGE_CODE_ENTER_PASSWORD);
-            create_message(&msg, MESSAGE_AUTH, "server", CLIENT_DEFAULT_NAME, send_msg);
-            send_message(req->ssl, &msg);
-
-            nbytes = SSL_read(req->ssl, buffer, sizeof(buffer));
-            if (nbytes <= 0)
-            {
-                goto cleanup;
-            }
-
-            parse_message(&msg, buffer);
-
-            char password[MAX_PASSWORD_LENGTH];
-            snprintf(password, MAX_PASSWORD_LENGTH, "%.*s", MAX_PASSWORD_LENGTH - 1, msg.payload);
-
-            char password_hash[HASH_HEX_OUTPUT_LENGTH];
-            if (get_hash((unsigned char*)password, password_hash) != 0)
-            {
-                fprintf(stderr, "Failed to hash password\n");
-                log_message(T_LOG_WARN, REQUESTS_LOG, __FILE__, "Failed to hash password - login request from %s:%d", inet_ntoa(req->addr.sin_addr), ntohs(req->addr.sin_port));
-                log_message(T_LOG_WARN, SERVER_LOG, __FILE__, "Failed to hash password - login request from %s:%d", inet_ntoa(req->addr.sin_addr), ntohs(req->addr.sin_port));
-                goto cleanup;
-            }
+        return auth_next_attempt(conn);
+    }
+    if (result != USER_AUTHENTICATION_SUCCESS || (result = auth_set_user(conn)) != USER_AUTHENTICATION_SUCCESS)
+        return result;
+
+    log_message(T_LOG_INFO, REQUESTS_LOG, __FILE__, "Authenticated user %s with UID %s", auth->username, cl->uid);
 
+    // send auth success message without UID specified as recipient parameter. user should be reading UID from next message now on
+    auth_send(conn, MESSAGE_AUTH, MESSAGE_CODE_USER_AUTHENTICATED);
+    auth_send_uid(conn);
+    return USER_AUTHENTICATION_SUCCESS;
+}
+
+static int auth_finish(connection* conn, int result)
+{
+    auth_state* auth = &conn->auth;
+    client_connection* cl = &conn->cl;
+
+    if (result != USER_AUTHENTICATION_SUCCESS && result != USER_AUTHENTICATION_IN_PROGRESS && cl->uid)
+    {
+        free(cl->uid);
+        cl->uid = NULL;
+    }
+    if (result != USER_AUTHENTICATION_IN_PROGRESS)
+        memset(auth->password, 0, sizeof(auth->password));
+    return result;
+}
+
+int user_auth(connection* conn, message* msg, hash_map* user_map, auth_pool* pool)
+{
+    auth_state* auth = &conn->auth;
+    request* req = &conn->req;
+
+    int result;
+    if (auth->busy)
+    {
+        // every stage is answered before the client may send again
+        log_message(T_LOG_INFO, REQUESTS_LOG, __FILE__, "Request from %s:%d failed authentication - message received while credentials were checked", inet_ntoa(req->addr.sin_addr), ntohs(req->addr.sin_port));
+        result = USER_AUTHENTICATION_FAILURE;
+    }
+    else if (auth->stage == AUTH_STAGE_REGISTER_CHOICE)
+        result = auth_register_choice(conn, msg);
+    else if (auth->stage == AUTH_STAGE_REGISTER_PASSWORD)
+    {
+        snprintf(auth->password, MAX_PASSWORD_LENGTH, "%.*s", MAX_PASSWORD_LENGTH - 1, msg->payload);
+        auth_send(conn, MESSAGE_AUTH, MESSAGE_CODE_ENTER_PASSWORD_CONFIRMATION);
+        auth->stage = AUTH_STAGE_REGISTER_PASSWORD_CONFIRMATION;
+        result = USER_AUTHENTICATION_IN_PROGRESS;
+    }
+    else if (auth->stage == AUTH_STAGE_USERNAME)
+        result = auth_username(conn, msg, user_map, pool);
+    else if (auth->stage == AUTH_STAGE_REGISTER_PASSWORD_CONFIRMATION)
+        result = auth_register(conn, msg, pool);
+    else
+        result = auth_login(conn, msg, pool);
+    return auth_finish(conn, result);
+}
+
+int user_auth_complete(connection* conn)
+{
+    auth_job* job = &conn->auth.job;
+
+    int result;
+    if (job->stage == AUTH_STAGE_USERNAME)
+        result = auth_username_done(conn, job->result);
+    else if (job->stage == AUTH_STAGE_REGISTER_PASSWORD_CONFIRMATION)
+        result = auth_register_done(conn, job->result);
+    else
+        result = auth_login_done(conn, job->result);
+    return auth_finish(conn, result);
+}
+
+static int auth_job_lookup(auth_job* job, sqlite3* db)
+{
+    sqlite3_stmt* stmt = NULL;
+    char* sql = "SELECT uid FROM users WHERE username = ?;";
+
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) != SQLITE_OK)
+    {
+        fprintf(stderr, "Can't prepare username query: %s\n", sqlite3_errmsg(db));
+        return USER_AUTHENTICATION_USERNAME_QUERY_FAILURE;
+    }
+
+    if (sqlite3_bind_text(stmt, 1, job->username, -1, SQLITE_STATIC) != SQLITE_OK)
+    {
+        fprintf(stderr, "Can't bind username parameter: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return USER_AUTHENTICATION_USERNAME_QUERY_FAILURE;
+    }
+
+    int step = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if (step == SQLITE_ROW)
+        return USER_AUTHENTICATION_SUCCESS;
+    else if (step == SQLITE_DONE)
+        return USER_AUTHENTICATION_USERNAME_DOES_NOT_EXIST;
+    fprintf(stderr, "Can't query username: %s\n", sqlite3_errmsg(db));
+    return USER_AUTHENTICATION_USERNAME_QUERY_FAILURE;
+}
+
+static int auth_job_register(auth_job* job, sqlite3* db)
+{
+    request* req = &job->conn->req;
+    sqlite3_stmt* stmt = NULL;
+
+    // the UID is the hash of the username, both hashes are taken in one batch
+    char password_hash[HASH_HEX_OUTPUT_LENGTH];
+    const unsigned char* hash_inputs[] = { (unsigned char*)job->username, (unsigned char*)job->password };
+    char* hash_outputs[] = { job->uid, password_hash };
+    if (get_hash_batch(hash_inputs, 2, hash_outputs) != 0)
+    {
+        fprintf(stderr, "Failed to hash username and password\n");
+        log_message(T_LOG_WARN, REQUESTS_LOG, __FILE__, "Failed to hash username and password - register request from %s:%d", inet_ntoa(req->addr.sin_addr), ntohs(req->addr.sin_port));
+        log_message(T_LOG_WARN, SERVER_LOG, __FILE__, "Failed to hash username and password - register request from %s:%d", inet_ntoa(req->addr.sin_addr), ntohs(req->addr.sin_port));
+        return USER_AUTHENTICATION_USER_CREATION_FAILURE;
+    }
+
+    char* sql = "INSERT INTO users (username, uid, password_hash, last_login) VALUES (?, ?, ?, CURRENT_TIMESTAMP);";
+
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) != SQLITE_OK)
+    {
+        fprintf(stderr, "Can't prepare user creation query: %s\n", sqlite3_errmsg(db));
+        return USER_AUTHENTICATION_USER_CREATION_QUERY_FAILURE;
+    }
+
+    if (sqlite3_bind_text(stmt, 1, job->username, -1, SQLITE_STATIC) != SQLITE_OK ||
+        sqlite3_bind_text(stmt, 2, job->uid, -1, SQLITE_STATIC) != SQLITE_OK ||
+        sqlite3_bind_text(stmt, 3, (char*)password_hash, HASH_HEX_OUTPUT_LENGTH, SQLITE_STATIC) != SQLITE_OK)
+    {
+        fprintf(stderr, "Can't bind query parameters: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return USER_AUTHENTICATION_USER_CREATION_QUERY_FAILURE;
+    }
+
+    if (sqlite3_step(stmt) != SQLITE_DONE)
+    {
+        fprintf(stderr, "Can't create user: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return USER_AUTHENTICATION_USER_CREATION_FAILURE;
+    }
+    sqlite3_finalize(stmt);
+    return USER_AUTHENTICATION_SUCCESS;
+}
+
+static int auth_job_login(auth_job* job, sqlite3* db)
+{
+    request* req = &job->conn->req;
+    sqlite3_stmt* stmt = NULL;
+
+    char password_hash[HASH_HEX_OUTPUT_LENGTH];
+    if (get_hash((unsigned char*)job->password, password_hash) != 0)
+    {
+        fprintf(stderr, "Failed to hash password\n");
+        log_message(T_LOG_WARN, REQUESTS_LOG, __FILE__, "Failed to hash password - login request from %s:%d", inet_ntoa(req->addr.sin_addr), ntohs(req->addr.sin_port));
+        log_message(T_LOG_WARN, SERVER_LOG, __FILE__, "Failed to hash password - login request from %s:%d", inet_ntoa(req->addr.sin_addr), ntohs(req->addr.sin_port));
+        return USER_AUTHENTICATION_FAILURE;
+    }
+
+    char* sql = "SELECT uid FROM users WHERE username = ? AND password_hash = ?;";
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) != SQLITE_OK)
+    {
+        fprintf(stderr, "Can't prepare user authentication query: %s\n", sqlite3_errmsg(db));
+        return USER_AUTHENTICATION_USER_AUTHENTICATION_QUERY_FAILURE;
+    }
+
+    if (sqlite3_bind_text(stmt, 1, job->username, -1, SQLITE_STATIC) != SQLITE_OK ||
+        sqlite3_bind_text(stmt, 2, (char*)password_hash, HASH_HEX_OUTPUT_LENGTH, SQLITE_STATIC) != SQLITE_OK)
+    {
+        fprintf(stderr, "Can't bind query parameters: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return USER_AUTHENTICATION_USER_AUTHENTICATION_QUERY_FAILURE;
+    }
+
+    int step = sqlite3_step(stmt);
+    if (step != SQLITE_ROW)
+    {
+        sqlite3_finalize(stmt);
+        if (step == SQLITE_DONE)
+            return USER_AUTHENTICATION_USER_AUTHENTICATION_FAILURE;
+        fprintf(stderr, "Can't authenticate user: %s\n", sqlite3_errmsg(db));
+        return USER_AUTHENTICATION_USER_AUTHENTICATION_QUERY_FAILURE;
+    }
+
+    // successful auth, get UID
+    snprintf(job->uid, sizeof(job->uid), "%s", (const char*)sqlite3_column_text(stmt, 0));
+    sqlite3_finalize(stmt);
+    stmt = NULL;
+
+    // last login update
+    sql = "UPDATE users SET last_login = CURRENT_TIMESTAMP WHERE uid = ?;";
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) != SQLITE_OK ||
+        sqlite3_bind_text(stmt, 1, job->uid, -1, SQLITE_STATIC) != SQLITE_OK)
+    {
+        fprintf(stderr, "Can't update last login: %s\n", sqlite3_errmsg(db));
+        if (stmt)
             sqlite3_finalize(stmt);
-            stmt = NULL;
-            sql = "SELECT uid FROM users WHERE username = ? AND password_hash = ?;";
-            if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) != SQLITE_OK)
-            {
-                fprintf(stderr, "Can't prepare user authentication query: %s\n", sqlite3_errmsg(db));
-                goto cleanup;
-            }
-
-            if (sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC) != SQLITE_OK ||
-                sqlite3_bind_text(stmt, 2, (char*)password_hash, HASH_HEX_OUTPUT_LENGTH, SQLITE_STATIC) != SQLITE_OK)
-            {
-                fprintf(stderr, "Can't bind query parameters: %s\n", sqlite3_errmsg(db));
-                goto cleanup;
-            }
-
-            if (sqlite3_step(stmt) != SQLITE_ROW)
-            {
-                log_message(T_LOG_INFO, REQUESTS_LOG, __FILE__, "Request from %s:%d failed authentication - invalid password", inet_ntoa(req->addr.sin_addr), ntohs(req->addr.sin_port));
-                attempts++;
-                if (attempts == USER_LOGIN_ATTEMPTS)
-                {
-                    send_msg[0] = '\0';
-                    sprintf(send_msg, "%d", MESSAGE_CODE_INVALID_PASSWORD);
-                    create_message(&msg, MESSAGE_AUTH, "server", CLIENT_DEFAULT_NAME, send_msg);
-                    send_message(req->ssl, &msg);
-                    send_msg[0] = '\0';
-                    sprintf(send_msg, "%d", MESSAGE_CODE_USER_AUTHENTICATION_ATTEMPTS_EXCEEDED);
-                    create_message(&msg, MESSAGE_ERROR, "server", CLIENT_DEFAULT_NAME, send_msg);
-                    send_message(req->ssl, &msg);
-                }
-                else
-                {
-                    send_msg[0] = '\0';
-                    sprintf(send_msg, "%d", MESSAGE_CODE_ENTER_PASSWORD);
-                    create_message(&msg, MESSAGE_AUTH, "server", CLIENT_DEFAULT_NAME, send_msg);
-                    send_message(req->ssl, &msg);
-                    send_msg[0] = '\0';
-                    sprintf(send_msg, "%d", MESSAGE_CODE_TRY_AGAIN);
-                    create_message(&msg, MESSAGE_AUTH, "server", CLIENT_DEFAULT_NAME, send_msg);
-                    send_message(req->ssl, &msg);
-                }
-
-                if (attempts >= USER_LOGIN_ATTEMPTS)
-                {
-                    log_message(T_LOG_INFO, REQUESTS_LOG, __FILE__, "Request from %s:%d failed authentication - out of login attempts", inet_ntoa(req->addr.sin_addr), ntohs(req->addr.sin_port));
-                    goto cleanup;
-                }
-            }
-            else
-            {
-                // successful auth, set username, get UID
-                snprintf(cl->username, MAX_USERNAME_LENGTH + 1, "%s", username);
-
-                const char* uid = (const char*)sqlite3_column_text(stmt, 0);
-                cl->uid = (char*)malloc(strlen(uid) + 1);
-                if (!cl->uid)
-                {
-                    fprintf(stderr, "Memory allocation failed for cl->uid\n");
-                    sqlite3_finalize(stmt);
-                    sqlite3_close(db);
-                    close(req->sock);
-                    return USER_AUTHENTICATION_MEMORY_ALLOCATION_FAILURE;
-                }
-                strcpy(cl->uid, uid);
-
-                sqlite3_finalize(stmt);
-                stmt = NULL;
-
-                // last login update
-                sql = "UPDATE users SET last_login = CURRENT_TIMESTAMP WHERE uid = ?;";
-                if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) != SQLITE_OK ||
-                    sqlite3_bind_text(stmt, 1, cl->uid, -1, SQLITE_STATIC) != SQLITE_OK)
-                {
-                    fprintf(stderr, "Can't update last login: %s\n", sqlite3_errmsg(db));
-                    goto cleanup;
-                }
-
-                if (sqlite3_step(stmt) != SQLITE_DONE)
-                {
-                    fprintf(stderr, "Failed to update last login: %s\n", sqlite3_errmsg(db));
-                    goto cleanup;
-                }
-
-                sqlite3_finalize(stmt);
-                stmt = NULL;
-                sqlite3_close(db);
-                cl->req = req;
-
-                log_message(T_LOG_INFO, REQUESTS_LOG, __FILE__, "Authenticated user %s with UID %s", username, cl->uid);
-
-                // send auth success message without UID specified as recipient parameter. user should be reading UID from next message now on
-                send_msg[0] = '\0';
-                sprintf(send_msg, "%d", MESSAGE_CODE_USER_AUTHENTICATED);
-                create_message(&msg, MESSAGE_AUTH, "server", CLIENT_DEFAULT_NAME, send_msg);
-                send_message(req->ssl, &msg);
-
-                // send username + separator + uid
-                char send_data[HASH_MESSAGE_LENGTH + strlen(cl->username) + strlen(MESSAGE_DELIMITER) + 1]; // Buffer to hold username + separator + uid
-                snprintf(send_data, sizeof(send_data), "%s%s%s", cl->username, MESSAGE_DELIMITER, cl->uid); // Concatenate username, separator, and uid
-                create_message(&msg, MESSAGE_UID, "server", CLIENT_DEFAULT_NAME, send_data); // Pass the new buffer to create_message
-                send_message(req->ssl, &msg);
-
-                return USER_AUTHENTICATION_SUCCESS;
-            }
+        return USER_AUTHENTICATION_LAST_LOGIN_UPDATE_FAILURE;
+    }
+
+    if (sqlite3_step(stmt) != SQLITE_DONE)
+    {
+        fprintf(stderr, "Failed to update last login: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return USER_AUTHENTICATION_LAST_LOGIN_UPDATE_FAILURE;
+    }
+    sqlite3_finalize(stmt);
+    return USER_AUTHENTICATION_SUCCESS;
+}
+
+static int auth_worker_connect(auth_worker* w)
+{
+    if (connect_db(&w->db, DB_NAME) != DATABASE_CONNECTION_SUCCESS)
+    {
+        w->db = NULL;
+        return DATABASE_OPEN_FAILURE;
+    }
+    // workers wait for each other's writes instead of failing the login with SQLITE_BUSY
+    sqlite3_busy_timeout(w->db, AUTH_BUSY_TIMEOUT);
+    return DATABASE_CONNECTION_SUCCESS;
+}
+
+static void auth_job_run(auth_worker* w, auth_job* job)
+{
+    if (!w->db && auth_worker_connect(w) != DATABASE_CONNECTION_SUCCESS)
+        job->result = USER_AUTHENTICATION_DATABASE_CONNECTION_FAILURE;
+    else if (job->stage == AUTH_STAGE_USERNAME)
+        job->result = auth_job_lookup(job, w->db);
+    else if (job->stage == AUTH_STAGE_REGISTER_PASSWORD_CONFIRMATION)
+        job->result = auth_job_register(job, w->db);
+    else
+        job->result = auth_job_login(job, w->db);
+    memset(job->password, 0, sizeof(job->password));
+}
+
+static void* auth_worker_run(void* arg)
+{
+    auth_worker* w = (auth_worker*)arg;
+    auth_pool* pool = w->pool;
+
+    log_message(T_LOG_INFO, SERVER_LOG, __FILE__, "Auth worker %d started", w->id);
+    if (auth_worker_connect(w) != DATABASE_CONNECTION_SUCCESS)
+        log_message(T_LOG_WARN, SERVER_LOG, __FILE__, "Auth worker %d could not open the database, retrying with the next job", w->id);
+
+    pthread_mutex_lock(&pool->mutex);
+    while (1)
+    {
+        while (!pool->head && !pool->stop)
+            pthread_cond_wait(&pool->cond, &pool->mutex);
+        if (pool->stop)
+            break;
+        auth_job* job = pool->head;
+        pool->head = job->next;
+        if (!pool->head)
+            pool->tail = NULL;
+        pthread_mutex_unlock(&pool->mutex);
+
+        auth_job_run(w, job);
+        atomic_fetch_add(&pool->completed, 1);
+        reactor_complete_auth(job->target, job);
+        pthread_mutex_lock(&pool->mutex);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    if (w->db)
+        sqlite3_close(w->db);
+    log_message(T_LOG_INFO, SERVER_LOG, __FILE__, "Exiting auth worker %d thread", w->id);
+    pthread_exit(NULL);
+}
+
+int auth_pool_start(auth_pool* pool, int worker_count)
+{
+    pool->worker_count = 0;
+    pool->head = NULL;
+    pool->tail = NULL;
+    pool->stop = 0;
+    atomic_init(&pool->completed, 0);
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+
+    pool->workers = (auth_worker*)calloc(worker_count, sizeof(auth_worker));
+    if (!pool->workers)
+        return AUTH_POOL_THREAD_FAILURE;
+    for (int i = 0; i < worker_count; ++i)
+    {
+        auth_worker* w = &pool->workers[i];
+        w->id = i;
+        w->db = NULL;
+        w->pool = pool;
+        if (pthread_create(&w->thread, NULL, auth_worker_run, (void*)w) != 0)
+        {
+            log_message(T_LOG_ERROR, SERVER_LOG, __FILE__, "Auth worker %d thread creation failed: %s", i, strerror(errno));
+            return AUTH_POOL_THREAD_FAILURE;
         }
+        pool->worker_count++;
     }
-    if (db)
+    return AUTH_POOL_SUCCESS;
+}
+
+void auth_pool_stop(auth_pool* pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+    for (int i = 0; i < pool->worker_count; ++i)
+        pthread_join(pool->workers[i].thread, NULL);
+
+    // the connections of queued jobs wait for an answer, they are closed by their reactors
+    while (pool->head)
     {
-        sqlite3_close(db);
+        auth_job* job = pool->head;
+        pool->head = job->next;
+        memset(job->password, 0, sizeof(job->password));
+        job->result = USER_AUTHENTICATION_DATABASE_CONNECTION_FAILURE;
+        reactor_complete_auth(job->target, job);
     }
+    pool->tail = NULL;
 
-cleanup:
-    if (stmt)
-        sqlite3_finalize(stmt);
-    if (cl->uid)
-        free(cl->uid);
-    if (db)
-        sqlite3_close(db);
-    close(req->sock);
-    return USER_AUTHENTICATION_FAILURE;
+    free(pool->workers);
+    pool->workers = NULL;
+    pool->worker_count = 0;
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->cond);
 }
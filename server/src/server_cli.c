@@ -16,9 +16,10 @@ static server_command srv_commands[] =
     {.srv_command = &srv_history, .srv_command_name = "!history", .srv_command_description = "Prints command history." },
     {.srv_command = &srv_clear, .srv_command_name = "!clear", .srv_command_description = "Clears CLI screen." },
     {.srv_command = &srv_list, .srv_command_name = "!list", .srv_command_description = "Lists authenticated users." },
+    {.srv_command = &srv_buckets, .srv_command_name = "!buckets", .srv_command_description = "Prints the probe lengths of the user map." },
     {.srv_command = &srv_ban, .srv_command_name = "!ban", .srv_command_description = "Bans given user by UID." },
     {.srv_command = &srv_mute, .srv_command_name = "!mute", .srv_command_description = "Mutes given user by UID." },
-    {.srv_command = &srv_kick, .srv_command_name = "!kick", .srv_command_description = "Kicks given user by UID." },
+    {.srv_command = &srv_kick, .srv_command_name = "!kick", .srv_command_description = "Kicks given user by username or UID." },
     {.srv_command = &srv_kick_all, .srv_command_name = "!kickall", .srv_command_description = "Kicks all authenticated users." },
     {.srv_command = &srv_broadcast, .srv_command_name = "!broadcast", .srv_command_description = "Broadcast given message to all authenticated users." },
     {.srv_command = &srv_help, .srv_command_name = "!help", .srv_command_description = "Prints command descriptions." },
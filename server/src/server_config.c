@@ -0,0 +1,116 @@
+#include "server_config.h"
+#include "server.h"
+#include "server_handshake.h"
+#include "server_router.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+static int parse_int_option(const char* value, int min, int max, int* out)
+{
+    char* end = NULL;
+    errno = 0;
+    long result = strtol(value, &end, 10);
+    if (errno || end == value || *end != '\0' || result < min || result > max)
+        return SERVER_CONFIG_INVALID_VALUE;
+    *out = (int)result;
+    return SERVER_CONFIG_SUCCESS;
+}
+
+int parse_server_config(server_config* config, int argc, char** argv)
+{
+    config->mode = SERVER_MODE_ACCEPT_THREAD;
+    config->reactor_count = 0;
+    config->handshake_workers = HANDSHAKE_WORKER_COUNT;
+    config->handshake_timeout = HANDSHAKE_TIMEOUT;
+    config->backlog = LISTEN_BACKLOG;
+    config->io = SERVER_IO_EPOLL;
+    config->router_count = ROUTER_COUNT;
+    config->node_id = -1;
+    config->presence_tick = PRESENCE_TICK;
+    config->log_overflow = LOG_OVERFLOW_BLOCK;
+    config->auth_workers = AUTH_WORKER_COUNT;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const char* arg = argv[i];
+        int result = SERVER_CONFIG_SUCCESS;
+
+        if (!strcmp(arg, "--help") || !strcmp(arg, "-h"))
+            return SERVER_CONFIG_HELP;
+        else if (!strncmp(arg, "--mode=", 7))
+        {
+            if (!strcmp(arg + 7, "accept"))
+                config->mode = SERVER_MODE_ACCEPT_THREAD;
+            else if (!strcmp(arg + 7, "multi"))
+                config->mode = SERVER_MODE_MULTI_REACTOR;
+            else
+                result = SERVER_CONFIG_INVALID_VALUE;
+        }
+        else if (!strncmp(arg, "--io=", 5))
+        {
+            if (!strcmp(arg + 5, "epoll"))
+                config->io = SERVER_IO_EPOLL;
+            else if (!strcmp(arg + 5, "uring"))
+                config->io = SERVER_IO_URING;
+            else
+                result = SERVER_CONFIG_INVALID_VALUE;
+        }
+        else if (!strncmp(arg, "--log-overflow=", 15))
+        {
+            if (!strcmp(arg + 15, "block"))
+                config->log_overflow = LOG_OVERFLOW_BLOCK;
+            else if (!strcmp(arg + 15, "drop"))
+                config->log_overflow = LOG_OVERFLOW_DROP;
+            else
+                result = SERVER_CONFIG_INVALID_VALUE;
+        }
+        else if (!strncmp(arg, "--reactors=", 11))
+            result = parse_int_option(arg + 11, 1, SERVER_CONFIG_MAX_REACTORS, &config->reactor_count);
+        else if (!strncmp(arg, "--handshake-workers=", 20))
+            result = parse_int_option(arg + 20, 1, SERVER_CONFIG_MAX_HANDSHAKE_WORKERS, &config->handshake_workers);
+        else if (!strncmp(arg, "--handshake-timeout=", 20))
+            result = parse_int_option(arg + 20, 100, SERVER_CONFIG_MAX_HANDSHAKE_TIMEOUT, &config->handshake_timeout);
+        else if (!strncmp(arg, "--auth-workers=", 15))
+            result = parse_int_option(arg + 15, 1, SERVER_CONFIG_MAX_AUTH_WORKERS, &config->auth_workers);
+        else if (!strncmp(arg, "--backlog=", 10))
+            result = parse_int_option(arg + 10, 1, SERVER_CONFIG_MAX_BACKLOG, &config->backlog);
+        else if (!strncmp(arg, "--routers=", 10))
+            result = parse_int_option(arg + 10, 1, SERVER_CONFIG_MAX_ROUTERS, &config->router_count);
+        else if (!strncmp(arg, "--node-id=", 10))
+            result = parse_int_option(arg + 10, 0, SERVER_CONFIG_MAX_NODE_ID, &config->node_id);
+        else if (!strncmp(arg, "--presence-tick=", 16))
+            result = parse_int_option(arg + 16, 1, SERVER_CONFIG_MAX_PRESENCE_TICK, &config->presence_tick);
+        else
+        {
+            fprintf(stderr, "Unknown option: %s\n", arg);
+            return SERVER_CONFIG_INVALID_OPTION;
+        }
+
+        if (result != SERVER_CONFIG_SUCCESS)
+        {
+            fprintf(stderr, "Invalid value for option: %s\n", arg);
+            return result;
+        }
+    }
+    return SERVER_CONFIG_SUCCESS;
+}
+
+void print_server_usage(const char* program)
+{
+    printf("Usage: %s [options]\n", program);
+    printf("  --mode=accept|multi        accept on a single thread (default) or on every reactor with SO_REUSEPORT\n");
+    printf("  --io=epoll|uring           reactor I/O backend, io_uring falls back to epoll if the kernel refuses it (default: epoll)\n");
+    printf("  --reactors=N               number of reactor threads (default: 4 in accept mode, one per core in multi mode)\n");
+    printf("  --handshake-workers=N      number of TLS handshake worker threads (default: %d)\n", HANDSHAKE_WORKER_COUNT);
+    printf("  --handshake-timeout=MS     time a client has to complete the TLS handshake (default: %d)\n", HANDSHAKE_TIMEOUT);
+    printf("  --auth-workers=N           number of threads running the database queries and password hashing of logins (default: %d)\n", AUTH_WORKER_COUNT);
+    printf("  --backlog=N                listen backlog of every listening socket (default: %d)\n", LISTEN_BACKLOG);
+    printf("  --routers=N                number of router shards, messages are assigned by recipient (default: %d)\n", ROUTER_COUNT);
+    printf("  --node-id=N                node ID put in the message IDs, unique per server process (default: random)\n");
+    printf("  --presence-tick=MS         interval joins and leaves are collected in before they are broadcast (default: %d)\n", PRESENCE_TICK);
+    printf("  --log-overflow=block|drop  wait for the log writer or drop log lines while a thread's log buffer is full (default: block)\n");
+    printf("  --help                     print this message\n");
+}
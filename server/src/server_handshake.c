@@ -0,0 +1,347 @@
+#define _GNU_SOURCE // clock_gettime
+
+#include "server_handshake.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <openssl/err.h>
+
+#include "server_reactor.h"
+#include "log.h"
+
+static uint64_t handshake_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void handshake_free(handshake* hs)
+{
+    if (hs->ssl)
+        SSL_free(hs->ssl);
+    close(hs->sock);
+    free(hs);
+    reactor_connection_release();
+}
+
+static void handshake_unlink(handshake_worker* w, handshake* hs)
+{
+    if (hs->prev)
+        hs->prev->next = hs->next;
+    else
+        w->oldest = hs->next;
+    if (hs->next)
+        hs->next->prev = hs->prev;
+    else
+        w->newest = hs->prev;
+}
+
+// removes the handshake from the worker, the handshake is freed unless it was handed off to a reactor
+static void handshake_finish(handshake_worker* w, handshake* hs, int result)
+{
+    handshake_pool* pool = w->pool;
+    epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, hs->sock, NULL);
+    handshake_unlink(w, hs);
+    atomic_fetch_sub(&pool->in_flight, 1);
+
+    if (result == HANDSHAKE_SUCCESS)
+    {
+        unsigned long long latency = handshake_now() - hs->start;
+        unsigned long long latency_max = atomic_load(&pool->latency_max);
+        while (latency > latency_max && !atomic_compare_exchange_weak(&pool->latency_max, &latency_max, latency));
+        atomic_fetch_add(&pool->latency_total, latency);
+        atomic_fetch_add(&pool->completed, 1);
+
+        if (reactor_add_connection(hs->target, hs->sock, hs->ssl, &hs->addr) == REACTOR_SUCCESS)
+        {
+            free(hs);
+            return;
+        }
+        log_message(T_LOG_WARN, SERVER_LOG, __FILE__, "Connection handoff failed for client %s", inet_ntoa(hs->addr.sin_addr));
+    }
+    else
+    {
+        atomic_fetch_add(&pool->failed, 1);
+        if (result == HANDSHAKE_TIMED_OUT)
+        {
+            atomic_fetch_add(&pool->timed_out, 1);
+            log_message(T_LOG_WARN, SERVER_LOG, __FILE__, "SSL handshake timed out for client %s", inet_ntoa(hs->addr.sin_addr));
+        }
+        else
+            log_message(T_LOG_ERROR, SERVER_LOG, __FILE__, "SSL handshake failed for client %s", inet_ntoa(hs->addr.sin_addr));
+    }
+    handshake_free(hs);
+}
+
+static void handshake_step(handshake_worker* w, handshake* hs)
+{
+    int result = SSL_accept(hs->ssl);
+    if (result == 1)
+    {
+        handshake_finish(w, hs, HANDSHAKE_SUCCESS);
+        return;
+    }
+
+    int ssl_error = SSL_get_error(hs->ssl, result);
+    if (ssl_error == SSL_ERROR_WANT_READ || ssl_error == SSL_ERROR_WANT_WRITE)
+    {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = (ssl_error == SSL_ERROR_WANT_WRITE ? EPOLLOUT : EPOLLIN) | EPOLLRDHUP;
+        ev.data.ptr = hs;
+        if (epoll_ctl(w->epoll_fd, EPOLL_CTL_MOD, hs->sock, &ev) == 0)
+            return;
+    }
+    ERR_clear_error();
+    handshake_finish(w, hs, HANDSHAKE_SSL_FAILURE);
+}
+
+static void handshake_register_pending(handshake_worker* w)
+{
+    uint64_t value;
+    while (read(w->event_fd, &value, sizeof(value)) > 0);
+
+    pthread_mutex_lock(&w->pending_mutex);
+    handshake* hs = w->pending;
+    w->pending = NULL;
+    pthread_mutex_unlock(&w->pending_mutex);
+
+    // the pending list is in reverse submit order, so link from its end to keep the worker list ordered by start time
+    handshake* last = hs;
+    while (last && last->next)
+        last = last->next;
+    while (last)
+    {
+        handshake* prev = last->prev;
+        last->prev = w->newest;
+        last->next = NULL;
+        if (w->newest)
+            w->newest->next = last;
+        else
+            w->oldest = last;
+        w->newest = last;
+
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.ptr = last;
+        if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, last->sock, &ev) < 0)
+            handshake_finish(w, last, HANDSHAKE_EPOLL_FAILURE);
+        else // the client hello is usually already waiting
+            handshake_step(w, last);
+        last = prev;
+    }
+}
+
+static void handshake_expire(handshake_worker* w)
+{
+    uint64_t deadline = handshake_now() - (uint64_t)w->pool->timeout * 1000;
+    while (w->oldest && w->oldest->start <= deadline)
+        handshake_finish(w, w->oldest, HANDSHAKE_TIMED_OUT);
+}
+
+static void* handshake_worker_run(void* arg)
+{
+    handshake_worker* w = (handshake_worker*)arg;
+    struct epoll_event events[HANDSHAKE_MAX_EVENTS];
+
+    log_message(T_LOG_INFO, SERVER_LOG, __FILE__, "Handshake worker %d started", w->id);
+    while (!atomic_load(&w->pool->stop))
+    {
+        int n = epoll_wait(w->epoll_fd, events, HANDSHAKE_MAX_EVENTS, HANDSHAKE_SWEEP_INTERVAL);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            log_message(T_LOG_ERROR, SERVER_LOG, __FILE__, "Handshake worker %d wait failed: %s", w->id, strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < n; ++i)
+        {
+            if (events[i].data.ptr == w)
+                handshake_register_pending(w);
+            else if (events[i].events & EPOLLERR)
+                handshake_finish(w, (handshake*)events[i].data.ptr, HANDSHAKE_SSL_FAILURE);
+            else
+                handshake_step(w, (handshake*)events[i].data.ptr);
+        }
+        handshake_expire(w);
+    }
+
+    log_message(T_LOG_INFO, SERVER_LOG, __FILE__, "Exiting handshake worker %d thread", w->id);
+    pthread_exit(NULL);
+}
+
+static int handshake_worker_start(handshake_worker* w, handshake_pool* pool, int id)
+{
+    w->id = id;
+    w->pool = pool;
+    w->pending = NULL;
+    w->oldest = NULL;
+    w->newest = NULL;
+    pthread_mutex_init(&w->pending_mutex, NULL);
+
+    w->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (w->epoll_fd < 0)
+    {
+        log_message(T_LOG_ERROR, SERVER_LOG, __FILE__, "Handshake worker %d epoll creation failed: %s", id, strerror(errno));
+        return HANDSHAKE_EPOLL_FAILURE;
+    }
+
+    w->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (w->event_fd < 0)
+    {
+        log_message(T_LOG_ERROR, SERVER_LOG, __FILE__, "Handshake worker %d eventfd creation failed: %s", id, strerror(errno));
+        close(w->epoll_fd);
+        return HANDSHAKE_EVENTFD_FAILURE;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = w;
+    if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->event_fd, &ev) < 0)
+    {
+        log_message(T_LOG_ERROR, SERVER_LOG, __FILE__, "Handshake worker %d eventfd registration failed: %s", id, strerror(errno));
+        close(w->event_fd);
+        close(w->epoll_fd);
+        return HANDSHAKE_EPOLL_FAILURE;
+    }
+
+    if (pthread_create(&w->thread, NULL, handshake_worker_run, (void*)w) != 0)
+    {
+        log_message(T_LOG_ERROR, SERVER_LOG, __FILE__, "Handshake worker %d thread creation failed: %s", id, strerror(errno));
+        close(w->event_fd);
+        close(w->epoll_fd);
+        return HANDSHAKE_THREAD_FAILURE;
+    }
+    return HANDSHAKE_SUCCESS;
+}
+
+int handshake_pool_start(handshake_pool* pool, SSL_CTX* ssl_ctx, int worker_count, int timeout)
+{
+    pool->ssl_ctx = ssl_ctx;
+    pool->worker_count = 0;
+    pool->timeout = timeout;
+    atomic_init(&pool->stop, 0);
+    atomic_init(&pool->next_worker, 0);
+    atomic_init(&pool->in_flight, 0);
+    atomic_init(&pool->completed, 0);
+    atomic_init(&pool->failed, 0);
+    atomic_init(&pool->timed_out, 0);
+    atomic_init(&pool->rejected, 0);
+    atomic_init(&pool->latency_total, 0);
+    atomic_init(&pool->latency_max, 0);
+
+    pool->workers = (handshake_worker*)calloc(worker_count, sizeof(handshake_worker));
+    if (!pool->workers)
+        return HANDSHAKE_THREAD_FAILURE;
+    for (int i = 0; i < worker_count; ++i)
+    {
+        int result = handshake_worker_start(&pool->workers[i], pool, i);
+        if (result != HANDSHAKE_SUCCESS)
+            return result;
+        pool->worker_count++;
+    }
+    return HANDSHAKE_SUCCESS;
+}
+
+void handshake_pool_stop(handshake_pool* pool)
+{
+    atomic_store(&pool->stop, 1);
+    for (int i = 0; i < pool->worker_count; ++i)
+    {
+        handshake_worker* w = &pool->workers[i];
+        uint64_t one = 1;
+        if (write(w->event_fd, &one, sizeof(one)) < 0) {}
+        pthread_join(w->thread, NULL);
+
+        while (w->pending)
+        {
+            handshake* next = w->pending->next;
+            handshake_free(w->pending);
+            w->pending = next;
+        }
+        while (w->oldest)
+        {
+            handshake* next = w->oldest->next;
+            handshake_free(w->oldest);
+            w->oldest = next;
+        }
+        close(w->event_fd);
+        close(w->epoll_fd);
+        pthread_mutex_destroy(&w->pending_mutex);
+    }
+    free(pool->workers);
+    pool->workers = NULL;
+    pool->worker_count = 0;
+}
+
+int handshake_submit(handshake_pool* pool, int sock, const struct sockaddr_in* addr, struct reactor* target)
+{
+    int stopped = atomic_load(&pool->stop);
+    if (stopped || atomic_fetch_add(&pool->in_flight, 1) >= HANDSHAKE_MAX_IN_FLIGHT)
+    {
+        if (!stopped)
+            atomic_fetch_sub(&pool->in_flight, 1);
+        atomic_fetch_add(&pool->rejected, 1);
+        log_message(T_LOG_WARN, SERVER_LOG, __FILE__, "Handshake rejected for client %s: too many handshakes in progress", inet_ntoa(addr->sin_addr));
+        close(sock);
+        reactor_connection_release();
+        return HANDSHAKE_POOL_FULL;
+    }
+
+    handshake* hs = (handshake*)calloc(1, sizeof(handshake));
+    if (hs)
+        hs->ssl = SSL_new(pool->ssl_ctx);
+    if (!hs || !hs->ssl)
+    {
+        log_message(T_LOG_ERROR, SERVER_LOG, __FILE__, "Failed to create SSL object for client");
+        if (hs && hs->ssl)
+            SSL_free(hs->ssl);
+        free(hs);
+        close(sock);
+        reactor_connection_release();
+        atomic_fetch_sub(&pool->in_flight, 1);
+        atomic_fetch_add(&pool->failed, 1);
+        return HANDSHAKE_SSL_FAILURE;
+    }
+    SSL_set_fd(hs->ssl, sock);
+    hs->sock = sock;
+    hs->addr = *addr;
+    hs->target = target;
+    hs->start = handshake_now();
+
+    handshake_worker* w = &pool->workers[atomic_fetch_add(&pool->next_worker, 1) % pool->worker_count];
+    pthread_mutex_lock(&w->pending_mutex);
+    hs->prev = NULL;
+    hs->next = w->pending;
+    if (w->pending)
+        w->pending->prev = hs;
+    w->pending = hs;
+    pthread_mutex_unlock(&w->pending_mutex);
+
+    uint64_t one = 1;
+    if (write(w->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        log_message(T_LOG_WARN, SERVER_LOG, __FILE__, "Handshake worker %d wakeup failed: %s", w->id, strerror(errno));
+    return HANDSHAKE_SUCCESS;
+}
+
+void handshake_pool_stats(handshake_pool* pool, handshake_stats* stats)
+{
+    stats->in_flight = atomic_load(&pool->in_flight);
+    stats->completed = atomic_load(&pool->completed);
+    stats->failed = atomic_load(&pool->failed);
+    stats->timed_out = atomic_load(&pool->timed_out);
+    stats->rejected = atomic_load(&pool->rejected);
+    stats->latency_avg = stats->completed ? atomic_load(&pool->latency_total) / 1000.0 / stats->completed : 0.0;
+    stats->latency_max = atomic_load(&pool->latency_max) / 1000.0;
+}
@@ -24,6 +24,7 @@ int init_ssl(struct server* server)
         finish_logging();
         return OPENSSL_SSL_CTX_CREATION_FAILURE;
     }
+    accept_binary_protocol(server->ssl_ctx);
     check_and_generate_key_cert();
     if (SSL_CTX_use_certificate_file(server->ssl_ctx, SERVER_CERT_FILE, SSL_FILETYPE_PEM) <= 0)
     {
@@ -0,0 +1,308 @@
+#define _GNU_SOURCE // clock_gettime
+#include "server_presence.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "server_reactor.h"
+#include "log.h"
+
+static size_t page_slots(size_t capacity)
+{
+    return capacity / PRESENCE_PAGE_USERS + 1;
+}
+
+int presence_init(presence* p)
+{
+    memset(p, 0, sizeof(*p));
+    p->users = (connection**)malloc(PRESENCE_INITIAL_CAPACITY * sizeof(connection*));
+    p->pages = (message_buffer**)calloc(page_slots(PRESENCE_INITIAL_CAPACITY), sizeof(message_buffer*));
+    if (!p->users || !p->pages)
+    {
+        free(p->users);
+        free(p->pages);
+        return PRESENCE_ALLOCATION_FAILURE;
+    }
+    p->capacity = PRESENCE_INITIAL_CAPACITY;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    p->version = (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+    p->broadcast_version = p->version;
+    pthread_mutex_init(&p->mutex, NULL);
+    return PRESENCE_SUCCESS;
+}
+
+void presence_destroy(presence* p)
+{
+    if (p->head)
+        message_buffer_release(p->head);
+    for (size_t i = 0; i < page_slots(p->capacity); ++i)
+        if (p->pages[i])
+            message_buffer_release(p->pages[i]);
+    free(p->pages);
+    free(p->users);
+    pthread_mutex_destroy(&p->mutex);
+}
+
+static int presence_grow(presence* p)
+{
+    size_t capacity = p->capacity * 2;
+    connection** users = (connection**)realloc(p->users, capacity * sizeof(connection*));
+    if (!users)
+        return PRESENCE_ALLOCATION_FAILURE;
+    p->users = users;
+    message_buffer** pages = (message_buffer**)realloc(p->pages, page_slots(capacity) * sizeof(message_buffer*));
+    if (!pages)
+        return PRESENCE_ALLOCATION_FAILURE;
+    memset(pages + page_slots(p->capacity), 0, (page_slots(capacity) - page_slots(p->capacity)) * sizeof(message_buffer*));
+    p->pages = pages;
+    p->capacity = capacity;
+    return PRESENCE_SUCCESS;
+}
+
+// drops the serialized frame of the page holding the slot, the first page is serialized again for every version anyway
+static void presence_invalidate(presence* p, size_t slot)
+{
+    size_t page = slot / PRESENCE_PAGE_USERS;
+    if (page && p->pages[page])
+    {
+        message_buffer_release(p->pages[page]);
+        p->pages[page] = NULL;
+    }
+}
+
+static void presence_record(presence* p, char marker, const char* username)
+{
+    presence_change* change = &p->history[++p->version % PRESENCE_HISTORY];
+    change->marker = marker;
+    snprintf(change->username, sizeof(change->username), "%s", username);
+    if (p->history_count < PRESENCE_HISTORY)
+        p->history_count++;
+}
+
+int presence_join(presence* p, connection* conn)
+{
+    pthread_mutex_lock(&p->mutex);
+    if (conn->presence_slot >= 0)
+    {
+        pthread_mutex_unlock(&p->mutex);
+        return PRESENCE_SUCCESS;
+    }
+    if (p->count == p->capacity && presence_grow(p) != PRESENCE_SUCCESS)
+    {
+        pthread_mutex_unlock(&p->mutex);
+        log_message(T_LOG_ERROR, SERVER_LOG, __FILE__, "Failed to grow the presence roster");
+        return PRESENCE_ALLOCATION_FAILURE;
+    }
+    conn->presence_slot = (int)p->count;
+    p->users[p->count++] = conn;
+    presence_invalidate(p, (size_t)conn->presence_slot);
+    presence_record(p, MESSAGE_PRESENCE_JOIN, conn->cl.username);
+    pthread_mutex_unlock(&p->mutex);
+    return PRESENCE_SUCCESS;
+}
+
+void presence_leave(presence* p, connection* conn)
+{
+    pthread_mutex_lock(&p->mutex);
+    if (conn->presence_slot >= 0)
+    {
+        // the last user moves into the freed slot, so only two pages change
+        size_t slot = (size_t)conn->presence_slot;
+        connection* last = p->users[--p->count];
+        p->users[slot] = last;
+        last->presence_slot = (int)slot;
+        conn->presence_slot = -1;
+        presence_invalidate(p, slot);
+        presence_invalidate(p, p->count);
+        presence_record(p, MESSAGE_PRESENCE_LEAVE, conn->cl.username);
+    }
+    pthread_mutex_unlock(&p->mutex);
+}
+
+// serializes presence lines into a fan-out frame, every client it is sent to queues a reference to it
+static message_buffer* presence_frame(const char* payload)
+{
+    message msg;
+    if (create_message(&msg, MESSAGE_PRESENCE, "server", "", payload) != MESSAGE_CREATION_SUCCESS)
+        return NULL;
+    return message_buffer_create_fanout(&msg);
+}
+
+static size_t presence_line(char* payload, size_t length, char marker, const char* username)
+{
+    size_t username_length = strlen(username);
+    payload[length++] = marker;
+    memcpy(payload + length, username, username_length);
+    length += username_length;
+    payload[length++] = '\n';
+    payload[length] = '\0';
+    return length;
+}
+
+// appends the join lines of the users of a page
+static size_t presence_page_lines(const presence* p, size_t page, char* payload, size_t length)
+{
+    size_t end = (page + 1) * PRESENCE_PAGE_USERS;
+    if (end > p->count)
+        end = p->count;
+    for (size_t i = page * PRESENCE_PAGE_USERS; i < end; ++i)
+        length = presence_line(payload, length, MESSAGE_PRESENCE_JOIN, p->users[i]->cl.username);
+    return length;
+}
+
+static int presence_snapshot(presence* p, message_buffer** frames, size_t* frame_count)
+{
+    char payload[MAX_PAYLOAD_SIZE];
+    if (!p->head || p->head_version != p->version)
+    {
+        size_t length = (size_t)sprintf(payload, "%c%llu %zu\n", MESSAGE_PRESENCE_SNAPSHOT, (unsigned long long)p->version, p->count);
+        presence_page_lines(p, 0, payload, length);
+        message_buffer* head = presence_frame(payload);
+        if (!head)
+            return PRESENCE_MESSAGE_FAILURE;
+        if (p->head)
+            message_buffer_release(p->head);
+        p->head = head;
+        p->head_version = p->version;
+    }
+    frames[(*frame_count)++] = message_buffer_retain(p->head);
+
+    size_t page_count = (p->count + PRESENCE_PAGE_USERS - 1) / PRESENCE_PAGE_USERS;
+    for (size_t page = 1; page < page_count; ++page)
+    {
+        if (!p->pages[page])
+        {
+            presence_page_lines(p, page, payload, 0);
+            p->pages[page] = presence_frame(payload);
+            if (!p->pages[page])
+                return PRESENCE_MESSAGE_FAILURE;
+        }
+        frames[(*frame_count)++] = message_buffer_retain(p->pages[page]);
+    }
+    return PRESENCE_SUCCESS;
+}
+
+static int presence_delta(presence* p, uint64_t since, message_buffer** frames, size_t* frame_count)
+{
+    // every frame is a delta of its own covering up to a page of changes, so a client may apply them one by one
+    char payload[MAX_PAYLOAD_SIZE];
+    uint64_t from = since;
+    do
+    {
+        uint64_t to = p->version - from > PRESENCE_PAGE_USERS ? from + PRESENCE_PAGE_USERS : p->version;
+        size_t length = (size_t)sprintf(payload, "%c%llu %llu\n", MESSAGE_PRESENCE_DELTA, (unsigned long long)from, (unsigned long long)to);
+        for (uint64_t version = from + 1; version <= to; ++version)
+        {
+            const presence_change* change = &p->history[version % PRESENCE_HISTORY];
+            length = presence_line(payload, length, change->marker, change->username);
+        }
+        message_buffer* frame = presence_frame(payload);
+        if (!frame)
+            return PRESENCE_MESSAGE_FAILURE;
+        frames[(*frame_count)++] = frame;
+        from = to;
+    } while (from < p->version);
+    return PRESENCE_SUCCESS;
+}
+
+// serializes the changes since the version under the roster lock, the caller queues and releases the frames
+static int presence_frames(presence* p, uint64_t since, message_buffer*** frames, size_t* frame_count)
+{
+    int delta = since && since <= p->version && p->version - since <= p->history_count;
+    size_t lines = delta ? (size_t)(p->version - since) : p->count;
+    *frame_count = 0;
+    *frames = (message_buffer**)malloc((lines / PRESENCE_PAGE_USERS + 1) * sizeof(message_buffer*));
+    if (!*frames)
+        return PRESENCE_ALLOCATION_FAILURE;
+    return delta ? presence_delta(p, since, *frames, frame_count) : presence_snapshot(p, *frames, frame_count);
+}
+
+static void presence_release(message_buffer** frames, size_t frame_count)
+{
+    for (size_t i = 0; i < frame_count; ++i)
+        message_buffer_release(frames[i]);
+    free(frames);
+}
+
+int presence_send(presence* p, connection* conn, uint64_t since)
+{
+    message_buffer** frames;
+    size_t frame_count;
+    pthread_mutex_lock(&p->mutex);
+    int result = presence_frames(p, since, &frames, &frame_count);
+    pthread_mutex_unlock(&p->mutex);
+
+    // the frames are queued outside the roster lock, the connection takes its own locks
+    if (result == PRESENCE_SUCCESS)
+        for (size_t i = 0; i < frame_count; ++i)
+            connection_send_buffer(conn, frames[i]);
+    presence_release(frames, frame_count);
+    if (result != PRESENCE_SUCCESS)
+        log_message(T_LOG_ERROR, SERVER_LOG, __FILE__, "Failed to serialize the presence roster");
+    return result;
+}
+
+typedef struct presence_fanout
+{
+    message_buffer** frames;
+    size_t frame_count;
+    unsigned long long recipients;
+    unsigned long long queued;
+} presence_fanout;
+
+static void presence_deliver(client_connection* cl, void* arg)
+{
+    presence_fanout* fan = (presence_fanout*)arg;
+    if (!atomic_load_explicit(&cl->is_ready, memory_order_acquire))
+        return;
+    for (size_t i = 0; i < fan->frame_count; ++i)
+        if (connection_send_buffer((connection*)cl, fan->frames[i]) == MESSAGE_SEND_SUCCESS)
+            fan->queued++;
+    fan->recipients++;
+}
+
+int presence_broadcast(presence* p, hash_map* map)
+{
+    pthread_mutex_lock(&p->mutex);
+    if (p->broadcast_version == p->version)
+    {
+        pthread_mutex_unlock(&p->mutex);
+        return PRESENCE_SUCCESS;
+    }
+    unsigned long long changes = p->version - p->broadcast_version;
+    presence_fanout fan = { NULL, 0, 0, 0 };
+    int result = presence_frames(p, p->broadcast_version, &fan.frames, &fan.frame_count);
+    p->broadcast_version = p->version;
+    pthread_mutex_unlock(&p->mutex);
+
+    // clients that logged in during the tick already hold a newer version and skip the changes their snapshot covered
+    if (result == PRESENCE_SUCCESS)
+        hash_map_iterate2(map, presence_deliver, &fan);
+    presence_release(fan.frames, fan.frame_count);
+    if (result != PRESENCE_SUCCESS)
+    {
+        log_message(T_LOG_ERROR, SERVER_LOG, __FILE__, "Failed to serialize the presence broadcast");
+        return result;
+    }
+
+    atomic_fetch_add(&p->broadcasts, 1);
+    atomic_fetch_add(&p->broadcast_changes, changes);
+    atomic_fetch_add(&p->broadcast_frames, fan.queued);
+    if (changes * fan.recipients > fan.queued)
+        atomic_fetch_add(&p->messages_saved, changes * fan.recipients - fan.queued);
+    log_message(T_LOG_INFO, SERVER_LOG, __FILE__, "Broadcast %llu presence changes in %zu frames to %llu clients", changes, fan.frame_count, fan.recipients);
+    return PRESENCE_SUCCESS;
+}
+
+uint64_t presence_version(presence* p, size_t* count)
+{
+    pthread_mutex_lock(&p->mutex);
+    uint64_t version = p->version;
+    if (count)
+        *count = p->count;
+    pthread_mutex_unlock(&p->mutex);
+    return version;
+}
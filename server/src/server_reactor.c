@@ -0,0 +1,1364 @@
+#define _GNU_SOURCE // pthread_setaffinity_np and CPU_SET for pinning reactors
+
+#include "server_reactor.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#include "protocol.h"
+#include "server.h"
+#include "server_handshake.h"
+#include "log.h"
+
+// io_uring request kinds, stored in the low bits of the user data next to the aligned reactor or connection pointer
+#define URING_OP_WAKE 1
+#define URING_OP_ACCEPT 2
+#define URING_OP_RECV 3
+#define URING_OP_SEND 4
+#define URING_OP_CANCEL 5
+#define URING_OP_MASK 7
+
+static atomic_size_t connection_total = 0;
+static atomic_size_t connection_limit = MAX_CLIENTS;
+
+// connection records are recycled across reactors, the handshake workers allocate them and the reactors free them
+static mem_pool connection_pool = MEM_POOL_INITIALIZER(sizeof(connection));
+
+static pthread_mutex_t admission_mutex = PTHREAD_MUTEX_INITIALIZER;
+static listener* paused_listeners = NULL;
+static atomic_int paused_count = 0;
+
+static void reactor_wake(reactor* r);
+static int uring_connection_send_next(connection* conn);
+static int reactor_flush_connections(reactor* r);
+static int reactor_wait_timeout(reactor* r);
+static int connection_gather(connection* conn);
+static void reactor_release_connection(reactor* r, connection* conn);
+
+size_t reactor_connection_total()
+{
+    return atomic_load(&connection_total);
+}
+
+void reactor_connection_stats(mem_pool_stats* stats)
+{
+    mem_pool_get_stats(&connection_pool, stats);
+}
+
+static void listener_set_interest(listener* l, uint32_t events)
+{
+    atomic_store(&l->paused, events == 0);
+    if (l->epoll_fd < 0)
+    {
+        // the reactor accepting through io_uring cancels its accept itself and re-arms it when woken
+        uint64_t one = 1;
+        if (events && write(l->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            log_message(T_LOG_WARN, SERVER_LOG, __FILE__, "Failed to wake paused listener: %s", strerror(errno));
+        return;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = l;
+    if (epoll_ctl(l->epoll_fd, EPOLL_CTL_MOD, l->fd, &ev) < 0)
+        log_message(T_LOG_WARN, SERVER_LOG, __FILE__, "Failed to modify listener interest: %s", strerror(errno));
+}
+
+// must be called with admission_mutex held and the paused count raised
+static void listener_pause(listener* l)
+{
+    listener_set_interest(l, 0);
+    l->next_paused = paused_listeners;
+    paused_listeners = l;
+}
+
+// returns 1 if the listener was paused because the server is full, a listener that is paused already is left alone
+static int listener_pause_if_full(listener* l)
+{
+    // below the limit nothing is paused, so accepts on different listeners meet on the admission mutex only once the server is full
+    if (reactor_connection_total() < atomic_load(&connection_limit))
+        return 0;
+
+    // the count is raised before the limit is checked, so a concurrent release either lets this check pass or sees a paused listener
+    pthread_mutex_lock(&admission_mutex);
+    if (atomic_load(&l->paused))
+    {
+        // listed once only, pushing it again would link the listener to itself
+        pthread_mutex_unlock(&admission_mutex);
+        return 1;
+    }
+    atomic_fetch_add(&paused_count, 1);
+    int full = reactor_connection_total() >= atomic_load(&connection_limit);
+    if (full)
+        listener_pause(l);
+    else
+        atomic_fetch_sub(&paused_count, 1);
+    pthread_mutex_unlock(&admission_mutex);
+    return full;
+}
+
+// returns 1 if the listener was paused because the process ran out of descriptors, the next release of a connection resumes it
+static int listener_pause_exhausted(listener* l, size_t total)
+{
+    pthread_mutex_lock(&admission_mutex);
+    int paused = atomic_load(&l->paused);
+    if (!paused)
+    {
+        // a connection released since the failed accept freed a descriptor already, and without connections no release would resume the listener
+        atomic_fetch_add(&paused_count, 1);
+        paused = total > 0 && reactor_connection_total() >= total;
+        if (paused)
+            listener_pause(l);
+        else
+            atomic_fetch_sub(&paused_count, 1);
+    }
+    pthread_mutex_unlock(&admission_mutex);
+    return paused;
+}
+
+size_t reactor_limit_connections(size_t max_connections)
+{
+    size_t limit = max_connections;
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0)
+    {
+        // the soft limit is raised as far as the hard limit allows, the default of 1024 descriptors is far below the client limit
+        rlim_t wanted = (rlim_t)(max_connections + CONNECTION_RESERVED_FDS);
+        if (rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < wanted)
+        {
+            rl.rlim_cur = rl.rlim_max != RLIM_INFINITY && rl.rlim_max < wanted ? rl.rlim_max : wanted;
+            if (setrlimit(RLIMIT_NOFILE, &rl) < 0)
+                getrlimit(RLIMIT_NOFILE, &rl);
+        }
+        if (rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < wanted)
+            limit = rl.rlim_cur > CONNECTION_RESERVED_FDS ? (size_t)rl.rlim_cur - CONNECTION_RESERVED_FDS : 1;
+    }
+    atomic_store(&connection_limit, limit);
+    return limit;
+}
+
+void reactor_connection_release()
+{
+    atomic_fetch_sub(&connection_total, 1);
+    if (!atomic_load(&paused_count))
+        return;
+
+    pthread_mutex_lock(&admission_mutex);
+    int resumed = 0;
+    while (paused_listeners)
+    {
+        listener_set_interest(paused_listeners, EPOLLIN);
+        paused_listeners = paused_listeners->next_paused;
+        resumed++;
+    }
+    atomic_fetch_sub(&paused_count, resumed);
+    pthread_mutex_unlock(&admission_mutex);
+}
+
+int listener_register(listener* l, int fd, int epoll_fd)
+{
+    l->fd = fd;
+    l->epoll_fd = epoll_fd;
+    l->wake_fd = -1;
+    atomic_init(&l->paused, 0);
+    l->next_paused = NULL;
+
+    int flags = fcntl(fd, F_GETFL, 0);
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = l;
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        return REACTOR_LISTENER_FAILURE;
+    return REACTOR_SUCCESS;
+}
+
+int listener_accept(listener* l, struct sockaddr_in* addr)
+{
+    if (listener_pause_if_full(l))
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    size_t total = reactor_connection_total();
+    socklen_t addr_len = sizeof(*addr);
+    int sock;
+    do
+        sock = accept4(l->fd, (struct sockaddr*)addr, &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    while (sock < 0 && errno == EINTR);
+    // the slot is taken at accept time, so connections still in the handshake count against the limit
+    if (sock >= 0)
+        atomic_fetch_add(&connection_total, 1);
+    else if (errno == EMFILE || errno == ENFILE)
+    {
+        // the pending connection keeps the listener readable, so it waits for a descriptor instead of failing on every wakeup
+        int error = errno;
+        listener_pause_exhausted(l, total);
+        errno = error;
+    }
+    return sock;
+}
+
+int reactor_enable_reuseport(int sock)
+{
+    int enable = 1;
+    return setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable));
+}
+
+static uint64_t reactor_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void reactor_wake(reactor* r)
+{
+    uint64_t one = 1;
+    if (write(r->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        log_message(T_LOG_WARN, SERVER_LOG, __FILE__, "Reactor %d wakeup failed: %s", r->id, strerror(errno));
+}
+
+static void connection_set_interest(connection* conn, int writable)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLRDHUP | (writable ? EPOLLOUT : 0);
+    ev.data.ptr = conn;
+    if (epoll_ctl(conn->owner->epoll_fd, EPOLL_CTL_MOD, conn->req.sock, &ev) < 0)
+        log_message(T_LOG_WARN, SERVER_LOG, __FILE__, "Reactor %d failed to modify interest of client %d: %s", conn->owner->id, conn->cl.id, strerror(errno));
+    conn->out_armed = writable;
+}
+
+// must be called with ssl_mutex held
+static int connection_flush(connection* conn)
+{
+    if (connection_gather(conn) != 0)
+        return MESSAGE_SEND_FAILURE;
+
+    if (conn->owner->io == SERVER_IO_URING)
+    {
+        // a memory BIO takes every record, the reactor sends them once the connection is scheduled
+        while (conn->out_len > 0)
+        {
+            int bytes_sent = SSL_write(conn->req.ssl, conn->out_buf + conn->out_start, conn->out_len);
+            if (bytes_sent <= 0)
+            {
+                ERR_clear_error();
+                return MESSAGE_SEND_FAILURE;
+            }
+            conn->out_start += bytes_sent;
+            conn->out_len -= bytes_sent;
+        }
+        conn->out_start = 0;
+        if (BIO_ctrl_pending(SSL_get_wbio(conn->req.ssl)) + conn->tx_len > CONNECTION_OUTPUT_LIMIT)
+            return MESSAGE_SEND_FAILURE;
+        return MESSAGE_SEND_RETRY;
+    }
+
+    while (conn->out_len > 0)
+    {
+        int bytes_sent = SSL_write(conn->req.ssl, conn->out_buf + conn->out_start, conn->out_len);
+        if (bytes_sent > 0)
+        {
+            conn->out_start += bytes_sent;
+            conn->out_len -= bytes_sent;
+            continue;
+        }
+        int ssl_error = SSL_get_error(conn->req.ssl, bytes_sent);
+        if (ssl_error == SSL_ERROR_WANT_WRITE || ssl_error == SSL_ERROR_WANT_READ)
+        {
+            if (!conn->out_armed)
+                connection_set_interest(conn, 1);
+            return MESSAGE_SEND_RETRY;
+        }
+        ERR_clear_error();
+        return MESSAGE_SEND_FAILURE;
+    }
+    conn->out_start = 0;
+    if (conn->out_armed)
+        connection_set_interest(conn, 0);
+    return MESSAGE_SEND_SUCCESS;
+}
+
+// must be called with ssl_mutex held, returns where length bytes are appended to the output buffer
+static char* connection_reserve(connection* conn, size_t length)
+{
+    if (conn->out_len + conn->out_ref_bytes + length > CONNECTION_OUTPUT_LIMIT)
+        return NULL;
+
+    if (conn->out_start + conn->out_len + length > conn->out_cap)
+    {
+        if (conn->out_start)
+        {
+            // compact instead of growing when the sent prefix frees enough space
+            memmove(conn->out_buf, conn->out_buf + conn->out_start, conn->out_len);
+            conn->out_start = 0;
+        }
+        if (conn->out_len + length > conn->out_cap)
+        {
+            size_t new_cap = conn->out_cap ? conn->out_cap : BUFFER_SIZE;
+            while (new_cap < conn->out_len + length)
+                new_cap *= 2;
+            char* new_buf = (char*)realloc(conn->out_buf, new_cap);
+            if (!new_buf)
+                return NULL;
+            conn->out_buf = new_buf;
+            conn->out_cap = new_cap;
+        }
+    }
+    char* dest = conn->out_buf + conn->out_start + conn->out_len;
+    conn->out_len += length;
+    return dest;
+}
+
+static const char* connection_uid(connection* conn)
+{
+    return conn->cl.uid ? conn->cl.uid : CLIENT_DEFAULT_NAME;
+}
+
+static size_t message_buffer_wire_length(connection* conn, const message_buffer* buffer)
+{
+    if (conn->protocol == MESSAGE_PROTOCOL_BINARY)
+        return buffer->length;
+    return buffer->text_length + (buffer->fanout ? strlen(connection_uid(conn)) : 0);
+}
+
+// must be called with ssl_mutex held, copies the queued message buffers behind the pending bytes and drops their references, returns 0 on success
+static int connection_gather(connection* conn)
+{
+    size_t i = 0;
+    for (; i < conn->out_ref_count; ++i)
+    {
+        message_buffer* buffer = conn->out_refs[i];
+        size_t length = message_buffer_wire_length(conn, buffer);
+        conn->out_ref_bytes -= length;
+        char* dest = connection_reserve(conn, length);
+        if (!dest)
+        {
+            conn->out_ref_bytes += length;
+            break;
+        }
+        if (conn->protocol == MESSAGE_PROTOCOL_BINARY)
+            memcpy(dest, buffer->data, buffer->length);
+        else
+        {
+            // fan-out frames are shared by all recipients, text clients get their own UID inserted while translating
+            translate_binary_message(buffer->data, buffer->length, buffer->fanout ? connection_uid(conn) : NULL, dest, length);
+        }
+        message_buffer_release(buffer);
+    }
+    if (i < conn->out_ref_count)
+    {
+        // the remaining references are dropped with the connection
+        memmove(conn->out_refs, conn->out_refs + i, (conn->out_ref_count - i) * sizeof(*conn->out_refs));
+        conn->out_ref_count -= i;
+        return -1;
+    }
+    conn->out_ref_count = 0;
+    conn->out_ref_bytes = 0;
+    return 0;
+}
+
+static void connection_schedule_flush(connection* conn, int urgent)
+{
+    reactor* r = conn->owner;
+    int on_reactor = pthread_equal(pthread_self(), r->thread);
+    int queued = atomic_exchange(&conn->flush_queued, 1);
+    if (queued && !urgent && !on_reactor)
+        return;
+
+    // replies from the reactor thread leave before its next wait, messages from other threads wait briefly for more to coalesce
+    uint64_t now = reactor_now();
+    uint64_t deadline = urgent || on_reactor ? now : now + CONNECTION_FLUSH_DELAY;
+    pthread_mutex_lock(&r->flush_mutex);
+    int was_empty = !r->flush_list;
+    if (!queued)
+    {
+        conn->flush_next = r->flush_list;
+        r->flush_list = conn;
+    }
+    int earlier = was_empty || deadline < r->flush_deadline;
+    if (earlier)
+        r->flush_deadline = deadline;
+    pthread_mutex_unlock(&r->flush_mutex);
+    // a sleeping reactor only has to recompute its wait timeout when the list deadline moves closer
+    if (earlier && !on_reactor)
+        reactor_wake(r);
+}
+
+// queues the concatenation of the parts as a single message
+static int connection_queue(connection* conn, const char* const* parts, const size_t* lengths, int count)
+{
+    size_t length = 0;
+    for (int i = 0; i < count; ++i)
+        length += lengths[i];
+
+    pthread_mutex_lock(&conn->ssl_mutex);
+    if (conn->released)
+    {
+        pthread_mutex_unlock(&conn->ssl_mutex);
+        return MESSAGE_SEND_FAILURE;
+    }
+    // bytes queued directly go behind the queued message buffers, so messages leave in the order they were sent
+    char* dest = connection_gather(conn) == 0 ? connection_reserve(conn, length) : NULL;
+    if (dest)
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            memcpy(dest, parts[i], lengths[i]);
+            dest += lengths[i];
+        }
+        // the message is written by the reactor together with everything else queued by then
+        connection_schedule_flush(conn, conn->out_len + conn->out_ref_bytes >= CONNECTION_COALESCE_SIZE);
+    }
+    else
+        connection_close(conn);
+    pthread_mutex_unlock(&conn->ssl_mutex);
+
+    if (!dest)
+    {
+        log_message(T_LOG_WARN, CLIENTS_LOG, __FILE__, "Failed to send message to client %d, closing connection", conn->cl.id);
+        return MESSAGE_SEND_FAILURE;
+    }
+    atomic_fetch_add(&conn->owner->sent_messages, 1);
+    return MESSAGE_SEND_SUCCESS;
+}
+
+int connection_send(connection* conn, message* msg)
+{
+    char buffer[BUFFER_SIZE];
+    int length = conn->protocol == MESSAGE_PROTOCOL_BINARY
+        ? serialize_binary_message(msg, buffer, sizeof(buffer))
+        : serialize_message(msg, buffer, sizeof(buffer));
+    if (length < 0)
+        return MESSAGE_SEND_FAILURE;
+
+    const char* parts[] = { buffer };
+    size_t lengths[] = { (size_t)length };
+    return connection_queue(conn, parts, lengths, 1);
+}
+
+int connection_send_buffer(connection* conn, message_buffer* buffer)
+{
+    size_t length = message_buffer_wire_length(conn, buffer);
+
+    pthread_mutex_lock(&conn->ssl_mutex);
+    if (conn->released)
+    {
+        pthread_mutex_unlock(&conn->ssl_mutex);
+        return MESSAGE_SEND_FAILURE;
+    }
+    int queued = conn->out_len + conn->out_ref_bytes + length <= CONNECTION_OUTPUT_LIMIT;
+    if (queued && conn->out_ref_count == conn->out_ref_cap)
+    {
+        size_t new_cap = conn->out_ref_cap ? conn->out_ref_cap * 2 : CONNECTION_REF_CAPACITY;
+        message_buffer** new_refs = (message_buffer**)realloc(conn->out_refs, new_cap * sizeof(*new_refs));
+        if (new_refs)
+        {
+            conn->out_refs = new_refs;
+            conn->out_ref_cap = new_cap;
+        }
+        else
+            queued = 0;
+    }
+    if (queued)
+    {
+        conn->out_refs[conn->out_ref_count++] = message_buffer_retain(buffer);
+        conn->out_ref_bytes += length;
+        connection_schedule_flush(conn, conn->out_len + conn->out_ref_bytes >= CONNECTION_COALESCE_SIZE);
+    }
+    else
+        connection_close(conn);
+    pthread_mutex_unlock(&conn->ssl_mutex);
+
+    if (!queued)
+    {
+        log_message(T_LOG_WARN, CLIENTS_LOG, __FILE__, "Failed to send message to client %d, closing connection", conn->cl.id);
+        return MESSAGE_SEND_FAILURE;
+    }
+    atomic_fetch_add(&conn->owner->sent_messages, 1);
+    return MESSAGE_SEND_SUCCESS;
+}
+
+static void connection_timer_fire(timer* t, void* arg)
+{
+    connection* conn = (connection*)arg;
+    if (t) {}
+    if (handle_client_timer(conn) != 0)
+        reactor_release_connection(conn->owner, conn);
+}
+
+void connection_set_timer(connection* conn, int state, int delay)
+{
+    conn->timer_state = state;
+    timer_schedule(&conn->owner->timers, &conn->timer, reactor_now() + delay);
+}
+
+void connection_cancel_timer(connection* conn)
+{
+    timer_cancel(&conn->owner->timers, &conn->timer);
+}
+
+void connection_close(connection* conn)
+{
+    // the reactor observes the hang up and releases the connection from its own thread
+    shutdown(conn->req.sock, SHUT_RDWR);
+}
+
+static void connection_reclaim(ebr_node* node)
+{
+    connection* conn = (connection*)((char*)node - offsetof(connection, retire));
+    pthread_mutex_destroy(&conn->ssl_mutex);
+    if (conn->cl.uid)
+        free(conn->cl.uid);
+    mem_pool_free(&connection_pool, conn);
+}
+
+// marks the connection released, senders check it under the SSL mutex before they queue anything or close the socket
+static void connection_set_released(connection* conn)
+{
+    pthread_mutex_lock(&conn->ssl_mutex);
+    conn->released = 1;
+    pthread_mutex_unlock(&conn->ssl_mutex);
+}
+
+static void connection_free(connection* conn)
+{
+    connection_set_released(conn);
+    SSL_free(conn->req.ssl);
+    close(conn->req.sock);
+    frame_decoder_destroy(&conn->decoder);
+    if (conn->out_buf)
+        free(conn->out_buf);
+    for (size_t i = 0; i < conn->out_ref_count; ++i)
+        message_buffer_release(conn->out_refs[i]);
+    if (conn->out_refs)
+        free(conn->out_refs);
+    if (conn->tx_buf)
+        free(conn->tx_buf);
+    // a client map reader may still hold the connection, its memory is reclaimed once every reader is done
+    ebr_retire(&conn->retire, connection_reclaim);
+}
+
+static void reactor_unlink(connection** list, connection* conn)
+{
+    if (conn->prev)
+        conn->prev->next = conn->next;
+    else
+        *list = conn->next;
+    if (conn->next)
+        conn->next->prev = conn->prev;
+}
+
+static void reactor_link(connection** list, connection* conn)
+{
+    conn->prev = NULL;
+    conn->next = *list;
+    if (*list)
+        (*list)->prev = conn;
+    *list = conn;
+}
+
+// frees a released connection once neither the kernel nor an auth worker references it
+static void connection_try_free(reactor* r, connection* conn)
+{
+    if (conn->recv_armed || conn->send_inflight || conn->auth.busy)
+        return;
+    reactor_unlink(&r->closing, conn);
+    connection_free(conn);
+}
+
+static void uring_cancel(reactor* r, void* ptr, int op)
+{
+    struct io_uring_sqe* sqe = uring_get_sqe(&r->ring);
+    if (!sqe)
+        return;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t)ptr | op;
+    sqe->user_data = URING_OP_CANCEL;
+}
+
+static void reactor_release_connection(reactor* r, connection* conn)
+{
+    // threads that found the client in the hash map before it left do not queue anything once it is released
+    handle_client_close(conn);
+    connection_set_released(conn);
+
+    reactor_unlink(&r->connections, conn);
+    atomic_fetch_sub(&r->connection_count, 1);
+    reactor_connection_release();
+    timer_cancel(&r->timers, &conn->timer);
+
+    if (atomic_load(&conn->flush_queued))
+    {
+        pthread_mutex_lock(&r->flush_mutex);
+        connection** link = &r->flush_list;
+        while (*link && *link != conn)
+            link = &(*link)->flush_next;
+        if (*link)
+            *link = conn->flush_next;
+        pthread_mutex_unlock(&r->flush_mutex);
+    }
+
+    conn->closing = 1;
+    if (r->io != SERVER_IO_URING)
+        epoll_ctl(r->epoll_fd, EPOLL_CTL_DEL, conn->req.sock, NULL);
+    else
+    {
+        if (conn->recv_armed)
+            uring_cancel(r, conn, URING_OP_RECV);
+        // fails a send still waiting for socket space
+        shutdown(conn->req.sock, SHUT_RDWR);
+    }
+    reactor_link(&r->closing, conn);
+    connection_try_free(r, conn);
+}
+
+static connection* connection_create(reactor* r, int sock, SSL* ssl, const struct sockaddr_in* addr)
+{
+    connection* conn = (connection*)mem_pool_alloc(&connection_pool);
+    if (!conn)
+    {
+        log_message(T_LOG_ERROR, SERVER_LOG, __FILE__, "Connection memory allocation failed");
+        return NULL;
+    }
+    memset(conn, 0, sizeof(*conn));
+    conn->req.sock = sock;
+    conn->req.addr = *addr;
+    conn->req.ssl = ssl;
+    conn->cl.req = &conn->req;
+    conn->presence_slot = -1;
+    conn->owner = r;
+    conn->protocol = get_message_protocol(ssl);
+    frame_decoder_init(&conn->decoder, conn->protocol);
+    atomic_init(&conn->flush_queued, 0);
+    timer_init(&conn->timer, connection_timer_fire, conn);
+    pthread_mutex_init(&conn->ssl_mutex, NULL);
+    // outbound data is buffered by the connection, so OpenSSL must accept a grown buffer and short writes on retry
+    SSL_set_mode(ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    return conn;
+}
+
+static int uring_arm_recv(reactor* r, connection* conn)
+{
+    struct io_uring_sqe* sqe = uring_get_sqe(&r->ring);
+    if (!sqe)
+        return -1;
+    // a multishot receive keeps delivering into provided buffers without being submitted again
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->req.sock;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = (uint64_t)(uintptr_t)conn | URING_OP_RECV;
+    conn->recv_armed = 1;
+    return 0;
+}
+
+static int uring_arm_send(reactor* r, connection* conn)
+{
+    struct io_uring_sqe* sqe = uring_get_sqe(&r->ring);
+    if (!sqe)
+        return -1;
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->req.sock;
+    sqe->addr = (uint64_t)(uintptr_t)(conn->tx_buf + conn->tx_start);
+    sqe->len = (uint32_t)conn->tx_len;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe->user_data = (uint64_t)(uintptr_t)conn | URING_OP_SEND;
+    conn->send_inflight = 1;
+    return 0;
+}
+
+static void uring_arm_accept(reactor* r)
+{
+    struct io_uring_sqe* sqe = uring_get_sqe(&r->ring);
+    if (!sqe)
+        return;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = r->listener.fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = (uint64_t)(uintptr_t)r | URING_OP_ACCEPT;
+    r->accept_armed = 1;
+}
+
+static void uring_arm_wake(reactor* r)
+{
+    struct io_uring_sqe* sqe = uring_get_sqe(&r->ring);
+    if (!sqe)
+        return;
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = r->event_fd;
+    sqe->addr = (uint64_t)(uintptr_t)&r->wake_value;
+    sqe->len = sizeof(r->wake_value);
+    sqe->user_data = (uint64_t)(uintptr_t)r | URING_OP_WAKE;
+}
+
+// returns 0 if the connection was moved to io_uring
+static int uring_register_connection(reactor* r, connection* conn)
+{
+    // TLS moves to memory BIOs, so OpenSSL never touches the socket and io_uring owns all socket I/O
+    BIO* rbio = BIO_new(BIO_s_mem());
+    BIO* wbio = BIO_new(BIO_s_mem());
+    int flags = fcntl(conn->req.sock, F_GETFL, 0);
+    if (!rbio || !wbio || flags < 0 || fcntl(conn->req.sock, F_SETFL, flags & ~O_NONBLOCK) < 0)
+    {
+        BIO_free(rbio);
+        BIO_free(wbio);
+        return -1;
+    }
+    BIO_set_mem_eof_return(rbio, -1);
+    BIO_set_mem_eof_return(wbio, -1);
+    SSL_set_bio(conn->req.ssl, rbio, wbio);
+    return uring_arm_recv(r, conn);
+}
+
+static void reactor_register_pending(reactor* r)
+{
+    pthread_mutex_lock(&r->pending_mutex);
+    connection* conn = r->pending;
+    r->pending = NULL;
+    pthread_mutex_unlock(&r->pending_mutex);
+
+    while (conn)
+    {
+        connection* next = conn->next;
+        int result;
+        if (r->io == SERVER_IO_URING)
+            result = uring_register_connection(r, conn);
+        else
+        {
+            struct epoll_event ev;
+            memset(&ev, 0, sizeof(ev));
+            ev.events = EPOLLIN | EPOLLRDHUP;
+            ev.data.ptr = conn;
+            result = epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, conn->req.sock, &ev);
+        }
+        if (result < 0)
+        {
+            log_message(T_LOG_ERROR, SERVER_LOG, __FILE__, "Reactor %d failed to register connection: %s", r->id, strerror(errno));
+            connection_free(conn);
+            atomic_fetch_sub(&r->connection_count, 1);
+            reactor_connection_release();
+        }
+        else
+        {
+            reactor_link(&r->connections, conn);
+            handle_client_open(conn);
+        }
+        conn = next;
+    }
+
+    pthread_mutex_lock(&r->pending_mutex);
+    auth_job* job = r->auth_done;
+    r->auth_done = NULL;
+    pthread_mutex_unlock(&r->pending_mutex);
+
+    while (job)
+    {
+        // the job lives in its connection, which may be freed below
+        auth_job* next = job->next;
+        conn = job->conn;
+        conn->auth.busy = 0;
+        if (conn->closing)
+            connection_try_free(r, conn);
+        else if (handle_client_auth_done(conn) != 0)
+            reactor_release_connection(r, conn);
+        job = next;
+    }
+}
+
+// returns 0 if the connection stays open
+static int reactor_read(connection* conn)
+{
+    // bytes are read into a pooled buffer, so long messages received whole are routed by reference instead of being copied
+    message_buffer* block = NULL;
+    message_view view;
+    int reads = 0;
+    int result = 0;
+
+    while (1)
+    {
+        // a buffer still referenced by routed messages is left to them
+        if (block && atomic_load_explicit(&block->refs, memory_order_acquire) > 1)
+        {
+            message_buffer_release(block);
+            block = NULL;
+        }
+        if (!block && !(block = message_buffer_create_receive()))
+        {
+            // the unread bytes keep the socket readable, so returning without them would wake the reactor again at once
+            log_message(T_LOG_ERROR, SERVER_LOG, __FILE__, "Receive buffer allocation failed for client %d, closing connection", conn->cl.id);
+            result = -1;
+            break;
+        }
+
+        pthread_mutex_lock(&conn->ssl_mutex);
+        int nbytes = SSL_read(conn->req.ssl, block->frame, block->length);
+        int ssl_error = nbytes > 0 ? SSL_ERROR_NONE : SSL_get_error(conn->req.ssl, nbytes);
+        // records already received into a memory BIO are not reported again, so they count as buffered as well
+        int has_pending = SSL_has_pending(conn->req.ssl) || BIO_ctrl_pending(SSL_get_rbio(conn->req.ssl)) > 0;
+        if (ssl_error == SSL_ERROR_WANT_WRITE && !conn->out_armed && conn->owner->io == SERVER_IO_EPOLL)
+            connection_set_interest(conn, 1);
+        pthread_mutex_unlock(&conn->ssl_mutex);
+
+        if (nbytes > 0)
+        {
+            // a read may hold several messages or end inside one, whatever the client's writes were
+            const char* frame;
+            size_t length;
+            int decoded;
+            frame_decoder_feed(&conn->decoder, block->frame, nbytes);
+            while ((decoded = frame_decoder_next(&conn->decoder, &frame, &length)) == FRAME_DECODER_FRAME)
+            {
+                if (parse_message_view(&view, conn->protocol, frame, length) != MESSAGE_PARSING_SUCCESS)
+                {
+                    decoded = FRAME_DECODER_INVALID;
+                    break;
+                }
+                // a message completed in the decoder's own buffer is copied when it is passed on
+                if (frame >= block->frame && frame < block->frame + nbytes)
+                    view.source = block;
+                if (handle_client(conn, &view) != 0)
+                {
+                    result = -1;
+                    break;
+                }
+            }
+            if (result == 0 && decoded != FRAME_DECODER_INCOMPLETE)
+            {
+                log_message(T_LOG_WARN, CLIENTS_LOG, __FILE__, "Malformed message from client %d, closing connection", conn->cl.id);
+                result = -1;
+            }
+            // level-triggered epoll reports the socket again, only data buffered inside SSL has to be drained here
+            if (result != 0 || (++reads >= REACTOR_READ_BUDGET && !has_pending))
+                break;
+            continue;
+        }
+
+        if (ssl_error != SSL_ERROR_WANT_READ && ssl_error != SSL_ERROR_WANT_WRITE)
+        {
+            ERR_clear_error();
+            result = -1;
+        }
+        break;
+    }
+    message_buffer_release(block);
+    return result;
+}
+
+static void reactor_accept(reactor* r)
+{
+    struct sockaddr_in cl_addr;
+    int cl_sock;
+
+    // drain the accept queue, a listener paused by admission control reports EAGAIN as well
+    while ((cl_sock = listener_accept(&r->listener, &cl_addr)) >= 0)
+    {
+        // the handshake pool hands the connection back to this reactor once TLS is established
+        handshake_submit(r->handshakes, cl_sock, &cl_addr, r);
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+        log_message(T_LOG_WARN, SERVER_LOG, __FILE__, "Reactor %d accept failed: %s", r->id, strerror(errno));
+}
+
+static void reactor_run_epoll(reactor* r)
+{
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+
+    while (!atomic_load(&r->stop))
+    {
+        int timeout = reactor_wait_timeout(r);
+        int n = epoll_wait(r->epoll_fd, events, REACTOR_MAX_EVENTS, timeout);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            log_message(T_LOG_ERROR, SERVER_LOG, __FILE__, "Reactor %d wait failed: %s", r->id, strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < n; ++i)
+        {
+            if (events[i].data.ptr == r)
+            {
+                uint64_t value;
+                while (read(r->event_fd, &value, sizeof(value)) > 0);
+                reactor_register_pending(r);
+                continue;
+            }
+            if (events[i].data.ptr == &r->listener)
+            {
+                reactor_accept(r);
+                continue;
+            }
+
+            connection* conn = (connection*)events[i].data.ptr;
+            int failed = 0;
+            if (events[i].events & EPOLLERR)
+                failed = 1;
+            else if (events[i].events & EPOLLOUT)
+            {
+                pthread_mutex_lock(&conn->ssl_mutex);
+                failed = connection_flush(conn) == MESSAGE_SEND_FAILURE;
+                pthread_mutex_unlock(&conn->ssl_mutex);
+            }
+            if (!failed && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLRDHUP)))
+                failed = reactor_read(conn) != 0;
+            if (failed)
+                reactor_release_connection(r, conn);
+        }
+    }
+}
+
+// returns 0 unless the records could not be handed to the kernel
+static int uring_connection_send_next(connection* conn)
+{
+    if (conn->send_inflight || conn->closing)
+        return 0;
+
+    pthread_mutex_lock(&conn->ssl_mutex);
+    BIO* wbio = SSL_get_wbio(conn->req.ssl);
+    size_t pending = BIO_ctrl_pending(wbio);
+    if (pending > conn->tx_cap)
+    {
+        char* new_buf = (char*)realloc(conn->tx_buf, pending);
+        if (!new_buf)
+        {
+            pthread_mutex_unlock(&conn->ssl_mutex);
+            return -1;
+        }
+        conn->tx_buf = new_buf;
+        conn->tx_cap = pending;
+    }
+    // all records written since the last send leave in a single request
+    conn->tx_start = 0;
+    conn->tx_len = pending ? (size_t)BIO_read(wbio, conn->tx_buf, (int)pending) : 0;
+    pthread_mutex_unlock(&conn->ssl_mutex);
+
+    if (!conn->tx_len)
+        return 0;
+    return uring_arm_send(conn->owner, conn);
+}
+
+// writes the queued messages of every scheduled connection once the list is due, returns the wait timeout until it is due next
+static int reactor_flush_connections(reactor* r)
+{
+    pthread_mutex_lock(&r->flush_mutex);
+    uint64_t now = reactor_now();
+    if (!r->flush_list || r->flush_deadline > now)
+    {
+        int timeout = r->flush_list ? (int)(r->flush_deadline - now) : REACTOR_WAIT_TIMEOUT;
+        pthread_mutex_unlock(&r->flush_mutex);
+        return timeout;
+    }
+    connection* conn = r->flush_list;
+    r->flush_list = NULL;
+    pthread_mutex_unlock(&r->flush_mutex);
+
+    while (conn)
+    {
+        connection* next = conn->flush_next;
+        // cleared first, so messages queued from now on schedule the connection again
+        atomic_store(&conn->flush_queued, 0);
+        pthread_mutex_lock(&conn->ssl_mutex);
+        // a single write turns everything queued into as few TLS records as possible
+        if (conn->out_len || conn->out_ref_count)
+            atomic_fetch_add(&r->sent_flushes, 1);
+        int failed = connection_flush(conn) == MESSAGE_SEND_FAILURE;
+        pthread_mutex_unlock(&conn->ssl_mutex);
+        if (!failed && r->io == SERVER_IO_URING)
+            failed = uring_connection_send_next(conn) != 0;
+        if (failed)
+            reactor_release_connection(r, conn);
+        conn = next;
+    }
+
+    pthread_mutex_lock(&r->flush_mutex);
+    int timeout = REACTOR_WAIT_TIMEOUT;
+    if (r->flush_list)
+        timeout = r->flush_deadline > now ? (int)(r->flush_deadline - now) : 0;
+    pthread_mutex_unlock(&r->flush_mutex);
+    return timeout;
+}
+
+// fires the connection timers that are due, returns the wait timeout until the wheel has to be advanced again
+static int reactor_run_timers(reactor* r)
+{
+    uint64_t now = reactor_now();
+    timer_wheel_advance(&r->timers, now);
+    uint64_t next = timer_wheel_next(&r->timers);
+    if (next == TIMER_WHEEL_NONE)
+        return REACTOR_WAIT_TIMEOUT;
+    uint64_t due = r->timers.now + next;
+    if (due - now >= REACTOR_WAIT_TIMEOUT)
+        return REACTOR_WAIT_TIMEOUT;
+    return (int)(due - now);
+}
+
+// timers run first, so messages they queue are written before the wait
+static int reactor_wait_timeout(reactor* r)
+{
+    // released connections are reclaimed a few loop iterations later, once no client map reader holds them
+    ebr_collect();
+    int timeout = reactor_run_timers(r);
+    int flush_timeout = reactor_flush_connections(r);
+    return flush_timeout < timeout ? flush_timeout : timeout;
+}
+
+static void uring_handle_recv(reactor* r, connection* conn, int res, unsigned flags)
+{
+    if (!(flags & IORING_CQE_F_MORE))
+        conn->recv_armed = 0;
+    if (res > 0)
+    {
+        unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        if (!conn->closing)
+        {
+            pthread_mutex_lock(&conn->ssl_mutex);
+            BIO_write(SSL_get_rbio(conn->req.ssl), uring_buffer(&r->ring, bid), res);
+            pthread_mutex_unlock(&conn->ssl_mutex);
+        }
+        uring_buffer_recycle(&r->ring, bid);
+    }
+    if (conn->closing)
+    {
+        connection_try_free(r, conn);
+        return;
+    }
+
+    // running out of provided buffers only ends the multishot receive, the connection is fine
+    int failed = res == 0 || (res < 0 && res != -ENOBUFS);
+    // reads until an incomplete record is left in the memory BIO
+    if (!failed && res > 0)
+        failed = reactor_read(conn) != 0;
+    // reading may produce records of its own, such as key updates
+    if (!failed)
+        failed = uring_connection_send_next(conn) != 0;
+    if (!failed && !conn->recv_armed)
+        failed = uring_arm_recv(r, conn) != 0;
+    if (failed)
+        reactor_release_connection(r, conn);
+}
+
+static void uring_handle_send(reactor* r, connection* conn, int res)
+{
+    conn->send_inflight = 0;
+    if (conn->closing)
+    {
+        connection_try_free(r, conn);
+        return;
+    }
+
+    int failed = res <= 0;
+    if (!failed)
+    {
+        conn->tx_start += res;
+        conn->tx_len -= res;
+        if (conn->tx_len)
+            failed = uring_arm_send(r, conn) != 0;
+        else
+            failed = uring_connection_send_next(conn) != 0;
+    }
+    if (failed)
+        reactor_release_connection(r, conn);
+}
+
+static void uring_handle_accept(reactor* r, int res, unsigned flags)
+{
+    if (!(flags & IORING_CQE_F_MORE))
+        r->accept_armed = 0;
+
+    if (res >= 0)
+    {
+        // connections the kernel completed while a pause was being cancelled exceed the limit
+        if (reactor_connection_total() >= atomic_load(&connection_limit))
+        {
+            log_message(T_LOG_WARN, SERVER_LOG, __FILE__, "Reactor %d rejected connection: connection limit reached", r->id);
+            close(res);
+        }
+        else
+        {
+            struct sockaddr_in cl_addr;
+            socklen_t cl_len = sizeof(cl_addr);
+            memset(&cl_addr, 0, sizeof(cl_addr));
+            getpeername(res, (struct sockaddr*)&cl_addr, &cl_len);
+            atomic_fetch_add(&connection_total, 1);
+            handshake_submit(r->handshakes, res, &cl_addr, r);
+        }
+        // completions queued behind the one that paused the listener still carry IORING_CQE_F_MORE
+        if (r->accept_armed && !atomic_load(&r->listener.paused) && listener_pause_if_full(&r->listener))
+            uring_cancel(r, r, URING_OP_ACCEPT);
+    }
+    else if (res == -EMFILE || res == -ENFILE)
+    {
+        // re-arming right away would fail again on the same pending connection, the listener waits for a released descriptor
+        log_message(T_LOG_WARN, SERVER_LOG, __FILE__, "Reactor %d accept failed: %s", r->id, strerror(-res));
+        if (listener_pause_exhausted(&r->listener, reactor_connection_total()) && r->accept_armed)
+            uring_cancel(r, r, URING_OP_ACCEPT);
+    }
+    else if (res != -ECANCELED)
+        log_message(T_LOG_WARN, SERVER_LOG, __FILE__, "Reactor %d accept failed: %s", r->id, strerror(-res));
+
+    if (!r->accept_armed && !atomic_load(&r->listener.paused))
+        uring_arm_accept(r);
+}
+
+static void reactor_run_uring(reactor* r)
+{
+    uring_arm_wake(r);
+    if (r->listener.fd >= 0)
+        uring_arm_accept(r);
+
+    while (!atomic_load(&r->stop))
+    {
+        int timeout = reactor_wait_timeout(r);
+        if (uring_submit_and_wait(&r->ring, timeout) < 0)
+        {
+            log_message(T_LOG_ERROR, SERVER_LOG, __FILE__, "Reactor %d wait failed: %s", r->id, strerror(errno));
+            break;
+        }
+
+        struct io_uring_cqe* cqe;
+        while ((cqe = uring_peek_cqe(&r->ring)))
+        {
+            uint64_t user_data = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            uring_cqe_seen(&r->ring);
+
+            void* ptr = (void*)(uintptr_t)(user_data & ~(uint64_t)URING_OP_MASK);
+            switch (user_data & URING_OP_MASK)
+            {
+            case URING_OP_WAKE:
+                reactor_register_pending(r);
+                if (r->listener.fd >= 0 && !r->accept_armed && !atomic_load(&r->listener.paused))
+                    uring_arm_accept(r);
+                uring_arm_wake(r);
+                break;
+            case URING_OP_ACCEPT:
+                uring_handle_accept(r, res, flags);
+                break;
+            case URING_OP_RECV:
+                uring_handle_recv(r, (connection*)ptr, res, flags);
+                break;
+            case URING_OP_SEND:
+                uring_handle_send(r, (connection*)ptr, res);
+                break;
+            default:
+                break;
+            }
+        }
+    }
+}
+
+static void* reactor_run(void* arg)
+{
+    reactor* r = (reactor*)arg;
+
+    if (r->cpu >= 0)
+    {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(r->cpu, &cpus);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+            log_message(T_LOG_WARN, SERVER_LOG, __FILE__, "Reactor %d could not be pinned to core %d", r->id, r->cpu);
+    }
+    log_message(T_LOG_INFO, SERVER_LOG, __FILE__, "Reactor %d started with %s%s", r->id, r->io == SERVER_IO_URING ? "io_uring" : "epoll", r->listener.fd >= 0 ? " and own listener" : "");
+    if (r->io == SERVER_IO_URING)
+        reactor_run_uring(r);
+    else
+        reactor_run_epoll(r);
+
+    log_message(T_LOG_INFO, SERVER_LOG, __FILE__, "Exiting reactor %d thread", r->id);
+    pthread_exit(NULL);
+}
+
+int reactor_start(reactor* r, server_io io, int id, struct handshake_pool* handshakes, int listen_fd, int cpu)
+{
+    r->id = id;
+    r->io = io;
+    r->handshakes = handshakes;
+    r->listener.fd = -1;
+    r->cpu = cpu;
+    r->epoll_fd = -1;
+    r->accept_armed = 0;
+    r->pending = NULL;
+    r->auth_done = NULL;
+    r->connections = NULL;
+    r->closing = NULL;
+    r->flush_list = NULL;
+    r->flush_deadline = 0;
+    timer_wheel_init(&r->timers, reactor_now());
+    atomic_init(&r->stop, 0);
+    atomic_init(&r->connection_count, 0);
+    atomic_init(&r->sent_messages, 0);
+    atomic_init(&r->sent_flushes, 0);
+    pthread_mutex_init(&r->pending_mutex, NULL);
+    pthread_mutex_init(&r->flush_mutex, NULL);
+
+    r->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (r->event_fd < 0)
+    {
+        log_message(T_LOG_ERROR, SERVER_LOG, __FILE__, "Reactor %d eventfd creation failed: %s", id, strerror(errno));
+        return REACTOR_EVENTFD_FAILURE;
+    }
+
+    if (io == SERVER_IO_URING)
+    {
+        if (uring_init(&r->ring) == URING_SUCCESS)
+        {
+            if (listen_fd >= 0)
+            {
+                r->listener.fd = listen_fd;
+                r->listener.epoll_fd = -1;
+                r->listener.wake_fd = r->event_fd;
+                atomic_init(&r->listener.paused, 0);
+                r->listener.next_paused = NULL;
+            }
+        }
+        else
+        {
+            log_message(T_LOG_WARN, SERVER_LOG, __FILE__, "Reactor %d io_uring setup failed: %s, falling back to epoll", id, strerror(errno));
+            r->io = SERVER_IO_EPOLL;
+        }
+    }
+
+    if (r->io == SERVER_IO_EPOLL)
+    {
+        r->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (r->epoll_fd < 0)
+        {
+            log_message(T_LOG_ERROR, SERVER_LOG, __FILE__, "Reactor %d epoll creation failed: %s", id, strerror(errno));
+            close(r->event_fd);
+            return REACTOR_EPOLL_FAILURE;
+        }
+
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = r;
+        if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->event_fd, &ev) < 0)
+        {
+            log_message(T_LOG_ERROR, SERVER_LOG, __FILE__, "Reactor %d eventfd registration failed: %s", id, strerror(errno));
+            close(r->event_fd);
+            close(r->epoll_fd);
+            return REACTOR_EPOLL_FAILURE;
+        }
+
+        if (listen_fd >= 0 && listener_register(&r->listener, listen_fd, r->epoll_fd) != REACTOR_SUCCESS)
+        {
+            log_message(T_LOG_ERROR, SERVER_LOG, __FILE__, "Reactor %d listener registration failed: %s", id, strerror(errno));
+            close(r->event_fd);
+            close(r->epoll_fd);
+            return REACTOR_LISTENER_FAILURE;
+        }
+    }
+
+    if (pthread_create(&r->thread, NULL, reactor_run, (void*)r) != 0)
+    {
+        log_message(T_LOG_ERROR, SERVER_LOG, __FILE__, "Reactor %d thread creation failed: %s", id, strerror(errno));
+        close(r->event_fd);
+        if (r->io == SERVER_IO_URING)
+            uring_destroy(&r->ring);
+        else
+            close(r->epoll_fd);
+        return REACTOR_THREAD_FAILURE;
+    }
+    return REACTOR_SUCCESS;
+}
+
+void reactor_stop(reactor* r)
+{
+    atomic_store(&r->stop, 1);
+    reactor_wake(r);
+    pthread_join(r->thread, NULL);
+
+    // the auth pool is stopped first, so every job is back and no worker references a connection
+    pthread_mutex_lock(&r->pending_mutex);
+    for (auth_job* job = r->auth_done; job; job = job->next)
+        job->conn->auth.busy = 0;
+    r->auth_done = NULL;
+    pthread_mutex_unlock(&r->pending_mutex);
+
+    if (r->io == SERVER_IO_URING)
+    {
+        // closing the ring cancels every request, after that no connection is referenced by the kernel
+        uring_destroy(&r->ring);
+        for (connection* conn = r->connections; conn; conn = conn->next)
+            conn->recv_armed = conn->send_inflight = 0;
+        for (connection* conn = r->closing; conn; conn = conn->next)
+            conn->recv_armed = conn->send_inflight = 0;
+    }
+    while (r->closing)
+        connection_try_free(r, r->closing);
+
+    // connections handed off after the loop ended are released without being registered
+    pthread_mutex_lock(&r->pending_mutex);
+    while (r->pending)
+    {
+        connection* next = r->pending->next;
+        reactor_link(&r->connections, r->pending);
+        r->pending = next;
+    }
+    pthread_mutex_unlock(&r->pending_mutex);
+    while (r->connections)
+        reactor_release_connection(r, r->connections);
+
+    if (r->listener.fd >= 0)
+        close(r->listener.fd);
+    close(r->event_fd);
+    if (r->epoll_fd >= 0)
+        close(r->epoll_fd);
+    pthread_mutex_destroy(&r->pending_mutex);
+    pthread_mutex_destroy(&r->flush_mutex);
+}
+
+int reactor_add_connection(reactor* r, int sock, SSL* ssl, const struct sockaddr_in* addr)
+{
+    int flags = fcntl(sock, F_GETFL, 0);
+    if (flags < 0 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) < 0)
+    {
+        log_message(T_LOG_ERROR, SERVER_LOG, __FILE__, "Failed to make client socket non-blocking: %s", strerror(errno));
+        return REACTOR_CONNECTION_FAILURE;
+    }
+
+    connection* conn = connection_create(r, sock, ssl, addr);
+    if (!conn)
+        return REACTOR_CONNECTION_FAILURE;
+
+    atomic_fetch_add(&r->connection_count, 1);
+    pthread_mutex_lock(&r->pending_mutex);
+    conn->next = r->pending;
+    r->pending = conn;
+    pthread_mutex_unlock(&r->pending_mutex);
+    reactor_wake(r);
+    return REACTOR_SUCCESS;
+}
+
+void reactor_complete_auth(reactor* r, auth_job* job)
+{
+    pthread_mutex_lock(&r->pending_mutex);
+    job->next = r->auth_done;
+    r->auth_done = job;
+    pthread_mutex_unlock(&r->pending_mutex);
+    reactor_wake(r);
+}
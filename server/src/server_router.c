@@ -0,0 +1,111 @@
+#include "server_router.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include "log.h"
+
+extern _sts_queue const sts_queue;
+
+// FNV-1a over the recipient UID spreads recipients evenly across shards
+static router* router_for(router_pool* pool, const char* recipient_uid)
+{
+    uint32_t hash = 2166136261u;
+    for (const unsigned char* p = (const unsigned char*)recipient_uid; *p; ++p)
+    {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    return &pool->routers[hash % (uint32_t)pool->router_count];
+}
+
+static void* router_run(void* arg)
+{
+    router* r = (router*)arg;
+    message_buffer* batch[ROUTER_BATCH_SIZE];
+
+    log_message(T_LOG_INFO, SERVER_LOG, __FILE__, "Router %d started", r->id);
+    // block until messages arrive, then route everything available in batches before waiting again
+    while (!atomic_load(&r->pool->stop))
+    {
+        size_t count = sts_queue.pop_batch(r->queue, batch, ROUTER_BATCH_SIZE, ROUTER_WAIT_TIMEOUT);
+        if (!count)
+            continue;
+        atomic_fetch_sub(&r->depth, count);
+        for (size_t i = 0; i < count; ++i)
+        {
+            r->pool->route(batch[i]);
+            message_buffer_release(batch[i]);
+        }
+        atomic_fetch_add(&r->routed, count);
+    }
+    log_message(T_LOG_INFO, SERVER_LOG, __FILE__, "Exiting router %d thread", r->id);
+    pthread_exit(NULL);
+}
+
+int router_pool_start(router_pool* pool, int router_count, void (*route)(message_buffer* msg))
+{
+    pool->route = route;
+    pool->router_count = 0;
+    atomic_init(&pool->stop, 0);
+    pool->routers = (router*)calloc(router_count, sizeof(router));
+    if (!pool->routers)
+        return ROUTER_QUEUE_FAILURE;
+
+    for (int i = 0; i < router_count; ++i)
+    {
+        router* r = &pool->routers[i];
+        r->id = i;
+        r->pool = pool;
+        atomic_init(&r->depth, 0);
+        atomic_init(&r->routed, 0);
+        r->queue = sts_queue.create();
+        if (!r->queue)
+        {
+            log_message(T_LOG_ERROR, SERVER_LOG, __FILE__, "Router %d queue creation failed", i);
+            router_pool_stop(pool);
+            return ROUTER_QUEUE_FAILURE;
+        }
+        if (pthread_create(&r->thread, NULL, router_run, (void*)r) != 0)
+        {
+            log_message(T_LOG_ERROR, SERVER_LOG, __FILE__, "Router %d thread creation failed: %s", i, strerror(errno));
+            sts_queue.destroy(r->queue);
+            router_pool_stop(pool);
+            return ROUTER_THREAD_FAILURE;
+        }
+        pool->router_count++;
+    }
+    return ROUTER_SUCCESS;
+}
+
+void router_pool_stop(router_pool* pool)
+{
+    atomic_store(&pool->stop, 1);
+    // routers sleeping on an empty queue see the stop request without waiting out their timeout
+    for (int i = 0; i < pool->router_count; ++i)
+        sts_queue.wake(pool->routers[i].queue);
+    for (int i = 0; i < pool->router_count; ++i)
+        pthread_join(pool->routers[i].thread, NULL);
+
+    for (int i = 0; i < pool->router_count; ++i)
+    {
+        message_buffer* msg;
+        while ((msg = sts_queue.pop(pool->routers[i].queue)))
+            message_buffer_release(msg);
+        sts_queue.destroy(pool->routers[i].queue);
+    }
+    free(pool->routers);
+    pool->routers = NULL;
+    pool->router_count = 0;
+}
+
+void router_submit(router_pool* pool, message_buffer* msg)
+{
+    router* r = router_for(pool, msg->recipient);
+    atomic_fetch_add(&r->depth, 1);
+    sts_queue.push(r->queue, msg);
+}
+
@@ -0,0 +1,204 @@
+#define _GNU_SOURCE // syscall and mmap flags
+
+#include "server_uring.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+static int uring_enter(uring* ring, unsigned to_submit, unsigned min_complete, unsigned flags, void* arg, size_t arg_size)
+{
+    return (int)syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+static int uring_setup(unsigned entries, struct io_uring_params* params)
+{
+    // cooperative task running avoids interrupting the reactor thread for every completion, older kernels reject the flag
+    params->flags = IORING_SETUP_COOP_TASKRUN | IORING_SETUP_CQSIZE;
+    params->cq_entries = entries * 2;
+    int fd = (int)syscall(__NR_io_uring_setup, entries, params);
+    if (fd < 0 && errno == EINVAL)
+    {
+        memset(params, 0, sizeof(*params));
+        fd = (int)syscall(__NR_io_uring_setup, entries, params);
+    }
+    return fd;
+}
+
+static int uring_init_buffers(uring* ring)
+{
+    size_t ring_size = URING_BUFFER_COUNT * sizeof(struct io_uring_buf);
+    void* buf_ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (buf_ring == MAP_FAILED)
+        return URING_BUFFER_FAILURE;
+    ring->buf_ring = (struct io_uring_buf_ring*)buf_ring;
+    ring->bufs = (char*)malloc((size_t)URING_BUFFER_COUNT * URING_BUFFER_SIZE);
+    if (!ring->bufs)
+        return URING_BUFFER_FAILURE;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)buf_ring;
+    reg.ring_entries = URING_BUFFER_COUNT;
+    reg.bgid = URING_BUFFER_GROUP;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        return URING_BUFFER_FAILURE;
+
+    for (unsigned bid = 0; bid < URING_BUFFER_COUNT; ++bid)
+    {
+        struct io_uring_buf* buf = &ring->buf_ring->bufs[bid];
+        buf->addr = (uint64_t)(uintptr_t)(ring->bufs + (size_t)bid * URING_BUFFER_SIZE);
+        buf->len = URING_BUFFER_SIZE;
+        buf->bid = (uint16_t)bid;
+    }
+    __atomic_store_n(&ring->buf_ring->tail, (uint16_t)URING_BUFFER_COUNT, __ATOMIC_RELEASE);
+    return URING_SUCCESS;
+}
+
+int uring_init(uring* ring)
+{
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = uring_setup(URING_ENTRIES, &params);
+    if (ring->fd < 0)
+        return URING_SETUP_FAILURE;
+    // a single mapping of both rings and extended wait arguments keep the wrapper simple, every kernel with provided buffer rings has them
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG))
+    {
+        uring_destroy(ring);
+        return URING_SETUP_FAILURE;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->ring_ptr = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->ring_ptr == MAP_FAILED)
+    {
+        ring->ring_ptr = NULL;
+        uring_destroy(ring);
+        return URING_MMAP_FAILURE;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe*)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        ring->sqes = NULL;
+        uring_destroy(ring);
+        return URING_MMAP_FAILURE;
+    }
+
+    char* ptr = (char*)ring->ring_ptr;
+    ring->sq_head = (unsigned*)(ptr + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(ptr + params.sq_off.tail);
+    ring->sq_mask = *(unsigned*)(ptr + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->cq_head = (unsigned*)(ptr + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(ptr + params.cq_off.tail);
+    ring->cq_mask = *(unsigned*)(ptr + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(ptr + params.cq_off.cqes);
+
+    // submission queue slots are used in order, so the indirection array is the identity
+    unsigned* sq_array = (unsigned*)(ptr + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; ++i)
+        sq_array[i] = i;
+
+    if (uring_init_buffers(ring) != URING_SUCCESS)
+    {
+        uring_destroy(ring);
+        return URING_BUFFER_FAILURE;
+    }
+    return URING_SUCCESS;
+}
+
+void uring_destroy(uring* ring)
+{
+    if (ring->fd >= 0)
+        close(ring->fd);
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->ring_ptr)
+        munmap(ring->ring_ptr, ring->ring_size);
+    if (ring->buf_ring)
+        munmap(ring->buf_ring, URING_BUFFER_COUNT * sizeof(struct io_uring_buf));
+    free(ring->bufs);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+struct io_uring_sqe* uring_get_sqe(uring* ring)
+{
+    unsigned tail = *ring->sq_tail;
+    if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+    {
+        if (uring_enter(ring, ring->sq_pending, 0, 0, NULL, 0) < 0)
+            return NULL;
+        ring->sq_pending = 0;
+        if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+            return NULL;
+    }
+    struct io_uring_sqe* sqe = &ring->sqes[tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->sq_pending++;
+    return sqe;
+}
+
+int uring_submit_and_wait(uring* ring, int timeout)
+{
+    struct __kernel_timespec ts;
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (long long)(timeout % 1000) * 1000000;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (uint64_t)(uintptr_t)&ts;
+
+    unsigned flags = IORING_ENTER_EXT_ARG;
+    // completions already waiting are reaped without blocking
+    if (!uring_peek_cqe(ring))
+        flags |= IORING_ENTER_GETEVENTS;
+    int submitted = uring_enter(ring, ring->sq_pending, flags & IORING_ENTER_GETEVENTS ? 1 : 0, flags, &arg, sizeof(arg));
+    if (submitted < 0)
+    {
+        // a full completion queue is drained by the caller before the next wait
+        if (errno == ETIME || errno == EINTR || errno == EBUSY)
+            return 0;
+        return -1;
+    }
+    ring->sq_pending -= (unsigned)submitted;
+    return submitted;
+}
+
+struct io_uring_cqe* uring_peek_cqe(uring* ring)
+{
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(uring* ring)
+{
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+char* uring_buffer(uring* ring, unsigned bid)
+{
+    return ring->bufs + (size_t)bid * URING_BUFFER_SIZE;
+}
+
+void uring_buffer_recycle(uring* ring, unsigned bid)
+{
+    uint16_t tail = ring->buf_ring->tail;
+    struct io_uring_buf* buf = &ring->buf_ring->bufs[tail & (URING_BUFFER_COUNT - 1)];
+    buf->addr = (uint64_t)(uintptr_t)uring_buffer(ring, bid);
+    buf->len = URING_BUFFER_SIZE;
+    buf->bid = (uint16_t)bid;
+    __atomic_store_n(&ring->buf_ring->tail, (uint16_t)(tail + 1), __ATOMIC_RELEASE);
+}
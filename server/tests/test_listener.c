@@ -0,0 +1,217 @@
+#define _GNU_SOURCE // accept4 through the listener
+
+#include "server_reactor.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define TEST_CLIENTS 24 // connections waiting in the backlog, more than both tests admit
+#define TEST_LIMIT 8 // the connections admitted by a descriptor limit of TEST_LIMIT + CONNECTION_RESERVED_FDS
+#define TEST_FREE_FDS 4 // the descriptors left to a process that exhausts them
+
+#define CHECK(condition, ...) \
+    do \
+    { \
+        if (!(condition)) \
+        { \
+            fprintf(stderr, "%s:%d: ", __FILE__, __LINE__); \
+            fprintf(stderr, __VA_ARGS__); \
+            fputc('\n', stderr); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while (0)
+
+/**
+ * The test server structure. This structure is used to store a listener with clients waiting in its backlog.
+ * The clients connect from a child process, so their descriptors do not count against the limit of the test.
+ *
+ * @param l The listener.
+ * @param fd The listening socket.
+ * @param epoll_fd The epoll instance watching the listener.
+ * @param client The client process.
+ * @param done The pipe end whose closing ends the client process.
+ * @param accepted The accepted sockets.
+ * @param accepted_count The number of accepted sockets.
+ */
+typedef struct test_server
+{
+    listener l;
+    int fd;
+    int epoll_fd;
+    pid_t client;
+    int done;
+    int accepted[TEST_CLIENTS];
+    int accepted_count;
+} test_server;
+
+static void test_server_start(test_server* s)
+{
+    memset(s, 0, sizeof(*s));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addr_len = sizeof(addr);
+    s->fd = socket(AF_INET, SOCK_STREAM, 0);
+    CHECK(s->fd >= 0, "socket failed: %s", strerror(errno));
+    CHECK(bind(s->fd, (struct sockaddr*)&addr, sizeof(addr)) == 0 && listen(s->fd, TEST_CLIENTS) == 0 && getsockname(s->fd, (struct sockaddr*)&addr, &addr_len) == 0,
+        "listening failed: %s", strerror(errno));
+    s->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    CHECK(s->epoll_fd >= 0 && listener_register(&s->l, s->fd, s->epoll_fd) == REACTOR_SUCCESS, "listener registration failed");
+
+    int ready[2];
+    int done[2];
+    CHECK(pipe(ready) == 0 && pipe(done) == 0, "pipe failed: %s", strerror(errno));
+    s->client = fork();
+    CHECK(s->client >= 0, "fork failed: %s", strerror(errno));
+    if (!s->client)
+    {
+        // the connections complete in the backlog without being accepted and stay open until the test is done
+        close(ready[0]);
+        close(done[1]);
+        for (int i = 0; i < TEST_CLIENTS; ++i)
+        {
+            int sock = socket(AF_INET, SOCK_STREAM, 0);
+            if (sock < 0 || connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+                _exit(EXIT_FAILURE);
+        }
+        char byte = 0;
+        if (write(ready[1], &byte, 1) != 1)
+            _exit(EXIT_FAILURE);
+        while (read(done[0], &byte, 1) > 0)
+            ;
+        _exit(EXIT_SUCCESS);
+    }
+    close(ready[1]);
+    close(done[0]);
+    s->done = done[1];
+    char byte;
+    CHECK(read(ready[0], &byte, 1) == 1, "clients failed to connect");
+    close(ready[0]);
+}
+
+static void test_server_stop(test_server* s)
+{
+    for (int i = 0; i < s->accepted_count; ++i)
+    {
+        close(s->accepted[i]);
+        reactor_connection_release();
+    }
+    close(s->done);
+    int status;
+    CHECK(waitpid(s->client, &status, 0) == s->client && WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS, "client process failed");
+    close(s->epoll_fd);
+    close(s->fd);
+}
+
+// accepts until the listener fails, returns the number of accepted sockets and leaves the errno of the failure
+static int test_drain(test_server* s)
+{
+    int count = 0;
+    struct sockaddr_in addr;
+    int sock;
+    while ((sock = listener_accept(&s->l, &addr)) >= 0)
+    {
+        CHECK(s->accepted_count < TEST_CLIENTS, "more connections accepted than clients connected");
+        s->accepted[s->accepted_count++] = sock;
+        count++;
+    }
+    return count;
+}
+
+static int test_readable(test_server* s)
+{
+    struct epoll_event ev;
+    int events = epoll_wait(s->epoll_fd, &ev, 1, 0);
+    return events == 1 && ev.data.ptr == &s->l;
+}
+
+// a released connection gives its slot back and resumes the listener, which is readable again for the clients still waiting
+static void test_release_one(test_server* s)
+{
+    close(s->accepted[--s->accepted_count]);
+    reactor_connection_release();
+    CHECK(!atomic_load(&s->l.paused), "listener not resumed by a released connection");
+    CHECK(test_readable(s), "resumed listener not readable with clients waiting");
+}
+
+// the connection limit fits into the descriptor limit, so the listener pauses before the process runs out of descriptors
+static void test_pause_if_full(test_server* s, rlim_t limit)
+{
+    struct rlimit rl = { limit, limit };
+    CHECK(setrlimit(RLIMIT_NOFILE, &rl) == 0, "setrlimit failed: %s", strerror(errno));
+    size_t admitted = reactor_limit_connections(TEST_CLIENTS);
+    CHECK(admitted == limit - CONNECTION_RESERVED_FDS, "%zu connections admitted under a limit of %lu descriptors", admitted, (unsigned long)limit);
+
+    int count = test_drain(s);
+    CHECK(count == (int)admitted && errno == EAGAIN, "%d connections accepted before the listener failed with %s", count, strerror(errno));
+    CHECK(atomic_load(&s->l.paused), "listener not paused at the connection limit");
+    CHECK(reactor_connection_total() == admitted, "%zu connections counted", reactor_connection_total());
+    CHECK(!test_readable(s), "paused listener still readable");
+
+    test_release_one(s);
+    count = test_drain(s);
+    CHECK(count == 1 && errno == EAGAIN && atomic_load(&s->l.paused), "%d connections accepted after one was released", count);
+    printf("listener: paused at the connection limit of %zu under %lu descriptors and resumed ok\n", admitted, (unsigned long)limit);
+}
+
+// the descriptors run out below the connection limit, so the failed accept pauses the listener instead of retrying on every wakeup
+static void test_pause_exhausted(test_server* s)
+{
+    CHECK(reactor_limit_connections(TEST_CLIENTS) == TEST_CLIENTS, "descriptor limit below %d connections", TEST_CLIENTS);
+    struct rlimit saved;
+    CHECK(getrlimit(RLIMIT_NOFILE, &saved) == 0, "getrlimit failed: %s", strerror(errno));
+
+    // every descriptor below the lowered limit is taken but a few
+    int probe = dup(STDIN_FILENO);
+    CHECK(probe >= 0, "dup failed: %s", strerror(errno));
+    close(probe);
+    struct rlimit rl = { (rlim_t)probe + 2 * TEST_CLIENTS, saved.rlim_max };
+    CHECK(setrlimit(RLIMIT_NOFILE, &rl) == 0, "setrlimit failed: %s", strerror(errno));
+    int fillers[2 * TEST_CLIENTS];
+    int filler_count = 0;
+    int fd;
+    while (filler_count < 2 * TEST_CLIENTS && (fd = dup(STDIN_FILENO)) >= 0)
+        fillers[filler_count++] = fd;
+    CHECK(filler_count > TEST_FREE_FDS && errno == EMFILE, "descriptors not exhausted after %d", filler_count);
+    for (int i = 0; i < TEST_FREE_FDS; ++i)
+        close(fillers[--filler_count]);
+
+    int count = test_drain(s);
+    CHECK(count == TEST_FREE_FDS && errno == EMFILE, "%d connections accepted before the listener failed with %s", count, strerror(errno));
+    CHECK(atomic_load(&s->l.paused), "listener not paused on exhausted descriptors");
+    CHECK(!test_readable(s), "paused listener still readable");
+
+    test_release_one(s);
+    count = test_drain(s);
+    CHECK(count == 1 && errno == EMFILE && atomic_load(&s->l.paused), "%d connections accepted after one was released", count);
+
+    while (filler_count)
+        close(fillers[--filler_count]);
+    CHECK(setrlimit(RLIMIT_NOFILE, &saved) == 0, "setrlimit failed: %s", strerror(errno));
+    printf("listener: paused on exhausted descriptors and resumed ok\n");
+}
+
+int main()
+{
+    test_server s;
+    test_server_start(&s);
+    test_pause_exhausted(&s);
+    test_server_stop(&s);
+
+    // lowering the hard limit cannot be undone without privileges, so the limit is tested last
+    test_server_start(&s);
+    test_pause_if_full(&s, TEST_LIMIT + CONNECTION_RESERVED_FDS);
+    test_server_stop(&s);
+    return EXIT_SUCCESS;
+}